@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file aggregate.rs
+ * @brief aggregate command over the collection tables
+ *
+ * The leading $match, $sort, $limit and $skip stages of the optimized
+ * pipeline become one query over the collection table, read through
+ * TABLESAMPLE when the pipeline starts with $sample, compiled the way
+ * find compiles them. Rows are decoded and the remaining stages run in the
+ * in-process aggregation engine. A pipeline that pushes down entirely
+ * returns rows as stored, like a find.
+ *
+ * $unionWith reads the other collection's table. Filtered reads followed
+ * by filtered branches become one flat UNION ALL; any other branch runs as
+ * an aggregate of its own and its documents join the stream in process.
+ *
+ * Identical concurrent aggregates on the single-flight collections share
+ * one execution, as finds do.
+ */
+
+use crate::aggregation::AggregationEngine;
+use crate::aggregation_pipeline::{AggregationPipeline, PipelineOptions, PipelineStage, SampleContext, UnionWithOptions};
+use crate::document_codec::{JsonbText, StorageLayout};
+use crate::error::{FauxDBError, Result};
+use crate::fauxdb_debug;
+use crate::find::{document_columns, pushdown_filter, pushdown_sort, row_bytes, row_document, SortPushdown};
+use crate::pipeline_optimizer::PipelineOptimizer;
+use crate::postgresql_manager::{collection_table, sample_context};
+use crate::single_flight::{aggregate_key, SingleFlight};
+use crate::spill::MemoryBudget;
+use crate::transactions::ConnectionTarget;
+use crate::wire_protocol::WireProtocolHandler;
+use bson::{Bson, Document};
+use futures::future::BoxFuture;
+use metrics::counter;
+use tokio_postgres::error::SqlState;
+
+/// A parsed aggregate command on a collection
+#[derive(Debug, Clone)]
+pub struct AggregateRequest {
+    pub database: String,
+    pub collection: String,
+    pub pipeline: AggregationPipeline,
+    /// Bytes the in-process stages may hold before spilling or failing
+    pub memory_limit: usize,
+}
+
+/// SQL for the pushed-down prefix plus the stages left to run after it
+#[derive(Debug)]
+pub struct AggregatePlan {
+    pub sql: String,
+    /// JSONB containment documents bound as $1, $2, ...
+    pub params: Vec<String>,
+    /// The sort is in SQL, and a third column says whether the first row
+    /// has keys it can't order; if so the pipeline is planned again with
+    /// the sort in process
+    pub checks_order: bool,
+    /// Leading rows to drop after SQL, for a skip SQL could not apply
+    pub skip_rows: usize,
+    /// Stages the in-process engine runs over the rows
+    pub remainder: Vec<PipelineStage>,
+    /// Tables of the $unionWith branches `sql` reads
+    pub union_tables: Vec<String>,
+}
+
+impl AggregatePlan {
+    pub fn remainder_documents(&self) -> Vec<Document> {
+        self.remainder.iter().flat_map(|stage| stage.to_documents()).collect()
+    }
+}
+
+impl AggregateRequest {
+    /// Whether the command aggregates a collection's documents, rather
+    /// than a database (`aggregate: 1`) or the collection's statistics
+    pub fn reads_collection(command: &Document) -> bool {
+        let collection_stats = command.get_array("pipeline").ok()
+            .and_then(|pipeline| pipeline.first())
+            .and_then(Bson::as_document)
+            .map_or(false, |stage| stage.contains_key("$collStats"));
+        command.get_str("aggregate").is_ok() && !collection_stats
+    }
+
+    pub fn parse(command: &Document) -> Result<Self> {
+        let collection = command.get_str("aggregate")
+            .map_err(|_| FauxDBError::WireProtocol("Missing collection in aggregate command".to_string()))?;
+        let stages = command.get_array("pipeline")
+            .map_err(|_| FauxDBError::WireProtocol("aggregate requires a pipeline array".to_string()))?;
+        let pipeline = AggregationPipeline::from_bson_array(stages.clone())
+            .map_err(|e| FauxDBError::WireProtocol(e.to_string()))?
+            .with_options(PipelineOptions::from_command(command));
+
+        Ok(Self {
+            database: command.get_str("$db").unwrap_or("fauxdb").to_string(),
+            collection: collection.to_string(),
+            pipeline,
+            memory_limit: MemoryBudget::default().limit_bytes,
+        })
+    }
+
+    pub fn namespace(&self) -> String {
+        format!("{}.{}", self.database, self.collection)
+    }
+
+    pub fn plan(&self, layout: &StorageLayout) -> Result<AggregatePlan> {
+        self.plan_with(layout, true, true)
+    }
+
+    /// The plan with any sort done in process
+    pub fn plan_unordered(&self, layout: &StorageLayout) -> Result<AggregatePlan> {
+        self.plan_with(layout, false, true)
+    }
+
+    /// The plan with every $unionWith run as an aggregate of its own, for
+    /// when a table it would read doesn't exist
+    pub fn plan_separate_unions(&self, layout: &StorageLayout) -> Result<AggregatePlan> {
+        self.plan_with(layout, true, false)
+    }
+
+    /// Whether planning needs the collection's table statistics
+    pub fn samples_collection(&self) -> bool {
+        matches!(self.pipeline.stages().first(), Some(PipelineStage::Sample { .. }))
+    }
+
+    pub fn with_memory_limit(mut self, memory_limit: usize) -> Self {
+        self.memory_limit = memory_limit;
+        self
+    }
+
+    pub fn with_sample_context(mut self, sample_context: SampleContext) -> Self {
+        self.pipeline = self.pipeline.with_sample_context(sample_context);
+        self
+    }
+
+    /// The aggregate a $unionWith stage runs over its collection
+    pub fn union_branch(&self, options: &UnionWithOptions) -> Self {
+        let stages = options.pipeline.clone().unwrap_or_default();
+        Self {
+            database: self.database.clone(),
+            collection: options.coll.clone(),
+            pipeline: AggregationPipeline::from_stages(stages).with_options(self.pipeline.options().clone()),
+            memory_limit: self.memory_limit,
+        }
+    }
+
+    fn plan_with(&self, layout: &StorageLayout, sort_in_sql: bool, unions_in_sql: bool) -> Result<AggregatePlan> {
+        let stages = PipelineOptimizer::optimize(self.pipeline.stages().to_vec());
+        let mut params = Vec::new();
+        let mut conditions = Vec::new();
+        let mut sort: Option<SortPushdown> = None;
+        let mut limit: Option<u64> = None;
+        let mut skip = 0u64;
+        let mut residual = None;
+
+        // Stages push down while WHERE, ORDER BY, OFFSET and LIMIT can
+        // still express them in that order
+        let mut pushed = 0;
+        let table = collection_table(&self.database, &self.collection);
+        let mut source = table.clone();
+        if let Some(PipelineStage::Sample { size }) = stages.first() {
+            let sample_sql = self.pipeline.sample_context().sample_sql(&table, *size)
+                .map_err(|e| FauxDBError::WireProtocol(e.to_string()))?;
+            source = format!("({}) AS sampled", sample_sql);
+            pushed = 1;
+        }
+        for stage in &stages[pushed..] {
+            let windowed = limit.is_some() || skip > 0;
+            match stage {
+                PipelineStage::Match(filter) if !windowed => {
+                    let (pushed_conditions, rest) = pushdown_filter(filter, layout, &mut params);
+                    conditions.extend(pushed_conditions);
+                    pushed += 1;
+                    if rest.is_some() {
+                        // Later stages have to see the residual filter first
+                        residual = rest;
+                        break;
+                    }
+                    continue;
+                }
+                PipelineStage::Sort(sort_doc) | PipelineStage::TopK { sort: sort_doc, .. }
+                    if sort_in_sql && !windowed && sort.is_none() =>
+                {
+                    match pushdown_sort(sort_doc, layout) {
+                        Some(pushdown) => sort = Some(pushdown),
+                        None => break,
+                    }
+                    if let PipelineStage::TopK { limit: top, .. } = stage {
+                        limit = Some((*top).max(0) as u64);
+                    }
+                }
+                PipelineStage::Limit(n) => {
+                    let n = (*n).max(0) as u64;
+                    limit = Some(limit.map_or(n, |current| current.min(n)));
+                }
+                PipelineStage::Skip(n) => {
+                    let n = (*n).max(0) as u64;
+                    limit = limit.map(|current| current.saturating_sub(n));
+                    skip += n;
+                }
+                _ => break,
+            }
+            pushed += 1;
+        }
+
+        let checks_order = sort.is_some();
+        let mut union_tables = Vec::new();
+        if unions_in_sql && !checks_order && limit.is_none() && skip == 0 && residual.is_none() {
+            // One flat UNION ALL lets PostgreSQL run every branch under a
+            // single (Parallel) Append
+            let mut branches = Vec::new();
+            while let Some(PipelineStage::UnionWith(options)) = stages.get(pushed) {
+                let bound = params.len();
+                let Some(branch_conditions) = union_branch_conditions(options, layout, &mut params) else {
+                    params.truncate(bound);
+                    break;
+                };
+                let branch_table = collection_table(&self.database, &options.coll);
+                branches.push(read_sql(layout, &branch_table, &branch_conditions));
+                union_tables.push(branch_table);
+                pushed += 1;
+            }
+            if !branches.is_empty() {
+                branches.insert(0, read_sql(layout, &source, &conditions));
+                let branches: Vec<String> = branches.iter().map(|branch| format!("({})", branch)).collect();
+                return Ok(AggregatePlan {
+                    sql: branches.join(" UNION ALL "),
+                    params,
+                    checks_order,
+                    skip_rows: 0,
+                    remainder: stages[pushed..].to_vec(),
+                    union_tables,
+                });
+            }
+        }
+
+        let mut sql = format!("SELECT {}", document_columns(layout));
+        let mut order_by = Vec::new();
+        if let Some(pushdown) = sort {
+            // Rows SQL can't order sort first, so the first row tells
+            sql.push_str(&format!(", {} AS unordered", pushdown.unordered));
+            order_by.push("unordered DESC".to_string());
+            order_by.extend(pushdown.order_by);
+        }
+        order_by.push("id".to_string());
+        sql.push_str(&format!(" FROM {}", source));
+        if !conditions.is_empty() {
+            sql.push_str(" WHERE ");
+            sql.push_str(&conditions.join(" AND "));
+        }
+        sql.push_str(" ORDER BY ");
+        sql.push_str(&order_by.join(", "));
+
+        // A checked sort must see the skipped rows too
+        let sql_skip = if checks_order { 0 } else { skip };
+        if let Some(limit) = limit {
+            sql.push_str(&format!(" LIMIT {}", limit + skip - sql_skip));
+        }
+        if sql_skip > 0 {
+            sql.push_str(&format!(" OFFSET {}", sql_skip));
+        }
+
+        let mut remainder = Vec::with_capacity(stages.len() - pushed + 1);
+        if let Some(residual) = residual {
+            remainder.push(PipelineStage::Match(residual));
+        }
+        remainder.extend_from_slice(&stages[pushed..]);
+
+        Ok(AggregatePlan {
+            sql,
+            params,
+            checks_order,
+            skip_rows: (skip - sql_skip) as usize,
+            remainder,
+            union_tables,
+        })
+    }
+
+    /// Run the stages SQL left over the rows it returned. $unionWith
+    /// needs the database and goes through `aggregate_command` instead.
+    pub async fn finish(&self, plan: &AggregatePlan, rows: Vec<Document>) -> Result<Vec<Document>> {
+        let rows = rows.into_iter().skip(plan.skip_rows).collect();
+        self.run_in_process(rows, plan.remainder_documents()).await
+    }
+
+    async fn run_in_process(&self, documents: Vec<Document>, stages: Vec<Document>) -> Result<Vec<Document>> {
+        if stages.is_empty() {
+            return Ok(documents);
+        }
+        AggregationEngine::new()
+            .with_budget(self.pipeline.options().memory_budget(self.memory_limit))
+            .process_pipeline_owned(documents, stages)
+            .await
+    }
+}
+
+/// Branch SQL conditions for a $unionWith whose pipeline is only filters
+/// SQL can evaluate
+fn union_branch_conditions(options: &UnionWithOptions, layout: &StorageLayout, params: &mut Vec<String>) -> Option<Vec<String>> {
+    let mut conditions = Vec::new();
+    for stage in options.pipeline.as_deref().unwrap_or_default() {
+        let PipelineStage::Match(filter) = stage else {
+            return None;
+        };
+        let (pushed, residual) = pushdown_filter(filter, layout, params);
+        if residual.is_some() {
+            return None;
+        }
+        conditions.extend(pushed);
+    }
+    Some(conditions)
+}
+
+/// A filtered read of one collection table, or a sample of it, in
+/// natural order
+fn read_sql(layout: &StorageLayout, source: &str, conditions: &[String]) -> String {
+    let mut sql = format!("SELECT {} FROM {}", document_columns(layout), source);
+    if !conditions.is_empty() {
+        sql.push_str(" WHERE ");
+        sql.push_str(&conditions.join(" AND "));
+    }
+    sql.push_str(" ORDER BY id");
+    sql
+}
+
+/// Execute an aggregate command and return the encoded reply body
+pub async fn aggregate_command(
+    target: ConnectionTarget<'_>,
+    layout: &StorageLayout,
+    single_flight: Option<&SingleFlight>,
+    memory_limit: usize,
+    command: &Document,
+) -> Result<Vec<u8>> {
+    let request = AggregateRequest::parse(command)?.with_memory_limit(memory_limit);
+    if let Some(single_flight) = single_flight.filter(|flight| flight.applies_to(&request.database, &request.collection)) {
+        if let Some(key) = aggregate_key(command) {
+            return single_flight.run(key, || run_aggregate(target, layout, &request)).await;
+        }
+    }
+    run_aggregate(target, layout, &request).await
+}
+
+async fn run_aggregate(target: ConnectionTarget<'_>, layout: &StorageLayout, request: &AggregateRequest) -> Result<Vec<u8>> {
+    let (plan, rows) = fetch(target, layout, request).await?;
+
+    let batch: Vec<Vec<u8>> = if plan.remainder.is_empty() {
+        counter!("fauxdb_aggregate_passthrough_total").increment(1);
+        rows.iter().skip(plan.skip_rows).map(row_bytes).collect::<Result<_>>()?
+    } else {
+        let documents = rows.iter().skip(plan.skip_rows).map(row_document).collect::<Result<Vec<Document>>>()?;
+        run_remainder(target, layout, request, &plan, documents).await?
+            .iter()
+            .map(|document| Ok(bson::to_vec(document)?))
+            .collect::<Result<_>>()?
+    };
+
+    WireProtocolHandler::build_cursor_reply(&request.namespace(), &batch)
+}
+
+/// The documents an aggregate produces; $unionWith branches run this
+fn aggregate_documents<'a>(
+    target: ConnectionTarget<'a>,
+    layout: &'a StorageLayout,
+    request: &'a AggregateRequest,
+) -> BoxFuture<'a, Result<Vec<Document>>> {
+    Box::pin(async move {
+        let (plan, rows) = fetch(target, layout, request).await?;
+        let documents = rows.iter().skip(plan.skip_rows).map(row_document).collect::<Result<Vec<Document>>>()?;
+        run_remainder(target, layout, request, &plan, documents).await
+    })
+}
+
+/// Run the remaining stages, reading the collections of $unionWith stages
+/// SQL didn't read
+async fn run_remainder(
+    target: ConnectionTarget<'_>,
+    layout: &StorageLayout,
+    request: &AggregateRequest,
+    plan: &AggregatePlan,
+    mut documents: Vec<Document>,
+) -> Result<Vec<Document>> {
+    let mut stages = Vec::new();
+    for stage in &plan.remainder {
+        match stage {
+            PipelineStage::UnionWith(options) => {
+                documents = request.run_in_process(documents, std::mem::take(&mut stages)).await?;
+                let branch = request.union_branch(options);
+                documents.extend(aggregate_documents(target, layout, &branch).await?);
+            }
+            stage => stages.extend(stage.to_documents()),
+        }
+    }
+    request.run_in_process(documents, stages).await
+}
+
+/// Run the pushed-down part of an aggregate. Returns the plan that ran,
+/// which may differ from the first one planned, with its rows. The
+/// connection goes back before the caller reads other collections.
+async fn fetch(target: ConnectionTarget<'_>, layout: &StorageLayout, request: &AggregateRequest) -> Result<(AggregatePlan, Vec<tokio_postgres::Row>)> {
+    let table = collection_table(&request.database, &request.collection);
+    let mut retried = false;
+    loop {
+        let connection = target.checkout().await?;
+        let client = connection.client();
+
+        // A collection that doesn't exist yet has no documents, but the
+        // remaining stages still run over none. Unions over a missing
+        // table run separately, so the branches that exist are still read.
+        let exists = target.catalog().exists(connection.pooled(), &table).await?;
+        let sampled;
+        let request = match exists && request.samples_collection() {
+            true => {
+                sampled = request.clone().with_sample_context(sample_context(client, &request.database, &request.collection).await?);
+                &sampled
+            }
+            false => request,
+        };
+        let mut plan = request.plan(layout)?;
+        let mut unions_exist = true;
+        for union_table in &plan.union_tables {
+            unions_exist &= target.catalog().exists(connection.pooled(), union_table).await?;
+        }
+        if !(exists && unions_exist) && !plan.union_tables.is_empty() {
+            plan = request.plan_separate_unions(layout)?;
+        }
+        if !exists {
+            return Ok((plan, Vec::new()));
+        }
+        fauxdb_debug!("Running {} with {} stages in process", plan.sql, plan.remainder.len());
+
+        let mut rows = match connection.pooled().timed(query_plan(client, &plan)).await {
+            Ok(rows) => rows,
+            // Dropped since the catalog last heard of it: forget and plan
+            // again. A transaction is aborted by the failed query, so
+            // there the error stands.
+            Err(e) if e.code() == Some(&SqlState::UNDEFINED_TABLE) && !target.in_transaction() && !retried => {
+                target.catalog().forget(&table);
+                for union_table in &plan.union_tables {
+                    target.catalog().forget(union_table);
+                }
+                retried = true;
+                continue;
+            }
+            Err(e) => return Err(FauxDBError::Database(format!("Failed to query documents: {}", e))),
+        };
+        if plan.checks_order && rows.first().map_or(false, |row| row.get::<_, bool>(2)) {
+            counter!("fauxdb_aggregate_sort_fallbacks_total").increment(1);
+            plan = request.plan_unordered(layout)?;
+            rows = connection.pooled().timed(query_plan(client, &plan)).await
+                .map_err(|e| FauxDBError::Database(format!("Failed to query documents: {}", e)))?;
+        }
+        return Ok((plan, rows));
+    }
+}
+
+async fn query_plan(client: &tokio_postgres::Client, plan: &AggregatePlan) -> std::result::Result<Vec<tokio_postgres::Row>, tokio_postgres::Error> {
+    let params: Vec<JsonbText<&str>> = plan.params.iter().map(|param| JsonbText(param.as_str())).collect();
+    let param_refs: Vec<&(dyn tokio_postgres::types::ToSql + Sync)> = params.iter()
+        .map(|param| param as &(dyn tokio_postgres::types::ToSql + Sync))
+        .collect();
+    client.query(&plan.sql, &param_refs).await
+}
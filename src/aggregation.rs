@@ -4,351 +4,474 @@
  */
 
 use crate::error::{FauxDBError, Result};
+use crate::aggregation_group::GroupSpec;
+use crate::aggregation_window::{DensifySpec, FillSpec, WindowFieldsSpec};
+use crate::bson_order::lookup_path;
+use crate::expression::{remove_path, set_path, CompiledExpr, CompiledProjection};
+use crate::external_sort::{external_sort, top_k, SortSpec};
+use crate::spill::MemoryBudget;
+use crate::predicate::CompiledPredicate;
 use bson::Document;
+use std::borrow::Cow;
+use rand::Rng;
 use serde::{Deserialize, Serialize};
 
+#[derive(Debug, Clone)]
 pub struct AggregationEngine {
-    // Aggregation pipeline stages
+    /// Memory limit for blocking stages, and whether they may spill past it
+    budget: MemoryBudget,
 }
 
+/// Pull-based document stream between pipeline operators. Documents stay
+/// borrowed from the input until a stage has to rewrite them, and each
+/// operator only pulls as many upstream documents as it needs.
+type DocStream<'a> = Box<dyn Iterator<Item = Result<Cow<'a, Document>>> + 'a>;
+
 impl AggregationEngine {
     pub fn new() -> Self {
-        Self {}
+        Self {
+            budget: MemoryBudget::default(),
+        }
+    }
+
+    pub fn with_budget(mut self, budget: MemoryBudget) -> Self {
+        self.budget = budget;
+        self
+    }
+
+    pub fn with_allow_disk_use(mut self, allow_disk_use: bool) -> Self {
+        self.budget.allow_disk_use = allow_disk_use;
+        self
+    }
+
+    pub fn with_memory_limit(mut self, memory_limit_bytes: usize) -> Self {
+        self.budget.limit_bytes = memory_limit_bytes;
+        self
     }
 
     /// Test-friendly method that accepts input documents directly
     pub async fn process_pipeline_with_input(&self, input_docs: &[Document], pipeline: &[Document]) -> Result<Vec<Document>> {
         println!("📊 Processing aggregation pipeline with {} input documents", input_docs.len());
         
-        let mut results = input_docs.to_vec();
-        
-        // Process each stage in the pipeline
-        for (i, stage) in pipeline.iter().enumerate() {
-            println!("🔧 Processing stage {}: {:?}", i, stage);
-            
-            if let Some(key) = stage.keys().next() {
-                match key.as_str() {
-                    "$match" => {
-                        results = self.process_match_stage(&results, stage).await?;
-                    }
-                    "$group" => {
-                        results = self.process_group_stage(&results, stage).await?;
-                    }
-                    "$sort" => {
-                        results = self.process_sort_stage(&results, stage).await?;
-                    }
-                    "$limit" => {
-                        results = self.process_limit_stage(&results, stage).await?;
-                    }
-                    "$skip" => {
-                        results = self.process_skip_stage(&results, stage).await?;
-                    }
-                    "$project" => {
-                        results = self.process_project_stage(&results, stage).await?;
-                    }
-                    "$count" => {
-                        results = self.process_count_stage(&results, stage).await?;
-                    }
-                    _ => {
-                        println!("⚠️ Unknown aggregation stage: {}", key);
-                        // Continue processing with current results
-                    }
-                }
-            }
-        }
+        // Unknown stages are skipped here so partially supported pipelines still run
+        let results = Self::run_cpu_bound(|| self.execute(input_docs, pipeline, true))?;
         
         println!("✅ Pipeline completed with {} result documents", results.len());
         Ok(results)
     }
 
+    /// Run a pipeline over owned input on the blocking pool, so a heavy
+    /// in-process aggregation never occupies a runtime worker thread.
+    pub async fn process_pipeline_owned(&self, input_docs: Vec<Document>, pipeline: Vec<Document>) -> Result<Vec<Document>> {
+        let engine = self.clone();
+        tokio::task::spawn_blocking(move || engine.execute(&input_docs, &pipeline, false))
+            .await
+            .map_err(|e| FauxDBError::Database(format!("Aggregation task failed: {}", e)))?
+    }
+
     pub async fn process_pipeline(&self, collection: &str, pipeline: &[Document]) -> Result<Vec<Document>> {
         println!("📊 Processing aggregation pipeline for collection: {}", collection);
         
-        let mut results = Vec::new();
-        
-        // Process each stage in the pipeline
-        for (i, stage) in pipeline.iter().enumerate() {
+        Self::run_cpu_bound(|| self.execute(&[], pipeline, false))
+    }
+
+    fn execute(&self, input_docs: &[Document], pipeline: &[Document], skip_unknown: bool) -> Result<Vec<Document>> {
+        let source: DocStream = Box::new(input_docs.iter().map(|doc| Ok(Cow::Borrowed(doc))));
+        let stream = self.build_stream(source, pipeline, skip_unknown)?;
+        stream.map(|doc| doc.map(Cow::into_owned)).collect()
+    }
+
+    /// Borrowed input cannot move to spawn_blocking, so on a multi-threaded
+    /// runtime hand this worker's other tasks off with block_in_place instead
+    fn run_cpu_bound<R>(f: impl FnOnce() -> R) -> R {
+        match tokio::runtime::Handle::try_current() {
+            Ok(handle) if handle.runtime_flavor() == tokio::runtime::RuntimeFlavor::MultiThread => {
+                tokio::task::block_in_place(f)
+            }
+            _ => f(),
+        }
+    }
+
+    /// Chain one operator per stage. Nothing runs until the caller pulls
+    /// from the returned stream.
+    fn build_stream<'a>(&self, mut stream: DocStream<'a>, pipeline: &[Document], skip_unknown: bool) -> Result<DocStream<'a>> {
+        let mut i = 0;
+        while i < pipeline.len() {
+            let stage = &pipeline[i];
             println!("🔧 Processing stage {}: {:?}", i, stage);
+            i += 1;
             
             if let Some(key) = stage.keys().next() {
-                match key.as_str() {
-                    "$match" => {
-                        results = self.process_match_stage(&results, stage).await?;
-                    }
-                    "$group" => {
-                        results = self.process_group_stage(&results, stage).await?;
-                    }
+                stream = match key.as_str() {
+                    "$match" => self.process_match_stage(stream, stage)?,
+                    "$group" => self.process_group_stage(stream, stage)?,
                     "$sort" => {
-                        results = self.process_sort_stage(&results, stage).await?;
-                    }
-                    "$limit" => {
-                        results = self.process_limit_stage(&results, stage).await?;
-                    }
-                    "$skip" => {
-                        results = self.process_skip_stage(&results, stage).await?;
-                    }
-                    "$project" => {
-                        results = self.process_project_stage(&results, stage).await?;
-                    }
-                    "$count" => {
-                        results = self.process_count_stage(&results, stage).await?;
-                    }
-                    "$unwind" => {
-                        results = self.process_unwind_stage(&results, stage).await?;
+                        // $sort directly followed by $limit only has to keep the top K
+                        match pipeline.get(i).and_then(|next| Self::stage_count(next, "$limit")) {
+                            Some(limit) => {
+                                i += 1;
+                                self.process_top_k_stage(stream, stage, limit)?
+                            }
+                            None => self.process_sort_stage(stream, stage)?,
+                        }
                     }
-                    "$lookup" => {
-                        results = self.process_lookup_stage(&results, stage).await?;
+                    "$limit" => self.process_limit_stage(stream, stage)?,
+                    "$skip" => self.process_skip_stage(stream, stage)?,
+                    "$project" => self.process_project_stage(stream, stage)?,
+                    "$addFields" | "$set" => self.process_add_fields_stage(stream, stage, key)?,
+                    "$replaceRoot" | "$replaceWith" => self.process_replace_root_stage(stream, stage, key)?,
+                    "$count" => self.process_count_stage(stream, stage)?,
+                    "$sample" => self.process_sample_stage(stream, stage)?,
+                    "$unwind" => self.process_unwind_stage(stream, stage)?,
+                    "$setWindowFields" => self.process_set_window_fields_stage(stream, stage)?,
+                    "$densify" => self.process_densify_stage(stream, stage)?,
+                    "$fill" => self.process_fill_stage(stream, stage)?,
+                    _ if skip_unknown => {
+                        println!("⚠️ Unknown aggregation stage: {}", key);
+                        // Continue processing with current results
+                        stream
                     }
                     _ => {
                         return Err(FauxDBError::Database(format!("Unknown aggregation stage: {:?}", stage)));
                     }
-                }
+                };
             }
         }
         
-        Ok(results)
+        Ok(stream)
     }
 
-    async fn process_match_stage(&self, input: &[Document], stage: &Document) -> Result<Vec<Document>> {
+    fn process_match_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
         println!("🔍 Processing $match stage");
         
-        let mut filtered_docs = Vec::new();
-        
         // Get the match criteria from the stage
-        if let Some(match_criteria) = stage.get("$match").and_then(|v| v.as_document()) {
-            for doc in input {
-                if self.document_matches_criteria(doc, match_criteria)? {
-                    filtered_docs.push(doc.clone());
-                }
+        match stage.get("$match").and_then(|v| v.as_document()) {
+            Some(match_criteria) => {
+                // Compile once; per-document evaluation is then a closure walk
+                let predicate = CompiledPredicate::compile(match_criteria)?;
+                Ok(Box::new(input.filter(move |doc| match doc {
+                    Ok(doc) => predicate.matches(doc),
+                    // Let errors through to the consumer
+                    Err(_) => true,
+                })))
             }
-        } else {
-            // If no match criteria, return all documents
-            filtered_docs = input.to_vec();
+            // If no match criteria, pass all documents through
+            None => Ok(input),
         }
-        
-        println!("✅ $match stage filtered {} documents to {}", input.len(), filtered_docs.len());
-        Ok(filtered_docs)
     }
 
-    fn document_matches_criteria(&self, doc: &Document, criteria: &Document) -> Result<bool> {
-        for (field, condition) in criteria {
-            if let Some(field_value) = doc.get(field) {
-                match condition.as_document() {
-                    Some(condition_doc) => {
-                        // Handle operators like $gt, $lt, $eq, etc.
-                        if !self.evaluate_field_condition(field_value, condition_doc)? {
-                            return Ok(false);
-                        }
-                    }
-                    None => {
-                        // Direct value comparison
-                        if field_value != condition {
-                            return Ok(false);
-                        }
-                    }
-                }
-            } else {
-                // Field doesn't exist in document
-                return Ok(false);
-            }
-        }
-        Ok(true)
+    fn process_group_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
+        println!("👥 Processing $group stage");
+        
+        let spec = match stage.get("$group") {
+            Some(bson::Bson::Document(group)) => GroupSpec::parse(group)?,
+            _ => return Err(FauxDBError::Database("$group stage must be a document".to_string())),
+        };
+        
+        // Grouping needs its whole input; batches are split across rayon
+        // workers and the group table spills to disk past the memory budget
+        let budget = self.budget;
+        Ok(Self::blocking_operator(input, move |mut upstream| {
+            let groups = spec.aggregate_stream(&mut upstream, &budget)?;
+            Ok(Box::new(groups.into_iter().map(|doc| Ok(Cow::Owned(doc)))) as DocStream<'a>)
+        }))
     }
 
-    fn evaluate_field_condition(&self, field_value: &bson::Bson, condition: &Document) -> Result<bool> {
-        for (operator, value) in condition {
-            match operator.as_str() {
-                "$eq" => {
-                    if field_value != value {
-                        return Ok(false);
-                    }
-                }
-                "$ne" => {
-                    if field_value == value {
-                        return Ok(false);
-                    }
-                }
-                "$gt" => {
-                    if !self.compare_values(field_value, value, |a, b| a > b)? {
-                        return Ok(false);
-                    }
-                }
-                "$gte" => {
-                    if !self.compare_values(field_value, value, |a, b| a >= b)? {
-                        return Ok(false);
-                    }
-                }
-                "$lt" => {
-                    if !self.compare_values(field_value, value, |a, b| a < b)? {
-                        return Ok(false);
-                    }
-                }
-                "$lte" => {
-                    if !self.compare_values(field_value, value, |a, b| a <= b)? {
-                        return Ok(false);
-                    }
-                }
-                "$in" => {
-                    if let Some(values_array) = value.as_array() {
-                        if !values_array.contains(field_value) {
-                            return Ok(false);
-                        }
-                    }
-                }
-                "$nin" => {
-                    if let Some(values_array) = value.as_array() {
-                        if values_array.contains(field_value) {
-                            return Ok(false);
-                        }
-                    }
-                }
-                _ => {
-                    // Unknown operator, skip for now
-                    continue;
-                }
-            }
-        }
-        Ok(true)
+    fn process_set_window_fields_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
+        println!("🪟 Processing $setWindowFields stage");
+        
+        let spec = match stage.get("$setWindowFields") {
+            Some(bson::Bson::Document(spec)) => WindowFieldsSpec::parse(spec)?,
+            _ => return Err(FauxDBError::Database("$setWindowFields stage must be a document".to_string())),
+        };
+        
+        let budget = self.budget;
+        Ok(Self::blocking_operator(input, move |mut upstream| {
+            let docs = spec.apply(&mut upstream, &budget)?;
+            Ok(Box::new(docs.into_iter().map(|doc| Ok(Cow::Owned(doc)))) as DocStream<'a>)
+        }))
     }
 
-    fn compare_values<F>(&self, a: &bson::Bson, b: &bson::Bson, compare_fn: F) -> Result<bool> 
-    where
-        F: FnOnce(f64, f64) -> bool,
-    {
-        let a_num = match a {
-            bson::Bson::Int32(n) => *n as f64,
-            bson::Bson::Int64(n) => *n as f64,
-            bson::Bson::Double(n) => *n,
-            _ => return Ok(false),
+    fn process_densify_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
+        println!("🧱 Processing $densify stage");
+        
+        let spec = match stage.get("$densify") {
+            Some(bson::Bson::Document(spec)) => DensifySpec::parse(spec)?,
+            _ => return Err(FauxDBError::Database("$densify stage must be a document".to_string())),
         };
         
-        let b_num = match b {
-            bson::Bson::Int32(n) => *n as f64,
-            bson::Bson::Int64(n) => *n as f64,
-            bson::Bson::Double(n) => *n,
-            _ => return Ok(false),
+        let budget = self.budget;
+        Ok(Self::blocking_operator(input, move |mut upstream| {
+            let docs = spec.apply(&mut upstream, &budget)?;
+            Ok(Box::new(docs.into_iter().map(|doc| Ok(Cow::Owned(doc)))) as DocStream<'a>)
+        }))
+    }
+
+    fn process_fill_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
+        println!("🩹 Processing $fill stage");
+        
+        let spec = match stage.get("$fill") {
+            Some(bson::Bson::Document(spec)) => FillSpec::parse(spec)?,
+            _ => return Err(FauxDBError::Database("$fill stage must be a document".to_string())),
         };
         
-        Ok(compare_fn(a_num, b_num))
+        let budget = self.budget;
+        Ok(Self::blocking_operator(input, move |mut upstream| {
+            let docs = spec.apply(&mut upstream, &budget)?;
+            Ok(Box::new(docs.into_iter().map(|doc| Ok(Cow::Owned(doc)))) as DocStream<'a>)
+        }))
     }
 
-    async fn process_group_stage(&self, input: &[Document], _stage: &Document) -> Result<Vec<Document>> {
-        println!("👥 Processing $group stage");
-        // Placeholder implementation
-        Ok(input.to_vec())
+    /// Wrap an operator that must consume all of its input before emitting
+    /// anything. The work is deferred until the first document is pulled.
+    fn blocking_operator<'a, F>(input: DocStream<'a>, operator: F) -> DocStream<'a>
+    where
+        F: FnOnce(DocStream<'a>) -> Result<DocStream<'a>> + 'a,
+    {
+        let mut pending = Some((input, operator));
+        let mut output: Option<DocStream<'a>> = None;
+        Box::new(std::iter::from_fn(move || {
+            if let Some((upstream, operator)) = pending.take() {
+                match operator(upstream) {
+                    Ok(stream) => output = Some(stream),
+                    Err(e) => return Some(Err(e)),
+                }
+            }
+            output.as_mut()?.next()
+        }))
     }
 
-    async fn process_sort_stage(&self, input: &[Document], _stage: &Document) -> Result<Vec<Document>> {
+    fn process_sort_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
         println!("📈 Processing $sort stage");
-        // Placeholder implementation
-        Ok(input.to_vec())
+        
+        let spec = Self::parse_sort_spec(stage)?;
+        let budget = self.budget;
+        
+        // Sorts in memory until the limit, then spills sorted runs if allowDiskUse is set
+        Ok(Self::blocking_operator(input, move |upstream| {
+            external_sort(&spec, upstream, &budget)
+        }))
     }
 
-    async fn process_limit_stage(&self, input: &[Document], stage: &Document) -> Result<Vec<Document>> {
-        println!("📏 Processing $limit stage");
+    fn process_top_k_stage<'a>(&self, input: DocStream<'a>, stage: &Document, limit: usize) -> Result<DocStream<'a>> {
+        println!("🏆 Processing $sort + $limit as top-{}", limit);
         
-        let limit_value = stage.get("$limit")
-            .and_then(|v| v.as_i32())
-            .unwrap_or(input.len() as i32) as usize;
-        
-        let limited_docs: Vec<Document> = input.iter()
-            .take(limit_value)
-            .cloned()
-            .collect();
+        let spec = Self::parse_sort_spec(stage)?;
+        Ok(Self::blocking_operator(input, move |upstream| {
+            let top = top_k(&spec, upstream, limit)?;
+            Ok(Box::new(top.into_iter().map(Ok)) as DocStream<'a>)
+        }))
+    }
+
+    fn parse_sort_spec(stage: &Document) -> Result<SortSpec> {
+        match stage.get("$sort") {
+            Some(bson::Bson::Document(sort)) => SortSpec::parse(sort),
+            _ => Err(FauxDBError::Database("$sort stage must be a document".to_string())),
+        }
+    }
+
+    fn process_limit_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
+        println!("📏 Processing $limit stage");
         
-        println!("✅ $limit stage limited {} documents to {}", input.len(), limited_docs.len());
-        Ok(limited_docs)
+        match Self::stage_count(stage, "$limit") {
+            // take() stops pulling from upstream once the limit is reached
+            Some(limit) => Ok(Box::new(input.take(limit))),
+            None => Ok(input),
+        }
     }
 
-    async fn process_skip_stage(&self, input: &[Document], stage: &Document) -> Result<Vec<Document>> {
+    fn process_skip_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
         println!("⏭️ Processing $skip stage");
         
-        let skip_value = stage.get("$skip")
-            .and_then(|v| v.as_i32())
-            .unwrap_or(0) as usize;
+        let skip_value = Self::stage_count(stage, "$skip").unwrap_or(0);
+        Ok(Box::new(input.skip(skip_value)))
+    }
+
+    fn stage_count(stage: &Document, key: &str) -> Option<usize> {
+        stage.get(key)
+            .and_then(|v| v.as_i64().or_else(|| v.as_i32().map(i64::from)))
+            .map(|n| n.max(0) as usize)
+    }
+
+    fn process_project_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
+        println!("🎯 Processing $project stage");
         
-        let skipped_docs: Vec<Document> = input.iter()
-            .skip(skip_value)
-            .cloned()
-            .collect();
+        // Get the projection specification
+        let projection = match stage.get("$project").and_then(|v| v.as_document()) {
+            Some(projection) => CompiledProjection::compile(projection)?,
+            // If no projection specified, return all documents as-is
+            None => return Ok(input),
+        };
         
-        println!("✅ $skip stage skipped {} documents, {} remaining", skip_value, skipped_docs.len());
-        Ok(skipped_docs)
+        Ok(Box::new(input.map(move |doc| Ok(Cow::Owned(projection.apply(&doc?)?)))))
     }
 
-    async fn process_project_stage(&self, input: &[Document], stage: &Document) -> Result<Vec<Document>> {
-        println!("🎯 Processing $project stage");
+    fn process_add_fields_stage<'a>(&self, input: DocStream<'a>, stage: &Document, key: &str) -> Result<DocStream<'a>> {
+        println!("➕ Processing {} stage", key);
         
-        let mut projected_docs = Vec::new();
+        let fields: Vec<(String, CompiledExpr)> = stage.get_document(key)
+            .map_err(|_| FauxDBError::Database(format!("{} stage must be a document", key)))?
+            .iter()
+            .map(|(field, value)| Ok((field.clone(), CompiledExpr::parse(value)?)))
+            .collect::<Result<_>>()?;
         
-        // Get the projection specification
-        if let Some(projection) = stage.get("$project").and_then(|v| v.as_document()) {
-            for doc in input {
-                let mut projected_doc = Document::new();
-                
-                for (field, include) in projection {
-                    match include.as_i32() {
-                        Some(1) => {
-                            // Include field
-                            if let Some(value) = doc.get(field) {
-                                projected_doc.insert(field, value.clone());
-                            }
-                        }
-                        Some(0) => {
-                            // Exclude field (don't add it to projected_doc)
-                            continue;
-                        }
-                        _ => {
-                            // Field expression or other value
-                            if let Some(value) = doc.get(field) {
-                                projected_doc.insert(field, value.clone());
-                            }
-                        }
-                    }
+        Ok(Box::new(input.map(move |doc| {
+            let doc = doc?;
+            // Every expression sees the input document, not earlier new fields
+            let mut values = Vec::with_capacity(fields.len());
+            for (field, expr) in &fields {
+                values.push((field, expr.evaluate_optional(&doc)?));
+            }
+            
+            let mut output = doc.into_owned();
+            for (field, value) in values {
+                if let Some(value) = value {
+                    set_path(&mut output, field, value);
                 }
-                
-                projected_docs.push(projected_doc);
             }
-        } else {
-            // If no projection specified, return all documents as-is
-            projected_docs = input.to_vec();
-        }
+            Ok(Cow::Owned(output))
+        })))
+    }
+
+    fn process_replace_root_stage<'a>(&self, input: DocStream<'a>, stage: &Document, key: &str) -> Result<DocStream<'a>> {
+        println!("🔄 Processing {} stage", key);
+        
+        let new_root = match (key, stage.get(key)) {
+            ("$replaceRoot", Some(bson::Bson::Document(spec))) => spec.get("newRoot")
+                .ok_or_else(|| FauxDBError::Database("$replaceRoot requires a newRoot".to_string()))?,
+            (_, Some(expression)) => expression,
+            (_, None) => return Err(FauxDBError::Database(format!("{} requires an expression", key))),
+        };
+        let new_root = CompiledExpr::parse(new_root)?;
         
-        println!("✅ $project stage processed {} documents", projected_docs.len());
-        Ok(projected_docs)
+        Ok(Box::new(input.map(move |doc| match new_root.evaluate(&doc?)? {
+            bson::Bson::Document(root) => Ok(Cow::Owned(root)),
+            other => Err(FauxDBError::Database(format!(
+                "'newRoot' expression must evaluate to an object, but resulting value was: {}", other
+            ))),
+        })))
     }
 
-    async fn process_count_stage(&self, input: &[Document], stage: &Document) -> Result<Vec<Document>> {
+    fn process_count_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
         println!("🔢 Processing $count stage");
-        let count = input.len() as i32;
         
         // Get the field name from the stage (e.g., {"$count": "total"})
-        let field_name = if let Some(count_value) = stage.get("$count") {
-            if let Some(name) = count_value.as_str() {
-                name
-            } else {
-                "count"
-            }
-        } else {
-            "count"
-        };
+        let field_name = stage.get("$count")
+            .and_then(|v| v.as_str())
+            .unwrap_or("count")
+            .to_string();
         
-        let result = bson::doc! {
-            field_name: count
-        };
-        Ok(vec![result])
+        // Counting is blocking but keeps no documents
+        Ok(Self::blocking_operator(input, move |upstream| {
+            let mut count = 0i32;
+            for doc in upstream {
+                doc?;
+                count += 1;
+            }
+            let result = bson::doc! { field_name.as_str(): count };
+            Ok(Box::new(std::iter::once(Ok(Cow::Owned(result)))) as DocStream<'a>)
+        }))
     }
 
-    async fn process_unwind_stage(&self, input: &[Document], _stage: &Document) -> Result<Vec<Document>> {
-        println!("🌀 Processing $unwind stage");
-        // Placeholder implementation
-        Ok(input.to_vec())
+    fn process_sample_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
+        println!("🎲 Processing $sample stage");
+
+        let size = stage.get_document("$sample")
+            .ok()
+            .and_then(|spec| spec.get("size"))
+            .and_then(|v| v.as_i64().or_else(|| v.as_i32().map(i64::from)))
+            .filter(|size| *size >= 0)
+            .ok_or_else(|| FauxDBError::Database("$sample size must be a non-negative number".to_string()))? as usize;
+
+        // Blocking, but only the reservoir is materialized
+        Ok(Self::blocking_operator(input, move |upstream| {
+            let sampled = Self::reservoir_sample(upstream, size)?;
+            Ok(Box::new(sampled.into_iter().map(Ok)) as DocStream<'a>)
+        }))
+    }
+
+    /// Reservoir sampling (Algorithm R): a single pass that keeps at most
+    /// `size` items, so memory tracks the sample and not the input. The
+    /// first upstream error ends the pass.
+    fn reservoir_sample<T, I: Iterator<Item = Result<T>>>(items: I, size: usize) -> Result<Vec<T>> {
+        let mut reservoir = Vec::with_capacity(size);
+        if size == 0 {
+            return Ok(reservoir);
+        }
+
+        let mut rng = rand::thread_rng();
+        for (seen, item) in items.enumerate() {
+            let item = item?;
+            if seen < size {
+                reservoir.push(item);
+            } else {
+                let slot = rng.gen_range(0..=seen);
+                if slot < size {
+                    reservoir[slot] = item;
+                }
+            }
+        }
+        Ok(reservoir)
     }
 
-    async fn process_lookup_stage(&self, input: &[Document], _stage: &Document) -> Result<Vec<Document>> {
-        println!("🔗 Processing $lookup stage");
-        // Placeholder implementation
-        Ok(input.to_vec())
+    fn process_unwind_stage<'a>(&self, input: DocStream<'a>, stage: &Document) -> Result<DocStream<'a>> {
+        println!("🌀 Processing $unwind stage");
+        
+        let (path, index_field, preserve) = match stage.get("$unwind") {
+            Some(bson::Bson::String(path)) => (path.clone(), None, false),
+            Some(bson::Bson::Document(spec)) => (
+                spec.get_str("path")
+                    .map_err(|_| FauxDBError::Database("$unwind requires a path".to_string()))?
+                    .to_string(),
+                spec.get_str("includeArrayIndex").ok().map(str::to_string),
+                spec.get_bool("preserveNullAndEmptyArrays").unwrap_or(false),
+            ),
+            _ => return Err(FauxDBError::Database("$unwind must be a field path or a document".to_string())),
+        };
+        let path = path.strip_prefix('$')
+            .filter(|field| !field.is_empty())
+            .ok_or_else(|| FauxDBError::Database(format!("$unwind path must be prefixed with '$': {}", path)))?
+            .to_string();
+        
+        Ok(Box::new(input.flat_map(move |doc| {
+            let doc = match doc {
+                Ok(doc) => doc,
+                Err(e) => return vec![Err(e)],
+            };
+            let with_index = |mut output: Document, index: bson::Bson| -> Result<Cow<'a, Document>> {
+                if let Some(index_field) = &index_field {
+                    set_path(&mut output, index_field, index);
+                }
+                Ok(Cow::Owned(output))
+            };
+            let keep = match lookup_path(&doc, &path) {
+                Some(bson::Bson::Array(items)) if !items.is_empty() => {
+                    return items.iter()
+                        .enumerate()
+                        .map(|(index, item)| {
+                            let mut output = doc.as_ref().clone();
+                            set_path(&mut output, &path, item.clone());
+                            with_index(output, bson::Bson::Int64(index as i64))
+                        })
+                        .collect();
+                }
+                // An empty array is dropped from the preserved document
+                Some(bson::Bson::Array(_)) if preserve => {
+                    let mut output = doc.into_owned();
+                    remove_path(&mut output, &path);
+                    return vec![with_index(output, bson::Bson::Null)];
+                }
+                // Missing, null and empty arrays
+                Some(bson::Bson::Array(_)) | Some(bson::Bson::Null) | None => preserve,
+                // A scalar unwinds to itself
+                Some(_) => true,
+            };
+            if keep {
+                vec![with_index(doc.into_owned(), bson::Bson::Null)]
+            } else {
+                Vec::new()
+            }
+        })))
     }
 }
 
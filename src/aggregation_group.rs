@@ -0,0 +1,532 @@
+/*!
+ * @file aggregation_group.rs
+ * @brief Hash aggregation for the in-process $group stage
+ *
+ * Accumulator states are mergeable, so a group table can be built per
+ * rayon worker and the partial tables combined afterwards. When the table
+ * outgrows the query's memory budget, documents for groups that are not
+ * already resident are hash-partitioned to spill files and each partition
+ * is aggregated on its own afterwards. The group key and accumulator
+ * operands are aggregation expressions, compiled once when the stage is
+ * parsed.
+ */
+
+use crate::bson_order::compare_bson;
+use crate::error::{FauxDBError, Result};
+use crate::expression::CompiledExpr;
+use crate::spill::{approximate_value_size, MemoryBudget, SpillWriter};
+use bson::{Bson, Document};
+use rayon::prelude::*;
+use std::borrow::Cow;
+use std::cmp::Ordering;
+use std::collections::hash_map::{DefaultHasher, Entry};
+use std::collections::HashMap;
+use std::hash::{Hash, Hasher};
+use std::sync::Arc;
+
+/// Below this many input documents the rayon fan-out costs more than it saves
+pub const PARALLEL_GROUP_THRESHOLD: usize = 4096;
+
+/// Documents pulled from upstream per aggregation round; the memory budget
+/// is checked between rounds
+const GROUP_BATCH_SIZE: usize = 8192;
+
+/// Fan-out when the group table spills
+const SPILL_PARTITIONS: usize = 16;
+
+/// Re-partitioning depth after which a $group gives up. Only reached when a
+/// handful of groups are individually too large, e.g. a $push of everything.
+const MAX_SPILL_DEPTH: u32 = 4;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum AccumulatorKind {
+    Sum,
+    Avg,
+    Min,
+    Max,
+    First,
+    Last,
+    Push,
+    AddToSet,
+    Count,
+}
+
+#[derive(Debug, Clone)]
+struct AccumulatorSpec {
+    output_field: String,
+    kind: AccumulatorKind,
+    operand: Arc<CompiledExpr>,
+}
+
+/// Parsed `$group` specification
+#[derive(Debug, Clone)]
+pub struct GroupSpec {
+    id: Arc<CompiledExpr>,
+    accumulators: Vec<AccumulatorSpec>,
+}
+
+impl GroupSpec {
+    pub fn parse(group: &Document) -> Result<Self> {
+        let id = group.get("_id")
+            .ok_or_else(|| FauxDBError::Database("$group requires an _id".to_string()))?;
+        let id = Arc::new(CompiledExpr::parse(id)?);
+
+        let mut accumulators = Vec::new();
+        for (field, spec) in group {
+            if field == "_id" {
+                continue;
+            }
+            let (operator, operand) = spec.as_document()
+                .filter(|spec| spec.len() == 1)
+                .and_then(|spec| spec.iter().next())
+                .ok_or_else(|| FauxDBError::Database(format!("$group field '{}' must be a single accumulator", field)))?;
+
+            let kind = AccumulatorKind::parse(operator)
+                .ok_or_else(|| FauxDBError::Database(format!("Unsupported $group accumulator: {}", operator)))?;
+
+            accumulators.push(AccumulatorSpec {
+                output_field: field.clone(),
+                kind,
+                operand: Arc::new(CompiledExpr::parse(operand)?),
+            });
+        }
+
+        Ok(Self { id, accumulators })
+    }
+
+    /// Group documents, fanning out across the rayon pool for large inputs.
+    /// `ordinal` in the states keeps $first/$last/$push in input order.
+    pub fn aggregate(&self, docs: &[&Document]) -> Result<Vec<Document>> {
+        Ok(self.partial_table(docs, 0)?.finish(self))
+    }
+
+    /// Group a document stream within a memory budget, spilling to disk when
+    /// the budget allows it. Groups that were spilled are emitted after the
+    /// resident ones; $group output order is unspecified anyway.
+    pub fn aggregate_stream<'a>(
+        &self,
+        input: &mut dyn Iterator<Item = Result<Cow<'a, Document>>>,
+        budget: &MemoryBudget,
+    ) -> Result<Vec<Document>> {
+        self.aggregate_level(input, budget, 0)
+    }
+
+    fn aggregate_level<'a>(
+        &self,
+        input: &mut dyn Iterator<Item = Result<Cow<'a, Document>>>,
+        budget: &MemoryBudget,
+        depth: u32,
+    ) -> Result<Vec<Document>> {
+        let mut table = GroupTable::default();
+        let mut partitions: Option<Vec<SpillWriter>> = None;
+        let mut ordinal = 0usize;
+        let mut batch: Vec<Cow<'a, Document>> = Vec::with_capacity(GROUP_BATCH_SIZE);
+
+        loop {
+            batch.clear();
+            for doc in input.by_ref().take(GROUP_BATCH_SIZE) {
+                batch.push(doc?);
+            }
+            if batch.is_empty() {
+                break;
+            }
+
+            let resident: Vec<&Document> = match partitions.as_mut() {
+                None => batch.iter().map(|doc| doc.as_ref()).collect(),
+                Some(writers) => {
+                    // Groups already in memory keep accumulating there; documents
+                    // for any other group go to that group's partition
+                    let mut resident = Vec::new();
+                    for doc in &batch {
+                        let key_bytes = group_key_bytes(&self.id.evaluate(doc)?);
+                        if table.groups.contains_key(&key_bytes) {
+                            resident.push(doc.as_ref());
+                        } else {
+                            writers[partition_of(&key_bytes, depth)].append(doc)?;
+                        }
+                    }
+                    resident
+                }
+            };
+            table = table.merge(self.partial_table(&resident, ordinal)?, self);
+            ordinal += batch.len();
+
+            if partitions.is_none() && budget.must_spill("$group", table.approximate_bytes())? {
+                if depth >= MAX_SPILL_DEPTH {
+                    return Err(FauxDBError::Database(format!(
+                        "$group exceeded memory limit of {} bytes even after spilling {} levels of partitions",
+                        budget.limit_bytes, depth
+                    )));
+                }
+                partitions = Some((0..SPILL_PARTITIONS)
+                    .map(|_| SpillWriter::create("$group"))
+                    .collect::<Result<_>>()?);
+            }
+        }
+
+        let mut output = table.finish(self);
+        for writer in partitions.into_iter().flatten() {
+            let run = writer.finish()?;
+            if run.documents == 0 {
+                continue;
+            }
+            // Each key lives in exactly one partition, so partitions never need merging
+            let mut spilled = run.into_reader()?.map(|doc| doc.map(Cow::Owned));
+            output.extend(self.aggregate_level(&mut spilled, budget, depth + 1)?);
+        }
+        Ok(output)
+    }
+
+    /// Build a group table for one slice of input whose first document has
+    /// the given ordinal
+    fn partial_table(&self, docs: &[&Document], first_ordinal: usize) -> Result<GroupTable> {
+        if docs.len() >= PARALLEL_GROUP_THRESHOLD {
+            docs.par_iter()
+                .enumerate()
+                .try_fold(GroupTable::default, |mut table, (offset, doc)| {
+                    table.accumulate(self, first_ordinal + offset, doc)?;
+                    Ok(table)
+                })
+                .try_reduce(GroupTable::default, |left, right| Ok(left.merge(right, self)))
+        } else {
+            let mut table = GroupTable::default();
+            for (offset, doc) in docs.iter().enumerate() {
+                table.accumulate(self, first_ordinal + offset, doc)?;
+            }
+            Ok(table)
+        }
+    }
+}
+
+/// Spill partition for a group key. The depth seeds the hash so a partition
+/// that overflows again splits differently at the next level.
+fn partition_of(key_bytes: &[u8], depth: u32) -> usize {
+    let mut hasher = DefaultHasher::new();
+    depth.hash(&mut hasher);
+    key_bytes.hash(&mut hasher);
+    (hasher.finish() % SPILL_PARTITIONS as u64) as usize
+}
+
+impl AccumulatorKind {
+    pub(crate) fn parse(operator: &str) -> Option<Self> {
+        Some(match operator {
+            "$sum" => AccumulatorKind::Sum,
+            "$avg" => AccumulatorKind::Avg,
+            "$min" => AccumulatorKind::Min,
+            "$max" => AccumulatorKind::Max,
+            "$first" => AccumulatorKind::First,
+            "$last" => AccumulatorKind::Last,
+            "$push" => AccumulatorKind::Push,
+            "$addToSet" => AccumulatorKind::AddToSet,
+            "$count" => AccumulatorKind::Count,
+            _ => return None,
+        })
+    }
+}
+
+/// Running state of one accumulator; $setWindowFields folds frames with it too
+#[derive(Debug, Clone)]
+pub(crate) enum AccumulatorState {
+    Sum { int: i64, float: f64, is_float: bool },
+    Avg { total: f64, count: u64 },
+    Extreme(Option<Bson>),
+    Positional(Option<(usize, Bson)>),
+    Push(Vec<(usize, Bson)>),
+    AddToSet(Vec<Bson>),
+}
+
+impl AccumulatorState {
+    pub(crate) fn new(kind: AccumulatorKind) -> Self {
+        match kind {
+            AccumulatorKind::Sum | AccumulatorKind::Count => AccumulatorState::Sum { int: 0, float: 0.0, is_float: false },
+            AccumulatorKind::Avg => AccumulatorState::Avg { total: 0.0, count: 0 },
+            AccumulatorKind::Min | AccumulatorKind::Max => AccumulatorState::Extreme(None),
+            AccumulatorKind::First | AccumulatorKind::Last => AccumulatorState::Positional(None),
+            AccumulatorKind::Push => AccumulatorState::Push(Vec::new()),
+            AccumulatorKind::AddToSet => AccumulatorState::AddToSet(Vec::new()),
+        }
+    }
+
+    /// Fold in one value, returning how many bytes the state now retains for it
+    pub(crate) fn add(&mut self, kind: AccumulatorKind, ordinal: usize, value: Bson) -> usize {
+        match self {
+            AccumulatorState::Sum { int, float, is_float } => {
+                match value {
+                    Bson::Int32(n) => Self::add_int(int, float, is_float, n as i64),
+                    Bson::Int64(n) => Self::add_int(int, float, is_float, n),
+                    Bson::Double(n) => {
+                        *is_float = true;
+                        *float += n;
+                    }
+                    // Non-numeric values are ignored by $sum
+                    _ => {}
+                }
+                0
+            }
+            AccumulatorState::Avg { total, count } => {
+                if let Some(n) = Self::numeric(&value) {
+                    *total += n;
+                    *count += 1;
+                }
+                0
+            }
+            AccumulatorState::Extreme(current) => {
+                // $min/$max skip null and missing values
+                if matches!(value, Bson::Null | Bson::Undefined) {
+                    return 0;
+                }
+                let replace = match current {
+                    None => true,
+                    Some(existing) => {
+                        let order = compare_bson(&value, existing);
+                        if kind == AccumulatorKind::Min { order == Ordering::Less } else { order == Ordering::Greater }
+                    }
+                };
+                if replace {
+                    *current = Some(value);
+                }
+                0
+            }
+            AccumulatorState::Positional(current) => {
+                let replace = match current {
+                    None => true,
+                    Some((existing, _)) => if kind == AccumulatorKind::First { ordinal < *existing } else { ordinal > *existing },
+                };
+                if replace {
+                    *current = Some((ordinal, value));
+                }
+                0
+            }
+            AccumulatorState::Push(values) => {
+                let retained = approximate_value_size(&value);
+                values.push((ordinal, value));
+                retained
+            }
+            AccumulatorState::AddToSet(values) => {
+                if values.contains(&value) {
+                    return 0;
+                }
+                let retained = approximate_value_size(&value);
+                values.push(value);
+                retained
+            }
+        }
+    }
+
+    fn add_int(int: &mut i64, float: &mut f64, is_float: &mut bool, n: i64) {
+        match int.checked_add(n) {
+            Some(sum) => *int = sum,
+            None => {
+                // Overflow promotes the running total to double, like the server
+                *is_float = true;
+                *float += n as f64;
+            }
+        }
+    }
+
+    fn numeric(value: &Bson) -> Option<f64> {
+        match value {
+            Bson::Int32(n) => Some(*n as f64),
+            Bson::Int64(n) => Some(*n as f64),
+            Bson::Double(n) => Some(*n),
+            _ => None,
+        }
+    }
+
+    fn merge(&mut self, kind: AccumulatorKind, other: AccumulatorState) {
+        match (self, other) {
+            (AccumulatorState::Sum { int, float, is_float }, AccumulatorState::Sum { int: other_int, float: other_float, is_float: other_is_float }) => {
+                Self::add_int(int, float, is_float, other_int);
+                *float += other_float;
+                *is_float |= other_is_float;
+            }
+            (AccumulatorState::Avg { total, count }, AccumulatorState::Avg { total: other_total, count: other_count }) => {
+                *total += other_total;
+                *count += other_count;
+            }
+            (state @ AccumulatorState::Extreme(_), AccumulatorState::Extreme(Some(value))) => {
+                state.add(kind, 0, value);
+            }
+            (state @ AccumulatorState::Positional(_), AccumulatorState::Positional(Some((ordinal, value)))) => {
+                state.add(kind, ordinal, value);
+            }
+            (AccumulatorState::Push(values), AccumulatorState::Push(other_values)) => values.extend(other_values),
+            (state @ AccumulatorState::AddToSet(_), AccumulatorState::AddToSet(other_values)) => {
+                for value in other_values {
+                    state.add(kind, 0, value);
+                }
+            }
+            _ => {}
+        }
+    }
+
+    pub(crate) fn finish(self) -> Bson {
+        match self {
+            AccumulatorState::Sum { int, float, is_float } => {
+                if is_float {
+                    Bson::Double(float + int as f64)
+                } else if let Ok(small) = i32::try_from(int) {
+                    Bson::Int32(small)
+                } else {
+                    Bson::Int64(int)
+                }
+            }
+            AccumulatorState::Avg { total, count } => {
+                if count == 0 { Bson::Null } else { Bson::Double(total / count as f64) }
+            }
+            AccumulatorState::Extreme(value) => value.unwrap_or(Bson::Null),
+            AccumulatorState::Positional(value) => value.map(|(_, v)| v).unwrap_or(Bson::Null),
+            AccumulatorState::Push(mut values) => {
+                values.sort_by_key(|(ordinal, _)| *ordinal);
+                Bson::Array(values.into_iter().map(|(_, v)| v).collect())
+            }
+            AccumulatorState::AddToSet(values) => Bson::Array(values),
+        }
+    }
+}
+
+struct GroupEntry {
+    first_ordinal: usize,
+    key: Bson,
+    states: Vec<AccumulatorState>,
+    /// Bytes held by $push/$addToSet values
+    payload_bytes: usize,
+}
+
+impl GroupEntry {
+    fn approximate_bytes(&self, key_bytes: &[u8]) -> usize {
+        std::mem::size_of::<GroupEntry>()
+            + key_bytes.len()
+            + approximate_value_size(&self.key)
+            + self.states.len() * std::mem::size_of::<AccumulatorState>()
+            + self.payload_bytes
+    }
+}
+
+#[derive(Default)]
+pub struct GroupTable {
+    groups: HashMap<Vec<u8>, GroupEntry>,
+    approximate_bytes: usize,
+}
+
+impl GroupTable {
+    pub fn accumulate(&mut self, spec: &GroupSpec, ordinal: usize, doc: &Document) -> Result<()> {
+        let key = spec.id.evaluate(doc)?;
+        let entry = match self.groups.entry(group_key_bytes(&key)) {
+            Entry::Occupied(occupied) => occupied.into_mut(),
+            Entry::Vacant(vacant) => {
+                let entry = GroupEntry {
+                    first_ordinal: ordinal,
+                    key,
+                    states: spec.accumulators.iter().map(|acc| AccumulatorState::new(acc.kind)).collect(),
+                    payload_bytes: 0,
+                };
+                self.approximate_bytes += entry.approximate_bytes(vacant.key());
+                vacant.insert(entry)
+            }
+        };
+        entry.first_ordinal = entry.first_ordinal.min(ordinal);
+
+        for (state, acc) in entry.states.iter_mut().zip(&spec.accumulators) {
+            let value = match acc.kind {
+                AccumulatorKind::Count => Bson::Int32(1),
+                _ => acc.operand.evaluate(doc)?,
+            };
+            let retained = state.add(acc.kind, ordinal, value);
+            entry.payload_bytes += retained;
+            self.approximate_bytes += retained;
+        }
+        Ok(())
+    }
+
+    /// Fold another partial table into this one
+    pub fn merge(mut self, other: GroupTable, spec: &GroupSpec) -> GroupTable {
+        for (key_bytes, incoming) in other.groups {
+            match self.groups.get_mut(&key_bytes) {
+                Some(existing) => {
+                    existing.first_ordinal = existing.first_ordinal.min(incoming.first_ordinal);
+                    // Merged $addToSet duplicates are still counted; the estimate errs high
+                    existing.payload_bytes += incoming.payload_bytes;
+                    self.approximate_bytes += incoming.payload_bytes;
+                    for ((state, other_state), acc) in existing.states.iter_mut().zip(incoming.states).zip(&spec.accumulators) {
+                        state.merge(acc.kind, other_state);
+                    }
+                }
+                None => {
+                    self.approximate_bytes += incoming.approximate_bytes(&key_bytes);
+                    self.groups.insert(key_bytes, incoming);
+                }
+            }
+        }
+        self
+    }
+
+    pub fn len(&self) -> usize {
+        self.groups.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.groups.is_empty()
+    }
+
+    /// Estimated resident size, charged against the query's memory budget
+    pub fn approximate_bytes(&self) -> usize {
+        self.approximate_bytes
+    }
+
+    /// Emit one document per group, in order of each group's first input document
+    pub fn finish(self, spec: &GroupSpec) -> Vec<Document> {
+        let mut entries: Vec<GroupEntry> = self.groups.into_values().collect();
+        entries.sort_by_key(|entry| entry.first_ordinal);
+
+        entries.into_iter()
+            .map(|entry| {
+                let mut output = Document::new();
+                output.insert("_id", entry.key);
+                for (state, acc) in entry.states.into_iter().zip(&spec.accumulators) {
+                    output.insert(acc.output_field.clone(), state.finish());
+                }
+                output
+            })
+            .collect()
+    }
+}
+
+/// Hashable encoding of a group key. Numbers are normalized so that 1,
+/// 1i64 and 1.0 fall into the same group, as they do in MongoDB.
+pub(crate) fn group_key_bytes(key: &Bson) -> Vec<u8> {
+    let mut wrapper = Document::new();
+    wrapper.insert("k", normalize_key(key));
+    bson::to_vec(&wrapper).unwrap_or_default()
+}
+
+/// Largest magnitude below which every integer is exactly representable as a
+/// double
+const MAX_EXACT_DOUBLE_INT: i64 = 1 << 53;
+
+/// Numbers map to a double while that is lossless. Past 2^53 an Int64 keeps
+/// its width, so distinct large ids don't collapse into one group, and an
+/// integral double that large maps back to Int64 so it still meets its twin.
+fn normalize_key(key: &Bson) -> Bson {
+    match key {
+        Bson::Int32(n) => Bson::Double(*n as f64),
+        Bson::Int64(n) if n.unsigned_abs() <= MAX_EXACT_DOUBLE_INT as u64 => Bson::Double(*n as f64),
+        Bson::Int64(n) => Bson::Int64(*n),
+        Bson::Double(d)
+            if d.fract() == 0.0
+                && d.abs() > MAX_EXACT_DOUBLE_INT as f64
+                && d.abs() < i64::MAX as f64 =>
+        {
+            Bson::Int64(*d as i64)
+        }
+        Bson::Document(fields) => {
+            let mut normalized = Document::new();
+            for (k, v) in fields {
+                normalized.insert(k, normalize_key(v));
+            }
+            Bson::Document(normalized)
+        }
+        Bson::Array(items) => Bson::Array(items.iter().map(normalize_key).collect()),
+        other => other.clone(),
+    }
+}
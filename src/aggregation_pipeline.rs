@@ -3,15 +3,20 @@
  * Full MongoDB 5.0+ aggregation support with PostgreSQL backend
  */
 
-use bson::{Document, Bson, Array};
+use bson::{doc, Document, Bson, Array};
 use anyhow::{Result, anyhow};
-use crate::{fauxdb_warn, fauxdb_debug};
+use crate::fauxdb_debug;
+use crate::expression::Expr;
+use crate::pipeline_optimizer::PipelineOptimizer;
+use crate::spill::MemoryBudget;
 
 #[derive(Debug, Clone)]
 pub struct AggregationPipeline {
     stages: Vec<PipelineStage>,
-    #[allow(dead_code)]
     options: PipelineOptions,
+    sample_context: SampleContext,
+    /// Column names of the source table, when the caller knows them
+    columns: Option<Vec<String>>,
 }
 
 #[derive(Debug, Clone)]
@@ -85,6 +90,9 @@ pub enum PipelineStage {
     // Fill stage
     Fill(FillOptions),
     
+    // SetWindowFields stage
+    SetWindowFields(SetWindowFieldsOptions),
+    
     // Set stage
     Set(Document),
     
@@ -96,6 +104,9 @@ pub enum PipelineStage {
     
     // Custom stage for PostgreSQL-specific optimizations
     CustomSql(String),
+    
+    // Fused $sort + $limit produced by the pipeline optimizer
+    TopK { sort: Document, limit: i32 },
 }
 
 #[derive(Debug, Clone)]
@@ -173,6 +184,7 @@ pub struct UnionWithOptions {
 #[derive(Debug, Clone)]
 pub struct DensifyOptions {
     pub field: String,
+    pub partition_by_fields: Option<Vec<String>>,
     pub range: Document,
 }
 
@@ -184,6 +196,151 @@ pub struct FillOptions {
     pub sort_by: Option<Document>,
 }
 
+#[derive(Debug, Clone)]
+pub struct SetWindowFieldsOptions {
+    pub partition_by: Option<Bson>,
+    pub sort_by: Option<Document>,
+    pub output: Document,
+}
+
+/// Result of splitting a pipeline at its pushdown boundary
+#[derive(Debug, Clone)]
+pub struct PipelinePlan {
+    /// SQL for the longest prefix that PostgreSQL can execute
+    pub sql: String,
+    /// Stages that must run in the in-process aggregation engine
+    pub remainder: Vec<PipelineStage>,
+    /// Why the first remainder stage could not be pushed down
+    pub boundary_reason: Option<String>,
+}
+
+impl PipelinePlan {
+    pub fn remainder_documents(&self) -> Vec<Document> {
+        self.remainder.iter().flat_map(|stage| stage.to_documents()).collect()
+    }
+}
+
+/// A SELECT under construction. Stages add clauses while that preserves
+/// pipeline semantics, and otherwise wrap the statement as a subquery.
+#[derive(Debug, Clone)]
+struct SqlSelect {
+    source: String,
+    projection: Option<String>,
+    filters: Vec<String>,
+    order_by: Option<String>,
+    limit: Option<i64>,
+    offset: Option<i64>,
+    /// Output column names, when known. Stages that overwrite a column
+    /// list every column once instead of selecting `*` and the new value.
+    columns: Option<Vec<String>>,
+}
+
+impl SqlSelect {
+    fn from_source(source: String) -> Self {
+        Self {
+            source,
+            projection: None,
+            filters: Vec::new(),
+            order_by: None,
+            limit: None,
+            offset: None,
+            columns: None,
+        }
+    }
+
+    fn wrap(&mut self, alias: &str) {
+        let columns = self.columns.take();
+        *self = Self::from_source(format!("({}) AS {}", self.render(), alias));
+        self.columns = columns;
+    }
+
+    /// Replace the statement with `sql`, whose output columns are `columns`
+    fn replace(&mut self, sql: String, alias: &str, columns: Option<Vec<String>>) {
+        *self = Self::from_source(format!("({}) AS {}", sql, alias));
+        self.columns = columns;
+    }
+
+    fn apply_limit(&mut self, limit: i64) {
+        self.limit = Some(self.limit.map_or(limit, |current| current.min(limit)));
+    }
+
+    fn apply_skip(&mut self, skip: i64) {
+        // OFFSET is applied before LIMIT, so skipping after a limit shrinks it
+        if let Some(limit) = self.limit {
+            self.limit = Some((limit - skip).max(0));
+        }
+        self.offset = Some(self.offset.unwrap_or(0) + skip);
+    }
+
+    fn render(&self) -> String {
+        let mut sql = format!(
+            "SELECT {} FROM {}",
+            self.projection.as_deref().unwrap_or("*"),
+            self.source
+        );
+        if !self.filters.is_empty() {
+            sql.push_str(&format!(" WHERE {}", self.filters.join(" AND ")));
+        }
+        if let Some(order_by) = &self.order_by {
+            sql.push_str(&format!(" ORDER BY {}", order_by));
+        }
+        if let Some(limit) = self.limit {
+            sql.push_str(&format!(" LIMIT {}", limit));
+        }
+        if let Some(offset) = self.offset {
+            sql.push_str(&format!(" OFFSET {}", offset));
+        }
+        sql
+    }
+}
+
+/// Table statistics used to compile a leading `$sample` into a `TABLESAMPLE`
+/// clause instead of a full scan.
+#[derive(Debug, Clone, Default)]
+pub struct SampleContext {
+    /// `pg_class.reltuples` for the collection table, if it has been analyzed
+    pub estimated_rows: Option<f64>,
+    /// Whether the `tsm_system_rows` extension is installed
+    pub tsm_system_rows: bool,
+}
+
+/// Bernoulli sampling draws rows independently, so ask for more than needed
+/// to survive a stale `reltuples` estimate; the surplus is trimmed by LIMIT.
+const SAMPLE_OVERSAMPLE_FACTOR: f64 = 1.5;
+
+impl SampleContext {
+    /// A query returning `size` random rows of `table`
+    pub fn sample_sql(&self, table: &str, size: i32) -> Result<String> {
+        if size < 0 {
+            return Err(anyhow!("$sample size must be a non-negative number"));
+        }
+
+        // SYSTEM_ROWS reads just enough blocks to return `size` rows
+        if self.tsm_system_rows {
+            return Ok(format!(
+                "SELECT sample_source.* FROM {} AS sample_source TABLESAMPLE SYSTEM_ROWS({})",
+                table, size
+            ));
+        }
+
+        if let Some(estimated_rows) = self.estimated_rows.filter(|rows| *rows > 0.0) {
+            let percent = size as f64 * SAMPLE_OVERSAMPLE_FACTOR / estimated_rows * 100.0;
+            if percent < 100.0 {
+                return Ok(format!(
+                    "SELECT sample_source.* FROM {} AS sample_source TABLESAMPLE BERNOULLI ({:.6}) ORDER BY random() LIMIT {}",
+                    table, percent, size
+                ));
+            }
+        }
+
+        // No statistics, or the sample covers the whole table anyway
+        Ok(format!(
+            "SELECT sample_source.* FROM {} AS sample_source ORDER BY random() LIMIT {}",
+            table, size
+        ))
+    }
+}
+
 impl Default for PipelineOptions {
     fn default() -> Self {
         Self {
@@ -199,14 +356,226 @@ impl Default for PipelineOptions {
     }
 }
 
+impl PipelineOptions {
+    /// Read the options that accompany `pipeline` in an aggregate command
+    pub fn from_command(command: &Document) -> Self {
+        Self {
+            allow_disk_use: command.get_bool("allowDiskUse").unwrap_or(false),
+            cursor: command.get_document("cursor").ok().cloned(),
+            max_time_ms: command.get("maxTimeMS")
+                .and_then(|v| v.as_i64().or_else(|| v.as_i32().map(i64::from)))
+                .and_then(|ms| u32::try_from(ms).ok()),
+            bypass_document_validation: command.get_bool("bypassDocumentValidation").unwrap_or(false),
+            read_concern: command.get_document("readConcern").ok().cloned(),
+            collation: command.get_document("collation").ok().cloned(),
+            hint: command.get_document("hint").ok().cloned(),
+            comment: command.get_str("comment").ok().map(|s| s.to_string()),
+        }
+    }
+
+    /// Memory budget for the in-process part of the pipeline
+    pub fn memory_budget(&self, limit_bytes: usize) -> MemoryBudget {
+        MemoryBudget::new(limit_bytes, self.allow_disk_use)
+    }
+}
+
+impl PipelineStage {
+    /// Render the stage back to its MongoDB form so the pipeline remainder
+    /// can be handed to the in-process aggregation engine. A fused TopK
+    /// expands to its original $sort and $limit.
+    pub fn to_documents(&self) -> Vec<Document> {
+        let stage = match self {
+            PipelineStage::Match(doc) => doc! { "$match": doc.clone() },
+            PipelineStage::Group(doc) => doc! { "$group": doc.clone() },
+            PipelineStage::Project(doc) => doc! { "$project": doc.clone() },
+            PipelineStage::Sort(doc) => doc! { "$sort": doc.clone() },
+            PipelineStage::Limit(limit) => doc! { "$limit": *limit },
+            PipelineStage::Skip(skip) => doc! { "$skip": *skip },
+            PipelineStage::Unwind(opts) => {
+                let mut unwind = doc! { "path": opts.path.clone() };
+                if let Some(index_field) = &opts.include_array_index {
+                    unwind.insert("includeArrayIndex", index_field.clone());
+                }
+                if let Some(preserve) = opts.preserve_null_and_empty_arrays {
+                    unwind.insert("preserveNullAndEmptyArrays", preserve);
+                }
+                doc! { "$unwind": unwind }
+            }
+            PipelineStage::Lookup(opts) => {
+                let mut lookup = doc! {
+                    "from": opts.from.clone(),
+                    "localField": opts.local_field.clone(),
+                    "foreignField": opts.foreign_field.clone(),
+                    "as": opts.r#as.clone(),
+                };
+                if let Some(stages) = &opts.pipeline {
+                    lookup.insert("pipeline", Self::stages_to_bson(stages));
+                }
+                if let Some(let_vars) = &opts.let_vars {
+                    lookup.insert("let", let_vars.clone());
+                }
+                doc! { "$lookup": lookup }
+            }
+            PipelineStage::AddFields(doc) => doc! { "$addFields": doc.clone() },
+            PipelineStage::ReplaceRoot(doc) => doc! { "$replaceRoot": doc.clone() },
+            PipelineStage::Count(field) => doc! { "$count": field.clone() },
+            PipelineStage::CollStats(doc) => doc! { "$collStats": doc.clone() },
+            PipelineStage::Facet(doc) => doc! { "$facet": doc.clone() },
+            PipelineStage::Bucket(opts) => {
+                let mut bucket = doc! {
+                    "groupBy": opts.group_by.clone(),
+                    "boundaries": opts.boundaries.clone(),
+                };
+                if let Some(default) = &opts.default {
+                    bucket.insert("default", default.clone());
+                }
+                if let Some(output) = &opts.output {
+                    bucket.insert("output", output.clone());
+                }
+                doc! { "$bucket": bucket }
+            }
+            PipelineStage::BucketAuto(opts) => {
+                let mut bucket = doc! {
+                    "groupBy": opts.group_by.clone(),
+                    "buckets": opts.buckets,
+                };
+                if let Some(output) = &opts.output {
+                    bucket.insert("output", output.clone());
+                }
+                if let Some(granularity) = &opts.granularity {
+                    bucket.insert("granularity", granularity.clone());
+                }
+                doc! { "$bucketAuto": bucket }
+            }
+            PipelineStage::GraphLookup(opts) => {
+                let mut lookup = doc! {
+                    "from": opts.from.clone(),
+                    "startWith": opts.start_with.clone(),
+                    "connectFromField": opts.connect_from_field.clone(),
+                    "connectToField": opts.connect_to_field.clone(),
+                    "as": opts.r#as.clone(),
+                };
+                if let Some(max_depth) = opts.max_depth {
+                    lookup.insert("maxDepth", max_depth);
+                }
+                if let Some(depth_field) = &opts.depth_field {
+                    lookup.insert("depthField", depth_field.clone());
+                }
+                if let Some(restrict) = &opts.restrict_search_with_match {
+                    lookup.insert("restrictSearchWithMatch", restrict.clone());
+                }
+                doc! { "$graphLookup": lookup }
+            }
+            PipelineStage::Sample { size } => doc! { "$sample": { "size": *size } },
+            PipelineStage::Redact(doc) => doc! { "$redact": doc.clone() },
+            PipelineStage::Out(coll) => doc! { "$out": coll.clone() },
+            PipelineStage::Merge(opts) => {
+                let mut merge = doc! { "into": opts.into.clone() };
+                if let Some(on) = &opts.on {
+                    merge.insert("on", on.clone());
+                }
+                if let Some(when_matched) = &opts.when_matched {
+                    merge.insert("whenMatched", when_matched.clone());
+                }
+                if let Some(when_not_matched) = &opts.when_not_matched {
+                    merge.insert("whenNotMatched", when_not_matched.clone());
+                }
+                if let Some(let_vars) = &opts.let_vars {
+                    merge.insert("let", let_vars.clone());
+                }
+                doc! { "$merge": merge }
+            }
+            PipelineStage::UnionWith(opts) => {
+                let mut union = doc! { "coll": opts.coll.clone() };
+                if let Some(stages) = &opts.pipeline {
+                    union.insert("pipeline", Self::stages_to_bson(stages));
+                }
+                doc! { "$unionWith": union }
+            }
+            PipelineStage::Densify(opts) => {
+                let mut densify = doc! { "field": opts.field.clone(), "range": opts.range.clone() };
+                if let Some(fields) = &opts.partition_by_fields {
+                    densify.insert("partitionByFields", fields.clone());
+                }
+                doc! { "$densify": densify }
+            }
+            PipelineStage::Fill(opts) => {
+                let mut fill = doc! { "output": opts.output.clone() };
+                if let Some(partition_by) = &opts.partition_by {
+                    fill.insert("partitionBy", partition_by.clone());
+                }
+                if let Some(fields) = &opts.partition_by_fields {
+                    fill.insert("partitionByFields", fields.clone());
+                }
+                if let Some(sort_by) = &opts.sort_by {
+                    fill.insert("sortBy", sort_by.clone());
+                }
+                doc! { "$fill": fill }
+            }
+            PipelineStage::SetWindowFields(opts) => {
+                let mut window = doc! { "output": opts.output.clone() };
+                if let Some(partition_by) = &opts.partition_by {
+                    window.insert("partitionBy", partition_by.clone());
+                }
+                if let Some(sort_by) = &opts.sort_by {
+                    window.insert("sortBy", sort_by.clone());
+                }
+                doc! { "$setWindowFields": window }
+            }
+            PipelineStage::Set(doc) => doc! { "$set": doc.clone() },
+            PipelineStage::Unset(doc) => doc! { "$unset": doc.clone() },
+            PipelineStage::ReplaceWith(doc) => doc! { "$replaceWith": doc.clone() },
+            PipelineStage::CustomSql(sql) => doc! { "$sql": sql.clone() },
+            PipelineStage::TopK { sort, limit } => {
+                return vec![doc! { "$sort": sort.clone() }, doc! { "$limit": *limit }];
+            }
+        };
+        vec![stage]
+    }
+
+    fn stages_to_bson(stages: &[PipelineStage]) -> Vec<Bson> {
+        stages.iter()
+            .flat_map(|stage| stage.to_documents())
+            .map(Bson::Document)
+            .collect()
+    }
+}
+
 impl AggregationPipeline {
     pub fn new() -> Self {
         Self {
             stages: Vec::new(),
             options: PipelineOptions::default(),
+            sample_context: SampleContext::default(),
+            columns: None,
         }
     }
 
+    /// Name the source table's columns. $fill and $setWindowFields
+    /// overwrite columns in place, so they are only pushed down with them.
+    pub fn with_columns(mut self, columns: Vec<String>) -> Self {
+        self.columns = Some(columns);
+        self
+    }
+
+    pub fn with_sample_context(mut self, sample_context: SampleContext) -> Self {
+        self.sample_context = sample_context;
+        self
+    }
+
+    pub fn sample_context(&self) -> &SampleContext {
+        &self.sample_context
+    }
+
+    pub fn with_options(mut self, options: PipelineOptions) -> Self {
+        self.options = options;
+        self
+    }
+
+    pub fn options(&self) -> &PipelineOptions {
+        &self.options
+    }
+
     pub async fn execute_stage(&self, stage: &PipelineStage, input: &Document) -> Result<Document> {
         match stage {
             PipelineStage::Match(filter) => {
@@ -246,6 +615,13 @@ impl AggregationPipeline {
         }
     }
 
+    pub fn from_stages(stages: Vec<PipelineStage>) -> Self {
+        Self {
+            stages,
+            ..Self::new()
+        }
+    }
+
     pub fn from_bson_array(pipeline_array: Array) -> Result<Self> {
         let mut pipeline = Self::new();
         
@@ -404,6 +780,10 @@ impl AggregationPipeline {
                 let fill_opts = Self::parse_fill_stage(stage_value)?;
                 Ok(PipelineStage::Fill(fill_opts))
             }
+            "$setWindowFields" => {
+                let window_opts = Self::parse_set_window_fields_stage(stage_value)?;
+                Ok(PipelineStage::SetWindowFields(window_opts))
+            }
             "$set" => {
                 if let Bson::Document(set_doc) = stage_value {
                     Ok(PipelineStage::Set(set_doc))
@@ -673,8 +1053,13 @@ impl AggregationPipeline {
                 .ok_or_else(|| anyhow!("$densify range is required"))?
                 .clone();
 
+            let partition_by_fields = doc.get("partitionByFields")
+                .and_then(|v| v.as_array())
+                .map(|arr| arr.iter().filter_map(|v| v.as_str().map(|s| s.to_string())).collect());
+
             Ok(DensifyOptions {
                 field,
+                partition_by_fields,
                 range,
             })
         } else {
@@ -706,129 +1091,235 @@ impl AggregationPipeline {
         }
     }
 
+    fn parse_set_window_fields_stage(value: Bson) -> Result<SetWindowFieldsOptions> {
+        if let Bson::Document(doc) = value {
+            let output = doc.get("output")
+                .and_then(|v| v.as_document())
+                .ok_or_else(|| anyhow!("$setWindowFields output is required"))?
+                .clone();
+
+            let partition_by = doc.get("partitionBy").cloned();
+            let sort_by = doc.get("sortBy").and_then(|v| v.as_document()).cloned();
+
+            Ok(SetWindowFieldsOptions {
+                partition_by,
+                sort_by,
+                output,
+            })
+        } else {
+            Err(anyhow!("$setWindowFields stage must be a document"))
+        }
+    }
+
+    pub fn stages(&self) -> &[PipelineStage] {
+        &self.stages
+    }
+
+    /// Compile the whole pipeline to one SQL statement. Fails if any stage
+    /// cannot be pushed down; use `plan` to split such pipelines instead.
     pub fn to_sql(&self, collection_name: &str) -> Result<String> {
-        let _sql_parts: Vec<String> = Vec::new();
-        let mut current_query = format!("SELECT * FROM {}", collection_name);
-        let mut has_where = false;
-        let mut _has_order_by = false;
-        let mut limit_clause = None;
-        let mut skip_clause = None;
-
-        for stage in &self.stages {
-            match stage {
-                PipelineStage::Match(filter) => {
-                    if let Ok(where_clause) = self.filter_to_sql(filter) {
-                        if has_where {
-                            current_query = current_query.replace("WHERE", &format!("AND {}", where_clause));
-                        } else {
-                            current_query = format!("{} WHERE {}", current_query, where_clause);
-                            has_where = true;
-                        }
-                    }
+        let plan = self.plan(collection_name)?;
+        match plan.remainder.first() {
+            None => Ok(plan.sql),
+            Some(stage) => Err(anyhow!(
+                "Stage {:?} cannot be pushed down to SQL: {}",
+                stage,
+                plan.boundary_reason.unwrap_or_default()
+            )),
+        }
+    }
+
+    /// Optimize the pipeline and split it at the first stage that cannot be
+    /// expressed in SQL. The prefix becomes a single statement; the remainder
+    /// is left for the in-process aggregation engine.
+    pub fn plan(&self, collection_name: &str) -> Result<PipelinePlan> {
+        let stages = PipelineOptimizer::optimize(self.stages.clone());
+        let mut select = SqlSelect::from_source(collection_name.to_string());
+        select.columns = self.columns.clone();
+
+        for (index, stage) in stages.iter().enumerate() {
+            let mut next = select.clone();
+            if let Err(e) = self.apply_stage_sql(&mut next, stage, index, collection_name) {
+                fauxdb_debug!("Pushdown boundary at stage {}: {}", index, e);
+                return Ok(PipelinePlan {
+                    sql: select.render(),
+                    remainder: stages[index..].to_vec(),
+                    boundary_reason: Some(e.to_string()),
+                });
+            }
+            select = next;
+        }
+
+        Ok(PipelinePlan {
+            sql: select.render(),
+            remainder: Vec::new(),
+            boundary_reason: None,
+        })
+    }
+
+    fn apply_stage_sql(&self, select: &mut SqlSelect, stage: &PipelineStage, index: usize, collection_name: &str) -> Result<()> {
+        match stage {
+            PipelineStage::Sample { size } => {
+                if index != 0 {
+                    // Only a leading $sample can sample the table itself; later
+                    // positions are handled by the in-process reservoir sampler
+                    return Err(anyhow!("$sample is only pushed down as the first pipeline stage"));
                 }
-                PipelineStage::Sort(sort_doc) => {
-                    if let Ok(order_clause) = self.sort_to_sql(sort_doc) {
-                        current_query = format!("{} ORDER BY {}", current_query, order_clause);
-                        _has_order_by = true;
-                    }
+                let sample_sql = self.sample_to_sql(collection_name, *size)?;
+                let columns = select.columns.take();
+                select.replace(sample_sql, "sampled", columns);
+            }
+            PipelineStage::Match(filter) => {
+                let where_clause = self.filter_to_sql(filter)?;
+                // Filtering commutes with ORDER BY but not with a projection or a row limit
+                if select.projection.is_some() || select.limit.is_some() || select.offset.is_some() {
+                    select.wrap("matched");
                 }
-                PipelineStage::Limit(limit) => {
-                    limit_clause = Some(*limit);
+                select.filters.push(where_clause);
+            }
+            PipelineStage::Sort(sort_doc) => {
+                let order_clause = self.sort_to_sql(sort_doc)?;
+                self.apply_sort(select, order_clause);
+            }
+            PipelineStage::TopK { sort, limit } => {
+                let order_clause = self.sort_to_sql(sort)?;
+                self.apply_sort(select, order_clause);
+                select.apply_limit(*limit as i64);
+            }
+            PipelineStage::Limit(limit) => {
+                select.apply_limit(*limit as i64);
+            }
+            PipelineStage::Skip(skip) => {
+                select.apply_skip(*skip as i64);
+            }
+            PipelineStage::Project(project_doc) => {
+                let select_clause = self.project_to_sql(project_doc)?;
+                if select.projection.is_some() {
+                    select.wrap("projected");
                 }
-                PipelineStage::Skip(skip) => {
-                    skip_clause = Some(*skip);
+                select.columns = Some(Self::projected_columns(project_doc));
+                select.projection = Some(select_clause);
+            }
+            PipelineStage::AddFields(fields) | PipelineStage::Set(fields) => {
+                let computed = self.computed_fields_to_sql(fields)?;
+                if select.projection.is_some() {
+                    select.wrap("with_fields");
                 }
-                PipelineStage::Project(project_doc) => {
-                    if let Ok(select_clause) = self.project_to_sql(project_doc) {
-                        current_query = current_query.replace("SELECT *", &format!("SELECT {}", select_clause));
+                select.projection = Some(match select.columns.take() {
+                    Some(columns) => {
+                        let (select_list, columns) = Self::overwrite_columns(&columns, &computed);
+                        select.columns = Some(columns);
+                        select_list
                     }
-                }
-                PipelineStage::Group(group_doc) => {
-                    // For complex group operations, we'll need to use CTEs or subqueries
-                    current_query = self.handle_group_stage(current_query, group_doc)?;
-                }
-                _ => {
-                    // For now, log unsupported stages
-                    fauxdb_warn!("Unsupported aggregation stage: {:?}", stage);
-                }
+                    None => {
+                        let computed: Vec<String> = computed.iter().map(|(field, sql)| format!("{} AS {}", sql, field)).collect();
+                        format!("*, {}", computed.join(", "))
+                    }
+                });
+            }
+            PipelineStage::Group(_) => {
+                // Accumulators have no SQL translation yet; a bare GROUP BY
+                // would drop them, so $group always runs in process
+                return Err(anyhow!("$group accumulators are computed in-process"));
+            }
+            PipelineStage::Count(field) => {
+                let counted = format!("SELECT COUNT(*) AS {} FROM ({}) AS count_source", field, select.render());
+                select.replace(counted, "counted", Some(vec![field.clone()]));
+            }
+            PipelineStage::SetWindowFields(window_opts) => {
+                let columns = select.columns.clone()
+                    .ok_or_else(|| anyhow!("$setWindowFields needs the source column names"))?;
+                let (windowed, columns) = self.set_window_fields_to_sql(&select.render(), &columns, window_opts)?;
+                select.replace(windowed, "windowed_fields", Some(columns));
+            }
+            PipelineStage::Densify(densify_opts) => {
+                let densified = self.densify_to_sql(&select.render(), densify_opts)?;
+                // USING lists the join keys first
+                let columns = select.columns.take().map(|columns| {
+                    let mut keys = densify_opts.partition_by_fields.clone().unwrap_or_default();
+                    keys.push(densify_opts.field.clone());
+                    let rest: Vec<String> = columns.into_iter().filter(|column| !keys.contains(column)).collect();
+                    keys.into_iter().chain(rest).collect()
+                });
+                select.replace(densified, "densified", columns);
             }
+            PipelineStage::Fill(fill_opts) => {
+                let columns = select.columns.clone()
+                    .ok_or_else(|| anyhow!("$fill needs the source column names"))?;
+                let filled = self.fill_to_sql(&select.render(), &columns, fill_opts)?;
+                select.replace(filled, "filled", Some(columns));
+            }
+            _ => return Err(anyhow!("no SQL translation for this stage"))
         }
 
-        // Add LIMIT and OFFSET clauses
-        if let Some(skip) = skip_clause {
-            if let Some(limit) = limit_clause {
-                current_query = format!("{} LIMIT {} OFFSET {}", current_query, limit, skip);
-            } else {
-                current_query = format!("{} OFFSET {}", current_query, skip);
-            }
-        } else if let Some(limit) = limit_clause {
-            current_query = format!("{} LIMIT {}", current_query, limit);
+        Ok(())
+    }
+
+    fn apply_sort(&self, select: &mut SqlSelect, order_clause: String) {
+        if select.limit.is_some() || select.offset.is_some() || select.projection.is_some() {
+            select.wrap("sorted");
         }
+        // A later $sort is a stable re-sort: its keys lead, earlier keys break ties
+        select.order_by = Some(match select.order_by.take() {
+            Some(previous) => format!("{}, {}", order_clause, previous),
+            None => order_clause,
+        });
+    }
 
-        Ok(current_query)
+    fn sample_to_sql(&self, collection_name: &str, size: i32) -> Result<String> {
+        self.sample_context.sample_sql(collection_name, size)
     }
 
     fn filter_to_sql(&self, filter: &Document) -> Result<String> {
         let mut conditions = Vec::new();
 
         for (field, value) in filter {
-            let condition = self.field_condition_to_sql(field, value)?;
+            let condition = match field.as_str() {
+                "$and" | "$or" | "$nor" => self.logical_filter_to_sql(field, value)?,
+                "$expr" => Expr::parse(value)?.to_sql_predicate()?,
+                _ if field.starts_with('$') => return Err(anyhow!("Unsupported operator: {}", field)),
+                _ => self.field_condition_to_sql(field, value)?,
+            };
             conditions.push(condition);
         }
 
+        if conditions.is_empty() {
+            return Ok("TRUE".to_string());
+        }
+
         Ok(conditions.join(" AND "))
     }
 
+    fn logical_filter_to_sql(&self, operator: &str, value: &Bson) -> Result<String> {
+        let clauses = value.as_array()
+            .ok_or_else(|| anyhow!("{} requires an array", operator))?
+            .iter()
+            .map(|clause| match clause {
+                Bson::Document(clause_doc) => Ok(format!("({})", self.filter_to_sql(clause_doc)?)),
+                _ => Err(anyhow!("{} entries must be documents", operator)),
+            })
+            .collect::<Result<Vec<String>>>()?;
+
+        if clauses.is_empty() {
+            return Err(anyhow!("{} requires a non-empty array", operator));
+        }
+
+        Ok(match operator {
+            "$and" => format!("({})", clauses.join(" AND ")),
+            "$or" => format!("({})", clauses.join(" OR ")),
+            _ => format!("NOT ({})", clauses.join(" OR ")),
+        })
+    }
+
     fn field_condition_to_sql(&self, field: &str, value: &Bson) -> Result<String> {
         match value {
-            Bson::Document(op_doc) => {
-                // Handle MongoDB operators
-                if op_doc.len() == 1 {
-                    let (op, op_value) = op_doc.into_iter().next().unwrap();
-                    match op.as_str() {
-                        "$eq" => Ok(format!("{} = {}", field, self.bson_to_sql_value(op_value)?)),
-                        "$ne" => Ok(format!("{} != {}", field, self.bson_to_sql_value(op_value)?)),
-                        "$gt" => Ok(format!("{} > {}", field, self.bson_to_sql_value(op_value)?)),
-                        "$gte" => Ok(format!("{} >= {}", field, self.bson_to_sql_value(op_value)?)),
-                        "$lt" => Ok(format!("{} < {}", field, self.bson_to_sql_value(op_value)?)),
-                        "$lte" => Ok(format!("{} <= {}", field, self.bson_to_sql_value(op_value)?)),
-                        "$in" => {
-                            if let Bson::Array(values) = op_value {
-                                let sql_values: Result<Vec<String>> = values.iter()
-                                    .map(|v| self.bson_to_sql_value(v))
-                                    .collect();
-                                Ok(format!("{} IN ({})", field, sql_values?.join(", ")))
-                            } else {
-                                Err(anyhow!("$in operator requires an array"))
-                            }
-                        }
-                        "$nin" => {
-                            if let Bson::Array(values) = op_value {
-                                let sql_values: Result<Vec<String>> = values.iter()
-                                    .map(|v| self.bson_to_sql_value(v))
-                                    .collect();
-                                Ok(format!("{} NOT IN ({})", field, sql_values?.join(", ")))
-                            } else {
-                                Err(anyhow!("$nin operator requires an array"))
-                            }
-                        }
-                        "$regex" => {
-                            let pattern = op_value.as_str().ok_or_else(|| anyhow!("$regex requires a string"))?;
-                            Ok(format!("{} ~ '{}'", field, pattern))
-                        }
-                        "$exists" => {
-                            let exists = op_value.as_bool().unwrap_or(false);
-                            if exists {
-                                Ok(format!("{} IS NOT NULL", field))
-                            } else {
-                                Ok(format!("{} IS NULL", field))
-                            }
-                        }
-                        _ => Err(anyhow!("Unsupported operator: {}", op))
-                    }
-                } else {
-                    Err(anyhow!("Complex operators not yet supported"))
+            Bson::Document(op_doc) if op_doc.keys().next().map_or(false, |k| k.starts_with('$')) => {
+                // Handle MongoDB operators; several operators on one field are ANDed
+                let mut conditions = Vec::new();
+                for (op, op_value) in op_doc {
+                    conditions.push(self.operator_to_sql(field, op, op_value)?);
                 }
+                Ok(conditions.join(" AND "))
             }
             _ => {
                 // Direct value comparison
@@ -837,6 +1328,50 @@ impl AggregationPipeline {
         }
     }
 
+    fn operator_to_sql(&self, field: &str, op: &str, op_value: &Bson) -> Result<String> {
+        match op {
+            "$eq" => Ok(format!("{} = {}", field, self.bson_to_sql_value(op_value)?)),
+            "$ne" => Ok(format!("{} != {}", field, self.bson_to_sql_value(op_value)?)),
+            "$gt" => Ok(format!("{} > {}", field, self.bson_to_sql_value(op_value)?)),
+            "$gte" => Ok(format!("{} >= {}", field, self.bson_to_sql_value(op_value)?)),
+            "$lt" => Ok(format!("{} < {}", field, self.bson_to_sql_value(op_value)?)),
+            "$lte" => Ok(format!("{} <= {}", field, self.bson_to_sql_value(op_value)?)),
+            "$in" => {
+                if let Bson::Array(values) = op_value {
+                    let sql_values: Result<Vec<String>> = values.iter()
+                        .map(|v| self.bson_to_sql_value(v))
+                        .collect();
+                    Ok(format!("{} IN ({})", field, sql_values?.join(", ")))
+                } else {
+                    Err(anyhow!("$in operator requires an array"))
+                }
+            }
+            "$nin" => {
+                if let Bson::Array(values) = op_value {
+                    let sql_values: Result<Vec<String>> = values.iter()
+                        .map(|v| self.bson_to_sql_value(v))
+                        .collect();
+                    Ok(format!("{} NOT IN ({})", field, sql_values?.join(", ")))
+                } else {
+                    Err(anyhow!("$nin operator requires an array"))
+                }
+            }
+            "$regex" => {
+                let pattern = op_value.as_str().ok_or_else(|| anyhow!("$regex requires a string"))?;
+                Ok(format!("{} ~ '{}'", field, pattern.replace("'", "''")))
+            }
+            "$exists" => {
+                let exists = op_value.as_bool().unwrap_or(false);
+                if exists {
+                    Ok(format!("{} IS NOT NULL", field))
+                } else {
+                    Ok(format!("{} IS NULL", field))
+                }
+            }
+            _ => Err(anyhow!("Unsupported operator: {}", op))
+        }
+    }
+
     fn bson_to_sql_value(&self, value: &Bson) -> Result<String> {
         match value {
             Bson::String(s) => Ok(format!("'{}'", s.replace("'", "''"))),
@@ -846,6 +1381,11 @@ impl AggregationPipeline {
             Bson::Boolean(b) => Ok(b.to_string()),
             Bson::Null => Ok("NULL".to_string()),
             Bson::ObjectId(_) => Ok(format!("'{}'", value.to_string())),
+            Bson::DateTime(dt) => {
+                let timestamp = dt.try_to_rfc3339_string()
+                    .map_err(|e| anyhow!("Invalid date for SQL conversion: {}", e))?;
+                Ok(format!("'{}'::timestamptz", timestamp))
+            }
             _ => Err(anyhow!("Unsupported BSON type for SQL conversion"))
         }
     }
@@ -865,50 +1405,412 @@ impl AggregationPipeline {
         Ok(sort_parts.join(", "))
     }
 
+    fn field_path_to_sql(&self, value: &Bson) -> Result<String> {
+        match value {
+            Bson::String(path) if path.starts_with('$') && path.len() > 1 => Ok(path[1..].to_string()),
+            _ => Err(anyhow!("Expected a field path like \"$field\", got {:?}", value))
+        }
+    }
+
+    fn number_to_sql(&self, value: &Bson) -> Result<String> {
+        match value {
+            Bson::Int32(i) => Ok(i.to_string()),
+            Bson::Int64(i) => Ok(i.to_string()),
+            Bson::Double(f) => Ok(f.to_string()),
+            _ => Err(anyhow!("Expected a number, got {:?}", value))
+        }
+    }
+
+    fn interval_to_sql(&self, amount: &Bson, unit: &str) -> Result<String> {
+        // PostgreSQL intervals have no quarter unit
+        if unit == "quarter" {
+            let months = match amount {
+                Bson::Int32(i) => *i as f64 * 3.0,
+                Bson::Int64(i) => *i as f64 * 3.0,
+                Bson::Double(f) => f * 3.0,
+                _ => return Err(anyhow!("Expected a number, got {:?}", amount))
+            };
+            return Ok(format!("INTERVAL '{} month'", months));
+        }
+
+        match unit {
+            "year" | "month" | "week" | "day" | "hour" | "minute" | "second" | "millisecond" => {
+                Ok(format!("INTERVAL '{} {}'", self.number_to_sql(amount)?, unit))
+            }
+            _ => Err(anyhow!("Unsupported time unit: {}", unit))
+        }
+    }
+
+    fn window_spec_to_sql(&self, partition: &[String], sort_by: Option<&Document>, frame: Option<String>) -> Result<String> {
+        let mut parts = Vec::new();
+
+        if !partition.is_empty() {
+            parts.push(format!("PARTITION BY {}", partition.join(", ")));
+        }
+        if let Some(sort_doc) = sort_by {
+            parts.push(format!("ORDER BY {}", self.sort_to_sql(sort_doc)?));
+        }
+        if let Some(frame) = frame {
+            parts.push(frame);
+        }
+
+        Ok(parts.join(" "))
+    }
+
+    fn window_bound_to_sql(&self, bound: &Bson, unit: Option<&str>, is_lower: bool) -> Result<String> {
+        match bound {
+            Bson::String(s) if s == "unbounded" => {
+                Ok(if is_lower { "UNBOUNDED PRECEDING" } else { "UNBOUNDED FOLLOWING" }.to_string())
+            }
+            Bson::String(s) if s == "current" => Ok("CURRENT ROW".to_string()),
+            Bson::Int32(_) | Bson::Int64(_) | Bson::Double(_) => {
+                let offset = match bound {
+                    Bson::Int32(i) => *i as f64,
+                    Bson::Int64(i) => *i as f64,
+                    Bson::Double(f) => *f,
+                    _ => unreachable!(),
+                };
+                if offset == 0.0 {
+                    return Ok("CURRENT ROW".to_string());
+                }
+
+                let magnitude = Bson::Double(offset.abs());
+                let amount = match unit {
+                    Some(unit) => self.interval_to_sql(&magnitude, unit)?,
+                    None => self.number_to_sql(&magnitude)?,
+                };
+                Ok(format!("{} {}", amount, if offset < 0.0 { "PRECEDING" } else { "FOLLOWING" }))
+            }
+            _ => Err(anyhow!("Invalid window bound: {:?}", bound))
+        }
+    }
+
+    fn window_frame_to_sql(&self, window: Option<&Bson>) -> Result<Option<String>> {
+        let window = match window {
+            None => return Ok(None),
+            Some(Bson::Document(window)) => window,
+            Some(_) => return Err(anyhow!("window must be a document")),
+        };
+
+        let (mode, bounds, unit) = if let Some(bounds) = window.get("documents").and_then(|v| v.as_array()) {
+            ("ROWS", bounds, None)
+        } else if let Some(bounds) = window.get("range").and_then(|v| v.as_array()) {
+            ("RANGE", bounds, window.get("unit").and_then(|v| v.as_str()))
+        } else {
+            return Err(anyhow!("window requires documents or range bounds"));
+        };
+
+        if bounds.len() != 2 {
+            return Err(anyhow!("window bounds must be a two-element array"));
+        }
+
+        Ok(Some(format!(
+            "{} BETWEEN {} AND {}",
+            mode,
+            self.window_bound_to_sql(&bounds[0], unit, true)?,
+            self.window_bound_to_sql(&bounds[1], unit, false)?
+        )))
+    }
+
+    fn window_output_to_sql(&self, spec: &Document, partition: &[String], sort_by: Option<&Document>) -> Result<String> {
+        let (operator, argument) = spec.iter()
+            .find(|(key, _)| key.starts_with('$'))
+            .ok_or_else(|| anyhow!("$setWindowFields output requires a window operator"))?;
+
+        let function = match operator.as_str() {
+            "$sum" => format!("sum({})", self.field_path_to_sql(argument)?),
+            "$avg" => format!("avg({})", self.field_path_to_sql(argument)?),
+            "$min" => format!("min({})", self.field_path_to_sql(argument)?),
+            "$max" => format!("max({})", self.field_path_to_sql(argument)?),
+            "$stdDevPop" => format!("stddev_pop({})", self.field_path_to_sql(argument)?),
+            "$stdDevSamp" => format!("stddev_samp({})", self.field_path_to_sql(argument)?),
+            "$first" => format!("first_value({})", self.field_path_to_sql(argument)?),
+            "$last" => format!("last_value({})", self.field_path_to_sql(argument)?),
+            "$push" => format!("array_agg({})", self.field_path_to_sql(argument)?),
+            "$count" => "count(*)".to_string(),
+            "$rank" => "rank()".to_string(),
+            "$denseRank" => "dense_rank()".to_string(),
+            "$documentNumber" => "row_number()".to_string(),
+            "$shift" => {
+                let shift = argument.as_document()
+                    .ok_or_else(|| anyhow!("$shift must be a document"))?;
+                let output = self.field_path_to_sql(shift.get("output").ok_or_else(|| anyhow!("$shift output is required"))?)?;
+                let by = match shift.get("by") {
+                    Some(Bson::Int32(i)) => *i as i64,
+                    Some(Bson::Int64(i)) => *i,
+                    _ => return Err(anyhow!("$shift by must be an integer")),
+                };
+                let default = match shift.get("default") {
+                    Some(value) => self.bson_to_sql_value(value)?,
+                    None => "NULL".to_string(),
+                };
+                if by >= 0 {
+                    format!("lead({}, {}, {})", output, by, default)
+                } else {
+                    format!("lag({}, {}, {})", output, -by, default)
+                }
+            }
+            _ => return Err(anyhow!("Unsupported window operator: {}", operator))
+        };
+
+        // Ranking and offset functions do not accept a frame clause
+        let frame = match operator.as_str() {
+            "$rank" | "$denseRank" | "$documentNumber" | "$shift" => None,
+            _ => self.window_frame_to_sql(spec.get("window"))?,
+        };
+
+        Ok(format!("{} OVER ({})", function, self.window_spec_to_sql(partition, sort_by, frame)?))
+    }
+
+    fn set_window_fields_to_sql(&self, source: &str, columns: &[String], options: &SetWindowFieldsOptions) -> Result<(String, Vec<String>)> {
+        let partition = match &options.partition_by {
+            None => Vec::new(),
+            Some(Bson::Document(fields)) => fields.values()
+                .map(|v| self.field_path_to_sql(v))
+                .collect::<Result<Vec<_>>>()?,
+            Some(expr) => vec![self.field_path_to_sql(expr)?],
+        };
+
+        let mut outputs = Vec::new();
+        for (field, spec) in &options.output {
+            let spec = spec.as_document()
+                .ok_or_else(|| anyhow!("$setWindowFields output for '{}' must be a document", field))?;
+            outputs.push((field.clone(), self.window_output_to_sql(spec, &partition, options.sort_by.as_ref())?));
+        }
+
+        if outputs.is_empty() {
+            return Err(anyhow!("$setWindowFields output must not be empty"));
+        }
+
+        let (select_list, columns) = Self::overwrite_columns(columns, &outputs);
+        Ok((format!("SELECT {} FROM ({}) AS window_source", select_list, source), columns))
+    }
+
+    fn densify_to_sql(&self, source: &str, options: &DensifyOptions) -> Result<String> {
+        let field = &options.field;
+        let step = options.range.get("step")
+            .ok_or_else(|| anyhow!("$densify range.step is required"))?;
+        let step_sql = match options.range.get("unit").and_then(|v| v.as_str()) {
+            Some(unit) => self.interval_to_sql(step, unit)?,
+            None => self.number_to_sql(step)?,
+        };
+
+        let partitions = options.partition_by_fields.clone().unwrap_or_default();
+        let partition_prefix: String = partitions.iter().map(|p| format!("{}, ", p)).collect();
+        let mut key_columns = partitions.clone();
+        key_columns.push(field.clone());
+        let key_list = key_columns.join(", ");
+
+        // Each partition (or the whole input) gets its own generate_series of
+        // missing points; existing keys are unioned back in so original rows
+        // that fall between steps are kept
+        let partition_source = if partitions.is_empty() {
+            String::new()
+        } else {
+            format!(" FROM (SELECT DISTINCT {} FROM densify_source) AS densify_partitions", partitions.join(", "))
+        };
+
+        let series = match options.range.get("bounds") {
+            Some(Bson::String(bounds)) if bounds == "partition" && !partitions.is_empty() => {
+                format!(
+                    "SELECT {}generate_series(min({}), max({}), {}) AS {} FROM densify_source GROUP BY {}",
+                    partition_prefix, field, field, step_sql, field, partitions.join(", ")
+                )
+            }
+            Some(Bson::String(bounds)) if bounds == "full" || bounds == "partition" => {
+                format!(
+                    "SELECT {}generate_series((SELECT min({}) FROM densify_source), (SELECT max({}) FROM densify_source), {}) AS {}{}",
+                    partition_prefix, field, field, step_sql, field, partition_source
+                )
+            }
+            Some(Bson::Array(bounds)) if bounds.len() == 2 => {
+                // The upper bound is exclusive
+                format!(
+                    "SELECT {}generate_series({}, ({}) - ({}), {}) AS {}{}",
+                    partition_prefix,
+                    self.bson_to_sql_value(&bounds[0])?,
+                    self.bson_to_sql_value(&bounds[1])?,
+                    step_sql,
+                    step_sql,
+                    field,
+                    partition_source
+                )
+            }
+            _ => return Err(anyhow!("$densify range.bounds must be \"full\", \"partition\" or [lower, upper]"))
+        };
+
+        Ok(format!(
+            "WITH densify_source AS ({}) SELECT * FROM ({} UNION SELECT {} FROM densify_source) AS densify_grid LEFT JOIN densify_source USING ({})",
+            source, series, key_list, key_list
+        ))
+    }
+
+    fn fill_to_sql(&self, source: &str, columns: &[String], options: &FillOptions) -> Result<String> {
+        let partition = match (&options.partition_by, &options.partition_by_fields) {
+            (Some(partition_by), _) => partition_by.values()
+                .map(|v| self.field_path_to_sql(v))
+                .collect::<Result<Vec<_>>>()?,
+            (None, Some(fields)) => fields.clone(),
+            (None, None) => Vec::new(),
+        };
+
+        // locf and linear need the index of the surrounding non-null values;
+        // count(field) only advances on non-null rows, so it numbers the
+        // groups that last_value(... IGNORE NULLS) would see
+        let mut group_columns = Vec::new();
+        let mut filled_columns = Vec::new();
+
+        for (field, spec) in &options.output {
+            let spec = spec.as_document()
+                .ok_or_else(|| anyhow!("$fill output for '{}' must be a document", field))?;
+
+            if !columns.contains(field) {
+                return Err(anyhow!("$fill output '{}' is not a column of its input", field));
+            }
+            if let Some(value) = spec.get("value") {
+                filled_columns.push((field.clone(), format!("COALESCE({}, {})", field, self.bson_to_sql_value(value)?)));
+                continue;
+            }
+
+            let sort_by = options.sort_by.as_ref()
+                .ok_or_else(|| anyhow!("$fill method requires sortBy"))?;
+            let previous_group = format!("_fill_prev_{}", field);
+            let mut previous_partition = partition.clone();
+            previous_partition.push(previous_group.clone());
+
+            group_columns.push(format!(
+                "count({}) OVER ({}) AS {}",
+                field, self.window_spec_to_sql(&partition, Some(sort_by), None)?, previous_group
+            ));
+            let previous_window = self.window_spec_to_sql(&previous_partition, Some(sort_by), None)?;
+
+            match spec.get_str("method") {
+                Ok("locf") => {
+                    filled_columns.push((field.clone(), format!("first_value({}) OVER ({})", field, previous_window)));
+                }
+                Ok("linear") => {
+                    if sort_by.len() != 1 {
+                        return Err(anyhow!("$fill linear requires a single sortBy field"));
+                    }
+                    let sort_field = sort_by.keys().next().unwrap();
+
+                    let mut reversed_sort = Document::new();
+                    for (key, direction) in sort_by {
+                        let reversed = match direction {
+                            Bson::Int32(d) => -(*d as i64),
+                            Bson::Int64(d) => -*d,
+                            _ => return Err(anyhow!("Sort direction must be 1 or -1")),
+                        };
+                        reversed_sort.insert(key.clone(), reversed);
+                    }
+
+                    let next_group = format!("_fill_next_{}", field);
+                    let mut next_partition = partition.clone();
+                    next_partition.push(next_group.clone());
+
+                    group_columns.push(format!(
+                        "count({}) OVER ({}) AS {}",
+                        field, self.window_spec_to_sql(&partition, Some(&reversed_sort), None)?, next_group
+                    ));
+                    let next_window = self.window_spec_to_sql(&next_partition, Some(&reversed_sort), None)?;
+
+                    // numeric, so integer columns interpolate without truncating
+                    let prev_value = format!("(first_value({}) OVER ({}))::numeric", field, previous_window);
+                    let prev_position = format!("(first_value({}) OVER ({}))::numeric", sort_field, previous_window);
+                    let next_value = format!("(first_value({}) OVER ({}))::numeric", field, next_window);
+                    let next_position = format!("(first_value({}) OVER ({}))::numeric", sort_field, next_window);
+
+                    filled_columns.push((field.clone(), format!(
+                        "COALESCE({}::numeric, {} + ({} - {}) * ({}::numeric - {}) / NULLIF({} - {}, 0))",
+                        field,
+                        prev_value,
+                        next_value, prev_value,
+                        sort_field, prev_position,
+                        next_position, prev_position
+                    )));
+                }
+                _ => return Err(anyhow!("$fill output for '{}' requires value or method locf/linear", field))
+            }
+        }
+
+        if filled_columns.is_empty() {
+            return Err(anyhow!("$fill output must not be empty"));
+        }
+
+        let grouped = if group_columns.is_empty() {
+            format!("SELECT * FROM ({}) AS fill_source", source)
+        } else {
+            format!("SELECT fill_source.*, {} FROM ({}) AS fill_source", group_columns.join(", "), source)
+        };
+
+        // Listing the columns drops the group helpers and keeps each filled
+        // column once, in place
+        let (select_list, _) = Self::overwrite_columns(columns, &filled_columns);
+        Ok(format!("SELECT {} FROM ({}) AS fill_groups", select_list, grouped))
+    }
+
     fn project_to_sql(&self, project_doc: &Document) -> Result<String> {
         let mut select_parts = Vec::new();
 
         for (field, projection) in project_doc {
             match projection {
-                Bson::Int32(1) | Bson::Int64(1) => {
+                Bson::Int32(1) | Bson::Int64(1) | Bson::Boolean(true) => {
                     select_parts.push(field.clone());
                 }
-                Bson::Int32(0) | Bson::Int64(0) => {
-                    // Skip this field - we'll need to handle exclusion differently
-                    continue;
+                Bson::Int32(0) | Bson::Int64(0) | Bson::Boolean(false) if field == "_id" => continue,
+                Bson::Int32(0) | Bson::Int64(0) | Bson::Boolean(false) => {
+                    // A select list can't name "every column but these"
+                    return Err(anyhow!("Exclusion projection of {} is applied in-process", field));
                 }
                 _ => {
-                    // Handle computed fields
-                    return Err(anyhow!("Computed projections not yet supported"));
+                    // Computed field; errors for expressions with no SQL form
+                    select_parts.push(format!("{} AS {}", Expr::parse(projection)?.to_sql()?, field));
                 }
             }
         }
 
         if select_parts.is_empty() {
-            Ok("*".to_string())
-        } else {
-            Ok(select_parts.join(", "))
+            return Err(anyhow!("Exclusion-only projection is applied in-process"));
         }
+        Ok(select_parts.join(", "))
     }
 
-    fn handle_group_stage(&self, current_query: String, group_doc: &Document) -> Result<String> {
-        // For now, implement a basic GROUP BY
-        // More complex group operations would require CTEs or subqueries
-        if let Some(group_id) = group_doc.get("_id") {
-            let group_field = match group_id {
-                Bson::String(field) => field.clone(),
-                Bson::Document(_) => {
-                    // Complex group expressions not yet supported
-                    return Err(anyhow!("Complex group expressions not yet supported"));
+    fn computed_fields_to_sql(&self, fields: &Document) -> Result<Vec<(String, String)>> {
+        fields.iter()
+            .map(|(field, value)| {
+                if field.contains('.') {
+                    return Err(anyhow!("Nested output field {} is computed in-process", field));
                 }
-                _ => return Err(anyhow!("Invalid group _id"))
-            };
+                Ok((field.clone(), Expr::parse(value)?.to_sql()?))
+            })
+            .collect()
+    }
 
-            Ok(format!("SELECT {}, COUNT(*) as count FROM ({}) AS grouped GROUP BY {}", 
-                      group_field, current_query, group_field))
-        } else {
-            Err(anyhow!("Group stage requires _id field"))
+    /// Columns a $project outputs: included and computed fields
+    fn projected_columns(project_doc: &Document) -> Vec<String> {
+        project_doc.iter()
+            .filter(|(_, projection)| !matches!(projection, Bson::Int32(0) | Bson::Int64(0) | Bson::Boolean(false)))
+            .map(|(field, _)| field.clone())
+            .collect()
+    }
+
+    /// Select list naming every column once: computed values replace the
+    /// column of the same name in place, new ones follow. Returns the list
+    /// and the resulting column names.
+    fn overwrite_columns(columns: &[String], computed: &[(String, String)]) -> (String, Vec<String>) {
+        let mut select_list = Vec::with_capacity(columns.len() + computed.len());
+        let mut names = columns.to_vec();
+        for column in columns {
+            match computed.iter().find(|(field, _)| field == column) {
+                Some((field, sql)) => select_list.push(format!("{} AS {}", sql, field)),
+                None => select_list.push(column.clone()),
+            }
+        }
+        for (field, sql) in computed.iter().filter(|(field, _)| !columns.contains(field)) {
+            select_list.push(format!("{} AS {}", sql, field));
+            names.push(field.clone());
         }
+        (select_list.join(", "), names)
     }
 }
 
@@ -0,0 +1,764 @@
+/*!
+ * @file aggregation_window.rs
+ * @brief $setWindowFields, $densify and $fill for the in-process engine
+ *
+ * All three look at a partition's documents in order, so each stage
+ * materializes its input, split into partitions in order of each
+ * partition's first document, and sorts every partition on its own. The
+ * input is charged against the query's memory budget; these stages do not
+ * spill, so past the limit they fail even with allowDiskUse.
+ *
+ * Window accumulators fold their frames with the $group accumulator
+ * states. A frame that starts at the partition's first document is folded
+ * incrementally as the current document advances; any other frame is
+ * folded again for each document. Range frames and date steps take fixed
+ * units only; month, quarter and year have no fixed length.
+ */
+
+use crate::aggregation_group::{group_key_bytes, AccumulatorKind, AccumulatorState};
+use crate::bson_order::{compare_bson, lookup_path};
+use crate::error::{FauxDBError, Result};
+use crate::expression::{set_path, CompiledExpr, DateUnit};
+use crate::external_sort::SortSpec;
+use crate::spill::{approximate_size, MemoryBudget};
+use bson::{Bson, Document};
+use std::borrow::Cow;
+use std::cmp::Ordering;
+use std::collections::HashMap;
+
+/// Most documents a $densify may generate, as in MongoDB
+const MAX_DENSIFY_DOCUMENTS: usize = 500_000;
+
+fn invalid(message: String) -> FauxDBError {
+    FauxDBError::Database(message)
+}
+
+/// Pull a blocking stage's whole input and split it by partition key, in
+/// order of each partition's first document
+fn partition_input<'a>(
+    input: &mut dyn Iterator<Item = Result<Cow<'a, Document>>>,
+    stage: &str,
+    budget: &MemoryBudget,
+    mut key: impl FnMut(&Document) -> Result<Bson>,
+) -> Result<Vec<Vec<Document>>> {
+    let mut partitions: Vec<Vec<Document>> = Vec::new();
+    let mut slots: HashMap<Vec<u8>, usize> = HashMap::new();
+    let mut used_bytes = 0usize;
+
+    for doc in input {
+        let doc = doc?.into_owned();
+        used_bytes += approximate_size(&doc);
+        if budget.must_spill(stage, used_bytes)? {
+            return Err(invalid(format!(
+                "{} exceeded the memory limit of {} bytes and cannot spill to disk",
+                stage, budget.limit_bytes
+            )));
+        }
+        let slot = *slots.entry(group_key_bytes(&key(&doc)?)).or_insert_with(|| {
+            partitions.push(Vec::new());
+            partitions.len() - 1
+        });
+        partitions[slot].push(doc);
+    }
+    Ok(partitions)
+}
+
+/// Key of a partitionByFields list: the fields' values, missing ones as null
+fn fields_key(doc: &Document, fields: &[String]) -> Bson {
+    let mut key = Document::new();
+    for field in fields {
+        key.insert(field.clone(), lookup_path(doc, field).cloned().unwrap_or(Bson::Null));
+    }
+    Bson::Document(key)
+}
+
+fn string_list(value: Option<&Bson>, what: &str) -> Result<Vec<String>> {
+    match value {
+        None => Ok(Vec::new()),
+        Some(Bson::Array(items)) => items.iter()
+            .map(|item| item.as_str()
+                .map(str::to_string)
+                .ok_or_else(|| invalid(format!("{} must list field names", what))))
+            .collect(),
+        Some(_) => Err(invalid(format!("{} must be an array", what))),
+    }
+}
+
+/// First sortBy key and whether it sorts descending
+fn leading_sort_field(sort_by: &Document) -> Option<(String, bool)> {
+    sort_by.iter().next().map(|(field, direction)| {
+        let descending = matches!(direction, Bson::Int32(d) if *d < 0)
+            || matches!(direction, Bson::Int64(d) if *d < 0)
+            || matches!(direction, Bson::Double(d) if *d < 0.0);
+        (field.clone(), descending)
+    })
+}
+
+/// Position of a value along a numeric or date axis, dates in milliseconds
+fn axis_value(value: Option<&Bson>) -> Option<f64> {
+    match value? {
+        Bson::Int32(n) => Some(*n as f64),
+        Bson::Int64(n) => Some(*n as f64),
+        Bson::Double(n) => Some(*n),
+        Bson::DateTime(at) => Some(at.timestamp_millis() as f64),
+        _ => None,
+    }
+}
+
+fn number(value: &Bson, what: &str) -> Result<f64> {
+    match value {
+        Bson::Int32(n) => Ok(*n as f64),
+        Bson::Int64(n) => Ok(*n as f64),
+        Bson::Double(n) => Ok(*n),
+        other => Err(invalid(format!("{} must be a number, got {}", what, other))),
+    }
+}
+
+/// Milliseconds per unit, or 1 for plain numbers
+fn unit_scale(unit: Option<&str>) -> Result<f64> {
+    match unit {
+        None => Ok(1.0),
+        Some(unit) => DateUnit::parse(unit)?
+            .fixed_millis()
+            .map(|millis| millis as f64)
+            .ok_or_else(|| invalid(format!("unit '{}' has no fixed length and is not supported", unit))),
+    }
+}
+
+fn count_bson(n: usize) -> Bson {
+    match i32::try_from(n) {
+        Ok(n) => Bson::Int32(n),
+        Err(_) => Bson::Int64(n as i64),
+    }
+}
+
+fn is_missing(doc: &Document, field: &str) -> bool {
+    matches!(lookup_path(doc, field), None | Some(Bson::Null))
+}
+
+#[derive(Debug, Clone, Copy)]
+enum Bound {
+    Unbounded,
+    Current,
+    Offset(f64),
+}
+
+impl Bound {
+    fn parse(value: &Bson) -> Result<Self> {
+        match value {
+            Bson::String(bound) if bound == "unbounded" => Ok(Bound::Unbounded),
+            Bson::String(bound) if bound == "current" => Ok(Bound::Current),
+            Bson::Int32(_) | Bson::Int64(_) | Bson::Double(_) => Ok(Bound::Offset(number(value, "window bound")?)),
+            other => Err(invalid(format!("Invalid window bound: {}", other))),
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+enum Frame {
+    /// Positions relative to the current document
+    Documents(Bound, Bound),
+    /// Sort-field values relative to the current document's, with the
+    /// unit's length in milliseconds for dates
+    Range(Bound, Bound, f64),
+}
+
+impl Frame {
+    /// The whole partition, MongoDB's default window
+    const PARTITION: Frame = Frame::Documents(Bound::Unbounded, Bound::Unbounded);
+
+    fn parse(window: &Bson) -> Result<Self> {
+        let window = window.as_document()
+            .ok_or_else(|| invalid("window must be a document".to_string()))?;
+        let (bounds, range) = match (window.get("documents"), window.get("range")) {
+            (Some(Bson::Array(bounds)), None) => (bounds, false),
+            (None, Some(Bson::Array(bounds))) => (bounds, true),
+            _ => return Err(invalid("window requires either documents or range bounds".to_string())),
+        };
+        if bounds.len() != 2 {
+            return Err(invalid("window bounds must be a two-element array".to_string()));
+        }
+        let (lower, upper) = (Bound::parse(&bounds[0])?, Bound::parse(&bounds[1])?);
+
+        if range {
+            return Ok(Frame::Range(lower, upper, unit_scale(window.get_str("unit").ok())?));
+        }
+        for bound in [lower, upper] {
+            if matches!(bound, Bound::Offset(offset) if offset.fract() != 0.0) {
+                return Err(invalid("documents window bounds must be integers".to_string()));
+            }
+        }
+        Ok(Frame::Documents(lower, upper))
+    }
+
+    /// Half-open index range of each document's frame. `axis` holds the
+    /// leading sort value of each document, negated for a descending sort
+    /// so that it always ascends.
+    fn bounds(&self, len: usize, axis: Option<&[f64]>) -> Result<Vec<(usize, usize)>> {
+        let mut frames = Vec::with_capacity(len);
+        match *self {
+            Frame::Documents(lower, upper) => {
+                let clamp = |position: f64| position.max(0.0).min(len as f64) as usize;
+                for i in 0..len {
+                    let start = match lower {
+                        Bound::Unbounded => 0,
+                        Bound::Current => i,
+                        Bound::Offset(offset) => clamp(i as f64 + offset),
+                    };
+                    let end = match upper {
+                        Bound::Unbounded => len,
+                        Bound::Current => i + 1,
+                        Bound::Offset(offset) => clamp(i as f64 + offset + 1.0),
+                    };
+                    frames.push((start, end.max(start)));
+                }
+            }
+            Frame::Range(lower, upper, scale) => {
+                let axis = axis.ok_or_else(|| invalid("range windows require a numeric or date sortBy field".to_string()))?;
+                for &current in axis {
+                    let low = match lower {
+                        Bound::Unbounded => f64::NEG_INFINITY,
+                        Bound::Current => current,
+                        Bound::Offset(offset) => current + offset * scale,
+                    };
+                    let high = match upper {
+                        Bound::Unbounded => f64::INFINITY,
+                        Bound::Current => current,
+                        Bound::Offset(offset) => current + offset * scale,
+                    };
+                    let start = axis.partition_point(|value| *value < low);
+                    let end = axis.partition_point(|value| *value <= high);
+                    frames.push((start, end.max(start)));
+                }
+            }
+        }
+        Ok(frames)
+    }
+}
+
+enum WindowFunction {
+    Accumulate { kind: AccumulatorKind, operand: CompiledExpr, frame: Frame },
+    StdDev { sample: bool, operand: CompiledExpr, frame: Frame },
+    Rank { dense: bool },
+    DocumentNumber,
+    Shift { output: CompiledExpr, by: i64, default: Bson },
+}
+
+struct WindowOutput {
+    field: String,
+    function: WindowFunction,
+}
+
+/// Parsed `$setWindowFields` specification
+pub struct WindowFieldsSpec {
+    partition_by: Option<CompiledExpr>,
+    sort_by: Option<SortSpec>,
+    /// Leading sortBy field and direction, the axis of range frames
+    sort_field: Option<(String, bool)>,
+    outputs: Vec<WindowOutput>,
+}
+
+impl WindowFieldsSpec {
+    pub fn parse(spec: &Document) -> Result<Self> {
+        let partition_by = spec.get("partitionBy").map(CompiledExpr::parse).transpose()?;
+        let (sort_by, sort_field) = match spec.get("sortBy") {
+            None => (None, None),
+            Some(Bson::Document(sort_by)) => (Some(SortSpec::parse(sort_by)?), leading_sort_field(sort_by)),
+            Some(_) => return Err(invalid("$setWindowFields sortBy must be a document".to_string())),
+        };
+
+        let output = spec.get_document("output")
+            .map_err(|_| invalid("$setWindowFields requires an output document".to_string()))?;
+        let mut outputs = Vec::with_capacity(output.len());
+        for (field, function) in output {
+            let function = function.as_document()
+                .ok_or_else(|| invalid(format!("$setWindowFields output for '{}' must be a document", field)))?;
+            let (operator, argument) = function.iter()
+                .find(|(key, _)| key.starts_with('$'))
+                .ok_or_else(|| invalid(format!("$setWindowFields output for '{}' requires a window operator", field)))?;
+            let frame = function.get("window").map(Frame::parse).transpose()?.unwrap_or(Frame::PARTITION);
+            if matches!(frame, Frame::Range(..)) && sort_field.is_none() {
+                return Err(invalid("range windows require sortBy".to_string()));
+            }
+
+            let requires_sort = |name: &str| -> Result<()> {
+                if sort_by.is_none() {
+                    return Err(invalid(format!("{} requires sortBy", name)));
+                }
+                Ok(())
+            };
+            let function = match operator.as_str() {
+                "$rank" | "$denseRank" => {
+                    requires_sort(operator)?;
+                    WindowFunction::Rank { dense: operator == "$denseRank" }
+                }
+                "$documentNumber" => {
+                    requires_sort(operator)?;
+                    WindowFunction::DocumentNumber
+                }
+                "$shift" => {
+                    requires_sort(operator)?;
+                    let shift = argument.as_document()
+                        .ok_or_else(|| invalid("$shift must be a document".to_string()))?;
+                    let output = CompiledExpr::parse(shift.get("output")
+                        .ok_or_else(|| invalid("$shift requires an output".to_string()))?)?;
+                    let by = match shift.get("by") {
+                        Some(Bson::Int32(by)) => *by as i64,
+                        Some(Bson::Int64(by)) => *by,
+                        _ => return Err(invalid("$shift by must be an integer".to_string())),
+                    };
+                    let default = shift.get("default").cloned().unwrap_or(Bson::Null);
+                    WindowFunction::Shift { output, by, default }
+                }
+                "$stdDevPop" | "$stdDevSamp" => WindowFunction::StdDev {
+                    sample: operator == "$stdDevSamp",
+                    operand: CompiledExpr::parse(argument)?,
+                    frame,
+                },
+                _ => WindowFunction::Accumulate {
+                    kind: AccumulatorKind::parse(operator)
+                        .ok_or_else(|| invalid(format!("Unsupported window operator: {}", operator)))?,
+                    operand: CompiledExpr::parse(argument)?,
+                    frame,
+                },
+            };
+            outputs.push(WindowOutput { field: field.clone(), function });
+        }
+        if outputs.is_empty() {
+            return Err(invalid("$setWindowFields output must not be empty".to_string()));
+        }
+
+        Ok(Self { partition_by, sort_by, sort_field, outputs })
+    }
+
+    /// Add the output fields to every document, partition by partition
+    pub fn apply<'a>(
+        &self,
+        input: &mut dyn Iterator<Item = Result<Cow<'a, Document>>>,
+        budget: &MemoryBudget,
+    ) -> Result<Vec<Document>> {
+        let partitions = partition_input(input, "$setWindowFields", budget, |doc| match &self.partition_by {
+            Some(partition_by) => partition_by.evaluate(doc),
+            None => Ok(Bson::Null),
+        })?;
+
+        let mut output = Vec::new();
+        for mut partition in partitions {
+            if let Some(sort_by) = &self.sort_by {
+                partition.sort_by(|a, b| sort_by.compare(a, b));
+            }
+            // Every output reads the input documents, not each other
+            let mut values = Vec::with_capacity(self.outputs.len());
+            for window in &self.outputs {
+                values.push(self.evaluate(&window.function, &partition)?);
+            }
+            for (window, values) in self.outputs.iter().zip(values) {
+                for (doc, value) in partition.iter_mut().zip(values) {
+                    set_path(doc, &window.field, value);
+                }
+            }
+            output.extend(partition);
+        }
+        Ok(output)
+    }
+
+    fn evaluate(&self, function: &WindowFunction, partition: &[Document]) -> Result<Vec<Bson>> {
+        match function {
+            WindowFunction::Accumulate { kind, operand, frame } => {
+                let operands = partition.iter()
+                    .map(|doc| match kind {
+                        AccumulatorKind::Count => Ok(Bson::Int32(1)),
+                        _ => operand.evaluate(doc),
+                    })
+                    .collect::<Result<Vec<_>>>()?;
+                let frames = frame.bounds(partition.len(), self.axis(partition, frame)?.as_deref())?;
+                Ok(Self::fold_frames(*kind, &operands, &frames))
+            }
+            WindowFunction::StdDev { sample, operand, frame } => {
+                let operands = partition.iter()
+                    .map(|doc| Ok(match operand.evaluate(doc)? {
+                        Bson::Int32(n) => Some(n as f64),
+                        Bson::Int64(n) => Some(n as f64),
+                        Bson::Double(n) => Some(n),
+                        _ => None,
+                    }))
+                    .collect::<Result<Vec<Option<f64>>>>()?;
+                let frames = frame.bounds(partition.len(), self.axis(partition, frame)?.as_deref())?;
+                Ok(frames.iter()
+                    .map(|&(start, end)| Self::std_dev(operands[start..end].iter().flatten().copied(), *sample))
+                    .collect())
+            }
+            WindowFunction::Rank { dense } => {
+                let sort_by = self.sort_by.as_ref().expect("rank requires sortBy");
+                let mut ranks = Vec::with_capacity(partition.len());
+                let (mut rank, mut distinct) = (0, 0);
+                for (i, doc) in partition.iter().enumerate() {
+                    if i == 0 || sort_by.compare(&partition[i - 1], doc) != Ordering::Equal {
+                        rank = i + 1;
+                        distinct += 1;
+                    }
+                    ranks.push(count_bson(if *dense { distinct } else { rank }));
+                }
+                Ok(ranks)
+            }
+            WindowFunction::DocumentNumber => Ok((1..=partition.len()).map(count_bson).collect()),
+            WindowFunction::Shift { output, by, default } => (0..partition.len())
+                .map(|i| {
+                    let target = i as i64 + by;
+                    if target < 0 || target >= partition.len() as i64 {
+                        return Ok(default.clone());
+                    }
+                    output.evaluate(&partition[target as usize])
+                })
+                .collect(),
+        }
+    }
+
+    /// Leading sort values for range frames, ascending in sort order
+    fn axis(&self, partition: &[Document], frame: &Frame) -> Result<Option<Vec<f64>>> {
+        let (field, descending) = match (frame, &self.sort_field) {
+            (Frame::Range(..), Some(sort_field)) => sort_field,
+            _ => return Ok(None),
+        };
+        partition.iter()
+            .map(|doc| {
+                let value = axis_value(lookup_path(doc, field))
+                    .ok_or_else(|| invalid(format!("range windows require numeric or date values of '{}'", field)))?;
+                Ok(if *descending { -value } else { value })
+            })
+            .collect::<Result<Vec<_>>>()
+            .map(Some)
+    }
+
+    fn fold_frames(kind: AccumulatorKind, operands: &[Bson], frames: &[(usize, usize)]) -> Vec<Bson> {
+        // Frames anchored at the partition start only ever grow
+        let anchored = frames.iter().all(|(start, _)| *start == 0)
+            && frames.windows(2).all(|pair| pair[0].1 <= pair[1].1);
+        if anchored {
+            let mut state = AccumulatorState::new(kind);
+            let mut folded = 0;
+            return frames.iter()
+                .map(|&(_, end)| {
+                    while folded < end {
+                        state.add(kind, folded, operands[folded].clone());
+                        folded += 1;
+                    }
+                    state.clone().finish()
+                })
+                .collect();
+        }
+
+        frames.iter()
+            .map(|&(start, end)| {
+                let mut state = AccumulatorState::new(kind);
+                for (ordinal, value) in operands.iter().enumerate().take(end).skip(start) {
+                    state.add(kind, ordinal, value.clone());
+                }
+                state.finish()
+            })
+            .collect()
+    }
+
+    fn std_dev(values: impl Iterator<Item = f64>, sample: bool) -> Bson {
+        let values: Vec<f64> = values.collect();
+        let count = values.len();
+        if count == 0 || (sample && count < 2) {
+            return Bson::Null;
+        }
+        let mean = values.iter().sum::<f64>() / count as f64;
+        let squares: f64 = values.iter().map(|value| (value - mean).powi(2)).sum();
+        let divisor = if sample { count - 1 } else { count };
+        Bson::Double((squares / divisor as f64).sqrt())
+    }
+}
+
+enum DensifyBounds {
+    Full,
+    Partition,
+    /// Lower inclusive, upper exclusive
+    Explicit(f64, f64),
+}
+
+/// Parsed `$densify` specification
+pub struct DensifySpec {
+    field: String,
+    partition_fields: Vec<String>,
+    step: f64,
+    /// Generated values are dates, with the unit's length in milliseconds
+    unit_millis: Option<f64>,
+    /// Step and explicit bounds are all integers
+    integral: bool,
+    bounds: DensifyBounds,
+}
+
+impl DensifySpec {
+    pub fn parse(spec: &Document) -> Result<Self> {
+        let field = spec.get_str("field")
+            .map_err(|_| invalid("$densify requires a field".to_string()))?
+            .to_string();
+        let partition_fields = string_list(spec.get("partitionByFields"), "$densify partitionByFields")?;
+        let range = spec.get_document("range")
+            .map_err(|_| invalid("$densify requires a range".to_string()))?;
+
+        let step_value = range.get("step").ok_or_else(|| invalid("$densify range.step is required".to_string()))?;
+        let step = number(step_value, "$densify range.step")?;
+        if step <= 0.0 {
+            return Err(invalid("$densify range.step must be positive".to_string()));
+        }
+        let unit_millis = match range.get_str("unit") {
+            Ok(unit) => Some(unit_scale(Some(unit))?),
+            Err(_) => None,
+        };
+
+        let mut integral = matches!(step_value, Bson::Int32(_) | Bson::Int64(_));
+        let bounds = match range.get("bounds") {
+            Some(Bson::String(bounds)) if bounds == "full" => DensifyBounds::Full,
+            Some(Bson::String(bounds)) if bounds == "partition" => DensifyBounds::Partition,
+            Some(Bson::Array(bounds)) if bounds.len() == 2 => {
+                integral &= bounds.iter().all(|bound| matches!(bound, Bson::Int32(_) | Bson::Int64(_)));
+                let lower = axis_value(Some(&bounds[0]));
+                let upper = axis_value(Some(&bounds[1]));
+                match (lower, upper) {
+                    (Some(lower), Some(upper)) if lower <= upper => DensifyBounds::Explicit(lower, upper),
+                    _ => return Err(invalid("$densify range.bounds must be ascending numbers or dates".to_string())),
+                }
+            }
+            _ => return Err(invalid("$densify range.bounds must be \"full\", \"partition\" or [lower, upper]".to_string())),
+        };
+
+        Ok(Self { field, partition_fields, step, unit_millis, integral, bounds })
+    }
+
+    /// Fill the gaps in each partition's sequence of field values
+    pub fn apply<'a>(
+        &self,
+        input: &mut dyn Iterator<Item = Result<Cow<'a, Document>>>,
+        budget: &MemoryBudget,
+    ) -> Result<Vec<Document>> {
+        let partitions = partition_input(input, "$densify", budget, |doc| Ok(fields_key(doc, &self.partition_fields)))?;
+
+        let full_range = match self.bounds {
+            DensifyBounds::Full => self.value_range(partitions.iter().flatten()),
+            _ => None,
+        };
+
+        let mut output = Vec::new();
+        let mut generated_total = 0;
+        for partition in partitions {
+            let range = match self.bounds {
+                DensifyBounds::Full => full_range.map(|(lower, upper)| (lower, upper, true)),
+                DensifyBounds::Partition => self.value_range(partition.iter()).map(|(lower, upper)| (lower, upper, true)),
+                DensifyBounds::Explicit(lower, upper) => Some((lower, upper, false)),
+            };
+
+            // Documents without a value pass through ahead of the sequence
+            let (mut sequence, unplaced): (Vec<Document>, Vec<Document>) = partition.into_iter()
+                .partition(|doc| axis_value(lookup_path(doc, &self.field)).is_some());
+            let template = sequence.first().or(unplaced.first()).map(|doc| {
+                let mut template = Document::new();
+                for field in &self.partition_fields {
+                    if let Some(value) = lookup_path(doc, field) {
+                        set_path(&mut template, field, value.clone());
+                    }
+                }
+                template
+            });
+            output.extend(unplaced);
+
+            let mut present: Vec<f64> = sequence.iter()
+                .filter_map(|doc| axis_value(lookup_path(doc, &self.field)))
+                .collect();
+            present.sort_by(|a, b| a.partial_cmp(b).unwrap_or(Ordering::Equal));
+
+            if let (Some((lower, upper, inclusive)), Some(template)) = (range, template) {
+                let step = self.step * self.unit_millis.unwrap_or(1.0);
+                let mut k = 0u64;
+                loop {
+                    let value = lower + k as f64 * step;
+                    if value > upper || (!inclusive && value >= upper) {
+                        break;
+                    }
+                    k += 1;
+                    if present.binary_search_by(|probe| probe.partial_cmp(&value).unwrap_or(Ordering::Equal)).is_ok() {
+                        continue;
+                    }
+                    generated_total += 1;
+                    if generated_total > MAX_DENSIFY_DOCUMENTS {
+                        return Err(invalid(format!("$densify would generate more than {} documents", MAX_DENSIFY_DOCUMENTS)));
+                    }
+                    let mut generated = template.clone();
+                    set_path(&mut generated, &self.field, self.value_bson(value));
+                    sequence.push(generated);
+                }
+            }
+
+            sequence.sort_by(|a, b| compare_bson(
+                lookup_path(a, &self.field).unwrap_or(&Bson::Null),
+                lookup_path(b, &self.field).unwrap_or(&Bson::Null),
+            ));
+            output.extend(sequence);
+        }
+        Ok(output)
+    }
+
+    fn value_range<'d>(&self, docs: impl Iterator<Item = &'d Document>) -> Option<(f64, f64)> {
+        let mut range: Option<(f64, f64)> = None;
+        for doc in docs {
+            if let Some(value) = axis_value(lookup_path(doc, &self.field)) {
+                range = Some(match range {
+                    None => (value, value),
+                    Some((lower, upper)) => (lower.min(value), upper.max(value)),
+                });
+            }
+        }
+        range
+    }
+
+    fn value_bson(&self, value: f64) -> Bson {
+        if self.unit_millis.is_some() {
+            return Bson::DateTime(bson::DateTime::from_millis(value as i64));
+        }
+        if self.integral && value.fract() == 0.0 {
+            if value.abs() <= i32::MAX as f64 {
+                return Bson::Int32(value as i32);
+            }
+            return Bson::Int64(value as i64);
+        }
+        Bson::Double(value)
+    }
+}
+
+enum FillMethod {
+    Value(CompiledExpr),
+    Locf,
+    Linear,
+}
+
+/// Parsed `$fill` specification
+pub struct FillSpec {
+    partition_by: Option<CompiledExpr>,
+    partition_fields: Vec<String>,
+    sort_by: Option<SortSpec>,
+    sort_field: Option<(String, bool)>,
+    outputs: Vec<(String, FillMethod)>,
+}
+
+impl FillSpec {
+    pub fn parse(spec: &Document) -> Result<Self> {
+        let partition_by = spec.get("partitionBy").map(CompiledExpr::parse).transpose()?;
+        let partition_fields = string_list(spec.get("partitionByFields"), "$fill partitionByFields")?;
+        if partition_by.is_some() && !partition_fields.is_empty() {
+            return Err(invalid("$fill takes partitionBy or partitionByFields, not both".to_string()));
+        }
+        let (sort_by, sort_field) = match spec.get("sortBy") {
+            None => (None, None),
+            Some(Bson::Document(sort_by)) => (Some(SortSpec::parse(sort_by)?), leading_sort_field(sort_by)),
+            Some(_) => return Err(invalid("$fill sortBy must be a document".to_string())),
+        };
+
+        let output = spec.get_document("output")
+            .map_err(|_| invalid("$fill requires an output document".to_string()))?;
+        let mut outputs = Vec::with_capacity(output.len());
+        for (field, method) in output {
+            let method = method.as_document()
+                .ok_or_else(|| invalid(format!("$fill output for '{}' must be a document", field)))?;
+            let method = match (method.get("value"), method.get_str("method")) {
+                (Some(value), _) => FillMethod::Value(CompiledExpr::parse(value)?),
+                (None, Ok("locf")) => FillMethod::Locf,
+                (None, Ok("linear")) => FillMethod::Linear,
+                _ => return Err(invalid(format!("$fill output for '{}' needs a value or a locf or linear method", field))),
+            };
+            if !matches!(method, FillMethod::Value(_)) && sort_by.is_none() {
+                return Err(invalid("$fill methods require sortBy".to_string()));
+            }
+            outputs.push((field.clone(), method));
+        }
+        if outputs.is_empty() {
+            return Err(invalid("$fill output must not be empty".to_string()));
+        }
+
+        Ok(Self { partition_by, partition_fields, sort_by, sort_field, outputs })
+    }
+
+    /// Fill null and missing output fields, partition by partition
+    pub fn apply<'a>(
+        &self,
+        input: &mut dyn Iterator<Item = Result<Cow<'a, Document>>>,
+        budget: &MemoryBudget,
+    ) -> Result<Vec<Document>> {
+        let partitions = partition_input(input, "$fill", budget, |doc| match &self.partition_by {
+            Some(partition_by) => partition_by.evaluate(doc),
+            None => Ok(fields_key(doc, &self.partition_fields)),
+        })?;
+
+        let mut output = Vec::new();
+        for mut partition in partitions {
+            if let Some(sort_by) = &self.sort_by {
+                partition.sort_by(|a, b| sort_by.compare(a, b));
+            }
+            for (field, method) in &self.outputs {
+                match method {
+                    FillMethod::Value(value) => {
+                        for doc in partition.iter_mut().filter(|doc| is_missing(doc, field)) {
+                            let filled = value.evaluate(doc)?;
+                            set_path(doc, field, filled);
+                        }
+                    }
+                    FillMethod::Locf => {
+                        let mut last: Option<Bson> = None;
+                        for doc in partition.iter_mut() {
+                            match lookup_path(doc, field) {
+                                Some(value) if !matches!(value, Bson::Null) => last = Some(value.clone()),
+                                _ => {
+                                    if let Some(last) = &last {
+                                        set_path(doc, field, last.clone());
+                                    }
+                                }
+                            }
+                        }
+                    }
+                    FillMethod::Linear => self.fill_linear(&mut partition, field)?,
+                }
+            }
+            output.extend(partition);
+        }
+        Ok(output)
+    }
+
+    /// Interpolate runs of nulls between two known values along the sort
+    /// field; runs at either end of the partition stay null
+    fn fill_linear(&self, partition: &mut [Document], field: &str) -> Result<()> {
+        let sort_field = &self.sort_field.as_ref().expect("linear fill requires sortBy").0;
+        let mut previous: Option<(f64, f64)> = None;
+        let mut gap: Vec<usize> = Vec::new();
+
+        for i in 0..partition.len() {
+            let value = match lookup_path(&partition[i], field) {
+                None | Some(Bson::Null) => {
+                    gap.push(i);
+                    continue;
+                }
+                Some(value) => axis_value(Some(value))
+                    .ok_or_else(|| invalid(format!("$fill linear requires numeric values of '{}'", field)))?,
+            };
+            let position = axis_value(lookup_path(&partition[i], sort_field))
+                .ok_or_else(|| invalid(format!("$fill linear requires numeric or date values of '{}'", sort_field)))?;
+
+            if let Some((previous_position, previous_value)) = previous {
+                for &j in &gap {
+                    let at = axis_value(lookup_path(&partition[j], sort_field))
+                        .ok_or_else(|| invalid(format!("$fill linear requires numeric or date values of '{}'", sort_field)))?;
+                    let filled = if position == previous_position {
+                        previous_value
+                    } else {
+                        previous_value + (value - previous_value) * (at - previous_position) / (position - previous_position)
+                    };
+                    set_path(&mut partition[j], field, Bson::Double(filled));
+                }
+            }
+            gap.clear();
+            previous = Some((position, value));
+        }
+        Ok(())
+    }
+}
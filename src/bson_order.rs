@@ -0,0 +1,124 @@
+/*!
+ * @file bson_order.rs
+ * @brief MongoDB's canonical ordering of BSON values
+ *
+ * Used wherever the in-process engine orders values across documents:
+ * $min/$max accumulators and $sort.
+ */
+
+use bson::{Bson, Document};
+use std::cmp::Ordering;
+
+/// Rank of a value's type in MongoDB's cross-type sort order.
+/// Numbers share a rank and compare by value.
+fn type_rank(value: &Bson) -> u8 {
+    match value {
+        Bson::MinKey => 0,
+        Bson::Null | Bson::Undefined => 1,
+        Bson::Int32(_) | Bson::Int64(_) | Bson::Double(_) | Bson::Decimal128(_) => 2,
+        Bson::Symbol(_) | Bson::String(_) => 3,
+        Bson::Document(_) => 4,
+        Bson::Array(_) => 5,
+        Bson::Binary(_) => 6,
+        Bson::ObjectId(_) => 7,
+        Bson::Boolean(_) => 8,
+        Bson::DateTime(_) => 9,
+        Bson::Timestamp(_) => 10,
+        Bson::RegularExpression(_) => 11,
+        Bson::DbPointer(_) => 12,
+        Bson::JavaScriptCode(_) | Bson::JavaScriptCodeWithScope(_) => 13,
+        Bson::MaxKey => 14,
+    }
+}
+
+fn as_f64(value: &Bson) -> Option<f64> {
+    match value {
+        Bson::Int32(n) => Some(*n as f64),
+        Bson::Int64(n) => Some(*n as f64),
+        Bson::Double(n) => Some(*n),
+        _ => None,
+    }
+}
+
+/// Total order over BSON values matching MongoDB's comparison rules
+pub fn compare_bson(a: &Bson, b: &Bson) -> Ordering {
+    let rank = type_rank(a).cmp(&type_rank(b));
+    if rank != Ordering::Equal {
+        return rank;
+    }
+
+    match (a, b) {
+        (Bson::Int32(x), Bson::Int32(y)) => x.cmp(y),
+        (Bson::Int64(x), Bson::Int64(y)) => x.cmp(y),
+        (Bson::String(x), Bson::String(y)) => x.cmp(y),
+        (Bson::Symbol(x), Bson::Symbol(y)) => x.cmp(y),
+        (Bson::String(x), Bson::Symbol(y)) | (Bson::Symbol(x), Bson::String(y)) => x.cmp(y),
+        (Bson::Document(x), Bson::Document(y)) => compare_documents(x, y),
+        (Bson::Array(x), Bson::Array(y)) => compare_sequences(x.iter(), y.iter()),
+        (Bson::Binary(x), Bson::Binary(y)) => x.bytes.len().cmp(&y.bytes.len())
+            .then_with(|| u8::from(x.subtype).cmp(&u8::from(y.subtype)))
+            .then_with(|| x.bytes.cmp(&y.bytes)),
+        (Bson::ObjectId(x), Bson::ObjectId(y)) => x.bytes().cmp(&y.bytes()),
+        (Bson::Boolean(x), Bson::Boolean(y)) => x.cmp(y),
+        (Bson::DateTime(x), Bson::DateTime(y)) => x.cmp(y),
+        (Bson::Timestamp(x), Bson::Timestamp(y)) => (x.time, x.increment).cmp(&(y.time, y.increment)),
+        (Bson::RegularExpression(x), Bson::RegularExpression(y)) => {
+            x.pattern.cmp(&y.pattern).then_with(|| x.options.cmp(&y.options))
+        }
+        _ => match (as_f64(a), as_f64(b)) {
+            // NaN sorts below every other number
+            (Some(x), Some(y)) => x.partial_cmp(&y).unwrap_or_else(|| x.is_nan().cmp(&y.is_nan()).reverse()),
+            _ => Ordering::Equal,
+        },
+    }
+}
+
+fn compare_documents(a: &Document, b: &Document) -> Ordering {
+    let mut left = a.iter();
+    let mut right = b.iter();
+    loop {
+        match (left.next(), right.next()) {
+            (None, None) => return Ordering::Equal,
+            (None, Some(_)) => return Ordering::Less,
+            (Some(_), None) => return Ordering::Greater,
+            (Some((lk, lv)), Some((rk, rv))) => {
+                let order = type_rank(lv).cmp(&type_rank(rv))
+                    .then_with(|| lk.cmp(rk))
+                    .then_with(|| compare_bson(lv, rv));
+                if order != Ordering::Equal {
+                    return order;
+                }
+            }
+        }
+    }
+}
+
+fn compare_sequences<'a>(mut left: impl Iterator<Item = &'a Bson>, mut right: impl Iterator<Item = &'a Bson>) -> Ordering {
+    loop {
+        match (left.next(), right.next()) {
+            (None, None) => return Ordering::Equal,
+            (None, Some(_)) => return Ordering::Less,
+            (Some(_), None) => return Ordering::Greater,
+            (Some(l), Some(r)) => {
+                let order = compare_bson(l, r);
+                if order != Ordering::Equal {
+                    return order;
+                }
+            }
+        }
+    }
+}
+
+/// Resolve a dotted path, returning None when any segment is missing
+pub fn lookup_path<'a>(doc: &'a Document, path: &str) -> Option<&'a Bson> {
+    let mut segments = path.split('.');
+    let mut current = doc.get(segments.next()?)?;
+    for segment in segments {
+        current = match current {
+            Bson::Document(inner) => inner.get(segment)?,
+            Bson::Array(items) => items.get(segment.parse::<usize>().ok()?)?,
+            _ => return None,
+        };
+    }
+    Some(current)
+}
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file bulk_insert.rs
+ * @brief Batched document inserts over binary COPY
+ *
+ * Documents are validated and encoded up front, then streamed to PostgreSQL
+ * with COPY ... FROM STDIN (FORMAT binary) in batches. COPY is all or
+ * nothing, so a batch that fails is replayed row by row to attribute the
+ * failure to the offending documents, the way MongoDB reports writeErrors.
+ * Inside a transaction a failed COPY would abort it, so each batch runs under
+ * a savepoint that the replay rolls back to first.
+ */
+
+use crate::document_codec::{EncodedDocument, JsonbText, StorageLayout};
+use crate::error::{FauxDBError, Result};
+use crate::postgresql_manager::collection_table;
+use crate::transactions::ConnectionTarget;
+use crate::update::database_error;
+use crate::{fauxdb_debug, fauxdb_warn};
+use bson::{doc, oid::ObjectId, Bson, Document};
+use futures::pin_mut;
+use metrics::counter;
+use std::collections::HashSet;
+use tokio_postgres::binary_copy::BinaryCopyInWriter;
+use tokio_postgres::error::SqlState;
+use tokio_postgres::types::Type;
+use tokio_postgres::Client;
+
+/// Documents per COPY. A failed batch is replayed row by row, so this also
+/// bounds the cost of locating a bad document.
+pub const DEFAULT_COPY_BATCH_SIZE: usize = 1000;
+
+/// MongoDB's maximum BSON document size
+const MAX_DOCUMENT_BYTES: usize = 16 * 1024 * 1024;
+
+const CODE_INTERNAL_ERROR: i32 = 1;
+const CODE_BAD_VALUE: i32 = 2;
+const CODE_DUPLICATE_KEY: i32 = 11000;
+const CODE_WRITE_CONFLICT: i32 = 112;
+const CODE_OBJECT_TOO_LARGE: i32 = 10334;
+
+/// One entry of a write command's `writeErrors`
+#[derive(Debug, Clone, PartialEq)]
+pub struct WriteError {
+    pub index: usize,
+    pub code: i32,
+    pub errmsg: String,
+}
+
+impl WriteError {
+    pub fn to_document(&self) -> Document {
+        doc! {
+            "index": self.index as i32,
+            "code": self.code,
+            "errmsg": self.errmsg.clone(),
+        }
+    }
+
+    /// A failed statement of a write command
+    pub fn from_error(index: usize, error: &FauxDBError) -> Self {
+        let (code, errmsg) = match error {
+            FauxDBError::DuplicateKey(message) => (CODE_DUPLICATE_KEY, message.clone()),
+            FauxDBError::WriteConflict(message) => (CODE_WRITE_CONFLICT, message.clone()),
+            FauxDBError::WireProtocol(_) => (CODE_BAD_VALUE, error.to_string()),
+            _ => (CODE_INTERNAL_ERROR, error.to_string()),
+        };
+        Self { index, code, errmsg }
+    }
+
+    fn from_postgres(index: usize, error: &tokio_postgres::Error) -> Self {
+        let code = match error.code() {
+            Some(state) if *state == SqlState::UNIQUE_VIOLATION => CODE_DUPLICATE_KEY,
+            Some(state) if *state == SqlState::T_R_SERIALIZATION_FAILURE || *state == SqlState::T_R_DEADLOCK_DETECTED => CODE_WRITE_CONFLICT,
+            Some(state) if state.code().starts_with("22") || state.code().starts_with("23") => CODE_BAD_VALUE,
+            _ => CODE_INTERNAL_ERROR,
+        };
+        let errmsg = match error.as_db_error() {
+            Some(db_error) if code == CODE_DUPLICATE_KEY => format!("E11000 duplicate key error: {}", db_error.message()),
+            Some(db_error) => db_error.message().to_string(),
+            None => error.to_string(),
+        };
+        Self { index, code, errmsg }
+    }
+}
+
+#[derive(Debug, Default)]
+pub struct BulkInsertResult {
+    pub inserted: u64,
+    pub write_errors: Vec<WriteError>,
+}
+
+impl BulkInsertResult {
+    /// Reply body for the `insert` command
+    pub fn to_response(&self) -> Document {
+        let mut response = doc! { "n": self.inserted as i64, "ok": 1.0 };
+        if !self.write_errors.is_empty() {
+            let errors: Vec<Bson> = self.write_errors.iter().map(|e| Bson::Document(e.to_document())).collect();
+            response.insert("writeErrors", errors);
+        }
+        response
+    }
+}
+
+/// A document encoded for the collection's storage layout, tagged with its
+/// position in the request
+#[derive(Debug)]
+pub struct PreparedDocument {
+    pub index: usize,
+    pub encoded: EncodedDocument,
+}
+
+impl PreparedDocument {
+    /// Parameters for the (document, bson_document) columns
+    fn columns(&self) -> (Option<JsonbText<&str>>, Option<&[u8]>) {
+        (self.encoded.jsonb.as_deref().map(JsonbText), self.encoded.bson.as_deref())
+    }
+}
+
+/// Validate and encode a request's documents, assigning missing `_id`s.
+/// When `ordered`, preparation stops at the first invalid document.
+pub fn prepare_documents(documents: &[Document], layout: &StorageLayout, ordered: bool) -> (Vec<PreparedDocument>, Vec<WriteError>) {
+    let mut prepared = Vec::with_capacity(documents.len());
+    let mut errors = Vec::new();
+    let mut seen_ids: HashSet<Vec<u8>> = HashSet::with_capacity(documents.len());
+
+    for (index, document) in documents.iter().enumerate() {
+        match prepare_document(index, document, layout, &mut seen_ids) {
+            Ok(document) => prepared.push(document),
+            Err(error) => {
+                errors.push(error);
+                if ordered {
+                    break;
+                }
+            }
+        }
+    }
+
+    (prepared, errors)
+}
+
+fn prepare_document(index: usize, document: &Document, layout: &StorageLayout, seen_ids: &mut HashSet<Vec<u8>>) -> std::result::Result<PreparedDocument, WriteError> {
+    let error = |code: i32, errmsg: String| WriteError { index, code, errmsg };
+
+    // _id goes first, as the server stores it
+    let with_id;
+    let document = if document.contains_key("_id") {
+        document
+    } else {
+        let mut assigned = doc! { "_id": ObjectId::new() };
+        assigned.extend(document.clone());
+        with_id = assigned;
+        &with_id
+    };
+
+    let id = document.get("_id").cloned().unwrap_or(Bson::Null);
+    if matches!(id, Bson::Array(_) | Bson::RegularExpression(_) | Bson::Undefined) {
+        return Err(error(CODE_BAD_VALUE, format!("can't use a {:?} for _id", id.element_type())));
+    }
+    let id_key = bson::to_vec(&doc! { "_id": id.clone() })
+        .map_err(|e| error(CODE_BAD_VALUE, e.to_string()))?;
+    if !seen_ids.insert(id_key) {
+        return Err(error(CODE_DUPLICATE_KEY, format!("E11000 duplicate key error index: _id_ dup key: {{ _id: {} }}", id)));
+    }
+
+    let encoded = layout.encode(document)
+        .map_err(|e| error(CODE_BAD_VALUE, e.to_string()))?;
+    if encoded.bson_size > MAX_DOCUMENT_BYTES {
+        return Err(error(CODE_OBJECT_TOO_LARGE, format!("object to insert too large. size in bytes: {}, max size: {}", encoded.bson_size, MAX_DOCUMENT_BYTES)));
+    }
+
+    Ok(PreparedDocument { index, encoded })
+}
+
+/// Batched insert into one collection table
+pub struct BulkInsert {
+    copy_sql: String,
+    insert_sql: String,
+    layout: StorageLayout,
+    ordered: bool,
+    batch_size: usize,
+    /// Running inside a transaction, where a failed statement aborts it
+    in_transaction: bool,
+}
+
+impl BulkInsert {
+    pub fn new(table: String, layout: StorageLayout, ordered: bool) -> Self {
+        Self {
+            copy_sql: format!("COPY {} (document, bson_document) FROM STDIN (FORMAT binary)", table),
+            insert_sql: format!("INSERT INTO {} (document, bson_document) VALUES ($1, $2)", table),
+            layout,
+            ordered,
+            batch_size: DEFAULT_COPY_BATCH_SIZE,
+            in_transaction: false,
+        }
+    }
+
+    /// Insert within an open transaction: the first failed document ends
+    /// the insert, since the transaction can't go on past it
+    pub fn in_transaction(mut self) -> Self {
+        self.in_transaction = true;
+        self
+    }
+
+    pub fn with_batch_size(mut self, batch_size: usize) -> Self {
+        self.batch_size = batch_size.max(1);
+        self
+    }
+
+    pub async fn execute(&self, client: &Client, documents: &[Document]) -> Result<BulkInsertResult> {
+        let (prepared, mut write_errors) = prepare_documents(documents, &self.layout, self.ordered);
+        let mut result = BulkInsertResult::default();
+
+        for batch in prepared.chunks(self.batch_size) {
+            let stopped = self.write_batch(client, batch, &mut result).await?;
+            if stopped {
+                // An ordered insert ends at the first failed document
+                write_errors.clear();
+                break;
+            }
+        }
+
+        result.write_errors.append(&mut write_errors);
+        result.write_errors.sort_by_key(|error| error.index);
+        counter!("fauxdb_bulk_insert_documents_total").increment(result.inserted);
+        if !result.write_errors.is_empty() {
+            counter!("fauxdb_bulk_insert_errors_total").increment(result.write_errors.len() as u64);
+        }
+        Ok(result)
+    }
+
+    /// Write one batch; returns true if an ordered insert has to stop
+    async fn write_batch(&self, client: &Client, batch: &[PreparedDocument], result: &mut BulkInsertResult) -> Result<bool> {
+        if self.in_transaction {
+            client.batch_execute("SAVEPOINT fauxdb_copy").await
+                .map_err(|e| FauxDBError::Database(format!("SAVEPOINT failed: {}", e)))?;
+        }
+        match self.copy_batch(client, batch).await {
+            Ok(rows) => {
+                fauxdb_debug!("COPY wrote {} documents", rows);
+                result.inserted += rows;
+                self.release_savepoint(client).await?;
+                return Ok(false);
+            }
+            Err(e) if e.as_db_error().is_none() => {
+                return Err(FauxDBError::Database(format!("COPY failed: {}", e)));
+            }
+            // Every row would fail the same way; the caller recreates the table
+            Err(e) if e.code() == Some(&SqlState::UNDEFINED_TABLE) => {
+                return Err(database_error(e));
+            }
+            Err(e) => {
+                fauxdb_warn!("COPY of {} documents failed ({}), retrying row by row", batch.len(), e);
+                counter!("fauxdb_bulk_insert_copy_fallbacks_total").increment(1);
+            }
+        }
+        if self.in_transaction {
+            client.batch_execute("ROLLBACK TO SAVEPOINT fauxdb_copy").await
+                .map_err(|e| FauxDBError::Database(format!("ROLLBACK TO SAVEPOINT failed: {}", e)))?;
+        }
+
+        for document in batch {
+            let (jsonb, bson) = document.columns();
+            match client.execute(&self.insert_sql, &[&jsonb, &bson]).await {
+                Ok(rows) => result.inserted += rows,
+                Err(e) if e.as_db_error().is_none() => {
+                    return Err(FauxDBError::Database(format!("Insert failed: {}", e)));
+                }
+                Err(e) => {
+                    result.write_errors.push(WriteError::from_postgres(document.index, &e));
+                    if self.ordered || self.in_transaction {
+                        return Ok(true);
+                    }
+                }
+            }
+        }
+        self.release_savepoint(client).await?;
+        Ok(false)
+    }
+
+    /// Drop the per-batch savepoint so a long transaction does not pile
+    /// them up; a failed statement has already aborted the transaction
+    async fn release_savepoint(&self, client: &Client) -> Result<()> {
+        if self.in_transaction {
+            client.batch_execute("RELEASE SAVEPOINT fauxdb_copy").await
+                .map_err(|e| FauxDBError::Database(format!("RELEASE SAVEPOINT failed: {}", e)))?;
+        }
+        Ok(())
+    }
+
+    async fn copy_batch(&self, client: &Client, batch: &[PreparedDocument]) -> std::result::Result<u64, tokio_postgres::Error> {
+        let sink = client.copy_in(&self.copy_sql).await?;
+        let writer = BinaryCopyInWriter::new(sink, &[Type::JSONB, Type::BYTEA]);
+        pin_mut!(writer);
+
+        for document in batch {
+            let (jsonb, bson) = document.columns();
+            writer.as_mut().write(&[&jsonb, &bson]).await?;
+        }
+        writer.finish().await
+    }
+}
+
+/// Execute an `insert` command against the collection's table, creating the
+/// collection on first use as MongoDB does
+pub async fn insert_command(target: ConnectionTarget<'_>, layout: &StorageLayout, command: &Document) -> Result<Document> {
+    let collection = command.get_str("insert")
+        .map_err(|_| FauxDBError::WireProtocol("Missing collection in insert command".to_string()))?;
+    let database = command.get_str("$db").unwrap_or("fauxdb");
+    let ordered = command.get_bool("ordered").unwrap_or(true);
+
+    let documents = command.get_array("documents")
+        .map_err(|_| FauxDBError::WireProtocol("Missing documents in insert command".to_string()))?
+        .iter()
+        .map(|value| value.as_document().cloned()
+            .ok_or_else(|| FauxDBError::WireProtocol("insert documents must be objects".to_string())))
+        .collect::<Result<Vec<Document>>>()?;
+
+    let connection = target.checkout().await?;
+    let client = connection.client();
+    let table = collection_table(database, collection);
+
+    target.ensure_collection(client, database, collection).await?;
+
+    let mut insert = BulkInsert::new(table.clone(), layout.clone(), ordered);
+    if target.in_transaction() {
+        insert = insert.in_transaction();
+    }
+    let result = match connection.pooled().timed(insert.execute(client, &documents)).await {
+        // Dropped since the catalog last heard of it, so nothing was
+        // written; recreate it and run once more. A transaction is aborted
+        // by the failed COPY, so there the error stands.
+        Err(FauxDBError::UndefinedTable(message)) => {
+            target.catalog().forget(&table);
+            if target.in_transaction() {
+                return Err(FauxDBError::UndefinedTable(message));
+            }
+            counter!("fauxdb_catalog_retries_total").increment(1);
+            target.ensure_collection(client, database, collection).await?;
+            connection.pooled().timed(insert.execute(client, &documents)).await?
+        }
+        result => result?,
+    };
+    Ok(result.to_response())
+}
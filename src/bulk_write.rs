@@ -0,0 +1,540 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file bulk_write.rs
+ * @brief Batched execution of insert, update and delete statements
+ *
+ * Consecutive inserts into one collection go out as a single COPY.
+ * Consecutive updates and deletes that compile to one SQL statement each are
+ * pipelined on one connection, with each distinct statement text prepared
+ * once, so a batch costs a round trip rather than one per statement.
+ * Statements that need an in-process predicate or an upsert run on their own
+ * between pipelines.
+ *
+ * Ordered batches pipeline inside a transaction. If statement k fails, the
+ * ones after it fail with it, the transaction is rolled back, and the
+ * statements before k are replayed and committed. This mirrors how a failed
+ * COPY is replayed in bulk_insert. Unordered batches pipeline with each
+ * statement in its own transaction, and large ones fan out across the
+ * connections that are free. Inside a multi-document transaction everything runs on its
+ * pinned connection and stops at the first error, which aborts it.
+ */
+
+use crate::bulk_insert::{BulkInsert, WriteError};
+use crate::delete::{deleted_count, execute_delete, plan_delete};
+use crate::document_codec::StorageLayout;
+use crate::error::{FauxDBError, Result};
+use crate::fauxdb_debug;
+use crate::postgresql_manager::collection_table;
+use crate::transactions::{Checkout, ConnectionTarget};
+use crate::update::{database_error, execute_update, execute_upsert, plan_update, query_prepared, update_outcome, UpdateOutcome};
+use bson::{doc, Bson, Document};
+use futures::future::join_all;
+use metrics::counter;
+use std::collections::{HashMap, HashSet};
+use tokio_postgres::{Client, Statement};
+
+/// Statements sent before waiting for their results
+pub const PIPELINE_DEPTH: usize = 1000;
+
+/// Connections an unordered batch fans out over, and the statements each
+/// one needs before another connection is worth taking from the pool
+const FANOUT_CONNECTIONS: usize = 4;
+const FANOUT_MIN_STATEMENTS: usize = 256;
+
+/// SQL and JSONB params of a write that runs as one statement returning
+/// its counts
+#[derive(Debug, Clone)]
+pub struct PlannedWrite {
+    pub sql: String,
+    pub params: Vec<String>,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum WriteOp {
+    Insert(Document),
+    Update { filter: Document, update: Document, multi: bool, upsert: bool },
+    Delete { filter: Document, multi: bool },
+}
+
+/// One statement of a write command
+#[derive(Debug, Clone)]
+pub struct WriteModel {
+    pub database: String,
+    pub collection: String,
+    pub op: WriteOp,
+}
+
+impl WriteModel {
+    pub fn table(&self) -> String {
+        collection_table(&self.database, &self.collection)
+    }
+
+    /// Writes that create their collection, as MongoDB does
+    fn creates_collection(&self) -> bool {
+        matches!(self.op, WriteOp::Insert(_) | WriteOp::Update { upsert: true, .. })
+    }
+}
+
+/// Result of one statement: documents inserted, matched or deleted
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct WriteOutcome {
+    pub n: u64,
+    pub modified: u64,
+    pub upserted: Option<Bson>,
+}
+
+impl From<UpdateOutcome> for WriteOutcome {
+    fn from(outcome: UpdateOutcome) -> Self {
+        Self { n: outcome.matched, modified: outcome.modified, upserted: outcome.upserted }
+    }
+}
+
+#[derive(Debug, Default)]
+pub struct BulkWriteResult {
+    /// Outcomes of the statements that ran, by request index
+    pub outcomes: Vec<(usize, WriteOutcome)>,
+    pub write_errors: Vec<WriteError>,
+}
+
+impl BulkWriteResult {
+    /// Add `writeErrors` to a write command reply when there are any
+    pub fn append_write_errors(&self, response: &mut Document) {
+        if !self.write_errors.is_empty() {
+            let errors: Vec<Bson> = self.write_errors.iter().map(|e| Bson::Document(e.to_document())).collect();
+            response.insert("writeErrors", errors);
+        }
+    }
+
+    fn merge(&mut self, other: BulkWriteResult) {
+        self.outcomes.extend(other.outcomes);
+        self.write_errors.extend(other.write_errors);
+    }
+}
+
+/// Execute a batch of writes. A table dropped without the catalog noticing
+/// fails the batch with UndefinedTable and is forgotten, so running the
+/// batch again sees it gone.
+pub async fn execute_bulk_write(target: ConnectionTarget<'_>, layout: &StorageLayout, models: &[WriteModel], ordered: bool) -> Result<BulkWriteResult> {
+    let result = run_bulk_write(target, layout, models, ordered).await;
+    if let Err(FauxDBError::UndefinedTable(_)) = &result {
+        for table in models.iter().map(WriteModel::table).collect::<HashSet<_>>() {
+            target.catalog().forget(&table);
+        }
+    }
+    result
+}
+
+async fn run_bulk_write(target: ConnectionTarget<'_>, layout: &StorageLayout, models: &[WriteModel], ordered: bool) -> Result<BulkWriteResult> {
+    let connection = target.checkout().await?;
+    let missing = prepare_collections(&connection, target, models).await?;
+    let in_transaction = target.in_transaction();
+
+    // Extra connections are taken only if free: waiting for one while this
+    // batch holds `connection` could deadlock with other batches doing the same
+    let wanted = if ordered || in_transaction { 1 } else { (models.len() / FANOUT_MIN_STATEMENTS).clamp(1, FANOUT_CONNECTIONS) };
+    let mut extras = Vec::with_capacity(wanted - 1);
+    while extras.len() + 1 < wanted {
+        match target.try_checkout().await {
+            Some(extra) => extras.push(extra),
+            None => break,
+        }
+    }
+
+    let chunks = extras.len() + 1;
+    let mut result = if chunks == 1 {
+        Executor::new(&connection, layout, &missing, ordered, in_transaction).run(models, 0).await?
+    } else {
+        // Unordered statements may apply in any order, so chunks run side by side
+        counter!("fauxdb_bulk_write_fanout_total").increment(1);
+        let chunk_size = (models.len() + chunks - 1) / chunks;
+        let missing = &missing;
+        let connections = std::iter::once(&connection).chain(&extras);
+        let runs = models.chunks(chunk_size).zip(connections).enumerate().map(|(chunk, (statements, connection))| async move {
+            Executor::new(connection, layout, missing, false, false).run(statements, chunk * chunk_size).await
+        });
+
+        let mut merged = BulkWriteResult::default();
+        for chunk in join_all(runs).await {
+            merged.merge(chunk?);
+        }
+        merged
+    };
+
+    result.outcomes.sort_by_key(|(index, _)| *index);
+    result.write_errors.sort_by_key(|error| error.index);
+    if !result.write_errors.is_empty() {
+        counter!("fauxdb_bulk_write_errors_total").increment(result.write_errors.len() as u64);
+    }
+    Ok(result)
+}
+
+/// Create the collections inserts and upserts write to; returns the tables
+/// that don't exist, where every other statement matches nothing
+async fn prepare_collections(connection: &Checkout<'_>, target: ConnectionTarget<'_>, models: &[WriteModel]) -> Result<HashSet<String>> {
+    let mut namespaces: HashMap<String, (&WriteModel, bool)> = HashMap::new();
+    for model in models {
+        let entry = namespaces.entry(model.table()).or_insert((model, false));
+        entry.1 |= model.creates_collection();
+    }
+
+    let mut missing = HashSet::new();
+    for (table, (model, creates)) in namespaces {
+        if creates {
+            target.ensure_collection(connection.client(), &model.database, &model.collection).await?;
+        } else if !target.catalog().exists(connection.pooled(), &table).await? {
+            missing.insert(table);
+        }
+    }
+    Ok(missing)
+}
+
+#[derive(Debug, Clone, Copy)]
+enum PlannedKind {
+    Update,
+    Delete,
+}
+
+impl PlannedKind {
+    fn outcome(self, rows: &[tokio_postgres::Row]) -> Result<WriteOutcome> {
+        let row = rows.first().ok_or_else(|| FauxDBError::Database("Write returned no counts".to_string()))?;
+        Ok(match self {
+            PlannedKind::Update => update_outcome(row).into(),
+            PlannedKind::Delete => WriteOutcome { n: deleted_count(row), ..WriteOutcome::default() },
+        })
+    }
+}
+
+#[derive(Debug)]
+struct Pending {
+    index: usize,
+    kind: PlannedKind,
+    write: PlannedWrite,
+}
+
+/// Runs statements on one connection, pipelining what it can
+struct Executor<'a> {
+    connection: &'a Checkout<'a>,
+    layout: &'a StorageLayout,
+    missing: &'a HashSet<String>,
+    ordered: bool,
+    /// On a transaction's pinned connection, which the first error aborts
+    in_transaction: bool,
+    pending: Vec<Pending>,
+    result: BulkWriteResult,
+}
+
+impl<'a> Executor<'a> {
+    fn new(connection: &'a Checkout<'a>, layout: &'a StorageLayout, missing: &'a HashSet<String>, ordered: bool, in_transaction: bool) -> Self {
+        Self { connection, layout, missing, ordered, in_transaction, pending: Vec::new(), result: BulkWriteResult::default() }
+    }
+
+    /// Run statements whose request indexes start at `offset`
+    async fn run(mut self, models: &[WriteModel], offset: usize) -> Result<BulkWriteResult> {
+        let mut position = 0;
+        while position < models.len() {
+            let index = offset + position;
+            let model = &models[position];
+            let table = model.table();
+            position += 1;
+
+            if self.missing.contains(&table) {
+                // Nothing matches in a collection that doesn't exist
+                self.result.outcomes.push((index, WriteOutcome::default()));
+                continue;
+            }
+
+            let stopped = match &model.op {
+                WriteOp::Insert(document) => {
+                    let mut documents = vec![document.clone()];
+                    while let Some(WriteModel { op: WriteOp::Insert(document), .. }) = models.get(position).filter(|next| next.table() == table) {
+                        documents.push(document.clone());
+                        position += 1;
+                    }
+                    self.flush().await? || self.insert(table, &documents, index).await?
+                }
+                WriteOp::Update { filter, update, multi, upsert } => {
+                    let planned = if *upsert { Ok(None) } else { plan_update(&table, self.layout, filter, update, *multi) };
+                    self.step(index, PlannedKind::Update, planned, model).await?
+                }
+                WriteOp::Delete { filter, multi } => {
+                    let planned = Ok(plan_delete(&table, self.layout, filter, *multi));
+                    self.step(index, PlannedKind::Delete, planned, model).await?
+                }
+            };
+            if stopped {
+                return Ok(self.result);
+            }
+        }
+
+        self.flush().await?;
+        Ok(self.result)
+    }
+
+    /// Queue a planned statement, or run one that can't be pipelined
+    async fn step(&mut self, index: usize, kind: PlannedKind, planned: Result<Option<PlannedWrite>>, model: &WriteModel) -> Result<bool> {
+        match planned {
+            Ok(Some(write)) => {
+                self.pending.push(Pending { index, kind, write });
+                if self.pending.len() >= PIPELINE_DEPTH {
+                    return self.flush().await;
+                }
+                Ok(false)
+            }
+            Ok(None) => {
+                if self.flush().await? {
+                    return Ok(true);
+                }
+                let outcome = self.execute_alone(model).await;
+                self.record(index, outcome)
+            }
+            Err(e) => Ok(self.flush().await? || self.record(index, Err(e))?),
+        }
+    }
+
+    async fn execute_alone(&self, model: &WriteModel) -> Result<WriteOutcome> {
+        let table = model.table();
+        match &model.op {
+            WriteOp::Update { filter, update, multi, upsert: true } => {
+                let write = execute_upsert(self.connection.client(), &table, self.layout, filter, update, *multi);
+                Ok(self.connection.pooled().timed(write).await?.into())
+            }
+            WriteOp::Update { filter, update, multi, .. } => {
+                let write = execute_update(self.connection.client(), &table, self.layout, filter, update, *multi);
+                Ok(self.connection.pooled().timed(write).await?.into())
+            }
+            WriteOp::Delete { filter, multi } => {
+                let write = execute_delete(self.connection.client(), &table, self.layout, filter, *multi);
+                let deleted = self.connection.pooled().timed(write).await?;
+                Ok(WriteOutcome { n: deleted, ..WriteOutcome::default() })
+            }
+            WriteOp::Insert(_) => Err(FauxDBError::Database("Inserts are not executed alone".to_string())),
+        }
+    }
+
+    /// Record a statement's result; returns true if the batch has to stop.
+    /// A missing table fails the whole batch instead.
+    fn record(&mut self, index: usize, outcome: Result<WriteOutcome>) -> Result<bool> {
+        match outcome {
+            Ok(outcome) => {
+                self.result.outcomes.push((index, outcome));
+                Ok(false)
+            }
+            Err(e @ FauxDBError::UndefinedTable(_)) => Err(e),
+            Err(e) => {
+                self.result.write_errors.push(WriteError::from_error(index, &e));
+                Ok(self.stops_on_error())
+            }
+        }
+    }
+
+    fn stops_on_error(&self) -> bool {
+        self.ordered || self.in_transaction
+    }
+
+    async fn insert(&mut self, table: String, documents: &[Document], first_index: usize) -> Result<bool> {
+        let mut insert = BulkInsert::new(table, self.layout.clone(), self.ordered);
+        if self.in_transaction {
+            insert = insert.in_transaction();
+        }
+        let inserted = self.connection.pooled().timed(insert.execute(self.connection.client(), documents)).await?;
+        let failed: HashSet<usize> = inserted.write_errors.iter().map(|error| error.index).collect();
+        // An ordered insert stops at its first failed document
+        let attempted = match inserted.write_errors.first() {
+            Some(error) if self.stops_on_error() => error.index,
+            _ => documents.len(),
+        };
+
+        for offset in (0..attempted).filter(|offset| !failed.contains(offset)) {
+            self.result.outcomes.push((first_index + offset, WriteOutcome { n: 1, ..WriteOutcome::default() }));
+        }
+        for mut error in inserted.write_errors {
+            error.index += first_index;
+            self.result.write_errors.push(error);
+        }
+        Ok(self.stops_on_error() && !failed.is_empty())
+    }
+
+    /// Send the queued statements; returns true if an ordered batch has to stop
+    async fn flush(&mut self) -> Result<bool> {
+        if self.pending.is_empty() {
+            return Ok(false);
+        }
+        let batch = std::mem::take(&mut self.pending);
+        counter!("fauxdb_bulk_write_pipelined_total").increment(batch.len() as u64);
+        fauxdb_debug!("Pipelining {} write statements", batch.len());
+
+        // A transaction can't roll back and replay a prefix of its own
+        if self.ordered && !self.in_transaction && batch.len() > 1 {
+            let (outcomes, failure) = run_ordered(self.connection, &batch).await?;
+            for (pending, outcome) in batch.iter().zip(outcomes) {
+                self.result.outcomes.push((pending.index, outcome));
+            }
+            return Ok(match failure {
+                Some((position, error)) => self.record(batch[position].index, Err(error))?,
+                None => false,
+            });
+        }
+
+        // After an error in a transaction the rest only report it aborted
+        let mut stopped = false;
+        let outcomes = self.connection.pooled().timed_batch(batch.len() as u64, run_pipeline(self.connection.client(), &batch)).await;
+        for (pending, outcome) in batch.iter().zip(outcomes) {
+            if stopped {
+                break;
+            }
+            stopped = self.record(pending.index, outcome)?;
+        }
+        Ok(stopped)
+    }
+}
+
+/// Send a batch without waiting between statements. Each distinct SQL text
+/// is prepared once; tokio-postgres pipelines queries polled together.
+async fn run_pipeline(client: &Client, batch: &[Pending]) -> Vec<Result<WriteOutcome>> {
+    let mut texts: Vec<&str> = Vec::new();
+    let mut seen = HashSet::new();
+    for pending in batch {
+        if seen.insert(pending.write.sql.as_str()) {
+            texts.push(&pending.write.sql);
+        }
+    }
+    let prepared = join_all(texts.iter().map(|sql| client.prepare(sql))).await;
+    let statements: HashMap<&str, std::result::Result<Statement, tokio_postgres::Error>> = texts.into_iter()
+        .zip(prepared)
+        .collect();
+
+    join_all(batch.iter().map(|pending| {
+        let statement = &statements[pending.write.sql.as_str()];
+        async move {
+            let statement = statement.as_ref().map_err(database_error)?;
+            let rows = query_prepared(client, statement, &pending.write.params).await?;
+            pending.kind.outcome(&rows)
+        }
+    }))
+    .await
+}
+
+/// Pipeline an ordered batch in a transaction. On a failure the statements
+/// before it are replayed and committed; returns their outcomes and the
+/// failing position with its error.
+async fn run_ordered(connection: &Checkout<'_>, batch: &[Pending]) -> Result<(Vec<WriteOutcome>, Option<(usize, FauxDBError)>)> {
+    let mut end = batch.len();
+    let mut failure = None;
+    while end > 0 {
+        connection.begin().await?;
+        let mut outcomes = connection.pooled().timed_batch(end as u64, run_pipeline(connection.client(), &batch[..end])).await;
+        match outcomes.iter().position(|outcome| outcome.is_err()) {
+            None => {
+                connection.end(true).await?;
+                return Ok((outcomes.into_iter().collect::<Result<_>>()?, failure));
+            }
+            Some(position) => {
+                connection.end(false).await?;
+                // Statements after the failure only report the aborted transaction
+                if let Some(Err(error)) = outcomes.drain(position..).next() {
+                    failure = Some((position, error));
+                }
+                counter!("fauxdb_bulk_write_replays_total").increment(1);
+                end = position;
+            }
+        }
+    }
+    Ok((Vec::new(), failure))
+}
+
+/// Execute a `bulkWrite` command: mixed inserts, updates and deletes over
+/// the namespaces listed in `nsInfo`
+pub async fn bulk_write_command(target: ConnectionTarget<'_>, layout: &StorageLayout, command: &Document) -> Result<Document> {
+    let invalid = |message: &str| FauxDBError::WireProtocol(message.to_string());
+    let namespaces = command.get_array("nsInfo")
+        .map_err(|_| invalid("Missing nsInfo in bulkWrite command"))?
+        .iter()
+        .map(|entry| entry.as_document()
+            .and_then(|entry| entry.get_str("ns").ok())
+            .and_then(|ns| ns.split_once('.'))
+            .map(|(database, collection)| (database.to_string(), collection.to_string()))
+            .ok_or_else(|| invalid("nsInfo entries must be {ns: \"db.collection\"}")))
+        .collect::<Result<Vec<(String, String)>>>()?;
+    let ordered = command.get_bool("ordered").unwrap_or(true);
+
+    let ops = command.get_array("ops").map_err(|_| invalid("Missing ops in bulkWrite command"))?;
+    let mut models = Vec::with_capacity(ops.len());
+    for op in ops {
+        let op = op.as_document().ok_or_else(|| invalid("bulkWrite ops must be objects"))?;
+        let (kind, target) = op.iter().next().ok_or_else(|| invalid("Empty bulkWrite op"))?;
+        let namespace = match target {
+            Bson::Int32(n) => namespaces.get(*n as usize),
+            Bson::Int64(n) => namespaces.get(*n as usize),
+            _ => None,
+        }
+        .ok_or_else(|| invalid("bulkWrite op refers to an unknown nsInfo index"))?;
+        let filter = || op.get_document("filter").cloned().map_err(|_| invalid("bulkWrite op is missing its filter"));
+
+        let op = match kind.as_str() {
+            "insert" => WriteOp::Insert(op.get_document("document").cloned().map_err(|_| invalid("insert op is missing its document"))?),
+            "update" => WriteOp::Update {
+                filter: filter()?,
+                update: match op.get("updateMods") {
+                    Some(Bson::Document(update)) => update.clone(),
+                    Some(Bson::Array(_)) => return Err(invalid("Pipeline-style updates are not supported")),
+                    _ => return Err(invalid("update op is missing updateMods")),
+                },
+                multi: op.get_bool("multi").unwrap_or(false),
+                upsert: op.get_bool("upsert").unwrap_or(false),
+            },
+            "delete" => WriteOp::Delete { filter: filter()?, multi: op.get_bool("multi").unwrap_or(false) },
+            other => return Err(FauxDBError::WireProtocol(format!("Unknown bulkWrite op: {}", other))),
+        };
+        models.push(WriteModel { database: namespace.0.clone(), collection: namespace.1.clone(), op });
+    }
+
+    let result = execute_bulk_write(target, layout, &models, ordered).await?;
+    Ok(bulk_write_response(&models, &result))
+}
+
+/// Reply for `bulkWrite`: per-op results in a cursor plus totals
+pub fn bulk_write_response(models: &[WriteModel], result: &BulkWriteResult) -> Document {
+    let (mut inserted, mut matched, mut modified, mut upserted, mut deleted) = (0u64, 0u64, 0u64, 0u64, 0u64);
+    let mut replies: Vec<(usize, Document)> = Vec::with_capacity(models.len());
+
+    for (index, outcome) in &result.outcomes {
+        let mut reply = doc! { "ok": 1.0, "idx": *index as i32 };
+        match models[*index].op {
+            WriteOp::Insert(_) => inserted += outcome.n,
+            WriteOp::Update { .. } => {
+                matched += outcome.n;
+                modified += outcome.modified;
+                reply.insert("nModified", outcome.modified as i32);
+            }
+            WriteOp::Delete { .. } => deleted += outcome.n,
+        }
+        let mut n = outcome.n;
+        if let Some(id) = &outcome.upserted {
+            upserted += 1;
+            n += 1;
+            reply.insert("upserted", doc! { "_id": id.clone() });
+        }
+        reply.insert("n", n as i32);
+        replies.push((*index, reply));
+    }
+    for error in &result.write_errors {
+        replies.push((error.index, doc! { "ok": 0.0, "idx": error.index as i32, "code": error.code, "errmsg": error.errmsg.clone() }));
+    }
+    replies.sort_by_key(|(index, _)| *index);
+
+    let first_batch: Vec<Bson> = replies.into_iter().map(|(_, reply)| Bson::Document(reply)).collect();
+    doc! {
+        "cursor": { "id": 0i64, "firstBatch": first_batch, "ns": "admin.$cmd.bulkWrite" },
+        "nErrors": result.write_errors.len() as i32,
+        "nInserted": inserted as i32,
+        "nMatched": matched as i32,
+        "nModified": modified as i32,
+        "nUpserted": upserted as i32,
+        "nDeleted": deleted as i32,
+        "ok": 1.0,
+    }
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file collection_catalog.rs
+ * @brief In-memory catalog of the collection tables that exist
+ *
+ * Finds and writes used to check to_regclass, or run the collection DDL, on
+ * every request. The catalog remembers which tables exist, so a known
+ * collection costs no catalog query. Only existence is cached. A table the
+ * catalog doesn't know is looked up again each time, so a collection created
+ * by another server is seen at once.
+ *
+ * Drops are what make an entry stale. A write that still finds its table
+ * gone forgets it and runs again, which recreates the collection. A
+ * listener connection runs LISTEN on fauxdb_catalog, and every server
+ * forgets the table named in a notification, or everything for "*". Where
+ * the role may create event triggers, one is installed that sends those
+ * notifications for any DROP TABLE in a fauxdb_ schema. The catalog is
+ * reloaded each time the listener connects, so drops missed while it was
+ * down are not kept.
+ */
+
+use crate::connection_pool::PooledConnection;
+use crate::error::{FauxDBError, Result};
+use crate::postgresql_manager::{collection_table, ensure_collection};
+use crate::{fauxdb_debug, fauxdb_info, fauxdb_warn};
+use dashmap::DashSet;
+use futures::StreamExt;
+use metrics::counter;
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::sync::mpsc;
+use tokio_postgres::{AsyncMessage, Client, NoTls};
+
+/// Channel carrying the names of dropped tables
+pub const CATALOG_CHANNEL: &str = "fauxdb_catalog";
+
+/// How long the listener waits before reconnecting
+const RECONNECT_DELAY: Duration = Duration::from_secs(1);
+
+/// Whether a table exists; every pooled connection has it prepared
+pub const LOOKUP_SQL: &str = "SELECT to_regclass($1) IS NOT NULL";
+
+/// Names are quoted the way collection_table quotes them
+const LOAD_SQL: &str = "SELECT format('\"%s\".\"%s\"', replace(schemaname, '\"', '\"\"'), replace(tablename, '\"', '\"\"')) \
+                        FROM pg_tables WHERE schemaname LIKE 'fauxdb\\_%' AND tablename LIKE '%\\_collections'";
+
+const DROP_TRIGGER_SQL: &str = "
+    CREATE OR REPLACE FUNCTION fauxdb_catalog_notify() RETURNS event_trigger LANGUAGE plpgsql AS $$
+    DECLARE
+        dropped record;
+    BEGIN
+        FOR dropped IN SELECT schema_name, object_name FROM pg_event_trigger_dropped_objects()
+                       WHERE object_type = 'table' AND schema_name LIKE 'fauxdb\\_%' LOOP
+            PERFORM pg_notify('fauxdb_catalog', format('\"%s\".\"%s\"',
+                replace(dropped.schema_name, '\"', '\"\"'), replace(dropped.object_name, '\"', '\"\"')));
+        END LOOP;
+    END $$;
+    DO $$ BEGIN
+        IF NOT EXISTS (SELECT 1 FROM pg_event_trigger WHERE evtname = 'fauxdb_catalog_drop') THEN
+            CREATE EVENT TRIGGER fauxdb_catalog_drop ON sql_drop EXECUTE FUNCTION fauxdb_catalog_notify();
+        END IF;
+    END $$;";
+
+#[derive(Debug, Default)]
+pub struct CollectionCatalog {
+    tables: DashSet<String>,
+}
+
+impl CollectionCatalog {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn contains(&self, table: &str) -> bool {
+        self.tables.contains(table)
+    }
+
+    /// Whether a collection table exists, asking PostgreSQL only about
+    /// tables not yet known
+    pub async fn exists(&self, connection: &PooledConnection, table: &str) -> Result<bool> {
+        if self.tables.contains(table) {
+            return Ok(true);
+        }
+        counter!("fauxdb_catalog_misses_total").increment(1);
+        let rows = connection.query_cached(LOOKUP_SQL, &[&table]).await
+            .map_err(|e| FauxDBError::Database(format!("Failed to look up {}: {}", table, e)))?;
+        let exists = rows.first().map_or(false, |row| row.get(0));
+        if exists {
+            self.tables.insert(table.to_string());
+        }
+        Ok(exists)
+    }
+
+    /// Create a collection on first use unless it is already known
+    pub async fn ensure(&self, client: &Client, database: &str, collection: &str) -> Result<()> {
+        let table = collection_table(database, collection);
+        if self.tables.contains(&table) {
+            return Ok(());
+        }
+        counter!("fauxdb_catalog_misses_total").increment(1);
+        ensure_collection(client, database, collection).await?;
+        self.tables.insert(table);
+        Ok(())
+    }
+
+    /// Forget a table, named as collection_table does; "*" forgets every
+    /// table
+    pub fn forget(&self, table: &str) {
+        if table == "*" {
+            self.tables.clear();
+        } else {
+            self.tables.remove(table);
+        }
+    }
+
+    /// Replace the catalog with the collection tables that exist now
+    pub async fn load(&self, client: &Client) -> Result<usize> {
+        let rows = client.query(LOAD_SQL, &[]).await
+            .map_err(|e| FauxDBError::Database(format!("Failed to load collection catalog: {}", e)))?;
+        self.tables.clear();
+        for row in &rows {
+            self.tables.insert(row.get(0));
+        }
+        Ok(rows.len())
+    }
+
+    /// Keep the catalog loaded and follow drop notifications for as long
+    /// as the server runs
+    pub fn listen(self: &Arc<Self>, connection_string: String) {
+        let catalog = self.clone();
+        tokio::spawn(async move {
+            loop {
+                if let Err(e) = catalog.follow(&connection_string).await {
+                    fauxdb_warn!("Collection catalog listener stopped: {}", e);
+                }
+                // Without the listener a drop could go unnoticed
+                catalog.tables.clear();
+                tokio::time::sleep(RECONNECT_DELAY).await;
+            }
+        });
+    }
+
+    async fn follow(&self, connection_string: &str) -> Result<()> {
+        let (client, mut connection) = tokio_postgres::connect(connection_string, NoTls).await
+            .map_err(|e| FauxDBError::Database(format!("Failed to connect catalog listener: {}", e)))?;
+
+        let (sender, mut dropped) = mpsc::unbounded_channel();
+        let driver = tokio::spawn(async move {
+            let mut messages = futures::stream::poll_fn(move |cx| connection.poll_message(cx));
+            while let Some(message) = messages.next().await {
+                match message {
+                    Ok(AsyncMessage::Notification(notification)) => {
+                        if sender.send(notification.payload().to_string()).is_err() {
+                            break;
+                        }
+                    }
+                    Ok(_) => {}
+                    Err(e) => {
+                        fauxdb_warn!("Collection catalog listener connection failed: {}", e);
+                        break;
+                    }
+                }
+            }
+        });
+
+        let result = self.run_listener(&client, &mut dropped).await;
+        driver.abort();
+        result
+    }
+
+    async fn run_listener(&self, client: &Client, dropped: &mut mpsc::UnboundedReceiver<String>) -> Result<()> {
+        client.batch_execute(&format!("LISTEN {}", CATALOG_CHANNEL)).await
+            .map_err(|e| FauxDBError::Database(format!("Failed to LISTEN on {}: {}", CATALOG_CHANNEL, e)))?;
+        if let Err(e) = client.batch_execute(DROP_TRIGGER_SQL).await {
+            fauxdb_warn!("Not installing the catalog drop trigger, drops by other servers go unnoticed until a write fails: {}", e);
+        }
+
+        // Loaded only once listening, so no drop can fall in between
+        let count = self.load(client).await?;
+        fauxdb_info!("Collection catalog loaded with {} collections", count);
+
+        while let Some(table) = dropped.recv().await {
+            fauxdb_debug!("Collection catalog forgetting {}", table);
+            counter!("fauxdb_catalog_invalidations_total").increment(1);
+            self.forget(&table);
+        }
+        Err(FauxDBError::Database("Catalog listener connection closed".to_string()))
+    }
+}
@@ -8,6 +8,7 @@
  * @brief FauxDB configuration management
  */
 
+use crate::document_codec::StorageMode;
 use anyhow::Result;
 use serde::{Deserialize, Serialize};
 use std::path::Path;
@@ -38,6 +39,12 @@ pub struct DatabaseConfig {
     pub connection_timeout_ms: u64,
     pub idle_timeout_ms: u64,
     pub enable_jsonb_extensions: bool,
+    /// Which columns hold documents: jsonb, bson or both
+    #[serde(default)]
+    pub storage_mode: StorageMode,
+    /// Paths kept queryable in JSONB when storage_mode is bson
+    #[serde(default)]
+    pub indexed_paths: Vec<String>,
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -123,6 +130,8 @@ impl Default for Config {
                 connection_timeout_ms: 5000,
                 idle_timeout_ms: 60000,
                 enable_jsonb_extensions: true,
+                storage_mode: StorageMode::default(),
+                indexed_paths: Vec::new(),
             },
             logging: LoggingConfig {
                 level: "info".to_string(),
@@ -1,21 +1,62 @@
 /*!
  * Production-ready connection pool management for FauxDB
+ *
+ * Many client connections share a few PostgreSQL backends, the way
+ * pgbouncer's transaction mode shares them. A command borrows a backend
+ * only while it runs. A multi-document transaction pins one until it ends,
+ * and only `max_pinned` backends may be pinned at once, so open
+ * transactions can't starve plain statements. A borrower that leaves a
+ * transaction block open, because it failed or was cancelled part way, has
+ * its backend rolled back before the next borrower gets it. A backend that
+ * can't be reset is closed. Nothing else outlives a borrow: FauxDB issues no
+ * session-level SET, and prepared statements are either closed when dropped
+ * or kept in the backend's own statement cache.
+ *
+ * Connecting costs a TCP handshake, authentication and often TLS, so the
+ * pool opens `min_idle` connections at startup and a maintenance task keeps
+ * that many idle. Each new connection prepares the statements every backend
+ * runs before the pool hands it out. Connections are closed after
+ * `max_lifetime`, less a jitter of up to a tenth, so the connections opened
+ * together at startup are not all replaced at once.
  */
 
-use deadpool_postgres::{Config, Pool, PoolConfig, Runtime};
-use tokio_postgres::{NoTls, Row};
-use std::time::Duration;
+use deadpool_postgres::{Config, Hook, HookError, Pool, PoolConfig, Runtime, Timeouts};
+use tokio_postgres::{NoTls, Row, Statement};
+use tokio_postgres::types::ToSql;
+use futures::future::join_all;
+use std::collections::hash_map::DefaultHasher;
+use std::future::Future;
+use std::hash::{Hash, Hasher};
+use std::time::{Duration, Instant};
 use std::sync::Arc;
-use parking_lot::RwLock;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use crossbeam::utils::CachePadded;
+use tokio::sync::{OwnedSemaphorePermit, Semaphore};
 use metrics::{counter, histogram, gauge};
 use crate::FauxDBError;
+use crate::collection_catalog::{CollectionCatalog, LOOKUP_SQL};
+use crate::latency_histogram::LatencyHistogram;
 use anyhow::Result;
-use crate::fauxdb_info;
+use crate::{fauxdb_info, fauxdb_warn};
+
+/// How long rolling back a backend handed back mid-transaction may take
+const RESET_TIMEOUT: Duration = Duration::from_secs(5);
+
+const HEALTH_CHECK_SQL: &str = "SELECT 1 as health_check";
+
+/// Prepared on every new connection before it joins the pool
+const PRIMED_STATEMENTS: &[&str] = &[LOOKUP_SQL, HEALTH_CHECK_SQL];
+
+/// How often idle connections are rotated and topped up
+const MAINTENANCE_INTERVAL: Duration = Duration::from_secs(10);
 
 pub struct ProductionConnectionPool {
     pub pool: Pool,
     config: Arc<ProductionPoolConfig>,
     stats: Arc<PoolStats>,
+    catalog: Arc<CollectionCatalog>,
+    /// Backends transactions may still pin
+    pinned: Arc<Semaphore>,
 }
 
 #[derive(Debug, Clone)]
@@ -26,16 +67,42 @@ pub struct ProductionPoolConfig {
     pub idle_timeout: Duration,
     pub connection_timeout: Duration,
     pub statement_cache_size: usize,
+    /// Backends transactions may hold at once; the rest serve statements
+    pub max_pinned: u32,
 }
 
+/// Updated on every checkout and query, so each counter is an atomic on a
+/// cache line of its own and the histograms are lock-free. Connection
+/// counts come from the pool itself when a snapshot is taken.
 #[derive(Debug, Default)]
 pub struct PoolStats {
-    pub total_connections: RwLock<u64>,
-    pub active_connections: RwLock<u64>,
-    pub idle_connections: RwLock<u64>,
-    pub connection_errors: RwLock<u64>,
-    pub query_count: RwLock<u64>,
-    pub avg_query_time: RwLock<f64>,
+    pub checkouts: CachePadded<AtomicU64>,
+    pub active_connections: CachePadded<AtomicU64>,
+    pub connection_errors: CachePadded<AtomicU64>,
+    pub query_count: CachePadded<AtomicU64>,
+    /// Backends rolled back or closed on handoff
+    pub resets: CachePadded<AtomicU64>,
+    /// Time spent waiting for a connection
+    pub wait_time: LatencyHistogram,
+    /// Time a connection stays checked out
+    pub hold_time: LatencyHistogram,
+    pub query_time: LatencyHistogram,
+}
+
+impl PoolStats {
+    fn record_query(&self, start_time: Instant) {
+        self.record_queries(start_time, 1);
+    }
+
+    /// `statements` sent together count once each toward the total, and
+    /// once in the latency histograms
+    fn record_queries(&self, start_time: Instant, statements: u64) {
+        let query_time = start_time.elapsed();
+        self.query_time.record(query_time);
+        self.query_count.fetch_add(statements, Ordering::Relaxed);
+        histogram!("fauxdb_query_duration_seconds").record(query_time.as_secs_f64());
+        counter!("fauxdb_queries_total").increment(statements);
+    }
 }
 
 impl Default for ProductionPoolConfig {
@@ -47,6 +114,7 @@ impl Default for ProductionPoolConfig {
             idle_timeout: Duration::from_secs(600),
             connection_timeout: Duration::from_secs(10),
             statement_cache_size: 1000,
+            max_pinned: 15,
         }
     }
 }
@@ -61,76 +129,218 @@ impl ProductionConnectionPool {
         let mut pg_config = Config::new();
         pg_config.url = Some(connection_string.to_string());
         
-        let pool_config = PoolConfig::new(config.max_size as usize);
+        let mut pool_config = PoolConfig::new(config.max_size as usize);
+        // Fail a checkout rather than queue it forever when every backend is busy
+        pool_config.timeouts.wait = Some(config.connection_timeout);
+        pool_config.timeouts.create = Some(config.connection_timeout);
         
         pg_config.pool = Some(pool_config);
 
         let pool = pg_config
-            .create_pool(Some(Runtime::Tokio1), NoTls)
+            .builder(NoTls)
+            .map_err(|e| anyhow::anyhow!("Failed to create connection pool: {}", e))?
+            .runtime(Runtime::Tokio1)
+            .post_create(Hook::async_fn(|client, _| Box::pin(async move {
+                let primed = join_all(PRIMED_STATEMENTS.iter().map(|sql| client.prepare_cached(sql))).await;
+                primed.into_iter().try_for_each(|statement| statement.map(drop)).map_err(HookError::Backend)
+            })))
+            .build()
             .map_err(|e| anyhow::anyhow!("Failed to create connection pool: {}", e))?;
 
-        // Test the connection
-        let test_client = pool.get().await
-            .map_err(|e| anyhow::anyhow!("Failed to get test connection: {}", e))?;
-        
-        test_client.execute("SELECT 1", &[]).await
+        // Open min_idle connections now so the first requests don't pay for
+        // connecting; holding them all at once makes each one a new connection
+        let prewarm = (config.min_idle as usize).clamp(1, config.max_size as usize);
+        let connections = join_all((0..prewarm).map(|_| pool.get())).await
+            .into_iter()
+            .collect::<std::result::Result<Vec<_>, _>>()
+            .map_err(|e| anyhow::anyhow!("Failed to open initial connections: {}", e))?;
+        connections[0].execute(HEALTH_CHECK_SQL, &[]).await
             .map_err(|e| anyhow::anyhow!("Failed to execute test query: {}", e))?;
+        drop(connections);
 
-        fauxdb_info!("Connection pool initialized successfully with {} max connections", config.max_size);
+        fauxdb_info!("Connection pool initialized successfully with {} max connections, {} opened", config.max_size, prewarm);
 
+        let max_pinned = config.max_pinned.clamp(1, config.max_size) as usize;
         Ok(Self {
             pool,
             config: Arc::new(config),
             stats: Arc::new(PoolStats::default()),
+            catalog: Arc::new(CollectionCatalog::new()),
+            pinned: Arc::new(Semaphore::new(max_pinned)),
         })
     }
 
     pub async fn get_connection(&self) -> Result<PooledConnection> {
-        let start_time = std::time::Instant::now();
+        let start_time = Instant::now();
         
         let client = self.pool.get().await
             .map_err(|e| {
-                *self.stats.connection_errors.write() += 1;
+                self.stats.connection_errors.fetch_add(1, Ordering::Relaxed);
                 counter!("fauxdb_pool_connection_errors_total").increment(1);
                 anyhow::anyhow!("Failed to get connection from pool: {}", e)
             })?;
 
-        let connection_time = start_time.duration_since(start_time);
+        Ok(self.checked_out(client, start_time))
+    }
+
+    /// A connection only if one is idle or can be opened, without waiting
+    /// for another borrower to hand one back
+    pub async fn try_get_connection(&self) -> Option<PooledConnection> {
+        let start_time = Instant::now();
+        let timeouts = Timeouts {
+            wait: Some(Duration::ZERO),
+            create: Some(self.config.connection_timeout),
+            recycle: None,
+        };
+        let client = self.pool.timeout_get(&timeouts).await.ok()?;
+        Some(self.checked_out(client, start_time))
+    }
+
+    fn checked_out(&self, client: deadpool_postgres::Object, start_time: Instant) -> PooledConnection {
+        let connection_time = start_time.elapsed();
+        self.stats.wait_time.record(connection_time);
         histogram!("fauxdb_pool_connection_time_seconds").record(connection_time.as_secs_f64());
 
-        *self.stats.active_connections.write() += 1;
-        gauge!("fauxdb_pool_active_connections").set(*self.stats.active_connections.read() as f64);
+        self.stats.checkouts.fetch_add(1, Ordering::Relaxed);
+        let active = self.stats.active_connections.fetch_add(1, Ordering::Relaxed) + 1;
+        gauge!("fauxdb_pool_active_connections").set(active as f64);
+        self.record_saturation();
 
-        Ok(PooledConnection {
-            client,
+        PooledConnection {
+            client: Some(client),
+            statement_cache_size: self.config.statement_cache_size,
             stats: Arc::clone(&self.stats),
-        })
+            checked_out: Instant::now(),
+            open_transaction: AtomicBool::new(false),
+            pin: None,
+        }
+    }
+
+    /// A backend for a transaction to hold across statements. None when no
+    /// pin was free within the connection timeout.
+    pub async fn get_pinned_connection(&self) -> Result<Option<PooledConnection>> {
+        let permit = match tokio::time::timeout(self.config.connection_timeout, self.pinned.clone().acquire_owned()).await {
+            Ok(permit) => permit.map_err(|e| anyhow::anyhow!("Pinned connection budget closed: {}", e))?,
+            Err(_) => {
+                counter!("fauxdb_pool_pin_timeouts_total").increment(1);
+                return Ok(None);
+            }
+        };
+        let mut connection = self.get_connection().await?;
+        connection.pin = Some(permit);
+        gauge!("fauxdb_pool_pinned").set(self.pinned_connections() as f64);
+        Ok(Some(connection))
+    }
+
+    fn pinned_connections(&self) -> u64 {
+        let max_pinned = self.config.max_pinned.clamp(1, self.config.max_size) as usize;
+        max_pinned.saturating_sub(self.pinned.available_permits()) as u64
+    }
+
+    /// Gauges that show when the pool, not PostgreSQL, is the bottleneck
+    fn record_saturation(&self) {
+        let status = self.pool.status();
+        let in_use = status.size.saturating_sub(status.available);
+        gauge!("fauxdb_pool_waiting").set(status.waiting as f64);
+        gauge!("fauxdb_pool_in_use").set(in_use as f64);
+        if status.max_size > 0 {
+            gauge!("fauxdb_pool_saturation").set(in_use as f64 / status.max_size as f64);
+        }
+    }
+
+    /// Rotate and top up idle connections for as long as the server runs
+    pub fn start_maintenance(self: &Arc<Self>) {
+        let pool = self.clone();
+        tokio::spawn(async move {
+            loop {
+                tokio::time::sleep(MAINTENANCE_INTERVAL).await;
+                pool.close_expired();
+                pool.top_up().await;
+            }
+        });
+    }
+
+    /// Close idle connections past their jittered lifetime, and those idle
+    /// longer than idle_timeout beyond the min_idle kept
+    fn close_expired(&self) {
+        let min_idle = self.config.min_idle as usize;
+        let kept = AtomicUsize::new(0);
+        let rotated = AtomicUsize::new(0);
+        let closed = AtomicUsize::new(0);
+        self.pool.retain(|_, metrics| {
+            if metrics.age() >= jittered_lifetime(self.config.max_lifetime, metrics.created) {
+                rotated.fetch_add(1, Ordering::Relaxed);
+                return false;
+            }
+            if metrics.last_used() >= self.config.idle_timeout && kept.load(Ordering::Relaxed) >= min_idle {
+                closed.fetch_add(1, Ordering::Relaxed);
+                return false;
+            }
+            kept.fetch_add(1, Ordering::Relaxed);
+            true
+        });
+        counter!("fauxdb_pool_rotated_total").increment(rotated.into_inner() as u64);
+        counter!("fauxdb_pool_idle_closed_total").increment(closed.into_inner() as u64);
+    }
+
+    /// Open the connections missing for min_idle to be idle again. The pool
+    /// hands out idle connections before it opens any, so the idle ones are
+    /// held for the moment it takes to open the missing ones.
+    async fn top_up(&self) {
+        let status = self.pool.status();
+        let min_idle = self.config.min_idle as usize;
+        if status.available >= min_idle {
+            return;
+        }
+        let missing = (min_idle - status.available).min(status.max_size.saturating_sub(status.size));
+        if missing == 0 {
+            return;
+        }
+        let connections = join_all((0..status.available + missing).map(|_| self.pool.get())).await;
+        let opened = connections.iter().filter(|connection| connection.is_ok()).count().saturating_sub(status.available);
+        if let Some(Err(e)) = connections.iter().find(|connection| connection.is_err()) {
+            fauxdb_warn!("Topping up idle connections failed: {}", e);
+        }
+        counter!("fauxdb_pool_topped_up_total").increment(opened as u64);
+    }
+
+    /// Collection tables known to exist in this pool's database
+    pub fn catalog(&self) -> &Arc<CollectionCatalog> {
+        &self.catalog
     }
 
     pub fn get_stats(&self) -> PoolStatsSnapshot {
+        let status = self.pool.status();
         PoolStatsSnapshot {
-            total_connections: *self.stats.total_connections.read(),
-            active_connections: *self.stats.active_connections.read(),
-            idle_connections: *self.stats.idle_connections.read(),
-            connection_errors: *self.stats.connection_errors.read(),
-            query_count: *self.stats.query_count.read(),
-            avg_query_time: *self.stats.avg_query_time.read(),
+            total_connections: status.size as u64,
+            active_connections: self.stats.active_connections.load(Ordering::Relaxed),
+            idle_connections: status.available as u64,
+            waiting_clients: status.waiting as u64,
+            pinned_connections: self.pinned_connections(),
+            resets: self.stats.resets.load(Ordering::Relaxed),
+            checkouts: self.stats.checkouts.load(Ordering::Relaxed),
+            connection_errors: self.stats.connection_errors.load(Ordering::Relaxed),
+            query_count: self.stats.query_count.load(Ordering::Relaxed),
+            avg_query_time: self.stats.query_time.mean().as_secs_f64(),
+            wait_p50: self.stats.wait_time.percentile(0.5),
+            wait_p99: self.stats.wait_time.percentile(0.99),
+            wait_max: self.stats.wait_time.max(),
+            hold_p99: self.stats.hold_time.percentile(0.99),
+            query_p99: self.stats.query_time.percentile(0.99),
             pool_size: self.config.max_size,
             pool_idle: self.config.min_idle,
         }
     }
 
     pub async fn health_check(&self) -> Result<()> {
-        use std::time::Instant;
-        
         let start_time = Instant::now();
         
         // Get a connection from the pool
-        let mut client = self.get_connection().await
+        let client = self.get_connection().await
             .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get connection for health check: {}", e)))?;
         
         // Execute a simple query to verify the connection is alive
-        client.execute("SELECT 1 as health_check", &[])
+        client.query_cached(HEALTH_CHECK_SQL, &[])
             .await
             .map_err(|e| FauxDBError::ConnectionPool(format!("Health check query failed: {}", e)))?;
         
@@ -139,75 +349,106 @@ impl ProductionConnectionPool {
         // Log health check results
         println!("💚 Connection pool health check passed in {:?}", duration);
         
-        // Update health check statistics
-        *self.stats.query_count.write() += 1;
         
         Ok(())
     }
 }
 
 pub struct PooledConnection {
-    client: deadpool_postgres::Object,
+    /// Taken only when dropped
+    client: Option<deadpool_postgres::Object>,
+    statement_cache_size: usize,
     stats: Arc<PoolStats>,
+    checked_out: Instant,
+    /// A transaction block is open on the backend
+    open_transaction: AtomicBool,
+    /// Held while a transaction pins this backend
+    pin: Option<OwnedSemaphorePermit>,
 }
 
 impl PooledConnection {
+    /// Underlying client, for protocol features the wrappers below don't
+    /// cover, such as COPY
+    pub fn client(&self) -> &tokio_postgres::Client {
+        self.client.as_ref().expect("connection already returned to the pool")
+    }
+
+    /// A statement prepared once per backend and kept in its cache. The
+    /// cache is emptied when it outgrows statement_cache_size.
+    pub async fn prepare_cached(&self, sql: &str) -> std::result::Result<Statement, tokio_postgres::Error> {
+        let client = self.client.as_ref().expect("connection already returned to the pool");
+        if client.statement_cache.size() >= self.statement_cache_size {
+            client.statement_cache.clear();
+        }
+        client.prepare_cached(sql).await
+    }
+
+    /// `query` with a statement from the backend's cache
+    pub async fn query_cached(&self, sql: &str, params: &[&(dyn ToSql + Sync)]) -> std::result::Result<Vec<Row>, tokio_postgres::Error> {
+        let start_time = Instant::now();
+        let statement = self.prepare_cached(sql).await?;
+        let result = self.client().query(&statement, params).await;
+        self.stats.record_query(start_time);
+        result
+    }
+
+    /// Await a statement issued through `client()`, recording it in the
+    /// query stats as `query` does
+    pub async fn timed<T>(&self, statement: impl Future<Output = T>) -> T {
+        self.timed_batch(1, statement).await
+    }
+
+    /// Like `timed`, for `statements` pipelined together
+    pub async fn timed_batch<T>(&self, statements: u64, batch: impl Future<Output = T>) -> T {
+        let start_time = Instant::now();
+        let result = batch.await;
+        self.stats.record_queries(start_time, statements);
+        result
+    }
+
+    /// Open a transaction block with `sql`. Until `end` succeeds the
+    /// backend is rolled back before anyone else borrows it.
+    pub async fn begin(&self, sql: &str) -> std::result::Result<(), tokio_postgres::Error> {
+        self.open_transaction.store(true, Ordering::Relaxed);
+        self.client().batch_execute(sql).await
+    }
+
+    /// Close the transaction block with COMMIT or ROLLBACK
+    pub async fn end(&self, sql: &str) -> std::result::Result<(), tokio_postgres::Error> {
+        self.client().batch_execute(sql).await?;
+        self.open_transaction.store(false, Ordering::Relaxed);
+        Ok(())
+    }
+
     pub async fn execute(&mut self, query: &str, params: &[&(dyn tokio_postgres::types::ToSql + Sync)]) -> Result<u64> {
-        let start_time = std::time::Instant::now();
+        let start_time = Instant::now();
         
-        let result = self.client.execute(query, params).await
+        let result = self.client().execute(query, params).await
             .map_err(|e| anyhow::anyhow!("Query execution failed: {}", e))?;
 
-        let query_time = start_time.duration_since(start_time);
-        histogram!("fauxdb_query_duration_seconds").record(query_time.as_secs_f64());
-
-        *self.stats.query_count.write() += 1;
-        counter!("fauxdb_queries_total").increment(1);
-
-        // Update average query time
-        let mut avg_time = self.stats.avg_query_time.write();
-        let count = *self.stats.query_count.read();
-        *avg_time = (*avg_time * (count - 1) as f64 + query_time.as_secs_f64()) / count as f64;
+        self.stats.record_query(start_time);
 
         Ok(result)
     }
 
     pub async fn query(&mut self, query: &str, params: &[&(dyn tokio_postgres::types::ToSql + Sync)]) -> Result<Vec<Row>> {
-        let start_time = std::time::Instant::now();
+        let start_time = Instant::now();
         
-        let result = self.client.query(query, params).await
+        let result = self.client().query(query, params).await
             .map_err(|e| anyhow::anyhow!("Query execution failed: {}", e))?;
 
-        let query_time = start_time.duration_since(start_time);
-        histogram!("fauxdb_query_duration_seconds").record(query_time.as_secs_f64());
-
-        *self.stats.query_count.write() += 1;
-        counter!("fauxdb_queries_total").increment(1);
-
-        // Update average query time
-        let mut avg_time = self.stats.avg_query_time.write();
-        let count = *self.stats.query_count.read();
-        *avg_time = (*avg_time * (count - 1) as f64 + query_time.as_secs_f64()) / count as f64;
+        self.stats.record_query(start_time);
 
         Ok(result)
     }
 
     pub async fn query_one(&mut self, query: &str, params: &[&(dyn tokio_postgres::types::ToSql + Sync)]) -> Result<Row> {
-        let start_time = std::time::Instant::now();
+        let start_time = Instant::now();
         
-        let result = self.client.query_one(query, params).await
+        let result = self.client().query_one(query, params).await
             .map_err(|e| anyhow::anyhow!("Query execution failed: {}", e))?;
 
-        let query_time = start_time.duration_since(start_time);
-        histogram!("fauxdb_query_duration_seconds").record(query_time.as_secs_f64());
-
-        *self.stats.query_count.write() += 1;
-        counter!("fauxdb_queries_total").increment(1);
-
-        // Update average query time
-        let mut avg_time = self.stats.avg_query_time.write();
-        let count = *self.stats.query_count.read();
-        *avg_time = (*avg_time * (count - 1) as f64 + query_time.as_secs_f64()) / count as f64;
+        self.stats.record_query(start_time);
 
         Ok(result)
     }
@@ -215,19 +456,69 @@ impl PooledConnection {
 
 impl Drop for PooledConnection {
     fn drop(&mut self) {
-        *self.stats.active_connections.write() -= 1;
-        gauge!("fauxdb_pool_active_connections").set(*self.stats.active_connections.read() as f64);
+        self.stats.hold_time.record(self.checked_out.elapsed());
+        let active = self.stats.active_connections.fetch_sub(1, Ordering::Relaxed) - 1;
+        gauge!("fauxdb_pool_active_connections").set(active as f64);
+        if self.open_transaction.load(Ordering::Relaxed) {
+            if let Some(client) = self.client.take() {
+                self.stats.resets.fetch_add(1, Ordering::Relaxed);
+                reset_on_handoff(client);
+            }
+        }
     }
 }
 
+/// A connection's lifetime, cut by up to a tenth. The cut is keyed on when
+/// the connection was opened, so it stays the same between checks.
+fn jittered_lifetime(max_lifetime: Duration, created: Instant) -> Duration {
+    let mut hasher = DefaultHasher::new();
+    created.hash(&mut hasher);
+    let jitter = (hasher.finish() % 1000) as f64 / 1000.0;
+    max_lifetime - (max_lifetime / 10).mul_f64(jitter)
+}
+
+/// Roll back a backend handed back inside a transaction block before it
+/// returns to the pool, or close it if that fails
+fn reset_on_handoff(client: deadpool_postgres::Object) {
+    counter!("fauxdb_pool_resets_total").increment(1);
+    let Ok(runtime) = tokio::runtime::Handle::try_current() else {
+        drop(deadpool_postgres::Object::take(client));
+        return;
+    };
+    runtime.spawn(async move {
+        match tokio::time::timeout(RESET_TIMEOUT, client.batch_execute("ROLLBACK")).await {
+            Ok(Ok(())) => {}
+            Ok(Err(e)) => {
+                fauxdb_warn!("Closing a backend that could not be rolled back: {}", e);
+                drop(deadpool_postgres::Object::take(client));
+            }
+            Err(_) => {
+                fauxdb_warn!("Closing a backend that did not roll back within {:?}", RESET_TIMEOUT);
+                drop(deadpool_postgres::Object::take(client));
+            }
+        }
+    });
+}
+
 #[derive(Debug, Clone)]
 pub struct PoolStatsSnapshot {
     pub total_connections: u64,
     pub active_connections: u64,
     pub idle_connections: u64,
+    /// Checkouts queued for a free connection right now
+    pub waiting_clients: u64,
+    /// Backends held by open transactions
+    pub pinned_connections: u64,
+    pub resets: u64,
+    pub checkouts: u64,
     pub connection_errors: u64,
     pub query_count: u64,
     pub avg_query_time: f64,
+    pub wait_p50: Duration,
+    pub wait_p99: Duration,
+    pub wait_max: Duration,
+    pub hold_p99: Duration,
+    pub query_p99: Duration,
     pub pool_size: u32,
     pub pool_idle: u32,
 }
@@ -235,9 +526,12 @@ pub struct PoolStatsSnapshot {
 impl std::fmt::Display for PoolStatsSnapshot {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
         write!(f, 
-            "Pool Stats: active={}, idle={}, total={}, errors={}, queries={}, avg_time={:.3}s, pool_size={}, pool_idle={}",
-            self.active_connections, self.idle_connections, self.total_connections,
+            "Pool Stats: active={}, idle={}, total={}, waiting={}, pinned={}, resets={}, errors={}, queries={}, avg_time={:.3}s, \
+             wait_p50={:?}, wait_p99={:?}, wait_max={:?}, hold_p99={:?}, query_p99={:?}, pool_size={}, pool_idle={}",
+            self.active_connections, self.idle_connections, self.total_connections, self.waiting_clients,
+            self.pinned_connections, self.resets,
             self.connection_errors, self.query_count, self.avg_query_time,
+            self.wait_p50, self.wait_p99, self.wait_max, self.hold_p99, self.query_p99,
             self.pool_size, self.pool_idle
         )
     }
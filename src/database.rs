@@ -126,7 +126,12 @@ impl DatabaseManager {
         }
 
         if existing_docs.is_empty() && upsert {
-            self.insert_document(collection, update).await?;
+            // The inserted document keeps the filter's equality fields and _id
+            let mut seeded = crate::update::upsert_seed(filter, update);
+            for (key, value) in update.iter() {
+                seeded.insert(key, value.clone());
+            }
+            self.insert_document(collection, &seeded).await?;
             updated_count += 1;
         }
 
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file delete.rs
+ * @brief delete command over the collection tables
+ *
+ * A delete statement whose filter SQL can evaluate runs as one DELETE that
+ * returns its count. Filters with clauses left for the in-process predicate
+ * select the matching ids first and delete by id.
+ */
+
+use crate::bulk_write::{PlannedWrite, WriteModel, WriteOp};
+use crate::document_codec::StorageLayout;
+use crate::error::{FauxDBError, Result};
+use crate::fauxdb_debug;
+use crate::find::{document_columns, pushdown_filter, row_document};
+use crate::predicate::CompiledPredicate;
+use crate::transactions::ConnectionTarget;
+use crate::update::{execute_bulk_write_retrying, query, where_clause};
+use bson::{doc, Bson, Document};
+use metrics::counter;
+use tokio_postgres::Client;
+
+fn invalid(message: &str) -> FauxDBError {
+    FauxDBError::WireProtocol(message.to_string())
+}
+
+/// The single statement for a delete, or None when part of its filter has
+/// to be matched in process first
+pub fn plan_delete(table: &str, layout: &StorageLayout, filter: &Document, multi: bool) -> Option<PlannedWrite> {
+    let mut params = Vec::new();
+    let (conditions, residual) = pushdown_filter(filter, layout, &mut params);
+    if residual.is_some() {
+        return None;
+    }
+    Some(PlannedWrite { sql: delete_sql(table, &conditions, multi), params })
+}
+
+fn delete_sql(table: &str, conditions: &[String], multi: bool) -> String {
+    let target = if multi {
+        where_clause(conditions)
+    } else {
+        // By primary key: a row locked after the snapshot may be a newer version
+        format!("id = (SELECT id FROM {} WHERE {} ORDER BY id LIMIT 1 FOR UPDATE)", table, where_clause(conditions))
+    };
+    format!("WITH deleted AS (DELETE FROM {} WHERE {} RETURNING 1) SELECT count(*) FROM deleted", table, target)
+}
+
+/// Deleted count from the row a delete statement returns
+pub fn deleted_count(row: &tokio_postgres::Row) -> u64 {
+    row.get::<_, i64>(0) as u64
+}
+
+/// Run one delete statement, matching residual clauses in process first
+pub async fn execute_delete(client: &Client, table: &str, layout: &StorageLayout, filter: &Document, multi: bool) -> Result<u64> {
+    let mut params = Vec::new();
+    let (mut conditions, residual) = pushdown_filter(filter, layout, &mut params);
+
+    let mut ids = None;
+    if let Some(residual) = residual {
+        let predicate = CompiledPredicate::compile(&residual)?;
+        let sql = format!("SELECT {}, id FROM {} WHERE {} ORDER BY id", document_columns(layout), table, where_clause(&conditions));
+        let rows = query(client, &sql, &params, None).await?;
+
+        let mut matching = Vec::new();
+        for row in &rows {
+            if predicate.matches(&row_document(row)?) {
+                matching.push(row.get::<_, i32>(2));
+                if !multi {
+                    break;
+                }
+            }
+        }
+        if matching.is_empty() {
+            return Ok(0);
+        }
+        conditions.push(format!("id = ANY(${})", params.len() + 1));
+        ids = Some(matching);
+    }
+
+    let sql = delete_sql(table, &conditions, multi);
+    fauxdb_debug!("Running {}", sql);
+    let rows = query(client, &sql, &params, ids.as_ref()).await?;
+    let row = rows.first().ok_or_else(|| FauxDBError::Database("DELETE returned no count".to_string()))?;
+    let deleted = deleted_count(row);
+    counter!("fauxdb_delete_documents_total").increment(deleted);
+    Ok(deleted)
+}
+
+/// Execute a `delete` command
+pub async fn delete_command(target: ConnectionTarget<'_>, layout: &StorageLayout, command: &Document) -> Result<Document> {
+    let collection = command.get_str("delete")
+        .map_err(|_| invalid("Missing collection in delete command"))?;
+    let database = command.get_str("$db").unwrap_or("fauxdb");
+    let ordered = command.get_bool("ordered").unwrap_or(true);
+    let models = command.get_array("deletes")
+        .map_err(|_| invalid("Missing deletes in delete command"))?
+        .iter()
+        .map(|statement| {
+            let statement = statement.as_document()
+                .ok_or_else(|| invalid("delete statements must be objects"))?;
+            let filter = statement.get_document("q")
+                .map_err(|_| invalid("Missing query in delete"))?;
+            // limit 0 deletes every match, limit 1 the first
+            let multi = match statement.get("limit") {
+                Some(Bson::Int32(0)) | Some(Bson::Int64(0)) => true,
+                Some(Bson::Int32(1)) | Some(Bson::Int64(1)) => false,
+                Some(Bson::Double(limit)) if *limit == 0.0 || *limit == 1.0 => *limit == 0.0,
+                _ => return Err(invalid("The limit field in delete objects must be 0 or 1")),
+            };
+            let op = WriteOp::Delete { filter: filter.clone(), multi };
+            Ok(WriteModel { database: database.to_string(), collection: collection.to_string(), op })
+        })
+        .collect::<Result<Vec<WriteModel>>>()?;
+
+    let result = execute_bulk_write_retrying(target, layout, &models, ordered).await?;
+
+    let deleted: u64 = result.outcomes.iter().map(|(_, outcome)| outcome.n).sum();
+    let mut response = doc! { "n": deleted as i64, "ok": 1.0 };
+    result.append_write_errors(&mut response);
+    Ok(response)
+}
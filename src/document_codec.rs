@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file document_codec.rs
+ * @brief Storage modes and the BSON <-> JSONB document codec
+ *
+ * Documents are serialized to BSON once; the JSONB text is produced by a
+ * single walk over those raw bytes. Types JSON cannot express are written as
+ * one-key tag objects ({"$oid": ...}, {"$date": ...}, ...) so a JSONB-only
+ * collection still round-trips them.
+ */
+
+use crate::error::{FauxDBError, Result};
+use base64::Engine;
+use bson::oid::ObjectId;
+use bson::raw::{RawArray, RawBsonRef, RawDocument};
+use bson::spec::BinarySubtype;
+use bson::{Binary, Bson, DateTime, Decimal128, Document, JavaScriptCodeWithScope, Regex, Timestamp};
+use bytes::{BufMut, BytesMut};
+use serde::{Deserialize, Serialize};
+use serde_json::{Map, Value};
+use std::fmt::Write;
+use tokio_postgres::types::{to_sql_checked, IsNull, ToSql, Type};
+
+/// Which of a collection's columns hold the document
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default, Serialize, Deserialize)]
+#[serde(rename_all = "snake_case")]
+pub enum StorageMode {
+    /// Tagged JSON in `document` only
+    Jsonb,
+    /// Raw BSON in `bson_document`; `document` holds only `_id` and the
+    /// indexed paths
+    Bson,
+    /// Both columns, as collections were originally laid out. An update
+    /// rewrites only `document` and clears `bson_document`, so updated
+    /// documents are read back from JSONB: Int64 values that fit an Int32
+    /// come back as Int32, and fields in JSONB's key order.
+    #[default]
+    Both,
+}
+
+/// Storage mode plus the paths kept queryable in JSONB under `StorageMode::Bson`
+#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+pub struct StorageLayout {
+    pub mode: StorageMode,
+    pub indexed_paths: Vec<String>,
+}
+
+/// Column values for one document; `None` is written as NULL
+#[derive(Debug, Clone)]
+pub struct EncodedDocument {
+    pub jsonb: Option<String>,
+    pub bson: Option<Vec<u8>>,
+    /// Size of the BSON encoding, whether or not it is stored
+    pub bson_size: usize,
+}
+
+impl StorageLayout {
+    pub fn new(mode: StorageMode, indexed_paths: Vec<String>) -> Self {
+        Self { mode, indexed_paths }
+    }
+
+    /// Whether reads should come from `bson_document`
+    pub fn reads_bson(&self) -> bool {
+        self.mode != StorageMode::Jsonb
+    }
+
+    pub fn encode(&self, document: &Document) -> Result<EncodedDocument> {
+        let mut bytes = Vec::with_capacity(256);
+        document.to_writer(&mut bytes)?;
+        let raw = RawDocument::from_bytes(&bytes).map_err(invalid_bson)?;
+
+        let jsonb = match self.mode {
+            StorageMode::Jsonb | StorageMode::Both => Some(raw_to_json(raw, None)?),
+            StorageMode::Bson => {
+                // `_id` always goes to JSONB: the unique index is on document->'_id'
+                let paths: Vec<&str> = std::iter::once("_id")
+                    .chain(self.indexed_paths.iter().map(String::as_str).filter(|path| *path != "_id"))
+                    .collect();
+                Some(raw_to_json(raw, Some(&paths))?)
+            }
+        };
+        let bson_size = bytes.len();
+        let bson = match self.mode {
+            StorageMode::Jsonb => None,
+            StorageMode::Bson | StorageMode::Both => Some(bytes),
+        };
+
+        Ok(EncodedDocument { jsonb, bson, bson_size })
+    }
+}
+
+fn invalid_bson(e: bson::raw::Error) -> FauxDBError {
+    FauxDBError::WireProtocol(format!("Invalid BSON: {}", e))
+}
+
+/// Render raw BSON as tagged JSON text. With `paths`, only those dotted
+/// paths (and the objects leading to them) are written.
+pub fn raw_to_json(raw: &RawDocument, paths: Option<&[&str]>) -> Result<String> {
+    let mut out = String::with_capacity(raw.as_bytes().len() + raw.as_bytes().len() / 4);
+    write_document(raw, paths, &mut out)?;
+    Ok(out)
+}
+
+fn write_document(raw: &RawDocument, paths: Option<&[&str]>, out: &mut String) -> Result<()> {
+    out.push('{');
+    let mut first = true;
+    for element in raw.iter() {
+        let (key, value) = element.map_err(invalid_bson)?;
+
+        let nested: Vec<&str>;
+        let value_paths = match paths {
+            None => None,
+            Some(paths) if paths.contains(&key) => None,
+            Some(paths) => {
+                nested = paths.iter()
+                    .filter_map(|path| path.strip_prefix(key).and_then(|rest| rest.strip_prefix('.')))
+                    .collect();
+                if nested.is_empty() || !matches!(value, RawBsonRef::Document(_)) {
+                    continue;
+                }
+                Some(nested.as_slice())
+            }
+        };
+
+        if !first {
+            out.push(',');
+        }
+        first = false;
+        write_string(key, out);
+        out.push(':');
+        match (value, value_paths) {
+            (RawBsonRef::Document(doc), Some(nested)) => write_document(doc, Some(nested), out)?,
+            _ => write_value(value, out)?,
+        }
+    }
+    out.push('}');
+    Ok(())
+}
+
+fn write_array(array: &RawArray, out: &mut String) -> Result<()> {
+    out.push('[');
+    for (i, value) in array.into_iter().enumerate() {
+        if i > 0 {
+            out.push(',');
+        }
+        write_value(value.map_err(invalid_bson)?, out)?;
+    }
+    out.push(']');
+    Ok(())
+}
+
+fn write_value(value: RawBsonRef<'_>, out: &mut String) -> Result<()> {
+    match value {
+        RawBsonRef::Null => out.push_str("null"),
+        RawBsonRef::Boolean(b) => out.push_str(if b { "true" } else { "false" }),
+        RawBsonRef::Int32(i) => { let _ = write!(out, "{}", i); }
+        RawBsonRef::Int64(i) => { let _ = write!(out, "{}", i); }
+        RawBsonRef::Double(d) => write_double(d, out),
+        RawBsonRef::String(s) => write_string(s, out),
+        RawBsonRef::Document(doc) => write_document(doc, None, out)?,
+        RawBsonRef::Array(array) => write_array(array, out)?,
+        RawBsonRef::ObjectId(oid) => {
+            let _ = write!(out, "{{\"$oid\":\"{}\"}}", oid.to_hex());
+        }
+        RawBsonRef::DateTime(date) => {
+            let _ = write!(out, "{{\"$date\":{}}}", date.timestamp_millis());
+        }
+        RawBsonRef::Timestamp(ts) => {
+            let _ = write!(out, "{{\"$timestamp\":{{\"t\":{},\"i\":{}}}}}", ts.time, ts.increment);
+        }
+        RawBsonRef::Binary(binary) => {
+            let _ = write!(
+                out,
+                "{{\"$binary\":{{\"base64\":\"{}\",\"subType\":\"{:02x}\"}}}}",
+                base64::engine::general_purpose::STANDARD.encode(binary.bytes),
+                u8::from(binary.subtype)
+            );
+        }
+        RawBsonRef::RegularExpression(regex) => {
+            out.push_str("{\"$regularExpression\":{\"pattern\":");
+            write_string(regex.pattern, out);
+            out.push_str(",\"options\":");
+            write_string(regex.options, out);
+            out.push_str("}}");
+        }
+        RawBsonRef::Decimal128(decimal) => {
+            // The bson crate has no decimal string form, so the tag carries the raw bytes
+            let _ = write!(
+                out,
+                "{{\"$numberDecimalBytes\":\"{}\"}}",
+                base64::engine::general_purpose::STANDARD.encode(decimal.bytes())
+            );
+        }
+        RawBsonRef::Symbol(s) => {
+            out.push_str("{\"$symbol\":");
+            write_string(s, out);
+            out.push('}');
+        }
+        RawBsonRef::JavaScriptCode(code) => {
+            out.push_str("{\"$code\":");
+            write_string(code, out);
+            out.push('}');
+        }
+        RawBsonRef::JavaScriptCodeWithScope(code) => {
+            out.push_str("{\"$code\":");
+            write_string(code.code, out);
+            out.push_str(",\"$scope\":");
+            write_document(code.scope, None, out)?;
+            out.push('}');
+        }
+        RawBsonRef::MinKey => out.push_str("{\"$minKey\":1}"),
+        RawBsonRef::MaxKey => out.push_str("{\"$maxKey\":1}"),
+        RawBsonRef::Undefined => out.push_str("{\"$undefined\":true}"),
+        RawBsonRef::DbPointer(_) => {
+            return Err(FauxDBError::WireProtocol("DBPointer values are not supported".to_string()));
+        }
+    }
+    Ok(())
+}
+
+/// Doubles always carry a fraction or exponent so they read back as
+/// doubles; JSONB's numeric keeps the scale of integral values like 5.0
+fn write_double(d: f64, out: &mut String) {
+    if d.is_nan() {
+        out.push_str("{\"$numberDouble\":\"NaN\"}");
+    } else if d.is_infinite() {
+        out.push_str(if d > 0.0 { "{\"$numberDouble\":\"Infinity\"}" } else { "{\"$numberDouble\":\"-Infinity\"}" });
+    } else if d.fract() == 0.0 {
+        let _ = write!(out, "{:.1}", d);
+    } else {
+        let _ = write!(out, "{:?}", d);
+    }
+}
+
+pub(crate) fn write_string(s: &str, out: &mut String) {
+    out.push('"');
+    for c in s.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            '\n' => out.push_str("\\n"),
+            '\r' => out.push_str("\\r"),
+            '\t' => out.push_str("\\t"),
+            c if (c as u32) < 0x20 => { let _ = write!(out, "\\u{:04x}", c as u32); }
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+}
+
+/// Tagged JSON text for a single value, as it would appear inside a document
+pub fn bson_to_json(value: &Bson) -> Result<String> {
+    let mut wrapper = Document::new();
+    wrapper.insert("v", value.clone());
+    let bytes = bson::to_vec(&wrapper)?;
+    let raw = RawDocument::from_bytes(&bytes).map_err(invalid_bson)?;
+
+    let mut out = String::new();
+    if let Some(value) = raw.get("v").map_err(invalid_bson)? {
+        write_value(value, &mut out)?;
+    }
+    Ok(out)
+}
+
+/// JSON text for a scalar that JSONB compares the way MongoDB does, for
+/// pushing equality down as containment; None for anything tagged or nested
+pub fn scalar_json(value: &Bson) -> Option<String> {
+    let mut out = String::new();
+    match value {
+        Bson::String(s) => write_string(s, &mut out),
+        Bson::Int32(i) => { let _ = write!(out, "{}", i); }
+        Bson::Int64(i) => { let _ = write!(out, "{}", i); }
+        Bson::Double(d) if d.is_finite() => write_double(*d, &mut out),
+        Bson::Boolean(b) => out.push_str(if *b { "true" } else { "false" }),
+        _ => return None,
+    }
+    Some(out)
+}
+
+/// JSONB's binary wire format is a version byte followed by the JSON text,
+/// so encoded documents can be sent without re-parsing them into a Value
+#[derive(Debug)]
+pub struct JsonbText<T>(pub T);
+
+impl<T: AsRef<str> + std::fmt::Debug> ToSql for JsonbText<T> {
+    fn to_sql(&self, _ty: &Type, out: &mut BytesMut) -> std::result::Result<IsNull, Box<dyn std::error::Error + Sync + Send>> {
+        out.put_u8(1);
+        out.put_slice(self.0.as_ref().as_bytes());
+        Ok(IsNull::No)
+    }
+
+    fn accepts(ty: &Type) -> bool {
+        *ty == Type::JSONB
+    }
+
+    to_sql_checked!();
+}
+
+/// Parse tagged JSON text from the `document` column back into a document
+pub fn decode_json(json: &str) -> Result<Document> {
+    match serde_json::from_str::<Value>(json)? {
+        Value::Object(map) => decode_object(map),
+        _ => Err(FauxDBError::Database("Stored document is not a JSON object".to_string())),
+    }
+}
+
+fn decode_object(map: Map<String, Value>) -> Result<Document> {
+    let mut document = Document::new();
+    for (key, value) in map {
+        document.insert(key, decode_value(value)?);
+    }
+    Ok(document)
+}
+
+/// Integers come back as Int32 when they fit and Int64 otherwise. Int64 is
+/// stored as a plain JSON number so containment and sort pushdown compare
+/// it with other numbers, which loses its width: a small Int64 reads back
+/// as Int32. Values compare equal either way.
+fn decode_value(value: Value) -> Result<Bson> {
+    Ok(match value {
+        Value::Null => Bson::Null,
+        Value::Bool(b) => Bson::Boolean(b),
+        Value::Number(n) => match n.as_i64() {
+            Some(i) => match i32::try_from(i) {
+                Ok(i) => Bson::Int32(i),
+                Err(_) => Bson::Int64(i),
+            },
+            None => Bson::Double(n.as_f64().unwrap_or(f64::NAN)),
+        },
+        Value::String(s) => Bson::String(s),
+        Value::Array(items) => Bson::Array(items.into_iter().map(decode_value).collect::<Result<_>>()?),
+        Value::Object(map) => match decode_tag(&map)? {
+            Some(tagged) => tagged,
+            None => Bson::Document(decode_object(map)?),
+        },
+    })
+}
+
+fn malformed(tag: &str) -> FauxDBError {
+    FauxDBError::Database(format!("Malformed {} value in stored document", tag))
+}
+
+fn decode_base64(tag: &str, value: Option<&Value>) -> Result<Vec<u8>> {
+    let text = value.and_then(Value::as_str).ok_or_else(|| malformed(tag))?;
+    base64::engine::general_purpose::STANDARD.decode(text).map_err(|_| malformed(tag))
+}
+
+/// Recognize a type-tag object; anything else is an ordinary subdocument
+fn decode_tag(map: &Map<String, Value>) -> Result<Option<Bson>> {
+    let Some((tag, value)) = map.iter().next() else {
+        return Ok(None);
+    };
+    if !tag.starts_with('$') {
+        return Ok(None);
+    }
+
+    let single = map.len() == 1;
+    let tagged = match tag.as_str() {
+        "$oid" if single => {
+            let hex = value.as_str().ok_or_else(|| malformed(tag))?;
+            Bson::ObjectId(ObjectId::parse_str(hex).map_err(|_| malformed(tag))?)
+        }
+        "$date" if single => {
+            // Older rows were written by bson's serde form, {"$date": {"$numberLong": "..."}}
+            let millis = match value {
+                Value::Number(n) => n.as_i64(),
+                Value::Object(inner) => inner.get("$numberLong").and_then(Value::as_str).and_then(|s| s.parse().ok()),
+                _ => None,
+            };
+            Bson::DateTime(DateTime::from_millis(millis.ok_or_else(|| malformed(tag))?))
+        }
+        "$numberLong" if single => {
+            let text = value.as_str().ok_or_else(|| malformed(tag))?;
+            Bson::Int64(text.parse().map_err(|_| malformed(tag))?)
+        }
+        "$numberDouble" if single => match value.as_str() {
+            Some("NaN") => Bson::Double(f64::NAN),
+            Some("Infinity") => Bson::Double(f64::INFINITY),
+            Some("-Infinity") => Bson::Double(f64::NEG_INFINITY),
+            Some(text) => Bson::Double(text.parse().map_err(|_| malformed(tag))?),
+            None => return Err(malformed(tag)),
+        },
+        "$numberDecimalBytes" if single => {
+            let bytes: [u8; 16] = decode_base64(tag, Some(value))?.try_into().map_err(|_| malformed(tag))?;
+            Bson::Decimal128(Decimal128::from_bytes(bytes))
+        }
+        "$binary" if single => {
+            let bytes = decode_base64(tag, value.get("base64"))?;
+            let subtype = value.get("subType").and_then(Value::as_str)
+                .and_then(|s| u8::from_str_radix(s, 16).ok())
+                .ok_or_else(|| malformed(tag))?;
+            Bson::Binary(Binary { subtype: BinarySubtype::from(subtype), bytes })
+        }
+        "$timestamp" if single => {
+            let field = |name: &str| value.get(name).and_then(Value::as_u64).and_then(|v| u32::try_from(v).ok());
+            match (field("t"), field("i")) {
+                (Some(time), Some(increment)) => Bson::Timestamp(Timestamp { time, increment }),
+                _ => return Err(malformed(tag)),
+            }
+        }
+        "$regularExpression" if single => {
+            let field = |name: &str| value.get(name).and_then(Value::as_str).ok_or_else(|| malformed(tag));
+            Bson::RegularExpression(Regex { pattern: field("pattern")?.to_string(), options: field("options")?.to_string() })
+        }
+        "$symbol" if single => Bson::Symbol(value.as_str().ok_or_else(|| malformed(tag))?.to_string()),
+        "$code" if single => Bson::JavaScriptCode(value.as_str().ok_or_else(|| malformed(tag))?.to_string()),
+        "$code" if map.len() == 2 && map.contains_key("$scope") => {
+            let code = value.as_str().ok_or_else(|| malformed(tag))?.to_string();
+            let scope = match map.get("$scope") {
+                Some(Value::Object(scope)) => decode_object(scope.clone())?,
+                _ => return Err(malformed(tag)),
+            };
+            Bson::JavaScriptCodeWithScope(JavaScriptCodeWithScope { code, scope })
+        }
+        "$minKey" if single => Bson::MinKey,
+        "$maxKey" if single => Bson::MaxKey,
+        "$undefined" if single => Bson::Undefined,
+        _ => return Ok(None),
+    };
+    Ok(Some(tagged))
+}
@@ -38,6 +38,16 @@ pub enum FauxDBError {
 
     #[error("Configuration error: {0}")]
     Config(String),
+
+    #[error("Duplicate key error: {0}")]
+    DuplicateKey(String),
+
+    #[error("Write conflict: {0}")]
+    WriteConflict(String),
+
+    /// A collection table dropped without the catalog noticing
+    #[error("Undefined table: {0}")]
+    UndefinedTable(String),
 }
 
 pub type Result<T> = std::result::Result<T, FauxDBError>;
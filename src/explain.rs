@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file explain.rs
+ * @brief explain command backed by PostgreSQL EXPLAIN (FORMAT JSON)
+ */
+
+use anyhow::{Result, anyhow};
+use bson::{doc, Bson, Document};
+use serde_json::Value;
+use tokio_postgres::types::{FromSql, Type};
+use crate::aggregate::AggregateRequest;
+use crate::document_codec::{JsonbText, StorageLayout};
+use crate::fauxdb_debug;
+use crate::find::FindRequest;
+use crate::transactions::ConnectionTarget;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ExplainVerbosity {
+    QueryPlanner,
+    ExecutionStats,
+    AllPlansExecution,
+}
+
+impl ExplainVerbosity {
+    pub fn parse(value: Option<&str>) -> Result<Self> {
+        match value {
+            Some("queryPlanner") => Ok(Self::QueryPlanner),
+            Some("executionStats") => Ok(Self::ExecutionStats),
+            // allPlansExecution is the server default for the explain command
+            Some("allPlansExecution") | None => Ok(Self::AllPlansExecution),
+            Some(other) => Err(anyhow!("Unknown explain verbosity: {}", other)),
+        }
+    }
+
+    /// EXPLAIN prefix for this verbosity. Anything beyond queryPlanner
+    /// executes the statement so actual row counts and buffers are known.
+    pub fn explain_prefix(&self) -> &'static str {
+        match self {
+            Self::QueryPlanner => "EXPLAIN (FORMAT JSON, SUMMARY)",
+            Self::ExecutionStats | Self::AllPlansExecution => "EXPLAIN (ANALYZE, BUFFERS, FORMAT JSON)",
+        }
+    }
+
+    fn analyzed(&self) -> bool {
+        *self != Self::QueryPlanner
+    }
+}
+
+/// An explained find/aggregate/count compiled down to the SQL it would run
+#[derive(Debug, Clone)]
+pub struct ExplainRequest {
+    pub namespace: String,
+    pub command: Document,
+    pub verbosity: ExplainVerbosity,
+    pub sql: String,
+    /// JSONB containment documents bound as $1, $2, ...
+    pub params: Vec<String>,
+    /// Stages the in-process engine would run after the SQL prefix
+    pub in_process_stages: Vec<Document>,
+}
+
+impl ExplainRequest {
+    /// Compile the explained command with the planner that runs it: find
+    /// and count plan as a find over the collection table, aggregate as an
+    /// aggregate.
+    pub fn parse(explain_doc: &Document, layout: &StorageLayout) -> Result<Self> {
+        let command = explain_doc.get_document("explain")
+            .map_err(|_| anyhow!("explain requires a command document"))?
+            .clone();
+        let verbosity = ExplainVerbosity::parse(explain_doc.get_str("verbosity").ok())?;
+        let database = explain_doc.get_str("$db")
+            .or_else(|_| command.get_str("$db"))
+            .unwrap_or("test")
+            .to_string();
+
+        let mut planned = command.clone();
+        planned.insert("$db", database.as_str());
+        let (collection, sql, params, in_process_stages) = if command.contains_key("aggregate") {
+            let request = AggregateRequest::parse(&planned)?;
+            let plan = request.plan(layout)?;
+            let stages = plan.remainder_documents();
+            (request.collection, plan.sql, plan.params, stages)
+        } else if let Ok(collection) = command.get_str("count") {
+            let mut find = doc! { "find": collection, "$db": database.as_str() };
+            for (from, to) in [("query", "filter"), ("skip", "skip"), ("limit", "limit")] {
+                if let Some(value) = command.get(from) {
+                    find.insert(to, value.clone());
+                }
+            }
+            let (collection, sql, params, mut stages) = Self::plan_find(&find, layout)?;
+            stages.push(doc! { "$count": "n" });
+            (collection, sql, params, stages)
+        } else if command.contains_key("find") {
+            Self::plan_find(&planned, layout)?
+        } else {
+            return Err(anyhow!("explain supports find, aggregate and count"));
+        };
+        Ok(Self {
+            namespace: format!("{}.{}", database, collection),
+            command,
+            verbosity,
+            sql,
+            params,
+            in_process_stages,
+        })
+    }
+
+    /// The find plan plus what `FindRequest` finishes in process, written
+    /// as pipeline stages
+    fn plan_find(command: &Document, layout: &StorageLayout) -> Result<(String, String, Vec<String>, Vec<Document>)> {
+        let request = FindRequest::parse(command)?;
+        let plan = request.plan(layout)?;
+
+        let mut stages = Vec::new();
+        if let Some(residual) = &plan.residual {
+            stages.push(doc! { "$match": residual.clone() });
+        }
+        if let Some(sort) = request.sort.as_ref().filter(|_| plan.sort_in_process) {
+            stages.push(doc! { "$sort": sort.clone() });
+        }
+        if plan.residual.is_some() || plan.sort_in_process {
+            if request.skip > 0 {
+                stages.push(doc! { "$skip": request.skip as i64 });
+            }
+            if let Some(limit) = request.limit {
+                stages.push(doc! { "$limit": limit as i64 });
+            }
+        } else if plan.skip_rows > 0 {
+            stages.push(doc! { "$skip": plan.skip_rows as i64 });
+        }
+        if let Some(projection) = &request.projection {
+            stages.push(doc! { "$project": projection.clone() });
+        }
+        Ok((request.collection, plan.sql, plan.params, stages))
+    }
+
+    pub fn explain_sql(&self) -> String {
+        format!("{} {}", self.verbosity.explain_prefix(), self.sql)
+    }
+
+    /// Response for callers without a database connection: the compiled
+    /// SQL is reported, the plan itself is not.
+    pub fn unplanned_response(&self) -> Document {
+        let mut response = Document::new();
+        response.insert("explainVersion", "1");
+        response.insert("queryPlanner", self.query_planner_section(None, None));
+        response.insert("command", self.command.clone());
+        response.insert("ok", 1.0);
+        response
+    }
+
+    /// Map the output of `explain_sql()` onto MongoDB's explain layout.
+    pub fn build_response(&self, explain_output: &str) -> Result<Document> {
+        let parsed: Value = serde_json::from_str(explain_output)
+            .map_err(|e| anyhow!("Failed to parse EXPLAIN output: {}", e))?;
+        let root = parsed.get(0).ok_or_else(|| anyhow!("EXPLAIN returned no plan"))?;
+        let plan = root.get("Plan").ok_or_else(|| anyhow!("EXPLAIN output has no Plan node"))?;
+
+        let analyzed = self.verbosity.analyzed();
+        let planning_time = root.get("Planning Time").and_then(Value::as_f64);
+
+        let mut response = Document::new();
+        response.insert("explainVersion", "1");
+        response.insert(
+            "queryPlanner",
+            self.query_planner_section(Some(PlanMapper::map_node(plan, false)), planning_time),
+        );
+
+        if analyzed {
+            let mut totals = ExaminedTotals::default();
+            let execution_stages = PlanMapper::map_node(plan, true);
+            totals.collect(&execution_stages);
+
+            let mut execution_stats = doc! {
+                "executionSuccess": true,
+                "nReturned": PlanMapper::actual_rows(plan),
+                "executionTimeMillis": root.get("Execution Time").and_then(Value::as_f64).unwrap_or(0.0),
+                "totalKeysExamined": totals.keys_examined,
+                "totalDocsExamined": totals.docs_examined,
+                "executionStages": execution_stages,
+            };
+            if self.verbosity == ExplainVerbosity::AllPlansExecution {
+                // PostgreSQL keeps only the winning plan, so there are no rejected candidates to report
+                execution_stats.insert("allPlansExecution", Vec::<Bson>::new());
+            }
+            response.insert("executionStats", execution_stats);
+        }
+
+        response.insert("command", self.command.clone());
+        response.insert("postgresPlan", bson::to_bson(&parsed)?);
+        response.insert("ok", 1.0);
+        Ok(response)
+    }
+
+    fn query_planner_section(&self, winning_plan: Option<Document>, planning_time: Option<f64>) -> Document {
+        let parsed_query = self.command.get_document("filter")
+            .or_else(|_| self.command.get_document("query"))
+            .cloned()
+            .unwrap_or_default();
+
+        let mut planner = doc! {
+            "plannerVersion": 1,
+            "namespace": self.namespace.clone(),
+            "indexFilterSet": false,
+            "parsedQuery": parsed_query,
+            "sql": self.sql.clone(),
+        };
+        if !self.in_process_stages.is_empty() {
+            planner.insert("inProcessStages", self.in_process_stages.clone());
+        }
+        if let Some(winning_plan) = winning_plan {
+            planner.insert("winningPlan", winning_plan);
+            planner.insert("rejectedPlans", Vec::<Bson>::new());
+        }
+        if let Some(planning_time) = planning_time {
+            planner.insert("planningTimeMillis", planning_time);
+        }
+        planner
+    }
+}
+
+/// EXPLAIN (FORMAT JSON) returns one json column, whose binary format is
+/// the JSON text itself
+struct ExplainOutput(String);
+
+impl<'a> FromSql<'a> for ExplainOutput {
+    fn from_sql(_ty: &Type, raw: &'a [u8]) -> std::result::Result<Self, Box<dyn std::error::Error + Sync + Send>> {
+        Ok(Self(std::str::from_utf8(raw)?.to_string()))
+    }
+
+    fn accepts(ty: &Type) -> bool {
+        *ty == Type::JSON || *ty == Type::TEXT
+    }
+}
+
+/// Run an explain command against PostgreSQL. Inside a transaction the
+/// statement is explained on its connection, so it sees the transaction's
+/// writes.
+pub async fn explain_command(target: ConnectionTarget<'_>, layout: &StorageLayout, explain_doc: &Document) -> Result<Document> {
+    let request = ExplainRequest::parse(explain_doc, layout)?;
+    let explain_sql = request.explain_sql();
+    fauxdb_debug!("Running {}", explain_sql);
+
+    let params: Vec<JsonbText<&str>> = request.params.iter().map(|param| JsonbText(param.as_str())).collect();
+    let param_refs: Vec<&(dyn tokio_postgres::types::ToSql + Sync)> = params.iter()
+        .map(|param| param as &(dyn tokio_postgres::types::ToSql + Sync))
+        .collect();
+    let connection = target.checkout().await?;
+    let rows = connection.client().query(&explain_sql, &param_refs).await?;
+    let row = rows.first().ok_or_else(|| anyhow!("EXPLAIN returned no rows"))?;
+
+    let output: ExplainOutput = row.try_get(0)?;
+    request.build_response(&output.0)
+}
+
+struct PlanMapper;
+
+impl PlanMapper {
+    fn map_node(node: &Value, with_stats: bool) -> Document {
+        let node_type = node.get("Node Type").and_then(Value::as_str).unwrap_or("Unknown");
+        let children: Vec<&Value> = node.get("Plans")
+            .and_then(Value::as_array)
+            .map(|plans| plans.iter().collect())
+            .unwrap_or_default();
+
+        // Wrapper nodes with one input and no filter of their own add nothing to the Mongo view
+        if matches!(node_type, "Subquery Scan" | "Gather" | "Gather Merge" | "Materialize" | "Result")
+            && children.len() == 1
+            && node.get("Filter").is_none()
+        {
+            return Self::map_node(children[0], with_stats);
+        }
+
+        let mut stage = match node_type {
+            "Seq Scan" => {
+                let mut scan = doc! { "stage": "COLLSCAN", "direction": "forward" };
+                if with_stats {
+                    scan.insert("docsExamined", Self::actual_rows(node) + Self::rows_removed(node));
+                }
+                scan
+            }
+            "Index Scan" => {
+                // A heap-fetching index scan is FETCH over IXSCAN in Mongo terms
+                let mut fetch = doc! { "stage": "FETCH" };
+                if with_stats {
+                    fetch.insert("docsExamined", Self::actual_rows(node) + Self::rows_removed(node));
+                }
+                fetch.insert("inputStage", Self::index_scan(node, with_stats));
+                fetch
+            }
+            "Index Only Scan" | "Bitmap Index Scan" => Self::index_scan(node, with_stats),
+            "Bitmap Heap Scan" => {
+                let mut fetch = doc! { "stage": "FETCH" };
+                if with_stats {
+                    fetch.insert("docsExamined", Self::actual_rows(node) + Self::rows_removed(node));
+                }
+                fetch
+            }
+            "BitmapAnd" => doc! { "stage": "AND_SORTED" },
+            "BitmapOr" => doc! { "stage": "OR" },
+            "Sort" | "Incremental Sort" => {
+                let sort_keys: Vec<Bson> = node.get("Sort Key")
+                    .and_then(Value::as_array)
+                    .map(|keys| keys.iter().filter_map(Value::as_str).map(|k| Bson::String(k.to_string())).collect())
+                    .unwrap_or_default();
+                let mut sort = doc! { "stage": "SORT", "sortPattern": sort_keys };
+                if let Some(method) = node.get("Sort Method").and_then(Value::as_str) {
+                    sort.insert("type", if method.starts_with("top-N") { "simple-topK" } else { "simple" });
+                }
+                if let Some(space) = node.get("Sort Space Type").and_then(Value::as_str) {
+                    sort.insert("usedDisk", space == "Disk");
+                }
+                sort
+            }
+            "Limit" => doc! { "stage": "LIMIT" },
+            "Aggregate" => doc! { "stage": "GROUP" },
+            "WindowAgg" => doc! { "stage": "SET_WINDOW_FIELDS" },
+            "Append" | "Merge Append" => doc! { "stage": "UNION" },
+            "Sample Scan" => doc! { "stage": "SAMPLE" },
+            "Hash Join" | "Merge Join" | "Nested Loop" => doc! { "stage": "EQ_LOOKUP" },
+            other => doc! { "stage": other.to_uppercase().replace(' ', "_") },
+        };
+
+        stage.insert("pgNodeType", node_type);
+        if let Some(relation) = node.get("Relation Name").and_then(Value::as_str) {
+            stage.insert("relation", relation);
+        }
+        if let Some(filter) = node.get("Filter").and_then(Value::as_str) {
+            stage.insert("filter", filter);
+        }
+        if let Some(cost) = node.get("Total Cost").and_then(Value::as_f64) {
+            stage.insert("estimatedCost", cost);
+        }
+        if let Some(rows) = node.get("Plan Rows").and_then(Value::as_f64) {
+            stage.insert("estimatedRows", rows as i64);
+        }
+        if with_stats {
+            stage.insert("nReturned", Self::actual_rows(node));
+            stage.insert(
+                "executionTimeMillisEstimate",
+                node.get("Actual Total Time").and_then(Value::as_f64).unwrap_or(0.0),
+            );
+            stage.insert("sharedHitBlocks", Self::counter(node, "Shared Hit Blocks"));
+            stage.insert("sharedReadBlocks", Self::counter(node, "Shared Read Blocks"));
+        }
+
+        let mut inputs: Vec<Document> = children.iter().map(|child| Self::map_node(child, with_stats)).collect();
+        if inputs.len() == 1 {
+            stage.insert("inputStage", inputs.remove(0));
+        } else if !inputs.is_empty() {
+            stage.insert("inputStages", inputs);
+        }
+
+        stage
+    }
+
+    fn index_scan(node: &Value, with_stats: bool) -> Document {
+        let mut scan = doc! {
+            "stage": "IXSCAN",
+            "indexName": node.get("Index Name").and_then(Value::as_str).unwrap_or(""),
+            "direction": match node.get("Scan Direction").and_then(Value::as_str) {
+                Some("Backward") => "backward",
+                _ => "forward",
+            },
+        };
+        if let Some(bounds) = node.get("Index Cond").and_then(Value::as_str) {
+            scan.insert("indexBounds", bounds);
+        }
+        if with_stats {
+            scan.insert("keysExamined", Self::actual_rows(node));
+        }
+        scan
+    }
+
+    /// Rows produced across all loops, which is what Mongo's nReturned counts
+    fn actual_rows(node: &Value) -> i64 {
+        let rows = node.get("Actual Rows").and_then(Value::as_f64).unwrap_or(0.0);
+        let loops = node.get("Actual Loops").and_then(Value::as_f64).unwrap_or(1.0);
+        (rows * loops) as i64
+    }
+
+    fn rows_removed(node: &Value) -> i64 {
+        let loops = node.get("Actual Loops").and_then(Value::as_f64).unwrap_or(1.0);
+        let removed = node.get("Rows Removed by Filter").and_then(Value::as_f64).unwrap_or(0.0)
+            + node.get("Rows Removed by Index Recheck").and_then(Value::as_f64).unwrap_or(0.0);
+        (removed * loops) as i64
+    }
+
+    fn counter(node: &Value, key: &str) -> i64 {
+        node.get(key).and_then(Value::as_i64).unwrap_or(0)
+    }
+}
+
+#[derive(Default)]
+struct ExaminedTotals {
+    keys_examined: i64,
+    docs_examined: i64,
+}
+
+impl ExaminedTotals {
+    fn collect(&mut self, stage: &Document) {
+        self.keys_examined += stage.get_i64("keysExamined").unwrap_or(0);
+        self.docs_examined += stage.get_i64("docsExamined").unwrap_or(0);
+
+        if let Ok(input) = stage.get_document("inputStage") {
+            self.collect(input);
+        }
+        if let Ok(inputs) = stage.get_array("inputStages") {
+            for input in inputs.iter().filter_map(Bson::as_document) {
+                self.collect(input);
+            }
+        }
+    }
+}
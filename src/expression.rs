@@ -0,0 +1,876 @@
+/*!
+ * @file expression.rs
+ * @brief Aggregation expressions: a typed IR with SQL and native backends
+ *
+ * Expressions are parsed once into `Expr`. The SQL backend renders them as
+ * PostgreSQL expressions so the stages that use them can be pushed down;
+ * anything it cannot express with the same semantics is an error, which
+ * leaves the stage to the in-process engine. The native backend compiles
+ * the same tree into closures evaluated per document.
+ */
+
+use crate::bson_order::{compare_bson, lookup_path};
+use crate::error::{FauxDBError, Result};
+use bson::{Bson, DateTime, Document};
+use chrono::{Datelike, TimeZone, Utc};
+use std::cmp::Ordering;
+
+const MILLIS_PER_DAY: i64 = 86_400_000;
+
+/// 2000-01-01T00:00:00Z, the origin MongoDB bins $dateTrunc results from
+const DATE_TRUNC_REFERENCE_MS: i64 = 946_684_800_000;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ArithmeticOp {
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Mod,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ComparisonOp {
+    Eq,
+    Ne,
+    Gt,
+    Gte,
+    Lt,
+    Lte,
+    Cmp,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum DateUnit {
+    Year,
+    Quarter,
+    Month,
+    Week,
+    Day,
+    Hour,
+    Minute,
+    Second,
+    Millisecond,
+}
+
+impl DateUnit {
+    pub(crate) fn parse(unit: &str) -> Result<Self> {
+        Ok(match unit {
+            "year" => DateUnit::Year,
+            "quarter" => DateUnit::Quarter,
+            "month" => DateUnit::Month,
+            "week" => DateUnit::Week,
+            "day" => DateUnit::Day,
+            "hour" => DateUnit::Hour,
+            "minute" => DateUnit::Minute,
+            "second" => DateUnit::Second,
+            "millisecond" => DateUnit::Millisecond,
+            other => return Err(invalid(format!("$dateTrunc unit '{}' is not supported", other))),
+        })
+    }
+
+    /// Length of fixed-width units; calendar units have none
+    pub(crate) fn fixed_millis(self) -> Option<i64> {
+        match self {
+            DateUnit::Week => Some(7 * MILLIS_PER_DAY),
+            DateUnit::Day => Some(MILLIS_PER_DAY),
+            DateUnit::Hour => Some(3_600_000),
+            DateUnit::Minute => Some(60_000),
+            DateUnit::Second => Some(1_000),
+            DateUnit::Millisecond => Some(1),
+            DateUnit::Year | DateUnit::Quarter | DateUnit::Month => None,
+        }
+    }
+
+    fn sql_name(self) -> &'static str {
+        match self {
+            DateUnit::Year => "year",
+            DateUnit::Quarter => "quarter",
+            DateUnit::Month => "month",
+            DateUnit::Week => "week",
+            DateUnit::Day => "day",
+            DateUnit::Hour => "hour",
+            DateUnit::Minute => "minute",
+            DateUnit::Second => "second",
+            DateUnit::Millisecond => "milliseconds",
+        }
+    }
+}
+
+/// Parsed aggregation expression
+#[derive(Debug, Clone)]
+pub enum Expr {
+    Literal(Bson),
+    Field(String),
+    Root,
+    Arithmetic(ArithmeticOp, Vec<Expr>),
+    Compare(ComparisonOp, Box<Expr>, Box<Expr>),
+    And(Vec<Expr>),
+    Or(Vec<Expr>),
+    Not(Box<Expr>),
+    Cond { condition: Box<Expr>, then: Box<Expr>, otherwise: Box<Expr> },
+    IfNull(Vec<Expr>),
+    Concat(Vec<Expr>),
+    /// `start_of_week` counts days from Sunday
+    DateTrunc { date: Box<Expr>, unit: DateUnit, bin_size: i64, start_of_week: u32 },
+    Object(Vec<(String, Expr)>),
+    Array(Vec<Expr>),
+}
+
+fn invalid(message: String) -> FauxDBError {
+    FauxDBError::Database(message)
+}
+
+impl Expr {
+    pub fn parse(value: &Bson) -> Result<Expr> {
+        match value {
+            Bson::String(path) if path == "$$ROOT" || path == "$$CURRENT" => Ok(Expr::Root),
+            Bson::String(path) if path.starts_with("$$") => {
+                Err(invalid(format!("Unsupported expression variable: {}", path)))
+            }
+            Bson::String(path) if path.len() > 1 && path.starts_with('$') => Ok(Expr::Field(path[1..].to_string())),
+            Bson::Array(items) => Ok(Expr::Array(items.iter().map(Expr::parse).collect::<Result<_>>()?)),
+            Bson::Document(doc) => Self::parse_document(doc),
+            other => Ok(Expr::Literal(other.clone())),
+        }
+    }
+
+    fn parse_document(doc: &Document) -> Result<Expr> {
+        match doc.iter().next() {
+            Some((operator, argument)) if operator.starts_with('$') => {
+                if doc.len() != 1 {
+                    return Err(invalid(format!("An expression object with {} must have exactly one field", operator)));
+                }
+                Self::parse_operator(operator, argument)
+            }
+            _ => Ok(Expr::Object(
+                doc.iter()
+                    .map(|(field, value)| Ok((field.clone(), Expr::parse(value)?)))
+                    .collect::<Result<_>>()?,
+            )),
+        }
+    }
+
+    fn parse_operator(operator: &str, argument: &Bson) -> Result<Expr> {
+        let arithmetic = |op: ArithmeticOp| -> Result<Expr> {
+            Ok(Expr::Arithmetic(op, operands(operator, argument)?))
+        };
+        let binary_arithmetic = |op: ArithmeticOp| -> Result<Expr> {
+            Ok(Expr::Arithmetic(op, exact_operands(operator, argument, 2)?))
+        };
+        let compare = |op: ComparisonOp| -> Result<Expr> {
+            let [left, right] = pair(operator, argument)?;
+            Ok(Expr::Compare(op, Box::new(left), Box::new(right)))
+        };
+
+        match operator {
+            "$literal" => Ok(Expr::Literal(argument.clone())),
+            "$add" => arithmetic(ArithmeticOp::Add),
+            "$multiply" => arithmetic(ArithmeticOp::Multiply),
+            "$subtract" => binary_arithmetic(ArithmeticOp::Subtract),
+            "$divide" => binary_arithmetic(ArithmeticOp::Divide),
+            "$mod" => binary_arithmetic(ArithmeticOp::Mod),
+            "$eq" => compare(ComparisonOp::Eq),
+            "$ne" => compare(ComparisonOp::Ne),
+            "$gt" => compare(ComparisonOp::Gt),
+            "$gte" => compare(ComparisonOp::Gte),
+            "$lt" => compare(ComparisonOp::Lt),
+            "$lte" => compare(ComparisonOp::Lte),
+            "$cmp" => compare(ComparisonOp::Cmp),
+            "$and" => Ok(Expr::And(operands(operator, argument)?)),
+            "$or" => Ok(Expr::Or(operands(operator, argument)?)),
+            "$not" => {
+                let [operand]: [Expr; 1] = exact_operands(operator, argument, 1)?
+                    .try_into()
+                    .map_err(|_| invalid("$not takes exactly one argument".to_string()))?;
+                Ok(Expr::Not(Box::new(operand)))
+            }
+            "$cond" => Self::parse_cond(argument),
+            "$ifNull" => {
+                let args = operands(operator, argument)?;
+                if args.len() < 2 {
+                    return Err(invalid("$ifNull needs at least two arguments".to_string()));
+                }
+                Ok(Expr::IfNull(args))
+            }
+            "$concat" => Ok(Expr::Concat(operands(operator, argument)?)),
+            "$dateTrunc" => Self::parse_date_trunc(argument),
+            other => Err(invalid(format!("Unsupported expression operator: {}", other))),
+        }
+    }
+
+    fn parse_cond(argument: &Bson) -> Result<Expr> {
+        let (condition, then, otherwise) = match argument {
+            Bson::Array(items) if items.len() == 3 => (&items[0], &items[1], &items[2]),
+            Bson::Document(spec) => {
+                let part = |name: &str| spec.get(name)
+                    .ok_or_else(|| invalid(format!("Missing '{}' parameter to $cond", name)));
+                (part("if")?, part("then")?, part("else")?)
+            }
+            _ => return Err(invalid("$cond takes [if, then, else] or {if, then, else}".to_string())),
+        };
+
+        Ok(Expr::Cond {
+            condition: Box::new(Expr::parse(condition)?),
+            then: Box::new(Expr::parse(then)?),
+            otherwise: Box::new(Expr::parse(otherwise)?),
+        })
+    }
+
+    fn parse_date_trunc(argument: &Bson) -> Result<Expr> {
+        let spec = argument.as_document()
+            .ok_or_else(|| invalid("$dateTrunc takes a document".to_string()))?;
+        let date = spec.get("date")
+            .ok_or_else(|| invalid("Missing 'date' parameter to $dateTrunc".to_string()))?;
+        let unit = spec.get_str("unit")
+            .map_err(|_| invalid("$dateTrunc requires a string 'unit'".to_string()))?;
+
+        let bin_size = match spec.get("binSize") {
+            None => 1,
+            Some(value) => value.as_i64()
+                .or_else(|| value.as_i32().map(i64::from))
+                .filter(|size| *size > 0)
+                .ok_or_else(|| invalid("$dateTrunc binSize must be a positive integer".to_string()))?,
+        };
+
+        // Only UTC is supported; anything else would silently shift bin edges
+        if let Some(timezone) = spec.get("timezone") {
+            match timezone.as_str() {
+                Some("UTC") | Some("GMT") | Some("Etc/UTC") | Some("+00:00") => {}
+                _ => return Err(invalid(format!("$dateTrunc timezone {} is not supported", timezone))),
+            }
+        }
+
+        let start_of_week = match spec.get_str("startOfWeek").map(|day| day.to_ascii_lowercase()) {
+            Err(_) => 0,
+            Ok(day) => match day.as_str() {
+                "sunday" | "sun" => 0,
+                "monday" | "mon" => 1,
+                "tuesday" | "tue" => 2,
+                "wednesday" | "wed" => 3,
+                "thursday" | "thu" => 4,
+                "friday" | "fri" => 5,
+                "saturday" | "sat" => 6,
+                _ => return Err(invalid(format!("Unknown startOfWeek: {}", day))),
+            },
+        };
+
+        Ok(Expr::DateTrunc {
+            date: Box::new(Expr::parse(date)?),
+            unit: DateUnit::parse(unit)?,
+            bin_size,
+            start_of_week,
+        })
+    }
+
+    /// Whether the SQL rendering of this expression has type boolean
+    fn is_sql_boolean(&self) -> bool {
+        match self {
+            Expr::Compare(op, _, _) => *op != ComparisonOp::Cmp,
+            Expr::And(_) | Expr::Or(_) | Expr::Not(_) => true,
+            Expr::Literal(Bson::Boolean(_)) => true,
+            _ => false,
+        }
+    }
+
+    /// Render as a PostgreSQL expression over the collection's columns
+    pub fn to_sql(&self) -> Result<String> {
+        self.to_sql_with(&mut |path| {
+            if path.contains('.') {
+                return Err(invalid(format!("Nested field path ${} is evaluated in-process", path)));
+            }
+            Ok(path.to_string())
+        })
+    }
+
+    /// Render as a PostgreSQL expression, with field paths rendered by `column`
+    pub fn to_sql_with(&self, column: &mut dyn FnMut(&str) -> Result<String>) -> Result<String> {
+        match self {
+            Expr::Literal(value) => literal_to_sql(value),
+            Expr::Field(path) => column(path),
+            Expr::Root => Err(invalid("$$ROOT is evaluated in-process".to_string())),
+            Expr::Arithmetic(op, args) => {
+                let parts = args.iter().map(|arg| arg.to_sql_with(column)).collect::<Result<Vec<_>>>()?;
+                Ok(match op {
+                    ArithmeticOp::Add => format!("({})", parts.join(" + ")),
+                    ArithmeticOp::Multiply => format!("({})", parts.join(" * ")),
+                    ArithmeticOp::Subtract => format!("({} - {})", parts[0], parts[1]),
+                    // $divide always produces a double, even for integer operands
+                    ArithmeticOp::Divide => format!("(({})::double precision / {})", parts[0], parts[1]),
+                    ArithmeticOp::Mod => format!("mod({}, {})", parts[0], parts[1]),
+                })
+            }
+            Expr::Compare(op, left, right) => {
+                let (left, right) = (left.to_sql_with(column)?, right.to_sql_with(column)?);
+                Ok(match op {
+                    // Null-safe, like MongoDB's equality
+                    ComparisonOp::Eq => format!("({} IS NOT DISTINCT FROM {})", left, right),
+                    ComparisonOp::Ne => format!("({} IS DISTINCT FROM {})", left, right),
+                    ComparisonOp::Gt => format!("({} > {})", left, right),
+                    ComparisonOp::Gte => format!("({} >= {})", left, right),
+                    ComparisonOp::Lt => format!("({} < {})", left, right),
+                    ComparisonOp::Lte => format!("({} <= {})", left, right),
+                    ComparisonOp::Cmp => format!(
+                        "(CASE WHEN {l} < {r} THEN -1 WHEN {l} > {r} THEN 1 ELSE 0 END)",
+                        l = left, r = right
+                    ),
+                })
+            }
+            Expr::And(args) | Expr::Or(args) => {
+                let joiner = if matches!(self, Expr::And(_)) { " AND " } else { " OR " };
+                let parts = args.iter().map(|arg| arg.to_sql_predicate_with(column)).collect::<Result<Vec<_>>>()?;
+                Ok(format!("({})", parts.join(joiner)))
+            }
+            Expr::Not(operand) => Ok(format!("(NOT {})", operand.to_sql_predicate_with(column)?)),
+            Expr::Cond { condition, then, otherwise } => Ok(format!(
+                "(CASE WHEN {} THEN {} ELSE {} END)",
+                condition.to_sql_predicate_with(column)?,
+                then.to_sql_with(column)?,
+                otherwise.to_sql_with(column)?
+            )),
+            Expr::IfNull(args) => {
+                let parts = args.iter().map(|arg| arg.to_sql_with(column)).collect::<Result<Vec<_>>>()?;
+                Ok(format!("COALESCE({})", parts.join(", ")))
+            }
+            // || yields NULL for a NULL operand, as $concat does
+            Expr::Concat(args) => {
+                let parts = args.iter().map(|arg| arg.to_sql_with(column)).collect::<Result<Vec<_>>>()?;
+                Ok(format!("({})", parts.join(" || ")))
+            }
+            Expr::DateTrunc { date, unit, bin_size, start_of_week } => {
+                let date = date.to_sql_with(column)?;
+                match unit.fixed_millis() {
+                    // date_trunc('week') starts on Monday and ignores binSize, so weeks always bin
+                    Some(_) if *unit == DateUnit::Week || *bin_size > 1 => {
+                        let origin_day = if *unit == DateUnit::Week { 1 + (start_of_week + 1) % 7 } else { 1 };
+                        Ok(format!(
+                            "date_bin(INTERVAL '{} {}', {}, TIMESTAMPTZ '2000-01-{:02} 00:00:00+00')",
+                            bin_size, unit.sql_name(), date, origin_day
+                        ))
+                    }
+                    _ if *bin_size == 1 => Ok(format!("date_trunc('{}', {}, 'UTC')", unit.sql_name(), date)),
+                    _ => Err(invalid("$dateTrunc with binSize on calendar units is evaluated in-process".to_string())),
+                }
+            }
+            Expr::Object(_) | Expr::Array(_) => {
+                Err(invalid("Object and array expressions are evaluated in-process".to_string()))
+            }
+        }
+    }
+
+    /// Render as a SQL condition; only expressions that are boolean in SQL qualify
+    pub fn to_sql_predicate(&self) -> Result<String> {
+        if !self.is_sql_boolean() {
+            return Err(invalid("Expression is not a boolean condition in SQL".to_string()));
+        }
+        self.to_sql()
+    }
+
+    pub fn to_sql_predicate_with(&self, column: &mut dyn FnMut(&str) -> Result<String>) -> Result<String> {
+        if !self.is_sql_boolean() {
+            return Err(invalid("Expression is not a boolean condition in SQL".to_string()));
+        }
+        self.to_sql_with(column)
+    }
+
+    /// Whether this only compares fields and numbers, joined by $and, $or
+    /// and $not. Over numeric columns its SQL then means what MongoDB
+    /// means, provided every field it reads holds a number.
+    pub fn compares_numbers(&self) -> bool {
+        match self {
+            Expr::Compare(op, left, right) => {
+                *op != ComparisonOp::Cmp && left.is_number_operand() && right.is_number_operand()
+            }
+            Expr::And(args) | Expr::Or(args) => !args.is_empty() && args.iter().all(Expr::compares_numbers),
+            Expr::Not(operand) => operand.compares_numbers(),
+            _ => false,
+        }
+    }
+
+    fn is_number_operand(&self) -> bool {
+        match self {
+            Expr::Field(_) | Expr::Literal(Bson::Int32(_)) | Expr::Literal(Bson::Int64(_)) => true,
+            // Numerics compare as doubles against a double literal; below
+            // 2^53 rounding them keeps their order relative to it
+            Expr::Literal(Bson::Double(f)) => f.abs() < (1u64 << 53) as f64,
+            _ => false,
+        }
+    }
+}
+
+fn operands(operator: &str, argument: &Bson) -> Result<Vec<Expr>> {
+    match argument {
+        Bson::Array(items) => items.iter().map(Expr::parse).collect(),
+        single => Ok(vec![Expr::parse(single).map_err(|e| invalid(format!("{}: {}", operator, e)))?]),
+    }
+}
+
+fn exact_operands(operator: &str, argument: &Bson, count: usize) -> Result<Vec<Expr>> {
+    let args = operands(operator, argument)?;
+    if args.len() != count {
+        return Err(invalid(format!("{} takes exactly {} arguments, {} given", operator, count, args.len())));
+    }
+    Ok(args)
+}
+
+fn pair(operator: &str, argument: &Bson) -> Result<[Expr; 2]> {
+    exact_operands(operator, argument, 2)?
+        .try_into()
+        .map_err(|_| invalid(format!("{} takes exactly 2 arguments", operator)))
+}
+
+fn literal_to_sql(value: &Bson) -> Result<String> {
+    match value {
+        Bson::String(s) => Ok(format!("'{}'", s.replace('\'', "''"))),
+        Bson::Int32(i) => Ok(i.to_string()),
+        Bson::Int64(i) => Ok(i.to_string()),
+        Bson::Double(f) if f.is_finite() => Ok(format!("{:?}::double precision", f)),
+        Bson::Boolean(b) => Ok(b.to_string()),
+        Bson::Null => Ok("NULL".to_string()),
+        Bson::DateTime(dt) => {
+            let timestamp = dt.try_to_rfc3339_string()
+                .map_err(|e| invalid(format!("Invalid date for SQL conversion: {}", e)))?;
+            Ok(format!("'{}'::timestamptz", timestamp))
+        }
+        other => Err(invalid(format!("No SQL literal for {:?}", other))),
+    }
+}
+
+type Evaluator = Box<dyn Fn(&Document) -> Result<Bson> + Send + Sync>;
+
+/// An expression compiled for repeated in-process evaluation
+pub struct CompiledExpr {
+    eval: Evaluator,
+    /// Set for bare field paths, whose absence is distinct from null
+    field: Option<String>,
+}
+
+impl CompiledExpr {
+    pub fn parse(value: &Bson) -> Result<Self> {
+        Ok(Self::compile(&Expr::parse(value)?))
+    }
+
+    pub fn compile(expr: &Expr) -> Self {
+        let field = match expr {
+            Expr::Field(path) => Some(path.clone()),
+            _ => None,
+        };
+        Self { eval: compile_expr(expr), field }
+    }
+
+    #[inline]
+    pub fn evaluate(&self, doc: &Document) -> Result<Bson> {
+        (self.eval)(doc)
+    }
+
+    /// Like `evaluate`, but a field path to a missing field yields None so
+    /// stages can leave the output field unset rather than null
+    pub fn evaluate_optional(&self, doc: &Document) -> Result<Option<Bson>> {
+        match &self.field {
+            Some(path) => Ok(lookup_path(doc, path).cloned()),
+            None => self.evaluate(doc).map(Some),
+        }
+    }
+}
+
+impl std::fmt::Debug for CompiledExpr {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.write_str("CompiledExpr")
+    }
+}
+
+/// MongoDB truthiness: false, null, missing and numeric zero are false
+pub fn is_truthy(value: &Bson) -> bool {
+    match value {
+        Bson::Boolean(b) => *b,
+        Bson::Null | Bson::Undefined => false,
+        Bson::Int32(n) => *n != 0,
+        Bson::Int64(n) => *n != 0,
+        Bson::Double(n) => *n != 0.0,
+        _ => true,
+    }
+}
+
+fn compile_all(exprs: &[Expr]) -> Vec<Evaluator> {
+    exprs.iter().map(compile_expr).collect()
+}
+
+fn compile_expr(expr: &Expr) -> Evaluator {
+    match expr {
+        Expr::Literal(value) => {
+            let value = value.clone();
+            Box::new(move |_| Ok(value.clone()))
+        }
+        Expr::Field(path) => {
+            let path = path.clone();
+            Box::new(move |doc| Ok(lookup_path(doc, &path).cloned().unwrap_or(Bson::Null)))
+        }
+        Expr::Root => Box::new(|doc| Ok(Bson::Document(doc.clone()))),
+        Expr::Arithmetic(op, args) => {
+            let op = *op;
+            let args = compile_all(args);
+            Box::new(move |doc| {
+                let mut values = Vec::with_capacity(args.len());
+                for arg in &args {
+                    values.push(arg(doc)?);
+                }
+                arithmetic(op, values)
+            })
+        }
+        Expr::Compare(op, left, right) => {
+            let op = *op;
+            let (left, right) = (compile_expr(left), compile_expr(right));
+            Box::new(move |doc| {
+                let order = compare_bson(&left(doc)?, &right(doc)?);
+                Ok(match op {
+                    ComparisonOp::Eq => Bson::Boolean(order == Ordering::Equal),
+                    ComparisonOp::Ne => Bson::Boolean(order != Ordering::Equal),
+                    ComparisonOp::Gt => Bson::Boolean(order == Ordering::Greater),
+                    ComparisonOp::Gte => Bson::Boolean(order != Ordering::Less),
+                    ComparisonOp::Lt => Bson::Boolean(order == Ordering::Less),
+                    ComparisonOp::Lte => Bson::Boolean(order != Ordering::Greater),
+                    ComparisonOp::Cmp => Bson::Int32(order as i32),
+                })
+            })
+        }
+        Expr::And(args) => {
+            let args = compile_all(args);
+            Box::new(move |doc| {
+                for arg in &args {
+                    if !is_truthy(&arg(doc)?) {
+                        return Ok(Bson::Boolean(false));
+                    }
+                }
+                Ok(Bson::Boolean(true))
+            })
+        }
+        Expr::Or(args) => {
+            let args = compile_all(args);
+            Box::new(move |doc| {
+                for arg in &args {
+                    if is_truthy(&arg(doc)?) {
+                        return Ok(Bson::Boolean(true));
+                    }
+                }
+                Ok(Bson::Boolean(false))
+            })
+        }
+        Expr::Not(operand) => {
+            let operand = compile_expr(operand);
+            Box::new(move |doc| Ok(Bson::Boolean(!is_truthy(&operand(doc)?))))
+        }
+        Expr::Cond { condition, then, otherwise } => {
+            let (condition, then, otherwise) = (compile_expr(condition), compile_expr(then), compile_expr(otherwise));
+            Box::new(move |doc| if is_truthy(&condition(doc)?) { then(doc) } else { otherwise(doc) })
+        }
+        Expr::IfNull(args) => {
+            let mut args = compile_all(args);
+            let replacement = args.pop().expect("$ifNull has at least two arguments");
+            Box::new(move |doc| {
+                for arg in &args {
+                    let value = arg(doc)?;
+                    if !matches!(value, Bson::Null | Bson::Undefined) {
+                        return Ok(value);
+                    }
+                }
+                replacement(doc)
+            })
+        }
+        Expr::Concat(args) => {
+            let args = compile_all(args);
+            Box::new(move |doc| {
+                let mut output = String::new();
+                for arg in &args {
+                    match arg(doc)? {
+                        Bson::String(s) => output.push_str(&s),
+                        Bson::Null | Bson::Undefined => return Ok(Bson::Null),
+                        other => return Err(invalid(format!("$concat only supports strings, not {:?}", other.element_type()))),
+                    }
+                }
+                Ok(Bson::String(output))
+            })
+        }
+        Expr::DateTrunc { date, unit, bin_size, start_of_week } => {
+            let (date, unit, bin_size, start_of_week) = (compile_expr(date), *unit, *bin_size, *start_of_week);
+            Box::new(move |doc| match date(doc)? {
+                Bson::DateTime(dt) => Ok(Bson::DateTime(DateTime::from_millis(
+                    truncate_date(dt.timestamp_millis(), unit, bin_size, start_of_week)?,
+                ))),
+                Bson::Null | Bson::Undefined => Ok(Bson::Null),
+                other => Err(invalid(format!("$dateTrunc requires a date, not {:?}", other.element_type()))),
+            })
+        }
+        Expr::Object(fields) => {
+            let fields: Vec<(String, Evaluator)> = fields.iter()
+                .map(|(name, expr)| (name.clone(), compile_expr(expr)))
+                .collect();
+            Box::new(move |doc| {
+                let mut output = Document::new();
+                for (name, field) in &fields {
+                    output.insert(name.clone(), field(doc)?);
+                }
+                Ok(Bson::Document(output))
+            })
+        }
+        Expr::Array(items) => {
+            let items = compile_all(items);
+            Box::new(move |doc| Ok(Bson::Array(items.iter().map(|item| item(doc)).collect::<Result<_>>()?)))
+        }
+    }
+}
+
+/// Numeric view of an operand; integers stay exact until they overflow
+#[derive(Clone, Copy)]
+enum Number {
+    Int(i64, bool),
+    Float(f64),
+}
+
+impl Number {
+    fn from_bson(value: &Bson) -> Option<Number> {
+        match value {
+            Bson::Int32(n) => Some(Number::Int(*n as i64, false)),
+            Bson::Int64(n) => Some(Number::Int(*n, true)),
+            Bson::Double(n) => Some(Number::Float(*n)),
+            _ => None,
+        }
+    }
+
+    fn as_f64(self) -> f64 {
+        match self {
+            Number::Int(n, _) => n as f64,
+            Number::Float(n) => n,
+        }
+    }
+
+    fn into_bson(self) -> Bson {
+        match self {
+            Number::Int(n, false) => i32::try_from(n).map(Bson::Int32).unwrap_or(Bson::Int64(n)),
+            Number::Int(n, true) => Bson::Int64(n),
+            Number::Float(n) => Bson::Double(n),
+        }
+    }
+
+    fn combine(self, other: Number, int_op: fn(i64, i64) -> Option<i64>, float_op: fn(f64, f64) -> f64) -> Number {
+        match (self, other) {
+            (Number::Int(a, a_long), Number::Int(b, b_long)) => match int_op(a, b) {
+                Some(result) => Number::Int(result, a_long || b_long),
+                // Integer overflow promotes to double, like the server
+                None => Number::Float(float_op(a as f64, b as f64)),
+            },
+            _ => Number::Float(float_op(self.as_f64(), other.as_f64())),
+        }
+    }
+}
+
+fn arithmetic(op: ArithmeticOp, values: Vec<Bson>) -> Result<Bson> {
+    if values.iter().any(|value| matches!(value, Bson::Null | Bson::Undefined)) {
+        return Ok(Bson::Null);
+    }
+
+    match op {
+        ArithmeticOp::Add => {
+            // At most one date; numbers are added to it as milliseconds
+            let mut date: Option<i64> = None;
+            let mut total = Number::Int(0, false);
+            for value in &values {
+                match value {
+                    Bson::DateTime(dt) if date.is_none() => date = Some(dt.timestamp_millis()),
+                    other => {
+                        let n = Number::from_bson(other)
+                            .ok_or_else(|| invalid(format!("$add only supports numeric or date types, not {:?}", other.element_type())))?;
+                        total = total.combine(n, i64::checked_add, |a, b| a + b);
+                    }
+                }
+            }
+            Ok(match date {
+                Some(millis) => Bson::DateTime(DateTime::from_millis(millis + total.as_f64().round() as i64)),
+                None => total.into_bson(),
+            })
+        }
+        ArithmeticOp::Multiply => {
+            let mut product = Number::Int(1, false);
+            for value in &values {
+                let n = Number::from_bson(value)
+                    .ok_or_else(|| invalid(format!("$multiply only supports numeric types, not {:?}", value.element_type())))?;
+                product = product.combine(n, i64::checked_mul, |a, b| a * b);
+            }
+            Ok(product.into_bson())
+        }
+        ArithmeticOp::Subtract => match (&values[0], &values[1]) {
+            (Bson::DateTime(a), Bson::DateTime(b)) => Ok(Bson::Int64(a.timestamp_millis() - b.timestamp_millis())),
+            (Bson::DateTime(a), other) => {
+                let n = Number::from_bson(other)
+                    .ok_or_else(|| invalid("can't $subtract a non-number from a date".to_string()))?;
+                Ok(Bson::DateTime(DateTime::from_millis(a.timestamp_millis() - n.as_f64().round() as i64)))
+            }
+            (a, b) => {
+                let (a, b) = numeric_pair("$subtract", a, b)?;
+                Ok(a.combine(b, i64::checked_sub, |a, b| a - b).into_bson())
+            }
+        },
+        ArithmeticOp::Divide => {
+            let (a, b) = numeric_pair("$divide", &values[0], &values[1])?;
+            if b.as_f64() == 0.0 {
+                return Err(invalid("can't $divide by zero".to_string()));
+            }
+            Ok(Bson::Double(a.as_f64() / b.as_f64()))
+        }
+        ArithmeticOp::Mod => {
+            let (a, b) = numeric_pair("$mod", &values[0], &values[1])?;
+            if b.as_f64() == 0.0 {
+                return Err(invalid("can't $mod by zero".to_string()));
+            }
+            Ok(a.combine(b, i64::checked_rem, |a, b| a % b).into_bson())
+        }
+    }
+}
+
+fn numeric_pair(operator: &str, a: &Bson, b: &Bson) -> Result<(Number, Number)> {
+    match (Number::from_bson(a), Number::from_bson(b)) {
+        (Some(a), Some(b)) => Ok((a, b)),
+        _ => Err(invalid(format!(
+            "{} only supports numeric types, not {:?} and {:?}",
+            operator, a.element_type(), b.element_type()
+        ))),
+    }
+}
+
+/// Lower bound of the `bin_size`-unit bin containing `millis`, with bins
+/// counted from 2000-01-01 (weeks from the first `start_of_week` on or after it)
+fn truncate_date(millis: i64, unit: DateUnit, bin_size: i64, start_of_week: u32) -> Result<i64> {
+    if let Some(unit_millis) = unit.fixed_millis() {
+        let mut reference = DATE_TRUNC_REFERENCE_MS;
+        if unit == DateUnit::Week {
+            // 2000-01-01 was a Saturday
+            reference += ((start_of_week + 1) % 7) as i64 * MILLIS_PER_DAY;
+        }
+        let width = unit_millis * bin_size;
+        return Ok(reference + (millis - reference).div_euclid(width) * width);
+    }
+
+    let date = Utc.timestamp_millis_opt(millis)
+        .single()
+        .ok_or_else(|| invalid(format!("$dateTrunc date out of range: {}", millis)))?;
+    let months_per_unit = match unit {
+        DateUnit::Quarter => 3,
+        DateUnit::Year => 12,
+        _ => 1,
+    };
+    let months = (date.year() as i64 - 2000) * 12 + date.month0() as i64;
+    let width = months_per_unit * bin_size;
+    let bin = months.div_euclid(width) * width;
+
+    Utc.with_ymd_and_hms(2000 + bin.div_euclid(12) as i32, bin.rem_euclid(12) as u32 + 1, 1, 0, 0, 0)
+        .single()
+        .map(|start| start.timestamp_millis())
+        .ok_or_else(|| invalid(format!("$dateTrunc date out of range: {}", millis)))
+}
+
+/// A `$project` specification compiled for the in-process engine
+#[derive(Debug)]
+pub struct CompiledProjection {
+    fields: Vec<(String, ProjectedField)>,
+    exclusion: bool,
+    include_id: bool,
+}
+
+#[derive(Debug)]
+enum ProjectedField {
+    Include,
+    Exclude,
+    Computed(CompiledExpr),
+}
+
+impl CompiledProjection {
+    pub fn compile(spec: &Document) -> Result<Self> {
+        let mut fields = Vec::with_capacity(spec.len());
+        let mut include_id = true;
+
+        for (field, value) in spec {
+            let projected = match value {
+                Bson::Boolean(include) => if *include { ProjectedField::Include } else { ProjectedField::Exclude },
+                Bson::Int32(_) | Bson::Int64(_) | Bson::Double(_) => {
+                    if is_truthy(value) { ProjectedField::Include } else { ProjectedField::Exclude }
+                }
+                expression => ProjectedField::Computed(CompiledExpr::parse(expression)?),
+            };
+            if field == "_id" && matches!(projected, ProjectedField::Exclude) {
+                include_id = false;
+                continue;
+            }
+            fields.push((field.clone(), projected));
+        }
+
+        let exclusion = fields.iter().any(|(_, projected)| matches!(projected, ProjectedField::Exclude));
+        if exclusion && fields.iter().any(|(_, projected)| !matches!(projected, ProjectedField::Exclude)) {
+            return Err(invalid("Cannot mix inclusion and exclusion in a $project".to_string()));
+        }
+        // {_id: 0} alone removes _id and keeps everything else
+        let exclusion = exclusion || fields.is_empty();
+
+        Ok(Self { fields, exclusion, include_id })
+    }
+
+    pub fn apply(&self, doc: &Document) -> Result<Document> {
+        if self.exclusion {
+            let mut output = doc.clone();
+            if !self.include_id {
+                output.remove("_id");
+            }
+            for (field, _) in &self.fields {
+                remove_path(&mut output, field);
+            }
+            return Ok(output);
+        }
+
+        let mut output = Document::new();
+        if self.include_id && !self.fields.iter().any(|(field, _)| field == "_id") {
+            if let Some(id) = doc.get("_id") {
+                output.insert("_id", id.clone());
+            }
+        }
+        for (field, projected) in &self.fields {
+            let value = match projected {
+                ProjectedField::Include => lookup_path(doc, field).cloned(),
+                ProjectedField::Computed(expr) => expr.evaluate_optional(doc)?,
+                ProjectedField::Exclude => None,
+            };
+            if let Some(value) = value {
+                set_path(&mut output, field, value);
+            }
+        }
+        Ok(output)
+    }
+}
+
+/// Set a dotted path, creating (or replacing non-document) intermediate levels
+pub fn set_path(doc: &mut Document, path: &str, value: Bson) {
+    match path.split_once('.') {
+        None => {
+            doc.insert(path, value);
+        }
+        Some((head, rest)) => {
+            if !matches!(doc.get(head), Some(Bson::Document(_))) {
+                doc.insert(head, Document::new());
+            }
+            if let Some(Bson::Document(inner)) = doc.get_mut(head) {
+                set_path(inner, rest, value);
+            }
+        }
+    }
+}
+
+/// Remove a dotted path; missing levels are ignored
+pub fn remove_path(doc: &mut Document, path: &str) {
+    match path.split_once('.') {
+        None => {
+            doc.remove(path);
+        }
+        Some((head, rest)) => {
+            if let Some(Bson::Document(inner)) = doc.get_mut(head) {
+                remove_path(inner, rest);
+            }
+        }
+    }
+}
@@ -0,0 +1,250 @@
+/*!
+ * @file external_sort.rs
+ * @brief $sort for the in-process engine: bounded top-K and external merge sort
+ *
+ * A $sort followed by $limit keeps only K documents in a binary heap. A
+ * plain $sort sorts in memory up to the query's memory budget and, when
+ * allowDiskUse is set, spills sorted runs through the spill module and
+ * merges them back.
+ */
+
+use crate::bson_order::{compare_bson, lookup_path};
+use crate::error::{FauxDBError, Result};
+use crate::spill::{approximate_size, approximate_value_size, MemoryBudget, SpillRun};
+use bson::{Bson, Document};
+use std::borrow::Cow;
+use std::cmp::Ordering;
+use std::collections::BinaryHeap;
+
+type DocIter<'a> = Box<dyn Iterator<Item = Result<Cow<'a, Document>>> + 'a>;
+
+/// Parsed `$sort` specification
+#[derive(Debug, Clone)]
+pub struct SortSpec {
+    keys: Vec<(String, bool)>,
+}
+
+impl SortSpec {
+    pub fn parse(sort: &Document) -> Result<Self> {
+        let mut keys = Vec::with_capacity(sort.len());
+        for (field, direction) in sort {
+            let descending = match direction {
+                Bson::Int32(1) | Bson::Int64(1) => false,
+                Bson::Int32(-1) | Bson::Int64(-1) => true,
+                Bson::Double(d) if *d == 1.0 => false,
+                Bson::Double(d) if *d == -1.0 => true,
+                _ => return Err(FauxDBError::Database(format!("$sort key '{}' must be 1 or -1", field))),
+            };
+            keys.push((field.clone(), descending));
+        }
+        if keys.is_empty() {
+            return Err(FauxDBError::Database("$sort requires at least one key".to_string()));
+        }
+        Ok(Self { keys })
+    }
+
+    /// Order two documents by this sort
+    pub fn compare(&self, a: &Document, b: &Document) -> Ordering {
+        self.sort_key(a).cmp(&self.sort_key(b))
+    }
+
+    /// A document's key under this sort; keys compare as the documents do
+    pub(crate) fn sort_key(&self, doc: &Document) -> Vec<SortValue> {
+        self.keys.iter()
+            .map(|(path, descending)| SortValue {
+                // Missing fields sort as null
+                value: lookup_path(doc, path).cloned().unwrap_or(Bson::Null),
+                descending: *descending,
+            })
+            .collect()
+    }
+}
+
+/// One sort key component; direction is folded into its ordering so whole
+/// keys compare lexicographically as plain Vecs
+#[derive(Debug, Clone)]
+pub(crate) struct SortValue {
+    value: Bson,
+    descending: bool,
+}
+
+impl SortValue {
+    pub(crate) fn approximate_size(&self) -> usize {
+        approximate_value_size(&self.value)
+    }
+}
+
+impl Ord for SortValue {
+    fn cmp(&self, other: &Self) -> Ordering {
+        let order = compare_bson(&self.value, &other.value);
+        if self.descending { order.reverse() } else { order }
+    }
+}
+
+impl PartialOrd for SortValue {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl PartialEq for SortValue {
+    fn eq(&self, other: &Self) -> bool {
+        self.cmp(other) == Ordering::Equal
+    }
+}
+
+impl Eq for SortValue {}
+
+/// A document with its extracted key; the ordinal makes the sort stable
+struct SortEntry<T> {
+    key: Vec<SortValue>,
+    ordinal: usize,
+    item: T,
+}
+
+impl<T> Ord for SortEntry<T> {
+    fn cmp(&self, other: &Self) -> Ordering {
+        self.key.cmp(&other.key).then(self.ordinal.cmp(&other.ordinal))
+    }
+}
+
+impl<T> PartialOrd for SortEntry<T> {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl<T> PartialEq for SortEntry<T> {
+    fn eq(&self, other: &Self) -> bool {
+        self.cmp(other) == Ordering::Equal
+    }
+}
+
+impl<T> Eq for SortEntry<T> {}
+
+/// Keep the first `limit` documents in sort order using a max-heap of at
+/// most `limit` entries, so memory is O(K) regardless of input size
+pub fn top_k<'a, I>(spec: &SortSpec, input: I, limit: usize) -> Result<Vec<Cow<'a, Document>>>
+where
+    I: Iterator<Item = Result<Cow<'a, Document>>>,
+{
+    if limit == 0 {
+        return Ok(Vec::new());
+    }
+
+    let mut heap: BinaryHeap<SortEntry<Cow<'a, Document>>> = BinaryHeap::with_capacity(limit + 1);
+    for (ordinal, doc) in input.enumerate() {
+        let doc = doc?;
+        let key = spec.sort_key(&doc);
+
+        if heap.len() == limit {
+            // Cheap reject before building an entry that would be popped straight away
+            let worst = heap.peek().unwrap();
+            if key.cmp(&worst.key) != Ordering::Less {
+                continue;
+            }
+            heap.pop();
+        }
+        heap.push(SortEntry { key, ordinal, item: doc });
+    }
+
+    Ok(heap.into_sorted_vec().into_iter().map(|entry| entry.item).collect())
+}
+
+/// Full sort with optional spilling. Returns documents in sort order.
+pub fn external_sort<'a, I>(
+    spec: &SortSpec,
+    input: I,
+    budget: &MemoryBudget,
+) -> Result<DocIter<'a>>
+where
+    I: Iterator<Item = Result<Cow<'a, Document>>>,
+{
+    let mut run: Vec<SortEntry<Cow<'a, Document>>> = Vec::new();
+    let mut run_bytes = 0usize;
+    let mut spilled: Vec<SpillRun> = Vec::new();
+
+    for (ordinal, doc) in input.enumerate() {
+        let doc = doc?;
+        run_bytes += approximate_size(&doc);
+        run.push(SortEntry { key: spec.sort_key(&doc), ordinal, item: doc });
+
+        if budget.must_spill("$sort", run_bytes)? {
+            run.sort_unstable();
+            spilled.push(SpillRun::write("$sort", run.drain(..).map(|entry| entry.item))?);
+            run_bytes = 0;
+        }
+    }
+
+    run.sort_unstable();
+    if spilled.is_empty() {
+        return Ok(Box::new(run.into_iter().map(|entry| Ok(entry.item))));
+    }
+
+    // The in-memory tail holds the latest ordinals, so it merges as the last run
+    let mut sources: Vec<DocIter<'a>> = Vec::with_capacity(spilled.len() + 1);
+    for spill in spilled {
+        sources.push(Box::new(spill.into_reader()?.map(|doc| doc.map(Cow::Owned))));
+    }
+    sources.push(Box::new(run.into_iter().map(|entry| Ok(entry.item))));
+
+    Ok(Box::new(MergeIterator::new(spec.clone(), sources)?))
+}
+
+/// K-way merge of sorted runs. Runs are few, so the smallest head is found
+/// by a linear scan; ties go to the earlier run, which keeps the sort stable.
+struct MergeIterator<'a> {
+    spec: SortSpec,
+    sources: Vec<DocIter<'a>>,
+    heads: Vec<Option<(Vec<SortValue>, Cow<'a, Document>)>>,
+}
+
+impl<'a> MergeIterator<'a> {
+    fn new(spec: SortSpec, mut sources: Vec<DocIter<'a>>) -> Result<Self> {
+        let mut heads = Vec::with_capacity(sources.len());
+        for source in sources.iter_mut() {
+            heads.push(Self::pull(&spec, source)?);
+        }
+        Ok(Self { spec, sources, heads })
+    }
+
+    fn pull(
+        spec: &SortSpec,
+        source: &mut DocIter<'a>,
+    ) -> Result<Option<(Vec<SortValue>, Cow<'a, Document>)>> {
+        match source.next() {
+            Some(doc) => {
+                let doc = doc?;
+                Ok(Some((spec.sort_key(&doc), doc)))
+            }
+            None => Ok(None),
+        }
+    }
+}
+
+impl<'a> Iterator for MergeIterator<'a> {
+    type Item = Result<Cow<'a, Document>>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let mut best: Option<usize> = None;
+        for (index, head) in self.heads.iter().enumerate() {
+            if let Some((key, _)) = head {
+                let better = match best {
+                    None => true,
+                    Some(current) => key < &self.heads[current].as_ref().unwrap().0,
+                };
+                if better {
+                    best = Some(index);
+                }
+            }
+        }
+
+        let index = best?;
+        let (_, doc) = self.heads[index].take().unwrap();
+        match Self::pull(&self.spec, &mut self.sources[index]) {
+            Ok(next_head) => self.heads[index] = next_head,
+            Err(e) => return Some(Err(e)),
+        }
+        Some(Ok(doc))
+    }
+}
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file find.rs
+ * @brief find command over the collection tables
+ *
+ * When the collection stores raw BSON and the query needs nothing from the
+ * documents beyond what SQL can do, rows are read from bson_document and
+ * spliced into firstBatch as-is, without ever being decoded. Residual
+ * filters, projections and sorts SQL cannot order correctly decode rows and
+ * finish the query in process.
+ */
+
+use crate::document_codec::{bson_to_json, decode_json, scalar_json, write_string, JsonbText, StorageLayout, StorageMode};
+use crate::error::{FauxDBError, Result};
+use crate::expression::{CompiledProjection, Expr};
+use crate::external_sort::{external_sort, SortSpec};
+use crate::fauxdb_debug;
+use crate::point_lookup::PointLookupBatcher;
+use crate::postgresql_manager::collection_table;
+use crate::predicate::CompiledPredicate;
+use crate::result_cache::ResultCache;
+use crate::single_flight::{find_key, SingleFlight};
+use crate::spill::MemoryBudget;
+use crate::transactions::ConnectionTarget;
+use crate::wire_protocol::WireProtocolHandler;
+use bson::{Bson, Document};
+use metrics::counter;
+use std::borrow::Cow;
+use std::sync::Arc;
+use tokio_postgres::error::SqlState;
+
+/// A parsed find command
+#[derive(Debug, Clone)]
+pub struct FindRequest {
+    pub database: String,
+    pub collection: String,
+    pub filter: Document,
+    pub projection: Option<Document>,
+    pub sort: Option<Document>,
+    pub skip: u64,
+    pub limit: Option<u64>,
+}
+
+/// SQL for a find plus whatever has to run after it
+#[derive(Debug)]
+pub struct FindPlan {
+    pub sql: String,
+    /// JSONB containment documents bound as $1, $2, ...
+    pub params: Vec<String>,
+    /// Filter clauses SQL could not evaluate
+    pub residual: Option<Document>,
+    /// Sort SQL could not do with BSON ordering
+    pub sort_in_process: bool,
+    /// The sort is in SQL, and a third column says whether the first row
+    /// has keys it can't order; if so the query is planned again with
+    /// the sort in process
+    pub checks_order: bool,
+    /// Leading rows to drop after SQL, for a skip SQL could not apply
+    pub skip_rows: usize,
+    pub reads_bson: bool,
+}
+
+impl FindPlan {
+    /// Rows can be returned byte for byte as stored
+    pub fn is_passthrough(&self, request: &FindRequest) -> bool {
+        self.reads_bson && self.residual.is_none() && !self.sort_in_process && request.projection.is_none()
+    }
+}
+
+impl FindRequest {
+    pub fn parse(command: &Document) -> Result<Self> {
+        let collection = command.get_str("find")
+            .map_err(|_| FauxDBError::WireProtocol("Missing collection in find command".to_string()))?;
+        let non_empty = |key: &str| command.get_document(key).ok().filter(|doc| !doc.is_empty()).cloned();
+        let number = |key: &str| match command.get(key) {
+            Some(Bson::Int32(n)) => Some(*n as i64),
+            Some(Bson::Int64(n)) => Some(*n),
+            Some(Bson::Double(n)) => Some(*n as i64),
+            _ => None,
+        };
+
+        Ok(Self {
+            database: command.get_str("$db").unwrap_or("fauxdb").to_string(),
+            collection: collection.to_string(),
+            filter: command.get_document("filter").cloned().unwrap_or_default(),
+            projection: non_empty("projection"),
+            sort: non_empty("sort"),
+            skip: number("skip").unwrap_or(0).max(0) as u64,
+            // A negative limit asks for a single batch of that size; 0 means no limit
+            limit: number("limit").map(i64::unsigned_abs).filter(|limit| *limit > 0),
+        })
+    }
+
+    pub fn namespace(&self) -> String {
+        format!("{}.{}", self.database, self.collection)
+    }
+
+    /// `_id` JSON when this find fetches at most one document by `_id`
+    pub fn point_lookup_id(&self, layout: &StorageLayout) -> Option<String> {
+        if self.filter.len() != 1 || self.skip > 0 || !jsonb_has(layout, "_id") {
+            return None;
+        }
+        self.filter.get("_id").and_then(id_equality_json)
+    }
+
+    pub fn plan(&self, layout: &StorageLayout) -> Result<FindPlan> {
+        self.plan_sorting(layout, true)
+    }
+
+    /// The plan with the sort always done in process
+    pub fn plan_unordered(&self, layout: &StorageLayout) -> Result<FindPlan> {
+        self.plan_sorting(layout, false)
+    }
+
+    fn plan_sorting(&self, layout: &StorageLayout, sort_in_sql: bool) -> Result<FindPlan> {
+        let mut params = Vec::new();
+        let (conditions, residual) = pushdown_filter(&self.filter, layout, &mut params);
+
+        let pushdown = self.sort.as_ref()
+            .filter(|_| sort_in_sql)
+            .and_then(|sort| pushdown_sort(sort, layout));
+        let sort_in_process = self.sort.is_some() && pushdown.is_none();
+        let checks_order = pushdown.is_some();
+
+        let reads_bson = layout.reads_bson();
+        let mut sql = format!("SELECT {}", document_columns(layout));
+        let mut order_by = Vec::new();
+        if let Some(pushdown) = pushdown {
+            // Rows SQL can't order sort first, so the first row tells
+            sql.push_str(&format!(", {} AS unordered", pushdown.unordered));
+            order_by.push("unordered DESC".to_string());
+            order_by.extend(pushdown.order_by);
+        }
+        order_by.push("id".to_string());
+        sql.push_str(&format!(" FROM {}", collection_table(&self.database, &self.collection)));
+        if !conditions.is_empty() {
+            sql.push_str(" WHERE ");
+            sql.push_str(&conditions.join(" AND "));
+        }
+        sql.push_str(" ORDER BY ");
+        sql.push_str(&order_by.join(", "));
+
+        // skip and limit only apply in SQL when every later step keeps row
+        // order and count. A checked sort must see the skipped rows too.
+        let mut skip_rows = 0;
+        if residual.is_none() && !sort_in_process {
+            let skip = if checks_order { 0 } else { self.skip };
+            if let Some(limit) = self.limit {
+                sql.push_str(&format!(" LIMIT {}", limit + self.skip - skip));
+            }
+            if skip > 0 {
+                sql.push_str(&format!(" OFFSET {}", skip));
+            }
+            skip_rows = (self.skip - skip) as usize;
+        }
+
+        Ok(FindPlan { sql, params, residual, sort_in_process, checks_order, skip_rows, reads_bson })
+    }
+
+    /// Finish a query in process: residual filter, sort, skip/limit, projection
+    fn finish(&self, plan: &FindPlan, rows: Vec<Document>) -> Result<Vec<Vec<u8>>> {
+        let mut documents: Vec<Document> = match &plan.residual {
+            Some(residual) => {
+                let predicate = CompiledPredicate::compile(residual)?;
+                rows.into_iter().filter(|doc| predicate.matches(doc)).collect()
+            }
+            None => rows,
+        };
+
+        if plan.sort_in_process {
+            if let Some(sort) = &self.sort {
+                let spec = SortSpec::parse(sort)?;
+                let input = documents.into_iter().map(|doc| Ok(Cow::Owned(doc)));
+                documents = external_sort(&spec, input, &MemoryBudget::default())?
+                    .map(|doc| doc.map(Cow::into_owned))
+                    .collect::<Result<_>>()?;
+            }
+        }
+
+        let in_sql = plan.residual.is_none() && !plan.sort_in_process;
+        let skip = if in_sql { plan.skip_rows } else { self.skip as usize };
+        let limit = if in_sql { usize::MAX } else { self.limit.map_or(usize::MAX, |limit| limit as usize) };
+        let projection = self.projection.as_ref().map(CompiledProjection::compile).transpose()?;
+
+        documents.into_iter().skip(skip).take(limit)
+            .map(|doc| {
+                let doc = match &projection {
+                    Some(projection) => projection.apply(&doc)?,
+                    None => doc,
+                };
+                Ok(bson::to_vec(&doc)?)
+            })
+            .collect()
+    }
+}
+
+fn jsonb_has(layout: &StorageLayout, field: &str) -> bool {
+    match layout.mode {
+        StorageMode::Jsonb | StorageMode::Both => true,
+        StorageMode::Bson => field == "_id" || layout.indexed_paths.iter().any(|path| path == field),
+    }
+}
+
+/// A sort done in SQL
+#[derive(Debug, Clone)]
+pub struct SortPushdown {
+    pub order_by: Vec<String>,
+    /// True for rows whose sort keys SQL can't order as MongoDB does
+    pub unordered: String,
+}
+
+/// ORDER BY terms for a sort, or None when it has to be sorted in process.
+/// Sort keys go to SQL when JSONB holds them; paths it doesn't hold are
+/// sorted here. Scalars sort as in MongoDB: missing and null, then numbers,
+/// strings in byte order (COLLATE "C", not the database collation), then
+/// booleans. Arrays and objects, tagged BSON types included, don't, and
+/// `unordered` flags rows holding them so the caller can sort in process.
+pub fn pushdown_sort(sort: &Document, layout: &StorageLayout) -> Option<SortPushdown> {
+    let mut order_by = Vec::with_capacity(sort.len() * 3 + 1);
+    let mut unordered = Vec::with_capacity(sort.len());
+    for (field, direction) in sort {
+        let descending = matches!(direction, Bson::Int32(-1) | Bson::Int64(-1))
+            || matches!(direction, Bson::Double(d) if *d == -1.0);
+        if field.contains('.') || !jsonb_has(layout, field) {
+            return None;
+        }
+        let field = field.replace('\'', "''");
+        let direction = if descending { "DESC" } else { "ASC" };
+        order_by.push(format!(
+            "CASE jsonb_typeof(document -> '{f}') WHEN 'number' THEN 1 WHEN 'string' THEN 2 WHEN 'boolean' THEN 3 ELSE 0 END {d}",
+            f = field, d = direction
+        ));
+        order_by.push(format!(
+            "(CASE WHEN jsonb_typeof(document -> '{f}') = 'string' THEN document ->> '{f}' END) COLLATE \"C\" {d}",
+            f = field, d = direction
+        ));
+        order_by.push(format!("document -> '{}' {}", field, direction));
+        unordered.push(format!("jsonb_typeof(document -> '{}') IN ('array', 'object')", field));
+    }
+    let unordered = match unordered.is_empty() {
+        true => "false".to_string(),
+        false => format!("COALESCE({}, false)", unordered.join(" OR ")),
+    };
+    Some(SortPushdown { order_by, unordered })
+}
+
+/// Split a filter into SQL conditions over `document` and the clauses left
+/// for the in-process predicate. Top-level scalar equality becomes
+/// GIN-indexable containment; Mongo equality also matches arrays holding
+/// the value, hence the second arm. `_id` is never an array, so it compares
+/// whole values through the unique `_id` index instead. Containment
+/// documents are appended to `params` and referenced by position.
+pub fn pushdown_filter(filter: &Document, layout: &StorageLayout, params: &mut Vec<String>) -> (Vec<String>, Option<Document>) {
+    let mut conditions = Vec::new();
+    let mut residual = Document::new();
+    for (field, value) in filter {
+        if field == "$expr" {
+            conditions.extend(expr_prefilter(value, layout));
+            residual.insert(field.clone(), value.clone());
+            continue;
+        }
+        let pushable = !field.starts_with('$') && !field.contains('.') && jsonb_has(layout, field);
+        if pushable && field == "_id" {
+            if let Some(json) = id_equality_json(value) {
+                params.push(json);
+                conditions.push(format!("document -> '_id' = ${}", params.len()));
+                continue;
+            }
+        }
+        match scalar_json(value).filter(|_| pushable) {
+            Some(json) => {
+                let mut key = String::new();
+                write_string(field, &mut key);
+                params.push(format!("{{{}:{}}}", key, json));
+                params.push(format!("{{{}:[{}]}}", key, json));
+                conditions.push(format!("(document @> ${} OR document @> ${})", params.len() - 1, params.len()));
+            }
+            None => {
+                residual.insert(field.clone(), value.clone());
+            }
+        }
+    }
+    let residual = if residual.is_empty() { None } else { Some(residual) };
+    (conditions, residual)
+}
+
+/// A condition that holds for every document an `$expr` comparing numbers
+/// matches, so SQL can drop the rest while the predicate still decides.
+/// It is exact for documents whose fields are all JSON numbers, and lets
+/// every other document through.
+fn expr_prefilter(value: &Bson, layout: &StorageLayout) -> Option<String> {
+    let expr = Expr::parse(value).ok().filter(Expr::compares_numbers)?;
+    let mut fields = Vec::new();
+    let condition = expr.to_sql_predicate_with(&mut |path| {
+        if path.contains('.') || !jsonb_has(layout, path) {
+            return Err(FauxDBError::Database(format!("${} is not held in JSONB", path)));
+        }
+        // CASE, unlike OR, guarantees the cast only sees numbers
+        let path = path.replace('\'', "''");
+        let column = format!(
+            "(CASE WHEN jsonb_typeof(document -> '{p}') = 'number' THEN (document ->> '{p}')::numeric END)",
+            p = path
+        );
+        fields.push(path);
+        Ok(column)
+    }).ok()?;
+    if fields.is_empty() {
+        return None;
+    }
+    fields.sort();
+    fields.dedup();
+    let other_types: Vec<String> = fields.iter()
+        .map(|field| format!("jsonb_typeof(document -> '{}') IS DISTINCT FROM 'number'", field))
+        .collect();
+    Some(format!("({} OR {})", other_types.join(" OR "), condition))
+}
+
+/// JSON for an `_id` equality value; operator documents and regexes are
+/// left to the predicate
+pub(crate) fn id_equality_json(value: &Bson) -> Option<String> {
+    match value {
+        Bson::Document(spec) if spec.keys().any(|key| key.starts_with('$')) => None,
+        Bson::RegularExpression(_) | Bson::Array(_) => None,
+        value => bson_to_json(value).ok(),
+    }
+}
+
+/// Select list read by `row_bytes` / `row_document`: stored BSON, and the
+/// JSONB text only for rows without it (updates done in SQL clear the BSON)
+pub fn document_columns(layout: &StorageLayout) -> &'static str {
+    if layout.reads_bson() {
+        "bson_document, CASE WHEN bson_document IS NULL THEN document::text END"
+    } else {
+        "NULL::bytea, document::text"
+    }
+}
+
+/// A row's document as BSON bytes, copied as stored when possible
+pub fn row_bytes(row: &tokio_postgres::Row) -> Result<Vec<u8>> {
+    match row.get::<_, Option<Vec<u8>>>(0) {
+        Some(bytes) => Ok(bytes),
+        None => Ok(bson::to_vec(&decode_json(row.get(1))?)?),
+    }
+}
+
+pub fn row_document(row: &tokio_postgres::Row) -> Result<Document> {
+    match row.get::<_, Option<&[u8]>>(0) {
+        Some(bytes) => Ok(Document::from_reader(&mut &bytes[..])?),
+        None => decode_json(row.get(1)),
+    }
+}
+
+/// State finds share across client connections
+#[derive(Default)]
+pub struct FindServices {
+    /// Coalesces concurrent `_id` lookups; None runs each on its own
+    pub point_lookups: Option<Arc<PointLookupBatcher>>,
+    /// Shares one execution among identical concurrent finds
+    pub single_flight: Option<SingleFlight>,
+    /// Serves repeated finds on read-mostly collections without a query
+    pub result_cache: Option<Arc<ResultCache>>,
+}
+
+/// Execute a find command and return the encoded reply body
+pub async fn find_command(target: ConnectionTarget<'_>, layout: &StorageLayout, services: &FindServices, command: &Document) -> Result<Vec<u8>> {
+    let request = FindRequest::parse(command)?;
+    let cache = services.result_cache.as_ref()
+        .filter(|cache| cache.applies_to(&request.database, &request.collection))
+        .and_then(|cache| Some((cache, find_key(command)?)));
+    let Some((cache, key)) = cache else {
+        return execute_find(target, layout, services, &request, command).await;
+    };
+
+    if let Some(reply) = cache.get(&key) {
+        return Ok(reply);
+    }
+    let stamp = cache.stamp();
+    let reply = execute_find(target, layout, services, &request, command).await?;
+    cache.insert(key, request.namespace(), stamp, &reply);
+    Ok(reply)
+}
+
+async fn execute_find(
+    target: ConnectionTarget<'_>,
+    layout: &StorageLayout,
+    services: &FindServices,
+    request: &FindRequest,
+    command: &Document,
+) -> Result<Vec<u8>> {
+    // Reads in a transaction see its writes only on its own connection
+    let point_lookups = services.point_lookups.as_ref().filter(|_| !target.in_transaction());
+    if let (Some(batcher), Some(id)) = (point_lookups, request.point_lookup_id(layout)) {
+        let table = collection_table(&request.database, &request.collection);
+        let batch = match batcher.lookup(&table, id).await? {
+            None => Vec::new(),
+            Some(bytes) => match &request.projection {
+                None => vec![bytes],
+                Some(projection) => {
+                    let document = Document::from_reader(&mut &bytes[..])?;
+                    vec![bson::to_vec(&CompiledProjection::compile(projection)?.apply(&document)?)?]
+                }
+            },
+        };
+        return WireProtocolHandler::build_cursor_reply(&request.namespace(), &batch);
+    }
+
+    if let Some(single_flight) = services.single_flight.as_ref().filter(|flight| flight.applies_to(&request.database, &request.collection)) {
+        if let Some(key) = find_key(command) {
+            return single_flight.run(key, || run_find(target, layout, request)).await;
+        }
+    }
+    run_find(target, layout, request).await
+}
+
+async fn run_find(target: ConnectionTarget<'_>, layout: &StorageLayout, request: &FindRequest) -> Result<Vec<u8>> {
+    let mut plan = request.plan(layout)?;
+    fauxdb_debug!("Running {}", plan.sql);
+
+    let connection = target.checkout().await?;
+    let client = connection.client();
+
+    // Finding in a collection that doesn't exist yet returns nothing
+    let table = collection_table(&request.database, &request.collection);
+    let empty: [&[u8]; 0] = [];
+    if !target.catalog().exists(connection.pooled(), &table).await? {
+        return WireProtocolHandler::build_cursor_reply(&request.namespace(), &empty);
+    }
+
+    let mut rows = match connection.pooled().timed(query_plan(client, &plan)).await {
+        Ok(rows) => rows,
+        // Dropped since the catalog last heard of it. A transaction is
+        // aborted by the failed query, so there the error stands.
+        Err(e) if e.code() == Some(&SqlState::UNDEFINED_TABLE) && !target.in_transaction() => {
+            target.catalog().forget(&table);
+            return WireProtocolHandler::build_cursor_reply(&request.namespace(), &empty);
+        }
+        Err(e) => return Err(FauxDBError::Database(format!("Failed to query documents: {}", e))),
+    };
+    if plan.checks_order && rows.first().map_or(false, |row| row.get::<_, bool>(2)) {
+        counter!("fauxdb_find_sort_fallbacks_total").increment(1);
+        plan = request.plan_unordered(layout)?;
+        rows = connection.pooled().timed(query_plan(client, &plan)).await
+            .map_err(|e| FauxDBError::Database(format!("Failed to query documents: {}", e)))?;
+    }
+
+    let batch: Vec<Vec<u8>> = if plan.is_passthrough(request) {
+        counter!("fauxdb_find_passthrough_total").increment(1);
+        rows.iter().skip(plan.skip_rows).map(row_bytes).collect::<Result<_>>()?
+    } else {
+        counter!("fauxdb_find_decoded_total").increment(1);
+        let documents = rows.iter().map(row_document).collect::<Result<Vec<Document>>>()?;
+        request.finish(&plan, documents)?
+    };
+
+    WireProtocolHandler::build_cursor_reply(&request.namespace(), &batch)
+}
+
+async fn query_plan(client: &tokio_postgres::Client, plan: &FindPlan) -> std::result::Result<Vec<tokio_postgres::Row>, tokio_postgres::Error> {
+    let params: Vec<JsonbText<&str>> = plan.params.iter().map(|param| JsonbText(param.as_str())).collect();
+    let param_refs: Vec<&(dyn tokio_postgres::types::ToSql + Sync)> = params.iter()
+        .map(|param| param as &(dyn tokio_postgres::types::ToSql + Sync))
+        .collect();
+    client.query(&plan.sql, &param_refs).await
+}
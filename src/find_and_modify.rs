@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file find_and_modify.rs
+ * @brief findAndModify as a single UPDATE / DELETE ... RETURNING
+ *
+ * The target row is picked and locked by a LIMIT 1 subselect with FOR UPDATE
+ * SKIP LOCKED, and modified by the same statement, so claiming the next item
+ * of a queue costs one round trip. Concurrent claims skip rows another
+ * claim holds instead of queueing behind it. The row is matched back by its
+ * primary key rather than ctid: a version committed after the statement's
+ * snapshot has a new ctid the outer scan would not see.
+ *
+ * An upsert whose query pins `_id` is one INSERT ... ON CONFLICT on the
+ * unique `_id` index instead, so concurrent upserts of the same `_id` can't
+ * both insert.
+ */
+
+use crate::document_codec::{decode_json, JsonbText, StorageLayout, StorageMode};
+use crate::error::{FauxDBError, Result};
+use crate::expression::CompiledProjection;
+use crate::external_sort::{SortSpec, SortValue};
+use crate::fauxdb_debug;
+use crate::find::{document_columns, id_equality_json, pushdown_filter, pushdown_sort, row_document, SortPushdown};
+use crate::postgresql_manager::collection_table;
+use crate::predicate::CompiledPredicate;
+use crate::spill::MemoryBudget;
+use crate::transactions::ConnectionTarget;
+use crate::update::{compile_update, compile_update_from, database_error, query, upsert_document, where_clause};
+use bson::{doc, Bson, Document};
+use futures::{pin_mut, TryStreamExt};
+use metrics::counter;
+use tokio_postgres::types::ToSql;
+use tokio_postgres::Client;
+
+fn invalid(message: &str) -> FauxDBError {
+    FauxDBError::WireProtocol(message.to_string())
+}
+
+/// A parsed findAndModify command
+#[derive(Debug, Clone)]
+pub struct FindAndModifyRequest {
+    pub database: String,
+    pub collection: String,
+    pub query: Document,
+    pub sort: Option<Document>,
+    pub remove: bool,
+    pub update: Option<Document>,
+    /// Return the modified document instead of the original
+    pub new: bool,
+    pub fields: Option<Document>,
+    pub upsert: bool,
+}
+
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct FindAndModifyOutcome {
+    pub value: Option<Document>,
+    pub n: u64,
+    pub updated_existing: bool,
+    pub upserted: Option<Bson>,
+}
+
+impl FindAndModifyRequest {
+    pub fn parse(command: &Document) -> Result<Self> {
+        let collection = command.get_str("findAndModify")
+            .or_else(|_| command.get_str("findandmodify"))
+            .map_err(|_| invalid("Missing collection in findAndModify command"))?;
+        let non_empty = |key: &str| command.get_document(key).ok().filter(|doc| !doc.is_empty()).cloned();
+
+        let request = Self {
+            database: command.get_str("$db").unwrap_or("fauxdb").to_string(),
+            collection: collection.to_string(),
+            query: command.get_document("query").cloned().unwrap_or_default(),
+            sort: non_empty("sort"),
+            remove: command.get_bool("remove").unwrap_or(false),
+            update: match command.get("update") {
+                Some(Bson::Document(update)) => Some(update.clone()),
+                Some(Bson::Array(_)) => return Err(invalid("Pipeline-style updates are not supported")),
+                _ => None,
+            },
+            new: command.get_bool("new").unwrap_or(false),
+            fields: non_empty("fields"),
+            upsert: command.get_bool("upsert").unwrap_or(false),
+        };
+
+        match (request.remove, &request.update) {
+            (true, Some(_)) => return Err(invalid("Cannot specify both an update and remove=true")),
+            (false, None) => return Err(invalid("Either an update or remove=true must be specified")),
+            (true, None) if request.new || request.upsert => {
+                return Err(invalid("Cannot specify new=true or upsert=true with remove=true"));
+            }
+            _ => {}
+        }
+        Ok(request)
+    }
+
+    /// Reply body, with `fields` applied to the returned document
+    pub fn to_response(&self, outcome: &FindAndModifyOutcome) -> Result<Document> {
+        let mut last_error = doc! { "n": outcome.n as i32 };
+        if !self.remove {
+            last_error.insert("updatedExisting", outcome.updated_existing);
+        }
+        if let Some(id) = &outcome.upserted {
+            last_error.insert("upserted", id.clone());
+        }
+
+        let value = match (&outcome.value, &self.fields) {
+            (Some(document), Some(fields)) => Bson::Document(CompiledProjection::compile(fields)?.apply(document)?),
+            (Some(document), None) => Bson::Document(document.clone()),
+            (None, _) => Bson::Null,
+        };
+        Ok(doc! { "lastErrorObject": last_error, "value": value, "ok": 1.0 })
+    }
+}
+
+/// Run a findAndModify on an existing collection
+pub async fn find_and_modify(request: &FindAndModifyRequest, client: &Client, layout: &StorageLayout) -> Result<FindAndModifyOutcome> {
+    if !request.remove && layout.mode == StorageMode::Bson {
+        return Err(FauxDBError::Config("Updates are applied to the JSONB document; storage_mode bson does not support them".to_string()));
+    }
+    let table = collection_table(&request.database, &request.collection);
+
+    let mut params = Vec::new();
+    let new_document = match &request.update {
+        Some(update) => Some(compile_update(update, &mut params)?),
+        None => None,
+    };
+    let (mut conditions, residual) = pushdown_filter(&request.query, layout, &mut params);
+    let pins_id = request.query.get("_id").map_or(false, |id| id_equality_json(id).is_some());
+    if let (Some(update), true, None) = (&request.update, request.upsert && pins_id, &residual) {
+        match upsert_by_id(request, client, &table, layout, update).await {
+            Err(FauxDBError::Database(message)) if message.contains("no unique or exclusion constraint") => {
+                // Collections created before the _id index existed
+                fauxdb_debug!("{} has no unique _id index, upserting in two steps", table);
+            }
+            result => return result,
+        }
+    }
+    // A sort SQL can do runs in the statement, which flags the rows it
+    // can't order. When one of those sorts first nothing is modified and
+    // the statement runs again with candidates picked in process.
+    let mut sql_order = match (&request.sort, &residual) {
+        (_, Some(_)) => None,
+        (None, None) => Some(SortPushdown { order_by: Vec::new(), unordered: "false".to_string() }),
+        (Some(sort), None) => pushdown_sort(sort, layout),
+    };
+    let mut ids = None;
+    loop {
+        // Filters and sorts SQL can't do pick the candidates in process; the
+        // statement then takes the first of them, in order, that isn't locked
+        let order = match sql_order.take() {
+            Some(order) => order,
+            None => {
+                let candidates = candidate_ids(client, &table, layout, request, residual.as_ref()).await?;
+                if candidates.is_empty() {
+                    return no_match(request, client, &table).await;
+                }
+                let param = params.len() + 1;
+                conditions.push(format!("id = ANY(${})", param));
+                ids = Some(candidates);
+                SortPushdown { order_by: vec![format!("array_position(${}, id)", param)], unordered: "false".to_string() }
+            }
+        };
+        let mut order_by = Vec::with_capacity(order.order_by.len() + 2);
+        if order.unordered != "false" {
+            order_by.push("unordered DESC".to_string());
+        }
+        order_by.extend(order.order_by);
+        order_by.push("id".to_string());
+
+        // An upsert must not skip a locked match and insert a second document
+        let lock = if request.upsert { "FOR UPDATE" } else { "FOR UPDATE SKIP LOCKED" };
+        let target = format!(
+            "SELECT id AS row_id, bson_document AS old_bson, document AS old_document, {} AS unordered \
+             FROM {} WHERE {} ORDER BY {} LIMIT 1 {}",
+            order.unordered, table, where_clause(&conditions), order_by.join(", "), lock
+        );
+        let modify = match &new_document {
+            None => format!(
+                "DELETE FROM {t} AS t USING old WHERE t.id = old.row_id AND NOT old.unordered RETURNING {columns}",
+                t = table, columns = document_columns(layout)
+            ),
+            Some(new_document) => format!(
+                "UPDATE {t} AS t SET document = {new}, bson_document = NULL, updated_at = CURRENT_TIMESTAMP \
+                 FROM old WHERE t.id = old.row_id AND NOT old.unordered RETURNING {columns}",
+                t = table,
+                new = new_document,
+                columns = if request.new {
+                    "NULL::bytea, t.document::text"
+                } else {
+                    "old.old_bson, CASE WHEN old.old_bson IS NULL THEN old.old_document::text END"
+                },
+            ),
+        };
+        let sql = format!(
+            "WITH old AS ({}), modified AS ({}) \
+             SELECT *, false FROM modified UNION ALL SELECT NULL::bytea, NULL::text, true FROM old WHERE old.unordered",
+            target, modify
+        );
+        fauxdb_debug!("Running {}", sql);
+
+        let rows = query(client, &sql, &params, ids.as_ref()).await?;
+        match rows.first() {
+            Some(row) if row.get::<_, bool>(2) => {
+                counter!("fauxdb_find_and_modify_sort_fallbacks_total").increment(1);
+            }
+            Some(row) => {
+                counter!("fauxdb_find_and_modify_total").increment(1);
+                return Ok(FindAndModifyOutcome {
+                    value: Some(row_document(row)?),
+                    n: 1,
+                    updated_existing: !request.remove,
+                    upserted: None,
+                });
+            }
+            None => return no_match(request, client, &table).await,
+        }
+    }
+}
+
+/// An upsert pinned to `_id`, as a single INSERT ... ON CONFLICT. The CTE
+/// reads the original document from the statement's snapshot; a row that
+/// a concurrent upsert inserted after it was taken has no original to show.
+async fn upsert_by_id(
+    request: &FindAndModifyRequest,
+    client: &Client,
+    table: &str,
+    layout: &StorageLayout,
+    update: &Document,
+) -> Result<FindAndModifyOutcome> {
+    let mut params = Vec::new();
+    let (conditions, _) = pushdown_filter(&request.query, layout, &mut params);
+    let inserted = upsert_document(&request.query, update, &mut params)?;
+    let updated = compile_update_from(update, "t.document", false, &mut params)?;
+    // The rest of the filter runs over a subselect, as in execute_upsert
+    let guards: Vec<String> = conditions.iter()
+        .map(|condition| format!("EXISTS (SELECT 1 FROM (SELECT t.document AS document) c WHERE {})", condition))
+        .collect();
+
+    let sql = format!(
+        "WITH old AS (SELECT document FROM {table} WHERE {matched}) \
+         INSERT INTO {table} AS t (document) VALUES ({inserted}) \
+         ON CONFLICT ((document -> '_id')) DO UPDATE \
+         SET document = {updated}, bson_document = NULL, updated_at = CURRENT_TIMESTAMP WHERE {guards} \
+         RETURNING t.xmax = 0, t.document::text, (SELECT document::text FROM old)",
+        table = table,
+        matched = where_clause(&conditions),
+        inserted = inserted,
+        updated = updated,
+        guards = where_clause(&guards),
+    );
+    fauxdb_debug!("Running {}", sql);
+
+    let rows = query(client, &sql, &params, None).await?;
+    let Some(row) = rows.first() else {
+        // The _id exists but the rest of the query didn't match it, so the
+        // insert collides, as it does in MongoDB
+        let id = request.query.get("_id").cloned().unwrap_or(Bson::Null);
+        return Err(FauxDBError::DuplicateKey(format!("E11000 duplicate key error collection: {} index: _id_ dup key: {{ _id: {} }}", table, id)));
+    };
+    let document = decode_json(row.get(1))?;
+    if row.get::<_, bool>(0) {
+        counter!("fauxdb_upsert_inserts_total").increment(1);
+        return Ok(FindAndModifyOutcome {
+            upserted: document.get("_id").cloned(),
+            value: if request.new { Some(document) } else { None },
+            n: 1,
+            updated_existing: false,
+        });
+    }
+    counter!("fauxdb_find_and_modify_total").increment(1);
+    let value = match request.new {
+        true => Some(document),
+        false => row.get::<_, Option<&str>>(2).map(decode_json).transpose()?,
+    };
+    Ok(FindAndModifyOutcome { value, n: 1, updated_existing: true, upserted: None })
+}
+
+/// Ids of the rows matching the whole query, in sort order. Rows stream
+/// in and only their sort keys are kept, held to the default memory limit
+/// of a blocking sort; findAndModify can't spill, so past it the command
+/// fails as an unindexed find sort would.
+async fn candidate_ids(
+    client: &Client,
+    table: &str,
+    layout: &StorageLayout,
+    request: &FindAndModifyRequest,
+    residual: Option<&Document>,
+) -> Result<Vec<i32>> {
+    let mut params = Vec::new();
+    let (conditions, _) = pushdown_filter(&request.query, layout, &mut params);
+    let sql = format!("SELECT {}, id FROM {} WHERE {} ORDER BY id", document_columns(layout), table, where_clause(&conditions));
+    let jsonb: Vec<JsonbText<&str>> = params.iter().map(|param| JsonbText(param.as_str())).collect();
+    let rows = client.query_raw(sql.as_str(), jsonb.iter().map(|param| param as &(dyn ToSql + Sync))).await
+        .map_err(database_error)?;
+    pin_mut!(rows);
+
+    let predicate = residual.map(CompiledPredicate::compile).transpose()?;
+    let spec = request.sort.as_ref().map(SortSpec::parse).transpose()?;
+    let budget = MemoryBudget::default();
+    let mut used_bytes = 0;
+    let mut matching = Vec::new();
+    while let Some(row) = rows.try_next().await.map_err(database_error)? {
+        let document = row_document(&row)?;
+        if !predicate.as_ref().map_or(true, |predicate| predicate.matches(&document)) {
+            continue;
+        }
+        let key = spec.as_ref().map(|spec| spec.sort_key(&document)).unwrap_or_default();
+        used_bytes += key.iter().map(SortValue::approximate_size).sum::<usize>() + std::mem::size_of::<i32>();
+        if used_bytes > budget.limit_bytes {
+            return Err(FauxDBError::Database(format!(
+                "findAndModify sort exceeded the memory limit of {} bytes",
+                budget.limit_bytes
+            )));
+        }
+        matching.push((key, row.get::<_, i32>(2)));
+    }
+    // Stable, so equal keys stay in id order
+    matching.sort_by(|a, b| a.0.cmp(&b.0));
+    Ok(matching.into_iter().map(|(_, id)| id).collect())
+}
+
+/// Nothing matched: insert for an upsert, otherwise return a null value
+async fn no_match(request: &FindAndModifyRequest, client: &Client, table: &str) -> Result<FindAndModifyOutcome> {
+    let update = match &request.update {
+        Some(update) if request.upsert => update,
+        _ => return Ok(FindAndModifyOutcome::default()),
+    };
+
+    let mut params = Vec::new();
+    let inserted = upsert_document(&request.query, update, &mut params)?;
+    let sql = format!("INSERT INTO {} (document) VALUES ({}) RETURNING NULL::bytea, document::text", table, inserted);
+    fauxdb_debug!("Running {}", sql);
+    let rows = query(client, &sql, &params, None).await?;
+    let row = rows.first().ok_or_else(|| FauxDBError::Database("INSERT returned no rows".to_string()))?;
+    let document = row_document(row)?;
+    counter!("fauxdb_upsert_inserts_total").increment(1);
+
+    Ok(FindAndModifyOutcome {
+        upserted: document.get("_id").cloned(),
+        value: if request.new { Some(document) } else { None },
+        n: 1,
+        updated_existing: false,
+    })
+}
+
+/// Execute a findAndModify command
+pub async fn find_and_modify_command(target: ConnectionTarget<'_>, layout: &StorageLayout, command: &Document) -> Result<Document> {
+    let request = FindAndModifyRequest::parse(command)?;
+
+    let connection = target.checkout().await?;
+    let client = connection.client();
+    let table = collection_table(&request.database, &request.collection);
+
+    // A table dropped without the catalog noticing fails before anything
+    // is written, so the second pass sees it gone and recreates or skips it
+    let mut retried = false;
+    loop {
+        if request.upsert {
+            target.ensure_collection(client, &request.database, &request.collection).await?;
+        } else if !target.catalog().exists(connection.pooled(), &table).await? {
+            return request.to_response(&FindAndModifyOutcome::default());
+        }
+
+        match connection.pooled().timed(find_and_modify(&request, client, layout)).await {
+            Err(FauxDBError::UndefinedTable(_)) if !retried && !target.in_transaction() => {
+                counter!("fauxdb_catalog_retries_total").increment(1);
+                target.catalog().forget(&table);
+                retried = true;
+            }
+            Err(e @ FauxDBError::UndefinedTable(_)) => {
+                target.catalog().forget(&table);
+                return Err(e);
+            }
+            outcome => return request.to_response(&outcome?),
+        }
+    }
+}
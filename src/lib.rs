@@ -11,14 +11,36 @@
 pub mod error;
 pub mod config;
 pub mod postgresql_manager;
+pub mod collection_catalog;
+pub mod document_codec;
+pub mod bulk_insert;
+pub mod find;
+pub mod aggregate;
+pub mod point_lookup;
+pub mod single_flight;
+pub mod result_cache;
+pub mod update;
+pub mod delete;
+pub mod bulk_write;
+pub mod find_and_modify;
 pub mod postgresql_server;
 
 // Production-ready modules
 pub mod production_config;
+pub mod latency_histogram;
 pub mod connection_pool;
 pub mod mongodb_commands;
 pub mod aggregation_pipeline;
+pub mod pipeline_optimizer;
+pub mod explain;
 pub mod aggregation;
+pub mod expression;
+pub mod predicate;
+pub mod bson_order;
+pub mod spill;
+pub mod external_sort;
+pub mod aggregation_group;
+pub mod aggregation_window;
 pub mod indexing;
 pub mod transactions;
 pub mod production_server;
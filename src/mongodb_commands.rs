@@ -12,6 +12,8 @@ use std::collections::HashMap;
 use anyhow::Result;
 use bson::{Document, Bson};
 use crate::{fauxdb_info, fauxdb_warn};
+use crate::document_codec::StorageLayout;
+use crate::explain::ExplainRequest;
 
 pub type CommandHandler = Box<dyn Fn(Document) -> Result<Document> + Send + Sync>;
 
@@ -578,44 +580,15 @@ impl MongoDBCommandRegistry {
         Ok(response)
     }
 
-    fn handle_explain(_doc: Document) -> Result<Document> {
+    fn handle_explain(doc: Document) -> Result<Document> {
         fauxdb_info!("Processing explain command");
         
-        let mut response = Document::new();
-        response.insert("queryPlanner", bson::doc! {
-            "plannerVersion": 1,
-            "namespace": "test.users",
-            "indexFilterSet": false,
-            "parsedQuery": {},
-            "winningPlan": {
-                "stage": "COLLSCAN",
-                "direction": "forward"
-            },
-            "rejectedPlans": []
-        });
-        response.insert("executionStats", bson::doc! {
-            "executionSuccess": true,
-            "nReturned": 0,
-            "executionTimeMillis": 0,
-            "totalKeysExamined": 0,
-            "totalDocsExamined": 0,
-            "executionStages": {
-                "stage": "COLLSCAN",
-                "nReturned": 0,
-                "executionTimeMillisEstimate": 0,
-                "works": 2,
-                "advanced": 0,
-                "needTime": 1,
-                "needYield": 0,
-                "saveState": 0,
-                "restoreState": 0,
-                "isEOF": 1,
-                "direction": "forward",
-                "docsExamined": 0
-            }
-        });
-        response.insert("ok", 1.0);
-        Ok(response)
+        // Without a connection only the compiled SQL can be reported; the
+        // production server routes explain through explain::explain_command
+        // to attach the PostgreSQL plan. The registry doesn't know the
+        // configured storage mode, so the SQL is for the default layout.
+        let request = ExplainRequest::parse(&doc, &StorageLayout::default())?;
+        Ok(request.unplanned_response())
     }
 
 
@@ -0,0 +1,176 @@
+/*!
+ * Logical rewrites for MongoDB aggregation pipelines
+ *
+ * Runs before SQL generation so the compiler sees filters as early as
+ * possible and row limits fused with the sort that feeds them.
+ */
+
+use bson::{doc, Bson, Document};
+use crate::aggregation_pipeline::PipelineStage;
+use crate::fauxdb_debug;
+
+pub struct PipelineOptimizer;
+
+impl PipelineOptimizer {
+    /// Apply the rewrite rules until the pipeline stops changing.
+    /// Every rule either removes a stage or moves a $match earlier, so the
+    /// loop terminates.
+    pub fn optimize(stages: Vec<PipelineStage>) -> Vec<PipelineStage> {
+        let mut current = stages;
+        loop {
+            let (next, changed) = Self::rewrite_pass(current);
+            current = next;
+            if !changed {
+                return current;
+            }
+        }
+    }
+
+    fn rewrite_pass(stages: Vec<PipelineStage>) -> (Vec<PipelineStage>, bool) {
+        let mut output: Vec<PipelineStage> = Vec::with_capacity(stages.len());
+        let mut changed = false;
+
+        for stage in stages {
+            let previous = match output.pop() {
+                Some(previous) => previous,
+                None => {
+                    output.push(stage);
+                    continue;
+                }
+            };
+
+            match (previous, stage) {
+                (PipelineStage::Match(first), PipelineStage::Match(second)) => {
+                    output.push(PipelineStage::Match(Self::merge_filters(first, second)));
+                    changed = true;
+                }
+                (previous, PipelineStage::Match(filter)) if Self::match_can_move_before(&previous, &filter) => {
+                    fauxdb_debug!("Moving $match ahead of {:?}", previous);
+                    output.push(PipelineStage::Match(filter));
+                    output.push(previous);
+                    changed = true;
+                }
+                (PipelineStage::Sort(sort), PipelineStage::Limit(limit)) => {
+                    output.push(PipelineStage::TopK { sort, limit });
+                    changed = true;
+                }
+                (PipelineStage::TopK { sort, limit }, PipelineStage::Limit(next_limit)) => {
+                    output.push(PipelineStage::TopK { sort, limit: limit.min(next_limit) });
+                    changed = true;
+                }
+                (PipelineStage::Limit(limit), PipelineStage::Limit(next_limit)) => {
+                    output.push(PipelineStage::Limit(limit.min(next_limit)));
+                    changed = true;
+                }
+                (PipelineStage::Skip(skip), PipelineStage::Skip(next_skip)) => {
+                    output.push(PipelineStage::Skip(skip.saturating_add(next_skip)));
+                    changed = true;
+                }
+                (PipelineStage::Skip(skip), PipelineStage::Limit(limit)) => {
+                    // Limiting first lets a preceding $sort become a top-K
+                    output.push(PipelineStage::Limit(skip.saturating_add(limit)));
+                    output.push(PipelineStage::Skip(skip));
+                    changed = true;
+                }
+                (previous, stage) => {
+                    output.push(previous);
+                    output.push(stage);
+                }
+            }
+        }
+
+        (output, changed)
+    }
+
+    fn merge_filters(mut first: Document, second: Document) -> Document {
+        if second.keys().all(|key| !first.contains_key(key)) {
+            first.extend(second);
+            first
+        } else {
+            doc! { "$and": [first, second] }
+        }
+    }
+
+    /// A $match may run before `stage` when the fields it reads are not
+    /// produced or removed by that stage.
+    fn match_can_move_before(stage: &PipelineStage, filter: &Document) -> bool {
+        let fields = match Self::referenced_fields(filter) {
+            Some(fields) => fields,
+            None => return false,
+        };
+
+        match stage {
+            // Filtering and sorting commute
+            PipelineStage::Sort(_) => true,
+            PipelineStage::Project(projection) => Self::projection_preserves(projection, &fields),
+            PipelineStage::AddFields(added) | PipelineStage::Set(added) => {
+                fields.iter().all(|field| !added.keys().any(|key| Self::paths_overlap(field, key)))
+            }
+            _ => false,
+        }
+    }
+
+    /// Collect the top-level paths a filter reads. Returns None when the
+    /// filter uses an operator whose inputs cannot be determined statically.
+    fn referenced_fields(filter: &Document) -> Option<Vec<String>> {
+        let mut fields = Vec::new();
+        for (key, value) in filter {
+            match key.as_str() {
+                "$and" | "$or" | "$nor" => {
+                    for clause in value.as_array()? {
+                        fields.extend(Self::referenced_fields(clause.as_document()?)?);
+                    }
+                }
+                _ if key.starts_with('$') => return None,
+                _ => fields.push(key.clone()),
+            }
+        }
+        Some(fields)
+    }
+
+    fn projection_preserves(projection: &Document, fields: &[String]) -> bool {
+        // Anything other than an exclusion flag, computed fields included,
+        // makes this an inclusion projection that drops unlisted fields
+        let is_inclusion = projection.iter()
+            .filter(|(key, _)| key.as_str() != "_id")
+            .any(|(_, value)| !Self::is_falsy_flag(value));
+
+        for (key, value) in projection {
+            if !Self::is_truthy_flag(value) && !Self::is_falsy_flag(value) {
+                // Computed field: the filter must not read anything it replaces
+                if fields.iter().any(|field| Self::paths_overlap(field, key)) {
+                    return false;
+                }
+            }
+        }
+
+        fields.iter().all(|field| {
+            if field == "_id" || field.starts_with("_id.") {
+                return !matches!(projection.get("_id"), Some(value) if Self::is_falsy_flag(value));
+            }
+            let listed = projection.iter().find(|(key, _)| Self::paths_overlap(field, key));
+            match listed {
+                Some((key, value)) => Self::is_truthy_flag(value) && Self::is_path_prefix(key, field),
+                None => !is_inclusion,
+            }
+        })
+    }
+
+    fn is_truthy_flag(value: &Bson) -> bool {
+        matches!(value, Bson::Boolean(true) | Bson::Int32(1) | Bson::Int64(1))
+            || matches!(value, Bson::Double(d) if *d == 1.0)
+    }
+
+    fn is_falsy_flag(value: &Bson) -> bool {
+        matches!(value, Bson::Boolean(false) | Bson::Int32(0) | Bson::Int64(0))
+            || matches!(value, Bson::Double(d) if *d == 0.0)
+    }
+
+    fn is_path_prefix(prefix: &str, path: &str) -> bool {
+        path == prefix || (path.starts_with(prefix) && path[prefix.len()..].starts_with('.'))
+    }
+
+    fn paths_overlap(a: &str, b: &str) -> bool {
+        Self::is_path_prefix(a, b) || Self::is_path_prefix(b, a)
+    }
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file point_lookup.rs
+ * @brief Coalescing of concurrent _id point lookups
+ *
+ * Each find({_id: X}) would otherwise check out a pooled connection for a
+ * one-row query. Lookups are instead queued per collection. A flusher task
+ * per collection takes everything queued, runs one query over the unique
+ * _id index and hands each waiter its row. New lookups queue behind an
+ * in-flight batch, so batches grow with load while an idle server adds no
+ * delay beyond the configured window.
+ */
+
+use crate::connection_pool::ProductionConnectionPool;
+use crate::document_codec::StorageLayout;
+use crate::error::{FauxDBError, Result};
+use crate::fauxdb_debug;
+use crate::find::{document_columns, row_bytes};
+use futures::future::join_all;
+use metrics::counter;
+use parking_lot::Mutex;
+use std::collections::HashMap;
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::sync::oneshot;
+use tokio_postgres::error::SqlState;
+
+/// Most lookups sent in one query; a longer queue is split into concurrent batches
+pub const DEFAULT_MAX_BATCH: usize = 256;
+
+struct Waiter {
+    /// `_id` as tagged JSON
+    key: String,
+    reply: oneshot::Sender<Result<Option<Vec<u8>>>>,
+}
+
+pub struct PointLookupBatcher {
+    pool: Arc<ProductionConnectionPool>,
+    layout: Arc<StorageLayout>,
+    /// How long a flusher waits for more lookups before its first batch.
+    /// Zero only yields to tasks already runnable; tokio timers round
+    /// anything else up to a millisecond.
+    window: Duration,
+    max_batch: usize,
+    /// A table has an entry exactly while its flusher runs
+    queues: Mutex<HashMap<String, Vec<Waiter>>>,
+}
+
+impl PointLookupBatcher {
+    pub fn new(pool: Arc<ProductionConnectionPool>, layout: Arc<StorageLayout>, window: Duration) -> Self {
+        Self { pool, layout, window, max_batch: DEFAULT_MAX_BATCH, queues: Mutex::new(HashMap::new()) }
+    }
+
+    pub fn with_max_batch(mut self, max_batch: usize) -> Self {
+        self.max_batch = max_batch.max(1);
+        self
+    }
+
+    /// Fetch the stored document whose `_id` is `id_json`, as BSON bytes
+    pub async fn lookup(self: &Arc<Self>, table: &str, id_json: String) -> Result<Option<Vec<u8>>> {
+        let (sender, receiver) = oneshot::channel();
+        let start_flusher = {
+            let mut queues = self.queues.lock();
+            let start = !queues.contains_key(table);
+            queues.entry(table.to_string()).or_default().push(Waiter { key: id_json, reply: sender });
+            start
+        };
+        if start_flusher {
+            // Spawned so a client that disconnects doesn't strand the others
+            let batcher = self.clone();
+            let table = table.to_string();
+            tokio::spawn(async move { batcher.flush(table).await });
+        }
+
+        counter!("fauxdb_point_lookups_total").increment(1);
+        receiver.await
+            .map_err(|_| FauxDBError::Database("Point lookup batch was dropped".to_string()))?
+    }
+
+    async fn flush(self: Arc<Self>, table: String) {
+        if self.window.is_zero() {
+            tokio::task::yield_now().await;
+        } else {
+            tokio::time::sleep(self.window).await;
+        }
+
+        loop {
+            let mut waiters = {
+                let mut queues = self.queues.lock();
+                match queues.get_mut(&table) {
+                    Some(queue) if !queue.is_empty() => std::mem::take(queue),
+                    _ => {
+                        queues.remove(&table);
+                        return;
+                    }
+                }
+            };
+
+            let mut batches = Vec::new();
+            while waiters.len() > self.max_batch {
+                let rest = waiters.split_off(self.max_batch);
+                batches.push(std::mem::replace(&mut waiters, rest));
+            }
+            batches.push(waiters);
+            counter!("fauxdb_point_lookup_batches_total").increment(batches.len() as u64);
+            join_all(batches.into_iter().map(|batch| self.run_batch(&table, batch))).await;
+        }
+    }
+
+    async fn run_batch(&self, table: &str, waiters: Vec<Waiter>) {
+        let mut keys: Vec<&str> = waiters.iter().map(|waiter| waiter.key.as_str()).collect();
+        keys.sort_unstable();
+        keys.dedup();
+        fauxdb_debug!("Looking up {} _ids in {} for {} waiters", keys.len(), table, waiters.len());
+
+        match self.fetch(table, &keys).await {
+            Ok(rows) => {
+                for waiter in waiters {
+                    let _ = waiter.reply.send(Ok(rows.get(&waiter.key).cloned()));
+                }
+            }
+            Err(e) => {
+                let message = e.to_string();
+                for waiter in waiters {
+                    let _ = waiter.reply.send(Err(FauxDBError::Database(message.clone())));
+                }
+            }
+        }
+    }
+
+    /// Rows by the requested key they matched. Keys are joined back in so
+    /// each waiter finds its row whatever text the stored JSONB prints as.
+    async fn fetch(&self, table: &str, keys: &[&str]) -> Result<HashMap<String, Vec<u8>>> {
+        let connection = self.pool.get_connection().await
+            .map_err(|e| FauxDBError::ConnectionPool(e.to_string()))?;
+        let sql = format!(
+            "SELECT {}, k.key FROM unnest($1::text[]) AS k(key) JOIN {} ON document -> '_id' = k.key::jsonb",
+            document_columns(&self.layout), table
+        );
+
+        // Prepared once per backend rather than on every batch
+        let rows = match connection.query_cached(&sql, &[&keys]).await {
+            Ok(rows) => rows,
+            // A collection that doesn't exist yet has no documents
+            Err(e) if e.code() == Some(&SqlState::UNDEFINED_TABLE) => {
+                self.pool.catalog().forget(table);
+                return Ok(HashMap::new());
+            }
+            Err(e) => return Err(FauxDBError::Database(format!("Point lookup failed: {}", e))),
+        };
+        rows.iter().map(|row| Ok((row.get::<_, String>(2), row_bytes(row)?))).collect()
+    }
+}
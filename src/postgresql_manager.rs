@@ -10,15 +10,95 @@
 
 use crate::error::{FauxDBError, Result};
 use crate::config::DatabaseConfig;
+use crate::aggregation_pipeline::SampleContext;
+use crate::bulk_insert::{BulkInsert, BulkInsertResult};
+use crate::document_codec::{JsonbText, StorageLayout};
+use crate::find::{document_columns, row_document};
+use crate::update::execute_update;
 use bson::Document;
 use tokio_postgres::NoTls;
 use deadpool_postgres::{Pool, Manager};
-use serde_json::Value;
 
 pub struct PostgreSQLManager {
     pool: Pool,
     #[allow(dead_code)]
     config: DatabaseConfig,
+    layout: StorageLayout,
+}
+
+/// Quote an identifier for interpolation into SQL. Always quoted, so names
+/// keep their case and may hold any character a MongoDB name allows.
+pub fn quote_ident(name: &str) -> String {
+    format!("\"{}\"", name.replace('"', "\"\""))
+}
+
+/// Schema-qualified, quoted table backing a collection
+pub fn collection_table(database: &str, collection: &str) -> String {
+    format!("{}.{}", quote_ident(&format!("fauxdb_{}", database)), quote_ident(&format!("{}_collections", collection)))
+}
+
+/// Statements that create a collection's schema, table and indexes
+pub fn collection_ddl(database: &str, collection: &str) -> Vec<String> {
+    let schema_name = quote_ident(&format!("fauxdb_{}", database));
+    let table = collection_table(database, collection);
+    let index = |suffix: &str| quote_ident(&format!("idx_{}_{}", collection, suffix));
+
+    vec![
+        format!("CREATE SCHEMA IF NOT EXISTS {}", schema_name),
+        format!(
+            "CREATE TABLE IF NOT EXISTS {} (
+                id SERIAL PRIMARY KEY,
+                document JSONB,
+                bson_document BYTEA,
+                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+                updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+            )",
+            table
+        ),
+        format!(
+            "CREATE INDEX IF NOT EXISTS {} ON {} USING GIN (document);
+             CREATE UNIQUE INDEX IF NOT EXISTS {} ON {} ((document -> '_id'));
+             CREATE INDEX IF NOT EXISTS {} ON {} (created_at);
+             CREATE INDEX IF NOT EXISTS {} ON {} (updated_at);",
+            index("document_gin"), table,
+            index("id"), table,
+            index("created_at"), table,
+            index("updated_at"), table
+        ),
+    ]
+}
+
+/// Create a collection's table on first use, as MongoDB does
+pub async fn ensure_collection(client: &tokio_postgres::Client, database: &str, collection: &str) -> Result<()> {
+    let table = collection_table(database, collection);
+    let exists = client.query_one("SELECT to_regclass($1) IS NOT NULL", &[&table]).await
+        .map_err(|e| FauxDBError::Database(format!("Failed to look up {}: {}", table, e)))?;
+    if !exists.get::<_, bool>(0) {
+        for statement in collection_ddl(database, collection) {
+            client.batch_execute(&statement).await
+                .map_err(|e| FauxDBError::Database(format!("Failed to create collection {}: {}", collection, e)))?;
+        }
+    }
+    Ok(())
+}
+
+/// Statistics for compiling a leading `$sample` on a collection
+pub async fn sample_context(client: &tokio_postgres::Client, database: &str, collection: &str) -> Result<SampleContext> {
+    let table = collection_table(database, collection);
+
+    // reltuples is -1 (PostgreSQL 14+) or 0 until the table has been analyzed
+    let row = client.query_one(
+        "SELECT (SELECT reltuples::float8 FROM pg_class WHERE oid = to_regclass($1)) AS reltuples,
+                EXISTS (SELECT 1 FROM pg_extension WHERE extname = 'tsm_system_rows') AS tsm_system_rows",
+        &[&table]
+    ).await
+        .map_err(|e| FauxDBError::Database(format!("Failed to read table statistics: {}", e)))?;
+
+    let reltuples: Option<f64> = row.get("reltuples");
+    Ok(SampleContext {
+        estimated_rows: reltuples.filter(|rows| *rows > 0.0),
+        tsm_system_rows: row.get("tsm_system_rows"),
+    })
 }
 
 impl PostgreSQLManager {
@@ -40,48 +120,19 @@ impl PostgreSQLManager {
         client.execute("CREATE EXTENSION IF NOT EXISTS btree_gin", &[]).await
             .map_err(|e| FauxDBError::Database(format!("Failed to create btree_gin extension: {}", e)))?;
 
-        Ok(Self { pool, config })
+        let layout = StorageLayout::new(config.storage_mode, config.indexed_paths.clone());
+        Ok(Self { pool, config, layout })
     }
 
     pub async fn create_collection(&self, database: &str, collection: &str) -> Result<()> {
         let client = self.pool.get().await
             .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get database connection: {}", e)))?;
 
-        let schema_name = format!("fauxdb_{}", database);
-        let table_name = format!("{}_collections", collection);
-
-        // Create schema if it doesn't exist
-        let create_schema = format!("CREATE SCHEMA IF NOT EXISTS {}", schema_name);
-        client.execute(&create_schema, &[]).await
-            .map_err(|e| FauxDBError::Database(format!("Failed to create schema: {}", e)))?;
-
-        // Create collection table with BSON support
-        let create_table = format!(
-            "CREATE TABLE IF NOT EXISTS {}.{} (
-                id SERIAL PRIMARY KEY,
-                document JSONB,
-                bson_document BYTEA,
-                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-                updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
-            )",
-            schema_name, table_name
-        );
-        
-        client.execute(&create_table, &[]).await
-            .map_err(|e| FauxDBError::Database(format!("Failed to create collection table: {}", e)))?;
-
-        // Create indexes for better performance
-        let create_indexes = format!(
-            "CREATE INDEX IF NOT EXISTS idx_{}_document_gin ON {}.{} USING GIN (document);
-             CREATE INDEX IF NOT EXISTS idx_{}_created_at ON {}.{} (created_at);
-             CREATE INDEX IF NOT EXISTS idx_{}_updated_at ON {}.{} (updated_at);",
-            collection, schema_name, table_name,
-            collection, schema_name, table_name,
-            collection, schema_name, table_name
-        );
-        
-        client.execute(&create_indexes, &[]).await
-            .map_err(|e| FauxDBError::Database(format!("Failed to create indexes: {}", e)))?;
+        // Schema, table with BSON support, then indexes for better performance
+        for statement in collection_ddl(database, collection) {
+            client.batch_execute(&statement).await
+                .map_err(|e| FauxDBError::Database(format!("Failed to create collection {}: {}", collection, e)))?;
+        }
 
         Ok(())
     }
@@ -90,40 +141,36 @@ impl PostgreSQLManager {
         let client = self.pool.get().await
             .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get database connection: {}", e)))?;
 
-        let schema_name = format!("fauxdb_{}", database);
-        let table_name = format!("{}_collections", collection);
-
-        // Convert BSON document to JSON
-        let json_value = bson::to_bson(document)
-            .map_err(FauxDBError::BsonSerialization)?;
-        
-        let json_str = serde_json::to_string(&json_value)
-            .map_err(FauxDBError::Serialization)?;
-
-        // Convert BSON to bytes
-        let bson_bytes = bson::to_vec(document)
-            .map_err(FauxDBError::BsonSerialization)?;
+        let encoded = self.layout.encode(document)?;
 
         let insert_query = format!(
-            "INSERT INTO {}.{} (document, bson_document) VALUES ($1::jsonb, $2) RETURNING id",
-            schema_name, table_name
+            "INSERT INTO {} (document, bson_document) VALUES ($1, $2) RETURNING id",
+            collection_table(database, collection)
         );
 
-        let row = client.query_one(&insert_query, &[&json_str, &bson_bytes]).await
+        let jsonb = encoded.jsonb.as_deref().map(JsonbText);
+        let row = client.query_one(&insert_query, &[&jsonb, &encoded.bson]).await
             .map_err(|e| FauxDBError::Database(format!("Failed to insert document: {}", e)))?;
 
         let id: i32 = row.get("id");
         Ok(id.to_string())
     }
 
-    pub async fn find_documents(&self, database: &str, collection: &str, filter: Option<&Document>, skip: Option<u64>, limit: Option<u64>) -> Result<Vec<Document>> {
+    /// Insert many documents with binary COPY, reporting per-document errors
+    pub async fn insert_documents(&self, database: &str, collection: &str, documents: &[Document], ordered: bool) -> Result<BulkInsertResult> {
         let client = self.pool.get().await
             .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get database connection: {}", e)))?;
 
-        let schema_name = format!("fauxdb_{}", database);
-        let table_name = format!("{}_collections", collection);
+        BulkInsert::new(collection_table(database, collection), self.layout.clone(), ordered)
+            .execute(&client, documents)
+            .await
+    }
+
+    pub async fn find_documents(&self, database: &str, collection: &str, filter: Option<&Document>, skip: Option<u64>, limit: Option<u64>) -> Result<Vec<Document>> {
+        let client = self.pool.get().await
+            .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get database connection: {}", e)))?;
 
-        let mut query = format!("SELECT document FROM {}.{}", schema_name, table_name);
+        let mut query = format!("SELECT {} FROM {}", document_columns(&self.layout), collection_table(database, collection));
         let mut params: Vec<Box<dyn tokio_postgres::types::ToSql + Sync>> = Vec::new();
         let mut param_count = 0;
 
@@ -162,18 +209,8 @@ impl PostgreSQLManager {
             .map_err(|e| FauxDBError::Database(format!("Failed to query documents: {}", e)))?;
 
         let mut documents = Vec::new();
-        for row in rows {
-            let json_str: String = row.get("document");
-            let json_value: Value = serde_json::from_str(&json_str)
-                .map_err(FauxDBError::Serialization)?;
-            
-            let document = bson::to_bson(&json_value)
-                .map_err(|e| FauxDBError::BsonSerialization(e))?
-                .as_document()
-                .ok_or_else(|| FauxDBError::Database("Failed to convert to document".to_string()))?
-                .clone();
-            
-            documents.push(document);
+        for row in &rows {
+            documents.push(row_document(row)?);
         }
 
         Ok(documents)
@@ -183,55 +220,15 @@ impl PostgreSQLManager {
         let client = self.pool.get().await
             .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get database connection: {}", e)))?;
 
-        let schema_name = format!("fauxdb_{}", database);
-        let table_name = format!("{}_collections", collection);
-
-        // Convert update document to JSON
-        let update_json = bson::to_bson(update)
-            .map_err(FauxDBError::BsonSerialization)?;
-        
-        let update_str = serde_json::to_string(&update_json)
-            .map_err(FauxDBError::Serialization)?;
-
-        // Build WHERE clause from filter
-        let mut where_clause = String::new();
-        let mut params: Vec<Box<dyn tokio_postgres::types::ToSql + Sync>> = Vec::new();
-        let mut param_count = 0;
-
-        for (key, value) in filter {
-            if param_count > 0 {
-                where_clause.push_str(" AND ");
-            }
-            param_count += 1;
-            where_clause.push_str(&format!("document->>'{}' = ${}", key, param_count));
-            
-            let value_str = match value.as_str() {
-                Some(s) => s.to_string(),
-                None => value.to_string(),
-            };
-            params.push(Box::new(value_str));
-        }
-
-        let update_query = format!(
-            "UPDATE {}.{} SET document = document || $1::jsonb, updated_at = CURRENT_TIMESTAMP WHERE {}",
-            schema_name, table_name, where_clause
-        );
-
-        params.insert(0, Box::new(update_str));
-
-        let modified_count = client.execute(&update_query, &params.iter().map(|p| p.as_ref()).collect::<Vec<_>>()).await
-            .map_err(|e| FauxDBError::Database(format!("Failed to update document: {}", e)))?;
-
-        Ok(modified_count)
+        // Operators compile to one UPDATE over the stored JSONB
+        let outcome = execute_update(&client, &collection_table(database, collection), &self.layout, filter, update, true).await?;
+        Ok(outcome.modified)
     }
 
     pub async fn delete_document(&self, database: &str, collection: &str, filter: &Document) -> Result<u64> {
         let client = self.pool.get().await
             .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get database connection: {}", e)))?;
 
-        let schema_name = format!("fauxdb_{}", database);
-        let table_name = format!("{}_collections", collection);
-
         // Build WHERE clause from filter
         let mut where_clause = String::new();
         let mut params: Vec<Box<dyn tokio_postgres::types::ToSql + Sync>> = Vec::new();
@@ -252,8 +249,8 @@ impl PostgreSQLManager {
         }
 
         let delete_query = format!(
-            "DELETE FROM {}.{} WHERE {}",
-            schema_name, table_name, where_clause
+            "DELETE FROM {} WHERE {}",
+            collection_table(database, collection), where_clause
         );
 
         let deleted_count = client.execute(&delete_query, &params.iter().map(|p| p.as_ref()).collect::<Vec<_>>()).await
@@ -266,10 +263,7 @@ impl PostgreSQLManager {
         let client = self.pool.get().await
             .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get database connection: {}", e)))?;
 
-        let schema_name = format!("fauxdb_{}", database);
-        let table_name = format!("{}_collections", collection);
-
-        let mut query = format!("SELECT COUNT(*) FROM {}.{}", schema_name, table_name);
+        let mut query = format!("SELECT COUNT(*) FROM {}", collection_table(database, collection));
         let mut params: Vec<Box<dyn tokio_postgres::types::ToSql + Sync>> = Vec::new();
         let mut param_count = 0;
 
@@ -300,6 +294,12 @@ impl PostgreSQLManager {
         Ok(count as u64)
     }
 
+    pub async fn sample_context(&self, database: &str, collection: &str) -> Result<SampleContext> {
+        let client = self.pool.get().await
+            .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get database connection: {}", e)))?;
+        sample_context(&client, database, collection).await
+    }
+
     pub async fn list_collections(&self, database: &str) -> Result<Vec<String>> {
         let client = self.pool.get().await
             .map_err(|e| FauxDBError::ConnectionPool(format!("Failed to get database connection: {}", e)))?;
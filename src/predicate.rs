@@ -0,0 +1,415 @@
+/*!
+ * @file predicate.rs
+ * @brief Compiled $match predicates for in-process aggregation
+ *
+ * Criteria are compiled once into a tree of closures: field paths are split
+ * up front, constants are typed, and $in lists are pre-bucketed, so matching
+ * a document does no operator lookups or value cloning.
+ */
+
+use crate::error::{FauxDBError, Result};
+use crate::expression::{is_truthy, CompiledExpr};
+use bson::{Bson, Document};
+use regex::RegexBuilder;
+use std::cmp::Ordering;
+use std::collections::HashSet;
+
+type DocumentTest = Box<dyn Fn(&Document) -> bool + Send + Sync>;
+type ValueTest = Box<dyn Fn(Option<&Bson>) -> bool + Send + Sync>;
+
+/// A `$match` filter compiled for repeated evaluation
+pub struct CompiledPredicate {
+    test: DocumentTest,
+}
+
+impl CompiledPredicate {
+    pub fn compile(criteria: &Document) -> Result<Self> {
+        Ok(Self { test: compile_criteria(criteria)? })
+    }
+
+    #[inline]
+    pub fn matches(&self, doc: &Document) -> bool {
+        (self.test)(doc)
+    }
+}
+
+impl std::fmt::Debug for CompiledPredicate {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.write_str("CompiledPredicate")
+    }
+}
+
+fn unsupported(what: &str) -> FauxDBError {
+    FauxDBError::Database(format!("Unsupported $match operator: {}", what))
+}
+
+fn compile_criteria(criteria: &Document) -> Result<DocumentTest> {
+    let mut clauses: Vec<DocumentTest> = Vec::with_capacity(criteria.len());
+
+    for (key, value) in criteria {
+        let clause = match key.as_str() {
+            "$and" => all_of(compile_clause_list(key, value)?),
+            "$or" => {
+                let branches = compile_clause_list(key, value)?;
+                Box::new(move |doc: &Document| branches.iter().any(|branch| branch(doc))) as DocumentTest
+            }
+            "$nor" => {
+                let branches = compile_clause_list(key, value)?;
+                Box::new(move |doc: &Document| !branches.iter().any(|branch| branch(doc))) as DocumentTest
+            }
+            "$expr" => {
+                // A document the expression fails on (e.g. division by zero) does not match
+                let expr = CompiledExpr::parse(value)?;
+                Box::new(move |doc: &Document| expr.evaluate(doc).map_or(false, |result| is_truthy(&result))) as DocumentTest
+            }
+            _ if key.starts_with('$') => return Err(unsupported(key)),
+            _ => compile_field(key, value)?,
+        };
+        clauses.push(clause);
+    }
+
+    Ok(all_of(clauses))
+}
+
+fn compile_clause_list(operator: &str, value: &Bson) -> Result<Vec<DocumentTest>> {
+    let clauses = value.as_array()
+        .filter(|clauses| !clauses.is_empty())
+        .ok_or_else(|| FauxDBError::Database(format!("{} requires a non-empty array", operator)))?;
+
+    clauses.iter()
+        .map(|clause| match clause {
+            Bson::Document(clause_doc) => compile_criteria(clause_doc),
+            _ => Err(FauxDBError::Database(format!("{} entries must be documents", operator))),
+        })
+        .collect()
+}
+
+fn all_of(mut clauses: Vec<DocumentTest>) -> DocumentTest {
+    match clauses.len() {
+        0 => Box::new(|_: &Document| true),
+        1 => clauses.pop().unwrap(),
+        _ => Box::new(move |doc: &Document| clauses.iter().all(|clause| clause(doc))),
+    }
+}
+
+fn is_operator_document(value: &Bson) -> bool {
+    matches!(value, Bson::Document(doc) if doc.keys().next().map_or(false, |key| key.starts_with('$')))
+}
+
+/// Compile the condition for one field path into a document test
+fn compile_field(path: &str, condition: &Bson) -> Result<DocumentTest> {
+    let path = FieldPath::new(path);
+
+    if !is_operator_document(condition) {
+        // {field: /pattern/} is a regex match, not equality with the regex value
+        let test = match condition {
+            Bson::RegularExpression(_) => value_test("$regex", condition, &Document::new())?,
+            _ => equality_test(condition),
+        };
+        return Ok(Box::new(move |doc: &Document| path.any_value(doc, &test)));
+    }
+
+    let operators = condition.as_document().unwrap();
+    let mut tests: Vec<DocumentTest> = Vec::with_capacity(operators.len());
+    for (operator, operand) in operators {
+        if operator == "$options" {
+            continue;
+        }
+        tests.push(compile_operator(path.clone(), operator, operand, operators)?);
+    }
+    Ok(all_of(tests))
+}
+
+fn compile_operator(path: FieldPath, operator: &str, operand: &Bson, siblings: &Document) -> Result<DocumentTest> {
+    // Negated operators apply to the field as a whole, not to each array element
+    let test: DocumentTest = match operator {
+        "$ne" => {
+            let test = equality_test(operand);
+            Box::new(move |doc: &Document| !path.any_value(doc, &test))
+        }
+        "$nin" => {
+            let test = in_test(operand)?;
+            Box::new(move |doc: &Document| !path.any_value(doc, &test))
+        }
+        "$not" => {
+            let negated = match operand {
+                Bson::Document(inner) if is_operator_document(operand) => {
+                    let mut tests = Vec::with_capacity(inner.len());
+                    for (inner_op, inner_operand) in inner {
+                        if inner_op != "$options" {
+                            tests.push(compile_operator(path.clone(), inner_op, inner_operand, inner)?);
+                        }
+                    }
+                    all_of(tests)
+                }
+                Bson::RegularExpression(_) => compile_operator(path.clone(), "$regex", operand, siblings)?,
+                _ => return Err(FauxDBError::Database("$not requires an operator document or regex".to_string())),
+            };
+            Box::new(move |doc: &Document| !negated(doc))
+        }
+        "$exists" => {
+            let wanted = match operand {
+                Bson::Boolean(b) => *b,
+                Bson::Int32(n) => *n != 0,
+                Bson::Int64(n) => *n != 0,
+                Bson::Double(n) => *n != 0.0,
+                _ => true,
+            };
+            Box::new(move |doc: &Document| path.any_value(doc, &|value: Option<&Bson>| value.is_some()) == wanted)
+        }
+        _ => {
+            let test = value_test(operator, operand, siblings)?;
+            Box::new(move |doc: &Document| path.any_value(doc, &test))
+        }
+    };
+    Ok(test)
+}
+
+/// Tests that match when any value reachable on the path satisfies them
+fn value_test(operator: &str, operand: &Bson, siblings: &Document) -> Result<ValueTest> {
+    let test: ValueTest = match operator {
+        "$eq" => equality_test(operand),
+        "$gt" => range_test(operand, |ord| ord == Ordering::Greater, false),
+        "$gte" => range_test(operand, |ord| ord != Ordering::Less, true),
+        "$lt" => range_test(operand, |ord| ord == Ordering::Less, false),
+        "$lte" => range_test(operand, |ord| ord != Ordering::Greater, true),
+        "$in" => in_test(operand)?,
+        "$regex" => {
+            let (pattern, inline_options) = match operand {
+                Bson::String(pattern) => (pattern.clone(), String::new()),
+                Bson::RegularExpression(regex) => (regex.pattern.clone(), regex.options.clone()),
+                _ => return Err(FauxDBError::Database("$regex requires a string".to_string())),
+            };
+            let options = siblings.get_str("$options").map(str::to_string).unwrap_or(inline_options);
+            let regex = RegexBuilder::new(&pattern)
+                .case_insensitive(options.contains('i'))
+                .multi_line(options.contains('m'))
+                .dot_matches_new_line(options.contains('s'))
+                .ignore_whitespace(options.contains('x'))
+                .build()
+                .map_err(|e| FauxDBError::Database(format!("Invalid $regex: {}", e)))?;
+            Box::new(move |value: Option<&Bson>| matches!(value, Some(Bson::String(s)) if regex.is_match(s)))
+        }
+        "$size" => {
+            let size = Constant::from_bson(operand).as_number()
+                .ok_or_else(|| FauxDBError::Database("$size requires a number".to_string()))? as usize;
+            Box::new(move |value: Option<&Bson>| matches!(value, Some(Bson::Array(items)) if items.len() == size))
+        }
+        "$elemMatch" => {
+            let criteria = operand.as_document()
+                .ok_or_else(|| FauxDBError::Database("$elemMatch requires a document".to_string()))?;
+            let element_test = if is_operator_document(operand) {
+                // {$elemMatch: {$gte: 80, $lt: 85}} applies operators to each element
+                let mut tests = Vec::with_capacity(criteria.len());
+                for (op, op_operand) in criteria {
+                    if op != "$options" {
+                        tests.push(value_test(op, op_operand, criteria)?);
+                    }
+                }
+                ElementTest::Value(tests)
+            } else {
+                ElementTest::Document(compile_criteria(criteria)?)
+            };
+            Box::new(move |value: Option<&Bson>| match value {
+                Some(Bson::Array(items)) => items.iter().any(|item| element_test.matches(item)),
+                _ => false,
+            })
+        }
+        _ => return Err(unsupported(operator)),
+    };
+    Ok(test)
+}
+
+enum ElementTest {
+    Value(Vec<ValueTest>),
+    Document(DocumentTest),
+}
+
+impl ElementTest {
+    fn matches(&self, item: &Bson) -> bool {
+        match self {
+            ElementTest::Value(tests) => tests.iter().all(|test| test(Some(item))),
+            ElementTest::Document(test) => matches!(item, Bson::Document(doc) if test(doc)),
+        }
+    }
+}
+
+fn equality_test(operand: &Bson) -> ValueTest {
+    let constant = Constant::from_bson(operand);
+    Box::new(move |value: Option<&Bson>| match value {
+        Some(value) => constant.equals(value),
+        // A missing field equals null
+        None => matches!(constant, Constant::Null),
+    })
+}
+
+fn range_test(operand: &Bson, accept: fn(Ordering) -> bool, inclusive: bool) -> ValueTest {
+    let constant = Constant::from_bson(operand);
+    let missing_matches = inclusive && matches!(constant, Constant::Null);
+    Box::new(move |value: Option<&Bson>| match value {
+        Some(value) => constant.compare(value).map_or(false, accept),
+        None => missing_matches,
+    })
+}
+
+fn in_test(operand: &Bson) -> Result<ValueTest> {
+    let values = operand.as_array()
+        .ok_or_else(|| FauxDBError::Database("$in/$nin requires an array".to_string()))?;
+    let set = InSet::new(values);
+    Ok(Box::new(move |value: Option<&Bson>| set.contains(value)))
+}
+
+/// `$in` operands bucketed by type so membership avoids a linear Bson scan
+struct InSet {
+    numbers: Vec<f64>,
+    strings: HashSet<String>,
+    others: Vec<Constant>,
+    has_null: bool,
+}
+
+impl InSet {
+    fn new(values: &[Bson]) -> Self {
+        let mut set = Self { numbers: Vec::new(), strings: HashSet::new(), others: Vec::new(), has_null: false };
+        for value in values {
+            match Constant::from_bson(value) {
+                Constant::Number(n) => set.numbers.push(n),
+                Constant::String(s) => {
+                    set.strings.insert(s);
+                }
+                Constant::Null => set.has_null = true,
+                other => set.others.push(other),
+            }
+        }
+        set
+    }
+
+    fn contains(&self, value: Option<&Bson>) -> bool {
+        match value {
+            None | Some(Bson::Null) => self.has_null,
+            Some(Bson::String(s)) => self.strings.contains(s.as_str()),
+            Some(value) => match numeric(value) {
+                Some(n) => self.numbers.iter().any(|candidate| *candidate == n),
+                None => self.others.iter().any(|candidate| candidate.equals(value)),
+            },
+        }
+    }
+}
+
+/// A typed query constant; numbers of any BSON width compare as one type
+enum Constant {
+    Null,
+    Number(f64),
+    String(String),
+    Boolean(bool),
+    Other(Bson),
+}
+
+impl Constant {
+    fn from_bson(value: &Bson) -> Self {
+        match value {
+            Bson::Null | Bson::Undefined => Constant::Null,
+            Bson::String(s) => Constant::String(s.clone()),
+            Bson::Boolean(b) => Constant::Boolean(*b),
+            _ => match numeric(value) {
+                Some(n) => Constant::Number(n),
+                None => Constant::Other(value.clone()),
+            },
+        }
+    }
+
+    fn as_number(&self) -> Option<f64> {
+        match self {
+            Constant::Number(n) => Some(*n),
+            _ => None,
+        }
+    }
+
+    #[inline]
+    fn equals(&self, value: &Bson) -> bool {
+        match (self, value) {
+            (Constant::Null, Bson::Null) => true,
+            (Constant::String(expected), Bson::String(actual)) => expected == actual,
+            (Constant::Boolean(expected), Bson::Boolean(actual)) => expected == actual,
+            (Constant::Number(expected), _) => numeric(value).map_or(false, |actual| actual == *expected),
+            (Constant::Other(expected), _) => expected == value,
+            _ => false,
+        }
+    }
+
+    /// Order `value` against the constant. Values of a different type never
+    /// compare, following MongoDB's type bracketing for range operators.
+    #[inline]
+    fn compare(&self, value: &Bson) -> Option<Ordering> {
+        match (self, value) {
+            (Constant::Number(expected), _) => numeric(value)?.partial_cmp(expected),
+            (Constant::String(expected), Bson::String(actual)) => Some(actual.as_str().cmp(expected.as_str())),
+            (Constant::Boolean(expected), Bson::Boolean(actual)) => Some(actual.cmp(expected)),
+            (Constant::Null, Bson::Null) => Some(Ordering::Equal),
+            (Constant::Other(Bson::DateTime(expected)), Bson::DateTime(actual)) => Some(actual.cmp(expected)),
+            (Constant::Other(Bson::ObjectId(expected)), Bson::ObjectId(actual)) => Some(actual.bytes().cmp(&expected.bytes())),
+            (Constant::Other(Bson::Timestamp(expected)), Bson::Timestamp(actual)) => {
+                Some((actual.time, actual.increment).cmp(&(expected.time, expected.increment)))
+            }
+            _ => None,
+        }
+    }
+}
+
+#[inline]
+fn numeric(value: &Bson) -> Option<f64> {
+    match value {
+        Bson::Int32(n) => Some(*n as f64),
+        Bson::Int64(n) => Some(*n as f64),
+        Bson::Double(n) => Some(*n),
+        _ => None,
+    }
+}
+
+/// A dotted field path split once at compile time
+#[derive(Clone)]
+struct FieldPath {
+    segments: Vec<String>,
+}
+
+impl FieldPath {
+    fn new(path: &str) -> Self {
+        Self { segments: path.split('.').map(str::to_string).collect() }
+    }
+
+    /// True when `test` accepts any value the path reaches. Arrays along the
+    /// path fan out, and a terminal array is tested both whole and per element.
+    #[inline]
+    fn any_value(&self, doc: &Document, test: &dyn Fn(Option<&Bson>) -> bool) -> bool {
+        Self::walk(doc.get(&self.segments[0]), &self.segments[1..], test)
+    }
+
+    fn walk(value: Option<&Bson>, rest: &[String], test: &dyn Fn(Option<&Bson>) -> bool) -> bool {
+        match (value, rest.split_first()) {
+            (Some(Bson::Array(items)), None) => {
+                test(value) || items.iter().any(|item| test(Some(item)))
+            }
+            (value, None) => test(value),
+            (Some(Bson::Document(inner)), Some((next, remaining))) => {
+                Self::walk(inner.get(next), remaining, test)
+            }
+            (Some(Bson::Array(items)), Some((next, remaining))) => {
+                // Numeric segments index into the array; otherwise descend into each element
+                if let Ok(index) = next.parse::<usize>() {
+                    if let Some(item) = items.get(index) {
+                        return Self::walk(Some(item), remaining, test);
+                    }
+                }
+                let mut reached = false;
+                let found = items.iter().any(|item| match item {
+                    Bson::Document(inner) => {
+                        reached = true;
+                        Self::walk(inner.get(next), remaining, test)
+                    }
+                    _ => false,
+                });
+                found || (!reached && test(None))
+            }
+            (_, Some(_)) => test(None),
+        }
+    }
+}
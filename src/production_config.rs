@@ -2,6 +2,7 @@
  * Production-ready configuration management for FauxDB
  */
 
+use crate::document_codec::StorageMode;
 use serde::{Deserialize, Serialize};
 use std::time::Duration;
 
@@ -31,12 +32,25 @@ pub struct ServerConfig {
 pub struct DatabaseConfig {
     pub connection_string: String,
     pub pool_size: u32,
+    /// Idle connections opened at startup and kept open afterwards
+    #[serde(default = "default_min_idle")]
+    pub min_idle: u32,
     pub max_lifetime: Duration,
     pub idle_timeout: Duration,
     pub connection_timeout: Duration,
     pub statement_cache_size: usize,
+    /// Connections multi-document transactions may hold at once; unset
+    /// leaves a quarter of the pool for other statements
+    #[serde(default)]
+    pub max_pinned_connections: Option<u32>,
     pub enable_ssl: bool,
     pub ssl_mode: String,
+    /// Which columns hold documents: jsonb, bson or both
+    #[serde(default)]
+    pub storage_mode: StorageMode,
+    /// Paths kept queryable in JSONB when storage_mode is bson
+    #[serde(default)]
+    pub indexed_paths: Vec<String>,
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -60,11 +74,38 @@ pub struct RateLimitConfig {
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct PerformanceConfig {
+    /// Replies the result cache may hold
     pub query_cache_size: usize,
+    /// Bytes of encoded replies the result cache may hold
+    #[serde(default = "default_query_cache_bytes")]
+    pub query_cache_bytes: usize,
+    /// How long a cached reply may be served; the only bound on staleness
+    /// from writes made to PostgreSQL without going through FauxDB
     pub query_cache_ttl: Duration,
     pub batch_size: usize,
     pub parallel_workers: usize,
     pub memory_limit: String,
+    /// Per-query limit for blocking aggregation stages before they spill
+    #[serde(default = "default_aggregation_memory_limit")]
+    pub aggregation_memory_limit: usize,
+    /// Coalesce concurrent find({_id}) lookups into one query per collection
+    #[serde(default = "default_point_lookup_batching")]
+    pub point_lookup_batching: bool,
+    /// Extra wait for more lookups before a batch goes out; 0 only yields
+    #[serde(default)]
+    pub point_lookup_window_us: u64,
+    /// Collections ("db.coll", "db.*" or "*") whose identical concurrent
+    /// finds share one execution
+    #[serde(default)]
+    pub single_flight_namespaces: Vec<String>,
+    /// Collections whose find replies are cached until a write to them;
+    /// empty disables the result cache
+    #[serde(default)]
+    pub query_cache_namespaces: Vec<String>,
+    /// How long a multi-document transaction may sit idle, holding its
+    /// connection, before it is rolled back
+    #[serde(default = "default_transaction_idle_timeout")]
+    pub transaction_idle_timeout: Duration,
     pub enable_compression: bool,
     pub compression_level: u32,
 }
@@ -133,12 +174,16 @@ impl Default for DatabaseConfig {
         Self {
             connection_string: "postgresql://localhost/fauxdb".to_string(),
             pool_size: 20,
+            min_idle: default_min_idle(),
             max_lifetime: Duration::from_secs(1800),
             idle_timeout: Duration::from_secs(600),
             connection_timeout: Duration::from_secs(10),
             statement_cache_size: 1000,
+            max_pinned_connections: None,
             enable_ssl: false,
             ssl_mode: "prefer".to_string(),
+            storage_mode: StorageMode::default(),
+            indexed_paths: Vec::new(),
         }
     }
 }
@@ -172,16 +217,43 @@ impl Default for PerformanceConfig {
     fn default() -> Self {
         Self {
             query_cache_size: 10000,
+            query_cache_bytes: default_query_cache_bytes(),
             query_cache_ttl: Duration::from_secs(300),
             batch_size: 1000,
             parallel_workers: num_cpus::get(),
             memory_limit: "2GB".to_string(),
+            aggregation_memory_limit: default_aggregation_memory_limit(),
+            point_lookup_batching: default_point_lookup_batching(),
+            point_lookup_window_us: 0,
+            single_flight_namespaces: Vec::new(),
+            query_cache_namespaces: Vec::new(),
+            transaction_idle_timeout: default_transaction_idle_timeout(),
             enable_compression: true,
             compression_level: 6,
         }
     }
 }
 
+fn default_query_cache_bytes() -> usize {
+    64 * 1024 * 1024
+}
+
+fn default_min_idle() -> u32 {
+    5
+}
+
+fn default_aggregation_memory_limit() -> usize {
+    crate::spill::DEFAULT_MEMORY_LIMIT_BYTES
+}
+
+fn default_point_lookup_batching() -> bool {
+    true
+}
+
+fn default_transaction_idle_timeout() -> Duration {
+    crate::transactions::DEFAULT_IDLE_TIMEOUT
+}
+
 impl Default for MonitoringConfig {
     fn default() -> Self {
         Self {
@@ -259,6 +331,14 @@ impl ProductionConfig {
         if self.database.pool_size == 0 {
             return Err(anyhow::anyhow!("database pool_size must be greater than 0"));
         }
+        if self.database.min_idle > self.database.pool_size {
+            return Err(anyhow::anyhow!("database min_idle must not exceed pool_size"));
+        }
+        if let Some(max_pinned) = self.database.max_pinned_connections {
+            if max_pinned == 0 || max_pinned > self.database.pool_size {
+                return Err(anyhow::anyhow!("database max_pinned_connections must be between 1 and pool_size"));
+            }
+        }
         if self.security.ssl_enabled {
             if self.security.ssl_cert_path.is_none() || self.security.ssl_key_path.is_none() {
                 return Err(anyhow::anyhow!("SSL certificate and key paths required when SSL is enabled"));
@@ -19,9 +19,15 @@ use crate::production_config::ProductionConfig;
 use crate::connection_pool::ProductionConnectionPool;
 use crate::mongodb_commands::MongoDBCommandRegistry;
 use crate::indexing::IndexManager;
-use crate::transactions::TransactionManager;
+use crate::error::FauxDBError;
+use crate::transactions::{ConnectionTarget, TransactionError, TransactionManager, TransactionRequest};
 use crate::process_manager::ProcessManager;
-use crate::wire_protocol::{WireProtocolHandler, WireMessage};
+use crate::wire_protocol::{WireProtocolHandler, WireMessage, MAX_MESSAGE_SIZE_BYTES};
+use crate::document_codec::StorageLayout;
+use crate::find::FindServices;
+use crate::point_lookup::PointLookupBatcher;
+use crate::result_cache::{ResultCache, Written};
+use crate::single_flight::{NamespaceSet, SingleFlight};
 
 #[derive(Clone)]
 pub struct ProductionFauxDBServer {
@@ -44,20 +50,28 @@ impl ProductionFauxDBServer {
         // Initialize connection pool
         let pool_config = crate::connection_pool::ProductionPoolConfig {
             max_size: config.database.pool_size,
-            min_idle: 5,
+            min_idle: config.database.min_idle,
             max_lifetime: config.database.max_lifetime,
             idle_timeout: config.database.idle_timeout,
             connection_timeout: config.database.connection_timeout,
             statement_cache_size: config.database.statement_cache_size,
+            max_pinned: config.database.max_pinned_connections
+                .unwrap_or((config.database.pool_size * 3 / 4).max(1)),
         };
         let connection_pool = Arc::new(
             ProductionConnectionPool::new(&config.database.connection_string, pool_config).await?
         );
+        connection_pool.start_maintenance();
+        connection_pool.catalog().listen(config.database.connection_string.clone());
         
         // Initialize components
         let command_registry = Arc::new(MongoDBCommandRegistry::new());
         let index_manager = Arc::new(IndexManager::new());
-        let transaction_manager = Arc::new(TransactionManager::new(Arc::new(connection_pool.pool.clone())));
+        let transaction_manager = Arc::new(TransactionManager::new(
+            connection_pool.clone(),
+            config.performance.transaction_idle_timeout,
+        ));
+        transaction_manager.start_reaper();
         
         fauxdb_info!("Production FauxDB Server initialized successfully");
         fauxdb_info!("Supported MongoDB Commands: {}", command_registry.get_supported_commands().len());
@@ -111,6 +125,34 @@ impl ProductionFauxDBServer {
         
         let mut connection_count = 0;
         let max_connections = self.config.server.max_connections;
+        let storage_layout = Arc::new(StorageLayout::new(
+            self.config.database.storage_mode,
+            self.config.database.indexed_paths.clone(),
+        ));
+        fauxdb_info!("Storage Mode: {:?}", storage_layout.mode);
+        let performance = &self.config.performance;
+        let find_services = Arc::new(FindServices {
+            point_lookups: performance.point_lookup_batching.then(|| Arc::new(PointLookupBatcher::new(
+                self.connection_pool.clone(),
+                storage_layout.clone(),
+                Duration::from_micros(performance.point_lookup_window_us),
+            ))),
+            single_flight: Some(NamespaceSet::new(&performance.single_flight_namespaces))
+                .filter(|namespaces| !namespaces.is_empty())
+                .map(SingleFlight::new),
+            result_cache: Some(NamespaceSet::new(&performance.query_cache_namespaces))
+                .filter(|namespaces| !namespaces.is_empty())
+                .map(|namespaces| {
+                    let cache = Arc::new(ResultCache::new(
+                        namespaces,
+                        performance.query_cache_size,
+                        performance.query_cache_bytes,
+                        performance.query_cache_ttl,
+                    ));
+                    cache.listen(self.config.database.connection_string.clone());
+                    cache
+                }),
+        });
         
         loop {
             // Check connection limit
@@ -129,11 +171,17 @@ impl ProductionFauxDBServer {
                     let command_registry = self.command_registry.clone();
                     let index_manager = self.index_manager.clone();
                     let transaction_manager = self.transaction_manager.clone();
+                    let storage_layout = storage_layout.clone();
+                    let find_services = find_services.clone();
+                    let aggregation_memory_limit = self.config.performance.aggregation_memory_limit;
                     
                     tokio::spawn(async move {
                         if let Err(e) = Self::handle_connection(
                             stream,
                             connection_pool,
+                            storage_layout,
+                            find_services,
+                            aggregation_memory_limit,
                             command_registry,
                             index_manager,
                             transaction_manager,
@@ -212,27 +260,28 @@ impl ProductionFauxDBServer {
 
     async fn handle_connection(
         mut stream: tokio::net::TcpStream,
-        _connection_pool: Arc<ProductionConnectionPool>,
+        connection_pool: Arc<ProductionConnectionPool>,
+        storage_layout: Arc<StorageLayout>,
+        find_services: Arc<FindServices>,
+        aggregation_memory_limit: usize,
         command_registry: Arc<MongoDBCommandRegistry>,
         _index_manager: Arc<IndexManager>,
-        _transaction_manager: Arc<TransactionManager>,
+        transaction_manager: Arc<TransactionManager>,
     ) -> Result<()> {
-        use tokio::io::{AsyncReadExt, AsyncWriteExt};
-        
-        let mut buffer = vec![0; 1024];
+        use tokio::io::AsyncWriteExt;
         
         loop {
-            match stream.read(&mut buffer).await {
-                Ok(0) => {
+            match Self::read_message(&mut stream).await {
+                Ok(None) => {
                     // Connection closed by client
                     break;
                 }
-                Ok(n) => {
+                Ok(Some(buffer)) => {
                     // Process MongoDB protocol message
-                    fauxdb_debug!("Received {} bytes from client", n);
+                    fauxdb_debug!("Received {} bytes from client", buffer.len());
                     
                     // Parse MongoDB wire protocol message using our new handler
-                    match WireProtocolHandler::parse_message(&buffer[..n]) {
+                    match WireProtocolHandler::parse_message(&buffer) {
                         Ok(wire_message) => {
                             let command_doc = wire_message.get_command_document();
                             let request_id = wire_message.get_request_id();
@@ -242,18 +291,56 @@ impl ProductionFauxDBServer {
                             if let Some(command_name) = Self::extract_command_name(&command_doc) {
                                 fauxdb_debug!("Processing command: {} with request_id: {}", command_name, request_id);
                                 
-                                // Execute command through registry
-                                match command_registry.handle_command(&command_name, command_doc) {
+                                let written = find_services.result_cache.as_ref()
+                                    .and_then(|_| Written::by_command(&command_name, &command_doc));
+                                
+                                // Statements of a multi-document transaction run on the connection it pinned
+                                let result: Result<Vec<u8>> = match TransactionRequest::parse(&command_doc) {
+                                    Some(request) if command_name == "commitTransaction" || command_name == "abortTransaction" => {
+                                        let outcome = if command_name == "commitTransaction" {
+                                            transaction_manager.commit_transaction(&request).await
+                                        } else {
+                                            transaction_manager.abort_transaction(&request).await
+                                        };
+                                        Ok(bson::to_vec(&outcome.unwrap_or_else(|e| e.to_response()))?)
+                                    }
+                                    Some(request) => match transaction_manager.enter(&request).await {
+                                        Ok(mut transaction) => {
+                                            let result = match transaction.connection() {
+                                                Some(connection) => {
+                                                    let target = ConnectionTarget::Transaction { pool: &connection_pool, connection };
+                                                    Self::dispatch(target, &command_name, command_doc, &storage_layout, &find_services, aggregation_memory_limit, &command_registry).await
+                                                }
+                                                None => Err(anyhow::anyhow!("Transaction {} is not open", request.txn_number)),
+                                            };
+                                            if Self::command_failed(&result) {
+                                                transaction_manager.abort_after_error(&mut transaction).await;
+                                            }
+                                            result
+                                        }
+                                        Err(e) => Ok(bson::to_vec(&e.to_response())?),
+                                    },
+                                    None => {
+                                        let target = ConnectionTarget::Pool(&connection_pool);
+                                        Self::dispatch(target, &command_name, command_doc, &storage_layout, &find_services, aggregation_memory_limit, &command_registry).await
+                                    }
+                                };
+                                // Writes that failed part way may still have changed rows
+                                if let (Some(cache), Some(written)) = (&find_services.result_cache, &written) {
+                                    cache.record_write(written);
+                                }
+                                
+                                match result {
                                     Ok(response) => {
                                         // Send MongoDB wire protocol response using appropriate format
                                         let response_bytes = match wire_message {
                                             WireMessage::Query(_) => {
                                                 // For OP_QUERY, always use OP_REPLY format
-                                                WireProtocolHandler::build_reply_message(request_id, response)?
+                                                WireProtocolHandler::build_reply_message_raw(request_id, &response)
                                             }
                                             WireMessage::Msg(_) => {
                                                 // For OP_MSG, use OP_MSG format
-                                                WireProtocolHandler::build_msg_response(request_id, response)?
+                                                WireProtocolHandler::build_msg_response_raw(request_id, &response)
                                             }
                                         };
                                         
@@ -263,7 +350,12 @@ impl ProductionFauxDBServer {
                                     }
                                     Err(e) => {
                                         fauxdb_error!("Command execution failed: {}", e);
-                                        let error_response = Self::build_error_response(e.to_string());
+                                        // Write conflicts carry the label that makes drivers retry
+                                        let error_response = match e.downcast::<FauxDBError>() {
+                                            Ok(error @ FauxDBError::WriteConflict(_)) => TransactionError::from(error).to_response(),
+                                            Ok(error) => Self::build_error_response(error.to_string()),
+                                            Err(e) => Self::build_error_response(e.to_string()),
+                                        };
                                         let response_bytes = match wire_message {
                                             WireMessage::Query(_) => {
                                                 WireProtocolHandler::build_reply_message(request_id, error_response)?
@@ -310,6 +402,32 @@ impl ProductionFauxDBServer {
         Ok(())
     }
 
+    /// Read one whole message, however many reads it arrives in, sized by
+    /// its messageLength header. Returns None when the client closed the
+    /// connection between messages.
+    async fn read_message(stream: &mut tokio::net::TcpStream) -> std::io::Result<Option<Vec<u8>>> {
+        use tokio::io::AsyncReadExt;
+        
+        let mut length = [0u8; 4];
+        match stream.read_exact(&mut length).await {
+            Ok(_) => {}
+            Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e),
+        }
+        let message_length = i32::from_le_bytes(length);
+        if message_length < 16 || message_length as usize > MAX_MESSAGE_SIZE_BYTES {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                format!("Invalid message length {}", message_length),
+            ));
+        }
+        
+        let mut message = vec![0u8; message_length as usize];
+        message[..4].copy_from_slice(&length);
+        stream.read_exact(&mut message[4..]).await?;
+        Ok(Some(message))
+    }
+
     #[allow(dead_code)]
     fn parse_mongodb_message_with_id(bytes: &[u8]) -> Result<(bson::Document, u32)> {
         // Log the raw bytes for debugging
@@ -488,8 +606,81 @@ impl ProductionFauxDBServer {
         bson::from_slice(&data[..doc_len]).map_err(|e| anyhow::anyhow!("BSON parse error: {}", e))
     }
 
+    /// Run one command. find, aggregate, explain and writes need a PostgreSQL
+    /// round trip, everything else goes through the registry. find and
+    /// aggregate build their reply bodies themselves so stored BSON can be
+    /// copied straight in.
+    async fn dispatch(
+        target: ConnectionTarget<'_>,
+        command_name: &str,
+        command_doc: bson::Document,
+        storage_layout: &StorageLayout,
+        find_services: &FindServices,
+        aggregation_memory_limit: usize,
+        command_registry: &MongoDBCommandRegistry,
+    ) -> Result<Vec<u8>> {
+        if command_name == "find" {
+            return crate::find::find_command(target, storage_layout, find_services, &command_doc).await
+                .map_err(Into::into);
+        }
+        if command_name == "aggregate" && crate::aggregate::AggregateRequest::reads_collection(&command_doc) {
+            return crate::aggregate::aggregate_command(target, storage_layout, find_services.single_flight.as_ref(), aggregation_memory_limit, &command_doc).await
+                .map_err(Into::into);
+        }
+        let response = if command_name == "explain" {
+            crate::explain::explain_command(target, storage_layout, &command_doc).await
+        } else if command_name == "insert" {
+            crate::bulk_insert::insert_command(target, storage_layout, &command_doc).await
+                .map_err(Into::into)
+        } else if command_name == "update" {
+            crate::update::update_command(target, storage_layout, &command_doc).await
+                .map_err(Into::into)
+        } else if command_name == "delete" {
+            crate::delete::delete_command(target, storage_layout, &command_doc).await
+                .map_err(Into::into)
+        } else if command_name == "bulkWrite" {
+            crate::bulk_write::bulk_write_command(target, storage_layout, &command_doc).await
+                .map_err(Into::into)
+        } else if command_name == "findAndModify" {
+            crate::find_and_modify::find_and_modify_command(target, storage_layout, &command_doc).await
+                .map_err(Into::into)
+        } else {
+            // Dropped tables are looked up again rather than trusted
+            match command_name {
+                "drop" => {
+                    let database = command_doc.get_str("$db").unwrap_or("fauxdb");
+                    if let Ok(collection) = command_doc.get_str("drop") {
+                        target.catalog().forget(&crate::postgresql_manager::collection_table(database, collection));
+                    }
+                }
+                "dropDatabase" => target.catalog().forget("*"),
+                _ => {}
+            }
+            command_registry.handle_command(command_name, command_doc)
+        };
+        response.and_then(|document| Ok(bson::to_vec(&document)?))
+    }
+
+    /// Whether a command failed in any part, which aborts its transaction
+    fn command_failed(result: &Result<Vec<u8>>) -> bool {
+        let Ok(reply) = result else {
+            return true;
+        };
+        match bson::RawDocument::from_bytes(reply) {
+            Ok(reply) => {
+                let failed = matches!(reply.get("ok"), Ok(Some(bson::RawBsonRef::Double(ok))) if ok == 0.0);
+                failed || matches!(reply.get("writeErrors"), Ok(Some(_)))
+            }
+            Err(_) => true,
+        }
+    }
+
     fn extract_command_name(doc: &bson::Document) -> Option<String> {
-        // Check for collection operations first
+        // Check for collection operations first; findAndModify carries an
+        // "update" field of its own, so it goes before update
+        if doc.contains_key("findAndModify") || doc.contains_key("findandmodify") {
+            return Some("findAndModify".to_string());
+        }
         if doc.contains_key("find") {
             return Some("find".to_string());
         }
@@ -574,7 +765,7 @@ impl ProductionFauxDBServer {
             connections: 0, // Would track actual connections
             commands_executed: 0, // Would track from metrics
             indexes_created: 0, // Would track from index manager
-            transactions_active: 0, // Would track from transaction manager
+            transactions_active: self.transaction_manager.active_transactions() as u64,
         }
     }
 }
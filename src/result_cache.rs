@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file result_cache.rs
+ * @brief Cache of encoded find replies for read-mostly collections
+ *
+ * Replies are stored already encoded and keyed like single-flight, by
+ * everything that shapes them. The cache is bounded by both a number of
+ * replies and their bytes, and evicts least recently used replies first.
+ *
+ * Invalidation uses one logical clock. Every write to a collection stamps it
+ * with a new tick once the write has finished. A find records the clock
+ * before it queries, and its reply is served later only while no write to
+ * its collection has a later stamp. A find that raced a write can therefore
+ * never be served after that write lands.
+ *
+ * Writes through other servers reach the cache over NOTIFY. A listener
+ * connection runs LISTEN on fauxdb_result_cache and announces this server's
+ * writes there, one notification per namespace, or an empty payload for
+ * everything. A reply can be served stale for as long as the notification
+ * takes to arrive. While the listener is down nothing is served, and every
+ * reply is dropped when it reconnects, since writes may have gone unheard.
+ * Writes that bypass FauxDB are only bounded by the TTL.
+ */
+
+use crate::error::{FauxDBError, Result};
+use crate::single_flight::NamespaceSet;
+use crate::{fauxdb_debug, fauxdb_warn};
+use bson::{Bson, Document};
+use dashmap::DashMap;
+use futures::StreamExt;
+use lru::LruCache;
+use metrics::{counter, gauge};
+use parking_lot::Mutex;
+use std::num::NonZeroUsize;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use tokio::sync::mpsc;
+use tokio_postgres::{AsyncMessage, Client, NoTls};
+
+/// Channel carrying the namespaces servers wrote; empty for everything
+pub const RESULT_CACHE_CHANNEL: &str = "fauxdb_result_cache";
+
+/// How long the listener waits before reconnecting
+const RECONNECT_DELAY: Duration = Duration::from_secs(1);
+
+const ANNOUNCE_SQL: &str = "SELECT pg_notify($1, namespace) FROM unnest($2::text[]) AS namespace";
+
+struct Entry {
+    namespace: String,
+    /// Clock reading taken before the query ran
+    stamp: u64,
+    stored_at: Instant,
+    reply: Arc<Vec<u8>>,
+}
+
+struct Replies {
+    entries: LruCache<Vec<u8>, Entry>,
+    bytes: usize,
+}
+
+impl Replies {
+    fn remove(&mut self, key: &[u8]) {
+        if let Some((key, entry)) = self.entries.pop_entry(key) {
+            self.bytes -= key.len() + entry.reply.len();
+        }
+    }
+}
+
+pub struct ResultCache {
+    namespaces: NamespaceSet,
+    max_bytes: usize,
+    ttl: Duration,
+    clock: AtomicU64,
+    /// Tick of the last write to each namespace
+    written: DashMap<String, u64>,
+    /// Tick of the last write whose collections aren't known
+    written_all: AtomicU64,
+    replies: Mutex<Replies>,
+    /// Where writes are announced to other servers, once `listen` runs
+    announce: Mutex<Option<mpsc::UnboundedSender<String>>>,
+    /// Whether writes through other servers reach this cache; false only
+    /// while the listener `listen` started is not connected
+    hearing: AtomicBool,
+}
+
+impl ResultCache {
+    pub fn new(namespaces: NamespaceSet, max_entries: usize, max_bytes: usize, ttl: Duration) -> Self {
+        let max_entries = NonZeroUsize::new(max_entries).unwrap_or(NonZeroUsize::MIN);
+        Self {
+            namespaces,
+            max_bytes,
+            ttl,
+            clock: AtomicU64::new(0),
+            written: DashMap::new(),
+            written_all: AtomicU64::new(0),
+            replies: Mutex::new(Replies { entries: LruCache::new(max_entries), bytes: 0 }),
+            announce: Mutex::new(None),
+            hearing: AtomicBool::new(true),
+        }
+    }
+
+    pub fn applies_to(&self, database: &str, collection: &str) -> bool {
+        self.namespaces.contains(database, collection)
+    }
+
+    /// Clock reading to pass to `insert` for a query about to run
+    pub fn stamp(&self) -> u64 {
+        self.clock.load(Ordering::SeqCst)
+    }
+
+    fn is_current(&self, namespace: &str, stamp: u64) -> bool {
+        let written = self.written.get(namespace).map_or(0, |tick| *tick);
+        written <= stamp && self.written_all.load(Ordering::SeqCst) <= stamp
+    }
+
+    /// The cached reply for `key`, if no write has made it stale
+    pub fn get(&self, key: &[u8]) -> Option<Vec<u8>> {
+        if !self.hearing.load(Ordering::SeqCst) {
+            counter!("fauxdb_result_cache_misses_total").increment(1);
+            return None;
+        }
+        let reply = {
+            let mut replies = self.replies.lock();
+            let fresh = match replies.entries.get(key) {
+                None => None,
+                Some(entry) => Some(entry.stored_at.elapsed() < self.ttl && self.is_current(&entry.namespace, entry.stamp)),
+            };
+            match fresh {
+                Some(true) => replies.entries.get(key).map(|entry| entry.reply.clone()),
+                Some(false) => {
+                    replies.remove(key);
+                    gauge!("fauxdb_result_cache_bytes").set(replies.bytes as f64);
+                    None
+                }
+                None => None,
+            }
+        };
+
+        match reply {
+            Some(reply) => {
+                counter!("fauxdb_result_cache_hits_total").increment(1);
+                Some(reply.as_ref().clone())
+            }
+            None => {
+                counter!("fauxdb_result_cache_misses_total").increment(1);
+                None
+            }
+        }
+    }
+
+    /// Store a reply computed by a query that started at `stamp`
+    pub fn insert(&self, key: Vec<u8>, namespace: String, stamp: u64, reply: &[u8]) {
+        let size = key.len() + reply.len();
+        if size > self.max_bytes || !self.is_current(&namespace, stamp) {
+            return;
+        }
+
+        let mut replies = self.replies.lock();
+        replies.remove(&key);
+        let entry = Entry { namespace, stamp, stored_at: Instant::now(), reply: Arc::new(reply.to_vec()) };
+        replies.bytes += size;
+        if let Some((key, entry)) = replies.entries.push(key, entry) {
+            replies.bytes -= key.len() + entry.reply.len();
+            counter!("fauxdb_result_cache_evictions_total").increment(1);
+        }
+        while replies.bytes > self.max_bytes {
+            match replies.entries.pop_lru() {
+                Some((key, entry)) => {
+                    replies.bytes -= key.len() + entry.reply.len();
+                    counter!("fauxdb_result_cache_evictions_total").increment(1);
+                }
+                None => break,
+            }
+        }
+        gauge!("fauxdb_result_cache_bytes").set(replies.bytes as f64);
+    }
+
+    /// Make cached replies for a namespace stale; call once the write is done
+    pub fn invalidate(&self, namespace: &str) {
+        let tick = self.clock.fetch_add(1, Ordering::SeqCst) + 1;
+        // Concurrent writes may record out of order; keep the latest tick
+        self.written.entry(namespace.to_string())
+            .and_modify(|written| *written = (*written).max(tick))
+            .or_insert(tick);
+    }
+
+    /// Make every cached reply stale
+    pub fn invalidate_all(&self) {
+        let tick = self.clock.fetch_add(1, Ordering::SeqCst) + 1;
+        self.written_all.fetch_max(tick, Ordering::SeqCst);
+    }
+
+    /// Invalidate what a command that has finished may have written, here
+    /// and on the servers listening
+    pub fn record_write(&self, written: &Written) {
+        match written {
+            Written::Namespaces(namespaces) => namespaces.iter().for_each(|namespace| self.invalidate(namespace)),
+            Written::All => self.invalidate_all(),
+        }
+        if let Some(announce) = self.announce.lock().as_ref() {
+            match written {
+                Written::Namespaces(namespaces) => namespaces.iter().for_each(|namespace| { let _ = announce.send(namespace.clone()); }),
+                Written::All => { let _ = announce.send(String::new()); }
+            }
+        }
+    }
+
+    /// Hear and announce writes over NOTIFY for as long as the server runs
+    pub fn listen(self: &Arc<Self>, connection_string: String) {
+        let (sender, mut announced) = mpsc::unbounded_channel();
+        *self.announce.lock() = Some(sender);
+        self.hearing.store(false, Ordering::SeqCst);
+        let cache = self.clone();
+        tokio::spawn(async move {
+            loop {
+                if let Err(e) = cache.follow(&connection_string, &mut announced).await {
+                    fauxdb_warn!("Result cache listener stopped: {}", e);
+                }
+                // Writes through other servers go unheard until it reconnects
+                cache.hearing.store(false, Ordering::SeqCst);
+                tokio::time::sleep(RECONNECT_DELAY).await;
+            }
+        });
+    }
+
+    async fn follow(&self, connection_string: &str, announced: &mut mpsc::UnboundedReceiver<String>) -> Result<()> {
+        let (client, mut connection) = tokio_postgres::connect(connection_string, NoTls).await
+            .map_err(|e| FauxDBError::Database(format!("Failed to connect result cache listener: {}", e)))?;
+
+        let (sender, mut heard) = mpsc::unbounded_channel();
+        let driver = tokio::spawn(async move {
+            let mut messages = futures::stream::poll_fn(move |cx| connection.poll_message(cx));
+            while let Some(message) = messages.next().await {
+                match message {
+                    Ok(AsyncMessage::Notification(notification)) => {
+                        if sender.send((notification.process_id(), notification.payload().to_string())).is_err() {
+                            break;
+                        }
+                    }
+                    Ok(_) => {}
+                    Err(e) => {
+                        fauxdb_warn!("Result cache listener connection failed: {}", e);
+                        break;
+                    }
+                }
+            }
+        });
+
+        let result = self.run_listener(&client, &mut heard, announced).await;
+        driver.abort();
+        result
+    }
+
+    async fn run_listener(
+        &self,
+        client: &Client,
+        heard: &mut mpsc::UnboundedReceiver<(i32, String)>,
+        announced: &mut mpsc::UnboundedReceiver<String>,
+    ) -> Result<()> {
+        client.batch_execute(&format!("LISTEN {}", RESULT_CACHE_CHANNEL)).await
+            .map_err(|e| FauxDBError::Database(format!("Failed to LISTEN on {}: {}", RESULT_CACHE_CHANNEL, e)))?;
+        // Our own announcements come back too
+        let own_pid: i32 = client.query_one("SELECT pg_backend_pid()", &[]).await
+            .map_err(|e| FauxDBError::Database(format!("Failed to start result cache listener: {}", e)))?
+            .get(0);
+
+        // Replies cached before now may have missed writes; only those
+        // after the LISTEN are certain to be heard
+        self.invalidate_all();
+        self.hearing.store(true, Ordering::SeqCst);
+
+        loop {
+            tokio::select! {
+                notification = heard.recv() => match notification {
+                    Some((pid, _)) if pid == own_pid => {}
+                    Some((_, namespace)) => {
+                        fauxdb_debug!("Result cache heard a write to {:?}", namespace);
+                        counter!("fauxdb_result_cache_remote_invalidations_total").increment(1);
+                        if namespace.is_empty() {
+                            self.invalidate_all();
+                        } else {
+                            self.invalidate(&namespace);
+                        }
+                    }
+                    None => break,
+                },
+                namespace = announced.recv() => match namespace {
+                    Some(namespace) => {
+                        // Writes that finished meanwhile go out in the same statement
+                        let mut namespaces = vec![namespace];
+                        while let Ok(namespace) = announced.try_recv() {
+                            namespaces.push(namespace);
+                        }
+                        namespaces.sort();
+                        namespaces.dedup();
+                        client.execute(ANNOUNCE_SQL, &[&RESULT_CACHE_CHANNEL, &namespaces]).await
+                            .map_err(|e| FauxDBError::Database(format!("Failed to announce writes: {}", e)))?;
+                    }
+                    None => break,
+                },
+            }
+        }
+        Err(FauxDBError::Database("Result cache listener connection closed".to_string()))
+    }
+}
+
+/// Data a command may change
+#[derive(Debug, Clone, PartialEq)]
+pub enum Written {
+    Namespaces(Vec<String>),
+    All,
+}
+
+impl Written {
+    /// Taken before the command runs, since dispatch may consume it.
+    /// None for commands that don't change documents.
+    pub fn by_command(command_name: &str, command: &Document) -> Option<Self> {
+        let database = command.get_str("$db").unwrap_or("fauxdb");
+        match command_name {
+            "insert" | "update" | "delete" | "findAndModify" | "drop" => {
+                let collection = command.get_str(command_name).or_else(|_| command.get_str("findandmodify")).ok()?;
+                Some(Self::Namespaces(vec![format!("{}.{}", database, collection)]))
+            }
+            "bulkWrite" => {
+                let ns_info = command.get_array("nsInfo").ok()?;
+                let namespaces = ns_info.iter().filter_map(|info| match info {
+                    Bson::Document(info) => info.get_str("ns").ok().map(str::to_string),
+                    _ => None,
+                });
+                Some(Self::Namespaces(namespaces.collect()))
+            }
+            // Transactional writes only become visible here, and which
+            // collections they touched isn't tracked
+            "dropDatabase" | "commitTransaction" => Some(Self::All),
+            _ => None,
+        }
+    }
+}
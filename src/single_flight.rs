@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file single_flight.rs
+ * @brief Deduplication of identical concurrent reads
+ *
+ * When many clients send the same query at once, only the first runs it.
+ * The rest wait for its encoded reply body and get a copy. Finds count as
+ * identical when namespace, filter, projection, sort, skip, limit and read
+ * concern all match byte for byte, aggregates when namespace, pipeline,
+ * options and read concern do. A leader that is cancelled before it
+ * finishes releases its followers, and they run the query themselves.
+ */
+
+use crate::error::{FauxDBError, Result};
+use bson::{doc, Bson, Document};
+use metrics::counter;
+use parking_lot::Mutex;
+use std::collections::{HashMap, HashSet};
+use std::future::Future;
+use std::sync::Arc;
+use tokio::sync::watch;
+
+type SharedReply = std::result::Result<Arc<Vec<u8>>, String>;
+
+/// Collections single-flight applies to, as configured: "db.collection",
+/// "db.*" or "*"
+#[derive(Debug, Clone, Default)]
+pub struct NamespaceSet {
+    all: bool,
+    databases: HashSet<String>,
+    namespaces: HashSet<String>,
+}
+
+impl NamespaceSet {
+    pub fn new(patterns: &[String]) -> Self {
+        let mut set = Self::default();
+        for pattern in patterns {
+            if pattern == "*" {
+                set.all = true;
+            } else if let Some(database) = pattern.strip_suffix(".*") {
+                set.databases.insert(database.to_string());
+            } else {
+                set.namespaces.insert(pattern.clone());
+            }
+        }
+        set
+    }
+
+    pub fn is_empty(&self) -> bool {
+        !self.all && self.databases.is_empty() && self.namespaces.is_empty()
+    }
+
+    pub fn contains(&self, database: &str, collection: &str) -> bool {
+        self.all || self.databases.contains(database) || self.namespaces.contains(&format!("{}.{}", database, collection))
+    }
+}
+
+pub struct SingleFlight {
+    namespaces: NamespaceSet,
+    in_flight: Mutex<HashMap<Vec<u8>, watch::Receiver<Option<SharedReply>>>>,
+}
+
+/// Removes a leader's entry when it finishes or is dropped mid-flight
+struct Flight<'a> {
+    in_flight: &'a Mutex<HashMap<Vec<u8>, watch::Receiver<Option<SharedReply>>>>,
+    key: &'a [u8],
+}
+
+impl Drop for Flight<'_> {
+    fn drop(&mut self) {
+        self.in_flight.lock().remove(self.key);
+    }
+}
+
+enum Role {
+    Leader(watch::Sender<Option<SharedReply>>),
+    Follower(watch::Receiver<Option<SharedReply>>),
+}
+
+impl SingleFlight {
+    pub fn new(namespaces: NamespaceSet) -> Self {
+        Self { namespaces, in_flight: Mutex::new(HashMap::new()) }
+    }
+
+    pub fn applies_to(&self, database: &str, collection: &str) -> bool {
+        self.namespaces.contains(database, collection)
+    }
+
+    /// Run `execute` unless an identical request is already running, in
+    /// which case wait for its reply instead
+    pub async fn run<F, Fut>(&self, key: Vec<u8>, execute: F) -> Result<Vec<u8>>
+    where
+        F: FnOnce() -> Fut,
+        Fut: Future<Output = Result<Vec<u8>>>,
+    {
+        let role = {
+            let mut in_flight = self.in_flight.lock();
+            match in_flight.get(&key) {
+                Some(receiver) => Role::Follower(receiver.clone()),
+                None => {
+                    let (sender, receiver) = watch::channel(None);
+                    in_flight.insert(key.clone(), receiver);
+                    Role::Leader(sender)
+                }
+            }
+        };
+
+        match role {
+            Role::Leader(sender) => {
+                counter!("fauxdb_single_flight_executions_total").increment(1);
+                let flight = Flight { in_flight: &self.in_flight, key: &key };
+                let result = execute().await;
+                // Later arrivals start a fresh flight rather than take a finished reply
+                drop(flight);
+                // Only copy the reply when someone is waiting for it
+                if sender.receiver_count() > 0 {
+                    let shared = match &result {
+                        Ok(reply) => Ok(Arc::new(reply.clone())),
+                        Err(e) => Err(e.to_string()),
+                    };
+                    sender.send_replace(Some(shared));
+                }
+                result
+            }
+            Role::Follower(mut receiver) => {
+                loop {
+                    if let Some(reply) = receiver.borrow_and_update().clone() {
+                        counter!("fauxdb_single_flight_shared_total").increment(1);
+                        return reply.map(|reply| reply.as_ref().clone()).map_err(FauxDBError::Database);
+                    }
+                    if receiver.changed().await.is_err() {
+                        break;
+                    }
+                }
+                // The leader went away without a reply
+                counter!("fauxdb_single_flight_fallbacks_total").increment(1);
+                execute().await
+            }
+        }
+    }
+}
+
+/// Identity of a find for single-flight: everything that shapes its reply.
+/// None for reads in a transaction, which must see their own writes.
+pub fn find_key(command: &Document) -> Option<Vec<u8>> {
+    if command.contains_key("txnNumber") {
+        return None;
+    }
+    let field = |key: &str| command.get(key).cloned().unwrap_or(Bson::Null);
+    let key = doc! {
+        "db": field("$db"),
+        "find": field("find"),
+        "filter": field("filter"),
+        "projection": field("projection"),
+        "sort": field("sort"),
+        "skip": field("skip"),
+        "limit": field("limit"),
+        "readConcern": field("readConcern"),
+    };
+    bson::to_vec(&key).ok()
+}
+
+/// Identity of an aggregate for single-flight, as `find_key` is for a find.
+/// None in a transaction, and for pipelines that write with $out or $merge.
+pub fn aggregate_key(command: &Document) -> Option<Vec<u8>> {
+    if command.contains_key("txnNumber") {
+        return None;
+    }
+    let writes = command.get_array("pipeline").ok()?
+        .iter()
+        .filter_map(Bson::as_document)
+        .any(|stage| stage.contains_key("$out") || stage.contains_key("$merge"));
+    if writes {
+        return None;
+    }
+    let field = |key: &str| command.get(key).cloned().unwrap_or(Bson::Null);
+    let key = doc! {
+        "db": field("$db"),
+        "aggregate": field("aggregate"),
+        "pipeline": field("pipeline"),
+        "allowDiskUse": field("allowDiskUse"),
+        "collation": field("collation"),
+        "let": field("let"),
+        "readConcern": field("readConcern"),
+    };
+    bson::to_vec(&key).ok()
+}
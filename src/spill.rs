@@ -0,0 +1,178 @@
+/*!
+ * @file spill.rs
+ * @brief Memory budgets and temp-file spilling for blocking aggregation stages
+ *
+ * Blocking operators ($sort, $group) each check their own resident state
+ * against the query's MemoryBudget. Once a stage exceeds it, that stage
+ * either fails, or, when the pipeline was run with allowDiskUse, writes
+ * documents out to temp files as consecutive raw BSON and reads them back
+ * later.
+ */
+
+use crate::error::{FauxDBError, Result};
+use bson::{Bson, Document};
+use metrics::counter;
+use std::borrow::Cow;
+use std::fs::File;
+use std::io::{BufReader, BufWriter, ErrorKind, Read, Write};
+use std::path::PathBuf;
+
+/// MongoDB's default memory limit for a blocking stage
+pub const DEFAULT_MEMORY_LIMIT_BYTES: usize = 100 * 1024 * 1024;
+
+/// Per-query memory limit. Each blocking stage is held to the whole limit on
+/// its own, as MongoDB applies it per stage, not to the stages' sum
+#[derive(Debug, Clone, Copy)]
+pub struct MemoryBudget {
+    pub limit_bytes: usize,
+    pub allow_disk_use: bool,
+}
+
+impl Default for MemoryBudget {
+    fn default() -> Self {
+        Self {
+            limit_bytes: DEFAULT_MEMORY_LIMIT_BYTES,
+            allow_disk_use: false,
+        }
+    }
+}
+
+impl MemoryBudget {
+    pub fn new(limit_bytes: usize, allow_disk_use: bool) -> Self {
+        Self { limit_bytes, allow_disk_use }
+    }
+
+    /// Check a stage's resident size against the limit. Returns true when the
+    /// stage must spill, and an error when it is over the limit but may not.
+    pub fn must_spill(&self, stage: &str, used_bytes: usize) -> Result<bool> {
+        if used_bytes <= self.limit_bytes {
+            return Ok(false);
+        }
+        if !self.allow_disk_use {
+            counter!("fauxdb_spill_limit_errors_total", "stage" => stage.to_string()).increment(1);
+            return Err(FauxDBError::Database(format!(
+                "Exceeded memory limit of {} bytes for {}, but did not opt in to external spilling. Pass allowDiskUse:true to opt in.",
+                self.limit_bytes, stage
+            )));
+        }
+        Ok(true)
+    }
+}
+
+/// Rough in-memory footprint of a document, used for memory accounting
+pub fn approximate_size(doc: &Document) -> usize {
+    doc.iter().map(|(key, value)| key.len() + approximate_value_size(value)).sum::<usize>() + 16
+}
+
+pub fn approximate_value_size(value: &Bson) -> usize {
+    std::mem::size_of::<Bson>() + match value {
+        Bson::String(s) | Bson::Symbol(s) | Bson::JavaScriptCode(s) => s.len(),
+        Bson::Document(doc) => approximate_size(doc),
+        Bson::Array(items) => items.iter().map(approximate_value_size).sum(),
+        Bson::Binary(binary) => binary.bytes.len(),
+        Bson::RegularExpression(regex) => regex.pattern.len() + regex.options.len(),
+        _ => 0,
+    }
+}
+
+/// Appends raw BSON documents to a fresh temp file
+pub struct SpillWriter {
+    stage: &'static str,
+    writer: BufWriter<File>,
+    run: SpillRun,
+    buffer: Vec<u8>,
+}
+
+impl SpillWriter {
+    pub fn create(stage: &'static str) -> Result<Self> {
+        let path = std::env::temp_dir().join(format!("fauxdb-spill-{}.bson", uuid::Uuid::new_v4()));
+        let writer = BufWriter::new(File::create(&path)?);
+        counter!("fauxdb_spill_files_total", "stage" => stage).increment(1);
+
+        Ok(Self {
+            stage,
+            writer,
+            run: SpillRun { path, bytes_written: 0, documents: 0 },
+            buffer: Vec::new(),
+        })
+    }
+
+    pub fn append(&mut self, doc: &Document) -> Result<()> {
+        self.buffer.clear();
+        doc.to_writer(&mut self.buffer)?;
+        self.writer.write_all(&self.buffer)?;
+        self.run.bytes_written += self.buffer.len() as u64;
+        self.run.documents += 1;
+        Ok(())
+    }
+
+    pub fn finish(mut self) -> Result<SpillRun> {
+        self.writer.flush()?;
+        counter!("fauxdb_spill_bytes_total", "stage" => self.stage).increment(self.run.bytes_written);
+        counter!("fauxdb_spill_documents_total", "stage" => self.stage).increment(self.run.documents);
+        Ok(self.run)
+    }
+}
+
+/// A finished spill file; removed from disk when dropped
+pub struct SpillRun {
+    path: PathBuf,
+    pub bytes_written: u64,
+    pub documents: u64,
+}
+
+impl SpillRun {
+    /// Write a whole run in one go
+    pub fn write<'a>(stage: &'static str, docs: impl Iterator<Item = Cow<'a, Document>>) -> Result<Self> {
+        let mut writer = SpillWriter::create(stage)?;
+        for doc in docs {
+            writer.append(&doc)?;
+        }
+        writer.finish()
+    }
+
+    pub fn into_reader(self) -> Result<SpillReader> {
+        let file = File::open(&self.path)?;
+        Ok(SpillReader { reader: BufReader::new(file), run: self })
+    }
+}
+
+impl Drop for SpillRun {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_file(&self.path);
+    }
+}
+
+/// Streams documents back out of a spill file in write order
+pub struct SpillReader {
+    reader: BufReader<File>,
+    run: SpillRun,
+}
+
+impl SpillReader {
+    fn read_document(&mut self) -> Result<Option<Document>> {
+        let mut length = [0u8; 4];
+        match self.reader.read_exact(&mut length) {
+            Ok(()) => {}
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e.into()),
+        }
+
+        let total = i32::from_le_bytes(length) as usize;
+        if total < 5 {
+            return Err(FauxDBError::Database(format!("Corrupt spill file {}", self.run.path.display())));
+        }
+        let mut raw = vec![0u8; total];
+        raw[..4].copy_from_slice(&length);
+        self.reader.read_exact(&mut raw[4..])?;
+        Ok(Some(Document::from_reader(&mut raw.as_slice())?))
+    }
+}
+
+impl Iterator for SpillReader {
+    type Item = Result<Document>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        self.read_document().transpose()
+    }
+}
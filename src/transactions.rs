@@ -1,169 +1,438 @@
 /*!
  * MongoDB Transaction Support for FauxDB
- * Production-ready ACID transaction support
+ *
+ * A multi-document transaction is tied to the driver's session (lsid) and
+ * transaction number. The statement that carries startTransaction checks out
+ * a PostgreSQL connection and runs BEGIN on it. The connection then stays
+ * pinned to the session, and each later statement of the transaction runs
+ * on it straight away. commitTransaction and abortTransaction map to COMMIT
+ * and ROLLBACK and hand the connection back to the pool. A transaction left
+ * idle longer than the configured timeout is rolled back, so an abandoned
+ * session can't hold a connection and its row locks indefinitely. The pool
+ * caps how many connections transactions may pin; a transaction that can't
+ * get one in time fails with a transient error, and drivers retry it.
  */
 
-use bson::Document;
-use anyhow::{Result, anyhow};
-use crate::{fauxdb_info, fauxdb_error};
+use crate::collection_catalog::CollectionCatalog;
+use crate::connection_pool::{PooledConnection, ProductionConnectionPool};
+use crate::error::{FauxDBError, Result};
+use crate::postgresql_manager::collection_table;
+use crate::update::database_error;
+use crate::{fauxdb_debug, fauxdb_warn};
+use bson::{doc, Bson, Document};
+use metrics::counter;
+use parking_lot::Mutex;
 use std::collections::HashMap;
+use std::sync::atomic::{AtomicUsize, Ordering};
 use std::sync::Arc;
-use parking_lot::RwLock;
-use chrono::{DateTime, Utc};
-use uuid::Uuid;
-use tokio::sync::Semaphore;
-use deadpool_postgres::{Pool, Transaction};
-
-#[derive(Debug, Clone)]
-pub struct TransactionState {
-    pub id: Uuid,
-    pub state: TransactionStatus,
-    pub start_time: DateTime<Utc>,
-    pub operations: Vec<TransactionOperation>,
+use std::time::{Duration, Instant};
+use tokio::sync::OwnedMutexGuard;
+use tokio_postgres::Client;
+
+/// MongoDB's default transactionLifetimeLimitSeconds
+pub const DEFAULT_IDLE_TIMEOUT: Duration = Duration::from_secs(60);
+
+/// Snapshot reads for the whole transaction, as MongoDB gives
+const BEGIN_SQL: &str = "BEGIN ISOLATION LEVEL REPEATABLE READ";
+
+const CODE_NO_SUCH_TRANSACTION: i32 = 251;
+const CODE_TRANSACTION_COMMITTED: i32 = 256;
+const CODE_TRANSACTION_TOO_OLD: i32 = 225;
+const CODE_CONFLICTING_OPERATION: i32 = 263;
+const CODE_EXCEEDED_TIME_LIMIT: i32 = 262;
+const CODE_WRITE_CONFLICT: i32 = 112;
+const CODE_INTERNAL_ERROR: i32 = 1;
+
+/// A command refused or failed because of its transaction
+#[derive(Debug, thiserror::Error)]
+#[error("{message}")]
+pub struct TransactionError {
+    pub code: i32,
+    pub code_name: &'static str,
+    pub message: String,
+}
+
+impl TransactionError {
+    fn new(code: i32, code_name: &'static str, message: String) -> Self {
+        Self { code, code_name, message }
+    }
+
+    fn no_such_transaction(txn_number: i64) -> Self {
+        Self::new(CODE_NO_SUCH_TRANSACTION, "NoSuchTransaction", format!("Transaction {} has been aborted or was never started", txn_number))
+    }
+
+    /// Error reply; drivers retry a whole transaction on TransientTransactionError
+    pub fn to_response(&self) -> Document {
+        let mut response = doc! { "ok": 0.0, "errmsg": self.message.clone(), "code": self.code, "codeName": self.code_name };
+        if matches!(self.code, CODE_NO_SUCH_TRANSACTION | CODE_EXCEEDED_TIME_LIMIT | CODE_WRITE_CONFLICT) {
+            response.insert("errorLabels", vec![Bson::String("TransientTransactionError".to_string())]);
+        }
+        response
+    }
+}
+
+impl From<FauxDBError> for TransactionError {
+    fn from(error: FauxDBError) -> Self {
+        match error {
+            // A REPEATABLE READ snapshot lost a race with another writer
+            FauxDBError::WriteConflict(message) => Self::new(CODE_WRITE_CONFLICT, "WriteConflict", message),
+            error => Self::new(CODE_INTERNAL_ERROR, "InternalError", error.to_string()),
+        }
+    }
 }
 
-#[derive(Debug, Clone)]
-pub enum TransactionStatus {
-    Starting,
-    InProgress,
+pub type TransactionResult<T> = std::result::Result<T, TransactionError>;
+
+/// The transaction fields of a command
+#[derive(Debug, Clone, PartialEq)]
+pub struct TransactionRequest {
+    /// The encoded lsid
+    pub session: Vec<u8>,
+    pub txn_number: i64,
+    pub start: bool,
+}
+
+impl TransactionRequest {
+    /// None for commands outside a multi-document transaction; retryable
+    /// writes carry a txnNumber but no autocommit: false
+    pub fn parse(command: &Document) -> Option<Self> {
+        if command.get_bool("autocommit") != Ok(false) {
+            return None;
+        }
+        let txn_number = match command.get("txnNumber")? {
+            Bson::Int64(n) => *n,
+            Bson::Int32(n) => *n as i64,
+            _ => return None,
+        };
+        Some(Self {
+            session: bson::to_vec(command.get_document("lsid").ok()?).ok()?,
+            txn_number,
+            start: command.get_bool("startTransaction").unwrap_or(false),
+        })
+    }
+}
+
+enum TransactionState {
+    None,
+    Active(PooledConnection),
     Committed,
     Aborted,
 }
 
-#[derive(Debug, Clone)]
-pub struct TransactionOperation {
-    pub id: Uuid,
-    pub operation_type: String,
-    pub collection: String,
-    pub command: Document,
+/// The latest transaction of one session
+pub struct SessionTransaction {
+    txn_number: i64,
+    state: TransactionState,
+    last_used: Instant,
+}
+
+impl SessionTransaction {
+    /// The pinned connection, while the transaction is open
+    pub fn connection(&self) -> Option<&PooledConnection> {
+        match &self.state {
+            TransactionState::Active(connection) => Some(connection),
+            _ => None,
+        }
+    }
+
+    pub fn client(&self) -> Option<&Client> {
+        self.connection().map(PooledConnection::client)
+    }
+
+    fn is_committed(&self) -> bool {
+        matches!(self.state, TransactionState::Committed)
+    }
+
+    /// End an open transaction with COMMIT or ROLLBACK and release its connection
+    async fn finish(&mut self, commit: bool, active: &AtomicUsize) -> Result<()> {
+        let connection = match std::mem::replace(&mut self.state, TransactionState::None) {
+            TransactionState::Active(connection) => connection,
+            other => {
+                self.state = other;
+                return Ok(());
+            }
+        };
+        active.fetch_sub(1, Ordering::Relaxed);
+        let sql = if commit { "COMMIT" } else { "ROLLBACK" };
+        let result = connection.end(sql).await;
+        self.state = if commit && result.is_ok() { TransactionState::Committed } else { TransactionState::Aborted };
+        // After a failed COMMIT or ROLLBACK the pool rolls the connection
+        // back, or closes it, before handing it out again
+        result.map_err(|e| match database_error(e) {
+            FauxDBError::Database(message) => FauxDBError::Database(format!("{} failed: {}", sql, message)),
+            error => error,
+        })
+    }
 }
 
-#[derive(Debug)]
 pub struct TransactionManager {
-    active_transactions: Arc<RwLock<HashMap<Uuid, TransactionState>>>,
-    connection_pool: Arc<Pool>,
-    transaction_semaphore: Arc<Semaphore>,
+    pool: Arc<ProductionConnectionPool>,
+    idle_timeout: Duration,
+    sessions: Mutex<HashMap<Vec<u8>, Arc<tokio::sync::Mutex<SessionTransaction>>>>,
+    active: AtomicUsize,
 }
 
 impl TransactionManager {
-    pub fn new(connection_pool: Arc<Pool>) -> Self {
-        Self {
-            active_transactions: Arc::new(RwLock::new(HashMap::new())),
-            connection_pool,
-            transaction_semaphore: Arc::new(Semaphore::new(100)),
-        }
+    pub fn new(pool: Arc<ProductionConnectionPool>, idle_timeout: Duration) -> Self {
+        Self { pool, idle_timeout, sessions: Mutex::new(HashMap::new()), active: AtomicUsize::new(0) }
+    }
+
+    /// Transactions holding a pinned connection
+    pub fn active_transactions(&self) -> usize {
+        self.active.load(Ordering::Relaxed)
     }
 
-    pub async fn start_transaction(&self) -> Result<Uuid> {
-        let _permit = self.transaction_semaphore.acquire().await?;
-        let transaction_id = Uuid::new_v4();
+    fn session(&self, session: &[u8]) -> Arc<tokio::sync::Mutex<SessionTransaction>> {
+        self.sessions.lock()
+            .entry(session.to_vec())
+            .or_insert_with(|| Arc::new(tokio::sync::Mutex::new(SessionTransaction {
+                txn_number: i64::MIN,
+                state: TransactionState::None,
+                last_used: Instant::now(),
+            })))
+            .clone()
+    }
 
-        let transaction_state = TransactionState {
-            id: transaction_id,
-            state: TransactionStatus::Starting,
-            start_time: Utc::now(),
-            operations: Vec::new(),
-        };
+    /// The open transaction a statement runs in, starting it on
+    /// startTransaction. The session stays locked until the guard drops.
+    pub async fn enter(&self, request: &TransactionRequest) -> TransactionResult<OwnedMutexGuard<SessionTransaction>> {
+        let mut transaction = self.session(&request.session).lock_owned().await;
+        transaction.last_used = Instant::now();
 
-        {
-            let mut transactions = self.active_transactions.write();
-            transactions.insert(transaction_id, transaction_state);
+        if !request.start {
+            if transaction.client().is_some() && transaction.txn_number == request.txn_number {
+                return Ok(transaction);
+            }
+            return Err(TransactionError::no_such_transaction(request.txn_number));
         }
 
-        fauxdb_info!("Started transaction: {}", transaction_id);
-        Ok(transaction_id)
+        if request.txn_number < transaction.txn_number {
+            return Err(TransactionError::new(
+                CODE_TRANSACTION_TOO_OLD,
+                "TransactionTooOld",
+                format!("txnNumber {} is older than the session's {}", request.txn_number, transaction.txn_number),
+            ));
+        }
+        if request.txn_number == transaction.txn_number {
+            return Err(TransactionError::new(
+                CODE_CONFLICTING_OPERATION,
+                "ConflictingOperationInProgress",
+                format!("Transaction {} has already been started", request.txn_number),
+            ));
+        }
+        // A newer transaction on the session abandons the previous one
+        if let Err(e) = transaction.finish(false, &self.active).await {
+            fauxdb_warn!("Rolling back an abandoned transaction failed: {}", e);
+        }
+
+        let connection = self.pool.get_pinned_connection().await
+            .map_err(|e| FauxDBError::ConnectionPool(e.to_string()))?
+            .ok_or_else(|| TransactionError::new(
+                CODE_EXCEEDED_TIME_LIMIT,
+                "ExceededTimeLimit",
+                "Too many open transactions; no connection could be pinned in time".to_string(),
+            ))?;
+        connection.begin(BEGIN_SQL).await
+            .map_err(|e| FauxDBError::Database(format!("BEGIN failed: {}", e)))?;
+        transaction.txn_number = request.txn_number;
+        transaction.state = TransactionState::Active(connection);
+        self.active.fetch_add(1, Ordering::Relaxed);
+        counter!("fauxdb_transactions_started_total").increment(1);
+        fauxdb_debug!("Started transaction {}", request.txn_number);
+        Ok(transaction)
     }
 
-    pub async fn commit_transaction(&self, transaction_id: Uuid) -> Result<Document> {
-        let transaction_state = {
-            let mut transactions = self.active_transactions.write();
-            transactions.remove(&transaction_id)
-                .ok_or_else(|| anyhow!("Transaction not found: {}", transaction_id))?
-        };
+    /// Roll back a transaction after a statement in it failed, as MongoDB
+    /// aborts a transaction on any error
+    pub async fn abort_after_error(&self, transaction: &mut SessionTransaction) {
+        if transaction.client().is_some() {
+            counter!("fauxdb_transactions_aborted_total").increment(1);
+        }
+        if let Err(e) = transaction.finish(false, &self.active).await {
+            fauxdb_warn!("Rolling back a failed transaction failed: {}", e);
+        }
+    }
 
-        let mut client = self.connection_pool.get().await?;
-        let mut pg_transaction = client.transaction().await?;
+    /// Execute a commitTransaction command. Committing again is a no-op, so
+    /// drivers may retry a commit whose reply was lost.
+    pub async fn commit_transaction(&self, request: &TransactionRequest) -> TransactionResult<Document> {
+        let mut transaction = self.session(&request.session).lock_owned().await;
+        transaction.last_used = Instant::now();
+        if transaction.txn_number != request.txn_number {
+            return Err(TransactionError::no_such_transaction(request.txn_number));
+        }
+        if transaction.client().is_some() {
+            transaction.finish(true, &self.active).await?;
+            counter!("fauxdb_transactions_committed_total").increment(1);
+            return Ok(doc! { "ok": 1.0 });
+        }
+        if transaction.is_committed() {
+            return Ok(doc! { "ok": 1.0 });
+        }
+        Err(TransactionError::no_such_transaction(request.txn_number))
+    }
 
-        let mut success = true;
-        for operation in &transaction_state.operations {
-            if let Err(e) = self.execute_operation(&mut pg_transaction, operation).await {
-                fauxdb_error!("Operation failed: {}", e);
-                success = false;
-                break;
-            }
+    /// Execute an abortTransaction command
+    pub async fn abort_transaction(&self, request: &TransactionRequest) -> TransactionResult<Document> {
+        let mut transaction = self.session(&request.session).lock_owned().await;
+        transaction.last_used = Instant::now();
+        if transaction.txn_number != request.txn_number {
+            return Err(TransactionError::no_such_transaction(request.txn_number));
+        }
+        if transaction.client().is_some() {
+            counter!("fauxdb_transactions_aborted_total").increment(1);
+            transaction.finish(false, &self.active).await?;
+            return Ok(doc! { "ok": 1.0 });
+        }
+        if transaction.is_committed() {
+            return Err(TransactionError::new(
+                CODE_TRANSACTION_COMMITTED,
+                "TransactionCommitted",
+                format!("Transaction {} has been committed", request.txn_number),
+            ));
         }
+        Err(TransactionError::no_such_transaction(request.txn_number))
+    }
 
-        let response = if success {
-            pg_transaction.commit().await?;
-            fauxdb_info!("Committed transaction: {}", transaction_id);
-            
-            let mut response = Document::new();
-            response.insert("ok", 1.0);
-            response.insert("transactionId", transaction_id.to_string());
-            response
-        } else {
-            pg_transaction.rollback().await?;
-            fauxdb_error!("Aborted transaction: {}", transaction_id);
-            
-            let mut response = Document::new();
-            response.insert("ok", 0.0);
-            response.insert("errmsg", "Transaction aborted");
-            response
-        };
+    /// Roll back transactions idle past the timeout, and forget sessions
+    /// that have had nothing open for as long
+    pub fn start_reaper(self: &Arc<Self>) {
+        let manager = self.clone();
+        let period = (self.idle_timeout / 4).clamp(Duration::from_millis(100), Duration::from_secs(5));
+        tokio::spawn(async move {
+            loop {
+                tokio::time::sleep(period).await;
+                manager.reap().await;
+            }
+        });
+    }
+
+    async fn reap(&self) {
+        let sessions: Vec<_> = self.sessions.lock().iter().map(|(key, session)| (key.clone(), session.clone())).collect();
+        for (key, session) in sessions {
+            // A session that is running a statement isn't idle
+            let Ok(mut transaction) = session.try_lock() else {
+                continue;
+            };
+            if transaction.last_used.elapsed() < self.idle_timeout {
+                continue;
+            }
+            if transaction.client().is_some() {
+                fauxdb_warn!("Rolling back transaction {} after {:?} idle", transaction.txn_number, self.idle_timeout);
+                counter!("fauxdb_transactions_expired_total").increment(1);
+                if let Err(e) = transaction.finish(false, &self.active).await {
+                    fauxdb_warn!("Rolling back an expired transaction failed: {}", e);
+                }
+                transaction.last_used = Instant::now();
+                continue;
+            }
+            drop(transaction);
 
-        Ok(response)
+            // Only the map and this loop hold it, so no statement can be
+            // about to use the entry
+            let mut sessions = self.sessions.lock();
+            if Arc::strong_count(&session) == 2 {
+                sessions.remove(&key);
+            }
+        }
     }
+}
 
-    pub async fn abort_transaction(&self, transaction_id: Uuid) -> Result<Document> {
-        {
-            let mut transactions = self.active_transactions.write();
-            transactions.remove(&transaction_id);
+/// Where a command's statements run
+#[derive(Clone, Copy)]
+pub enum ConnectionTarget<'a> {
+    /// Autocommit statements on connections taken from the pool
+    Pool(&'a ProductionConnectionPool),
+    /// The pinned connection of an open transaction
+    Transaction { pool: &'a ProductionConnectionPool, connection: &'a PooledConnection },
+}
+
+/// A connection checked out for one command
+pub enum Checkout<'a> {
+    Pooled(PooledConnection),
+    Pinned(&'a PooledConnection),
+}
+
+impl Checkout<'_> {
+    pub fn pooled(&self) -> &PooledConnection {
+        match self {
+            Checkout::Pooled(connection) => connection,
+            Checkout::Pinned(connection) => connection,
         }
+    }
 
-        fauxdb_info!("Aborted transaction: {}", transaction_id);
-        
-        let mut response = Document::new();
-        response.insert("ok", 1.0);
-        response.insert("transactionId", transaction_id.to_string());
-        Ok(response)
+    pub fn client(&self) -> &Client {
+        self.pooled().client()
     }
 
-    pub fn add_operation(&self, transaction_id: Uuid, operation: TransactionOperation) -> Result<()> {
-        let mut transactions = self.active_transactions.write();
-        
-        if let Some(transaction_state) = transactions.get_mut(&transaction_id) {
-            transaction_state.operations.push(operation);
-            transaction_state.state = TransactionStatus::InProgress;
-            Ok(())
-        } else {
-            Err(anyhow!("Transaction not found: {}", transaction_id))
+    /// Open a transaction block of the command's own, tracked so the pool
+    /// resets the connection if the command never closes it
+    pub async fn begin(&self) -> Result<()> {
+        match self {
+            Checkout::Pooled(connection) => connection.begin("BEGIN").await
+                .map_err(|e| FauxDBError::Database(format!("BEGIN failed: {}", e))),
+            Checkout::Pinned(_) => Err(FauxDBError::Database("Already inside a transaction".to_string())),
         }
     }
 
-    async fn execute_operation(&self, transaction: &mut Transaction<'_>, operation: &TransactionOperation) -> Result<()> {
-        match operation.operation_type.as_str() {
-            "insert" => self.execute_insert(transaction, operation).await,
-            "update" => self.execute_update(transaction, operation).await,
-            "delete" => self.execute_delete(transaction, operation).await,
-            _ => Err(anyhow!("Unsupported operation: {}", operation.operation_type))
+    /// Close the block `begin` opened with COMMIT or ROLLBACK
+    pub async fn end(&self, commit: bool) -> Result<()> {
+        let sql = if commit { "COMMIT" } else { "ROLLBACK" };
+        match self {
+            Checkout::Pooled(connection) => connection.end(sql).await
+                .map_err(|e| FauxDBError::Database(format!("{} failed: {}", sql, e))),
+            Checkout::Pinned(_) => Err(FauxDBError::Database("Already inside a transaction".to_string())),
         }
     }
+}
 
-    pub async fn execute_insert(&self, _transaction: &mut Transaction<'_>, _operation: &TransactionOperation) -> Result<()> {
-        // Simplified insert execution
-        fauxdb_info!("Executing insert in transaction");
-        Ok(())
+impl<'a> ConnectionTarget<'a> {
+    pub fn pool(&self) -> &'a ProductionConnectionPool {
+        match self {
+            ConnectionTarget::Pool(pool) | ConnectionTarget::Transaction { pool, .. } => pool,
+        }
     }
 
-    pub async fn execute_update(&self, _transaction: &mut Transaction<'_>, _operation: &TransactionOperation) -> Result<()> {
-        // Simplified update execution
-        fauxdb_info!("Executing update in transaction");
-        Ok(())
+    pub fn in_transaction(&self) -> bool {
+        matches!(self, ConnectionTarget::Transaction { .. })
     }
 
-    pub async fn execute_delete(&self, _transaction: &mut Transaction<'_>, _operation: &TransactionOperation) -> Result<()> {
-        // Simplified delete execution
-        fauxdb_info!("Executing delete in transaction");
-        Ok(())
+    pub fn catalog(&self) -> &'a CollectionCatalog {
+        self.pool().catalog()
     }
-}
\ No newline at end of file
+
+    pub async fn checkout(&self) -> Result<Checkout<'a>> {
+        match self {
+            ConnectionTarget::Pool(pool) => pool.get_connection().await
+                .map(Checkout::Pooled)
+                .map_err(|e| FauxDBError::ConnectionPool(e.to_string())),
+            ConnectionTarget::Transaction { connection, .. } => Ok(Checkout::Pinned(connection)),
+        }
+    }
+
+    /// Another pool connection, only if one is free right now. Never one
+    /// inside a transaction, whose statements share its pinned connection.
+    pub async fn try_checkout(&self) -> Option<Checkout<'a>> {
+        match self {
+            ConnectionTarget::Pool(pool) => pool.try_get_connection().await.map(Checkout::Pooled),
+            ConnectionTarget::Transaction { .. } => None,
+        }
+    }
+
+    /// Create a collection on first use. In a transaction the DDL runs on
+    /// a connection of its own: created inside, an abort would drop the
+    /// table without the catalog hearing of it.
+    pub async fn ensure_collection(&self, client: &Client, database: &str, collection: &str) -> Result<()> {
+        match self {
+            ConnectionTarget::Pool(pool) => pool.catalog().ensure(client, database, collection).await,
+            ConnectionTarget::Transaction { pool, .. } => {
+                if pool.catalog().contains(&collection_table(database, collection)) {
+                    return Ok(());
+                }
+                let connection = pool.get_connection().await
+                    .map_err(|e| FauxDBError::ConnectionPool(e.to_string()))?;
+                pool.catalog().ensure(connection.client(), database, collection).await
+            }
+        }
+    }
+}
@@ -0,0 +1,783 @@
+/*
+ * Copyright (c) 2025 pgElephant. All rights reserved.
+ *
+ * FauxDB - Production-ready MongoDB-compatible database server
+ * Built with Rust for superior performance and reliability
+ *
+ * @file update.rs
+ * @brief Update operators compiled to JSONB expressions
+ *
+ * An update document becomes a chain of jsonb_set / jsonb_insert / #- steps
+ * over the stored document, each step a nested subselect over the previous
+ * one so the SQL grows linearly with the number of operators. The whole
+ * update then runs as a single UPDATE; documents never travel through the
+ * proxy to be modified. Upserts keyed by `_id` run as one INSERT ... ON
+ * CONFLICT against the unique `_id` index.
+ *
+ * Updates apply to the JSONB column only and clear `bson_document`, rather
+ * than rebuilding the BSON in the proxy for every row; in storage mode
+ * both, an updated document is read back from JSONB, with JSONB's numeric
+ * widths and key order.
+ */
+
+use crate::bulk_write::{execute_bulk_write, BulkWriteResult, PlannedWrite, WriteModel, WriteOp};
+use crate::document_codec::{bson_to_json, decode_json, JsonbText, StorageLayout, StorageMode};
+use crate::error::{FauxDBError, Result};
+use crate::expression::set_path;
+use crate::fauxdb_debug;
+use crate::find::{document_columns, id_equality_json, pushdown_filter, row_document};
+use crate::predicate::CompiledPredicate;
+use crate::transactions::ConnectionTarget;
+use bson::{doc, oid::ObjectId, Bson, Document};
+use metrics::counter;
+use std::borrow::Borrow;
+use tokio_postgres::error::SqlState;
+use tokio_postgres::types::ToSql;
+use tokio_postgres::{Client, Statement};
+
+/// A row version: the row's id with the transaction that wrote it. A row
+/// updated since it was read no longer has the version read.
+const ROW_VERSION: &str = "((id::bigint << 32) | xmin::text::bigint)";
+
+/// Times an update with a residual filter reads again rows that changed
+/// under it before giving up with a write conflict
+const RESIDUAL_ATTEMPTS: usize = 5;
+
+fn invalid(message: String) -> FauxDBError {
+    FauxDBError::WireProtocol(message)
+}
+
+/// Builds the step chain for one update document. JSON values are appended
+/// to a shared parameter list so they can be bound alongside filter params.
+struct UpdateCompiler<'p> {
+    params: &'p mut Vec<String>,
+    steps: Vec<String>,
+    targets: Vec<String>,
+    inserting: bool,
+}
+
+/// Compile an update document (operators or a replacement) to an SQL
+/// expression that evaluates to the updated `document`
+pub fn compile_update(update: &Document, params: &mut Vec<String>) -> Result<String> {
+    compile_update_from(update, "document", false, params)
+}
+
+/// Compile an update applied to the JSONB expression `base`. When
+/// `inserting`, the update seeds a new upserted document and `$setOnInsert`
+/// applies.
+pub fn compile_update_from(update: &Document, base: &str, inserting: bool, params: &mut Vec<String>) -> Result<String> {
+    let mut compiler = UpdateCompiler { params, steps: Vec::new(), targets: Vec::new(), inserting };
+
+    let operators = update.keys().filter(|key| key.starts_with('$')).count();
+    if operators == 0 {
+        compiler.replacement(update)?;
+    } else if operators != update.len() {
+        return Err(invalid("Update document cannot mix operators and fields".to_string()));
+    } else {
+        for (operator, spec) in update {
+            let fields = spec.as_document()
+                .ok_or_else(|| invalid(format!("Modifiers operate on fields but we found type {:?} instead for {}", spec.element_type(), operator)))?;
+            for (path, value) in fields {
+                compiler.operator(operator, path, value)?;
+            }
+        }
+        compiler.check_conflicts()?;
+    }
+
+    Ok(compiler.finish(base))
+}
+
+impl UpdateCompiler<'_> {
+    fn finish(self, base: &str) -> String {
+        let mut sql = format!("SELECT {} AS d", base);
+        for step in self.steps {
+            sql = format!("SELECT {} AS d FROM ({}) s", step, sql);
+        }
+        format!("({})", sql)
+    }
+
+    fn bind(&mut self, value: &Bson) -> Result<String> {
+        self.params.push(bson_to_json(value)?);
+        Ok(format!("${}::jsonb", self.params.len()))
+    }
+
+    fn bind_array(&mut self, values: &[Bson]) -> Result<String> {
+        self.bind(&Bson::Array(values.to_vec()))
+    }
+
+    fn replacement(&mut self, replacement: &Document) -> Result<()> {
+        let param = self.bind(&Bson::Document(replacement.clone()))?;
+        // _id is immutable and stays first
+        self.steps.push(format!("jsonb_build_object('_id', d -> '_id') || ({} - '_id')", param));
+        Ok(())
+    }
+
+    fn operator(&mut self, operator: &str, path: &str, value: &Bson) -> Result<()> {
+        let segments = self.target(operator, path)?;
+        let target = path_sql(&segments);
+
+        match operator {
+            "$set" | "$setOnInsert" if operator == "$set" || self.inserting => {
+                let param = self.bind(value)?;
+                self.ensure_parents(&segments, None);
+                self.steps.push(format!("jsonb_set(d, {}, {}, true)", target, param));
+            }
+            "$unset" => self.steps.push(format!("d #- {}", target)),
+            "$inc" | "$mul" => {
+                let operand = numeric_literal(value)
+                    .ok_or_else(|| invalid(format!("Cannot {} with non-numeric argument: {{{}: {}}}", &operator[1..], path, value)))?;
+                let op = if operator == "$inc" { "+" } else { "*" };
+                self.ensure_parents(&segments, None);
+                self.steps.push(format!(
+                    "jsonb_set(d, {t}, to_jsonb(COALESCE((d #>> {t})::numeric, 0) {op} {operand}), true)",
+                    t = target, op = op, operand = operand
+                ));
+            }
+            "$min" | "$max" => {
+                let param = self.bind(value)?;
+                let cmp = if operator == "$min" { "<" } else { ">" };
+                self.ensure_parents(&segments, None);
+                self.steps.push(format!(
+                    "jsonb_set(d, {t}, CASE WHEN d #> {t} IS NULL OR {p} {cmp} d #> {t} THEN {p} ELSE d #> {t} END, true)",
+                    t = target, p = param, cmp = cmp
+                ));
+            }
+            "$push" => self.push(&segments, value)?,
+            "$addToSet" => {
+                let values = each_values(value, &["$each"])?;
+                self.ensure_parents(&segments, None);
+                for value in values {
+                    let param = self.bind(&value)?;
+                    self.steps.push(format!(
+                        "CASE WHEN EXISTS (SELECT 1 FROM jsonb_array_elements(COALESCE(d #> {t}, '[]'::jsonb)) e WHERE e = {p}) \
+                         THEN d ELSE jsonb_set(d, {t}, COALESCE(d #> {t}, '[]'::jsonb) || jsonb_build_array({p}), true) END",
+                        t = target, p = param
+                    ));
+                }
+            }
+            "$pull" => {
+                let keep = self.pull_condition(value)?;
+                self.steps.push(format!(
+                    "CASE WHEN jsonb_typeof(d #> {t}) = 'array' THEN jsonb_set(d, {t}, COALESCE(\
+                     (SELECT jsonb_agg(e ORDER BY i) FROM jsonb_array_elements(d #> {t}) WITH ORDINALITY AS x(e, i) WHERE {keep}), \
+                     '[]'::jsonb)) ELSE d END",
+                    t = target, keep = keep
+                ));
+            }
+            "$rename" => {
+                let to = value.as_str()
+                    .ok_or_else(|| invalid(format!("The 'to' field for $rename must be a string: {}: {}", path, value)))?;
+                let to_segments = self.target(operator, to)?;
+                let to_target = path_sql(&to_segments);
+                let present = format!("d #> {} IS NOT NULL", target);
+                self.ensure_parents(&to_segments, Some(&present));
+                self.steps.push(format!(
+                    "CASE WHEN {present} THEN jsonb_set(d #- {from}, {to}, d #> {from}, true) ELSE d END",
+                    present = present, from = target, to = to_target
+                ));
+            }
+            "$currentDate" => {
+                let kind = match value {
+                    Bson::Boolean(true) => "date",
+                    Bson::Document(spec) => spec.get_str("$type").unwrap_or(""),
+                    _ => "",
+                };
+                // Same tag shapes the document codec writes
+                let now = match kind {
+                    "date" => "jsonb_build_object('$date', (extract(epoch FROM now()) * 1000)::bigint)",
+                    "timestamp" => "jsonb_build_object('$timestamp', jsonb_build_object('t', extract(epoch FROM now())::bigint, 'i', 1))",
+                    _ => return Err(invalid(format!("$currentDate for {} must be true or {{$type: \"date\" | \"timestamp\"}}", path))),
+                };
+                self.ensure_parents(&segments, None);
+                self.steps.push(format!("jsonb_set(d, {}, {}, true)", target, now));
+            }
+            // Only applies when an upsert inserts
+            "$setOnInsert" => {}
+            _ => return Err(invalid(format!("Unknown modifier: {}", operator))),
+        }
+        Ok(())
+    }
+
+    /// Validate a target path and remember it for conflict checks
+    fn target(&mut self, operator: &str, path: &str) -> Result<Vec<String>> {
+        let segments: Vec<String> = path.split('.').map(str::to_string).collect();
+        if segments.iter().any(|segment| segment.is_empty() || segment.starts_with('$')) {
+            return Err(invalid(format!("Invalid path '{}' for {}", path, operator)));
+        }
+        if segments[0] == "_id" && operator != "$setOnInsert" {
+            return Err(invalid(format!("Performing an update on the path '{}' would modify the immutable field '_id'", path)));
+        }
+        self.targets.push(path.to_string());
+        Ok(segments)
+    }
+
+    fn check_conflicts(&self) -> Result<()> {
+        for (i, a) in self.targets.iter().enumerate() {
+            for b in &self.targets[i + 1..] {
+                let overlaps = a == b
+                    || b.strip_prefix(a.as_str()).map_or(false, |rest| rest.starts_with('.'))
+                    || a.strip_prefix(b.as_str()).map_or(false, |rest| rest.starts_with('.'));
+                if overlaps {
+                    return Err(invalid(format!("Updating the path '{}' would create a conflict at '{}'", b, a)));
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// jsonb_set only creates the last path element, so create missing
+    /// intermediate objects first, as MongoDB does
+    fn ensure_parents(&mut self, segments: &[String], guard: Option<&str>) {
+        for depth in 1..segments.len() {
+            let parent = path_sql(&segments[..depth]);
+            let step = format!("jsonb_set(d, {p}, COALESCE(d #> {p}, '{{}}'::jsonb), true)", p = parent);
+            self.steps.push(match guard {
+                Some(guard) => format!("CASE WHEN {} THEN {} ELSE d END", guard, step),
+                None => step,
+            });
+        }
+    }
+
+    fn push(&mut self, segments: &[String], value: &Bson) -> Result<()> {
+        let target = path_sql(segments);
+        let values = each_values(value, &["$each", "$position"])?;
+        let position = match value {
+            Bson::Document(spec) if spec.contains_key("$each") => match spec.get("$position") {
+                None => None,
+                Some(position) => Some(numeric_literal(position)
+                    .and_then(|literal| literal.parse::<i64>().ok())
+                    .ok_or_else(|| invalid("$position must be an integer".to_string()))?),
+            },
+            _ => None,
+        };
+
+        self.ensure_parents(segments, None);
+        match position {
+            None => {
+                let param = self.bind_array(&values)?;
+                self.steps.push(format!("jsonb_set(d, {t}, COALESCE(d #> {t}, '[]'::jsonb) || {p}, true)", t = target, p = param));
+            }
+            Some(position) => {
+                self.steps.push(format!("jsonb_set(d, {t}, COALESCE(d #> {t}, '[]'::jsonb), true)", t = target));
+                for (offset, value) in values.iter().enumerate() {
+                    let param = self.bind(value)?;
+                    // Negative positions count from the end, so consecutive inserts all land at the same index
+                    let index = if position < 0 { position } else { position + offset as i64 };
+                    let mut indexed = segments.to_vec();
+                    indexed.push(index.to_string());
+                    self.steps.push(format!("jsonb_insert(d, {}, {})", path_sql(&indexed), param));
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// SQL condition over array element `e` that is true for elements to keep
+    fn pull_condition(&mut self, value: &Bson) -> Result<String> {
+        let Bson::Document(spec) = value else {
+            let param = self.bind(value)?;
+            return Ok(format!("e <> {}", param));
+        };
+
+        if !spec.keys().all(|key| key.starts_with('$')) {
+            if spec.keys().any(|key| key.starts_with('$')) {
+                return Err(invalid("$pull condition cannot mix operators and fields".to_string()));
+            }
+            // A plain document matches elements containing those fields
+            let param = self.bind(value)?;
+            return Ok(format!("NOT (e @> {})", param));
+        }
+
+        let mut removes = Vec::new();
+        for (operator, operand) in spec {
+            let condition = match operator.as_str() {
+                "$in" | "$nin" => {
+                    let values = operand.as_array()
+                        .ok_or_else(|| invalid(format!("{} needs an array", operator)))?;
+                    let param = self.bind_array(values)?;
+                    let contained = format!("EXISTS (SELECT 1 FROM jsonb_array_elements({}) v WHERE v = e)", param);
+                    if operator == "$in" { contained } else { format!("NOT {}", contained) }
+                }
+                "$eq" | "$ne" | "$gt" | "$gte" | "$lt" | "$lte" => {
+                    let param = self.bind(operand)?;
+                    let cmp = match operator.as_str() {
+                        "$eq" => "=",
+                        "$ne" => "<>",
+                        "$gt" => ">",
+                        "$gte" => ">=",
+                        "$lt" => "<",
+                        _ => "<=",
+                    };
+                    // Range operators only match values of the same type, as in MongoDB
+                    if matches!(operator.as_str(), "$eq" | "$ne") {
+                        format!("e {} {}", cmp, param)
+                    } else {
+                        format!("(jsonb_typeof(e) = jsonb_typeof({p}) AND e {cmp} {p})", p = param, cmp = cmp)
+                    }
+                }
+                _ => return Err(invalid(format!("Unsupported $pull operator: {}", operator))),
+            };
+            removes.push(condition);
+        }
+        Ok(format!("NOT ({})", removes.join(" AND ")))
+    }
+}
+
+/// `ARRAY['a','b']::text[]` for a dotted path; numeric segments address array elements
+fn path_sql(segments: &[String]) -> String {
+    let quoted: Vec<String> = segments.iter().map(|segment| format!("'{}'", segment.replace('\'', "''"))).collect();
+    format!("ARRAY[{}]::text[]", quoted.join(","))
+}
+
+fn numeric_literal(value: &Bson) -> Option<String> {
+    match value {
+        Bson::Int32(n) => Some(n.to_string()),
+        Bson::Int64(n) => Some(n.to_string()),
+        Bson::Double(n) if n.is_finite() => Some(format!("{:?}", n)),
+        _ => None,
+    }
+}
+
+/// The values an array modifier adds: `{$each: [...]}` or a single value
+fn each_values(value: &Bson, allowed: &[&str]) -> Result<Vec<Bson>> {
+    match value {
+        Bson::Document(spec) if spec.contains_key("$each") => {
+            if let Some(unsupported) = spec.keys().find(|key| !allowed.contains(&key.as_str())) {
+                return Err(invalid(format!("Unsupported modifier: {}", unsupported)));
+            }
+            spec.get_array("$each")
+                .map(|values| values.clone())
+                .map_err(|_| invalid("$each must be an array".to_string()))
+        }
+        _ => Ok(vec![value.clone()]),
+    }
+}
+
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct UpdateOutcome {
+    pub matched: u64,
+    pub modified: u64,
+    /// `_id` of the document an upsert inserted
+    pub upserted: Option<Bson>,
+}
+
+/// The document an upsert starts from before its update applies: the
+/// filter's equality fields, with `_id` first. A replacement's `_id` is used
+/// when the filter has none, otherwise a new ObjectId.
+pub fn upsert_seed(filter: &Document, update: &Document) -> Document {
+    let mut fields = Document::new();
+    collect_equalities(filter, &mut fields);
+
+    let replacement_id = update.get("_id").filter(|_| !update.keys().any(|key| key.starts_with('$')));
+    let id = fields.remove("_id")
+        .or_else(|| replacement_id.cloned())
+        .unwrap_or_else(|| Bson::ObjectId(ObjectId::new()));
+
+    let mut seed = doc! { "_id": id };
+    for (path, value) in fields {
+        set_path(&mut seed, &path, value);
+    }
+    seed
+}
+
+fn collect_equalities(filter: &Document, fields: &mut Document) {
+    for (field, value) in filter {
+        if field == "$and" {
+            for clause in value.as_array().into_iter().flatten() {
+                if let Some(clause) = clause.as_document() {
+                    collect_equalities(clause, fields);
+                }
+            }
+            continue;
+        }
+        if field.starts_with('$') {
+            continue;
+        }
+        let value = match value {
+            Bson::Document(spec) if spec.keys().any(|key| key.starts_with('$')) => match spec.get("$eq") {
+                Some(value) if spec.len() == 1 => value.clone(),
+                _ => continue,
+            },
+            Bson::RegularExpression(_) => continue,
+            value => value.clone(),
+        };
+        fields.insert(field.clone(), value);
+    }
+}
+
+fn check_layout(layout: &StorageLayout) -> Result<()> {
+    if layout.mode == StorageMode::Bson {
+        return Err(FauxDBError::Config("Updates are applied to the JSONB document; storage_mode bson does not support them".to_string()));
+    }
+    Ok(())
+}
+
+/// Expression for the document an upsert inserts: the update applied to the
+/// seed, bound as a parameter
+pub fn upsert_document(filter: &Document, update: &Document, params: &mut Vec<String>) -> Result<String> {
+    params.push(bson_to_json(&Bson::Document(upsert_seed(filter, update)))?);
+    let base = format!("${}::jsonb", params.len());
+    compile_update_from(update, &base, true, params)
+}
+
+/// `_id` of an inserted row from its `(document -> '_id')::text`
+fn returned_id(row: &tokio_postgres::Row, column: usize) -> Result<Option<Bson>> {
+    match row.get::<_, Option<&str>>(column) {
+        Some(json) => Ok(decode_json(&format!("{{\"_id\":{}}}", json))?.remove("_id")),
+        None => Ok(None),
+    }
+}
+
+/// Run one upsert. A filter on `_id` with nothing left for the in-process
+/// predicate becomes a single INSERT ... ON CONFLICT on the unique `_id`
+/// index; any other filter updates first and inserts when nothing matched,
+/// which, as in MongoDB, can insert twice under concurrent upserts unless a
+/// unique index covers the filter.
+pub async fn execute_upsert(
+    client: &Client,
+    table: &str,
+    layout: &StorageLayout,
+    filter: &Document,
+    update: &Document,
+    multi: bool,
+) -> Result<UpdateOutcome> {
+    check_layout(layout)?;
+
+    let mut params = Vec::new();
+    let (conditions, residual) = pushdown_filter(filter, layout, &mut params);
+    if residual.is_none() && filter.get("_id").map_or(false, |id| id_equality_json(id).is_some()) {
+        match upsert_on_conflict(client, table, layout, filter, update, conditions, params).await {
+            Err(FauxDBError::Database(message)) if message.contains("no unique or exclusion constraint") => {
+                // Collections created before the _id index existed
+                fauxdb_debug!("{} has no unique _id index, upserting in two steps", table);
+            }
+            result => return result,
+        }
+    }
+
+    let outcome = execute_update(client, table, layout, filter, update, multi).await?;
+    if outcome.matched > 0 {
+        return Ok(outcome);
+    }
+
+    let mut params = Vec::new();
+    let inserted = upsert_document(filter, update, &mut params)?;
+    let sql = format!("INSERT INTO {} (document) VALUES ({}) RETURNING (document -> '_id')::text", table, inserted);
+    fauxdb_debug!("Running {}", sql);
+    let rows = query(client, &sql, &params, None).await?;
+    let row = rows.first().ok_or_else(|| FauxDBError::Database("INSERT returned no rows".to_string()))?;
+    counter!("fauxdb_upsert_inserts_total").increment(1);
+    Ok(UpdateOutcome { matched: 0, modified: 0, upserted: returned_id(row, 0)? })
+}
+
+async fn upsert_on_conflict(
+    client: &Client,
+    table: &str,
+    layout: &StorageLayout,
+    filter: &Document,
+    update: &Document,
+    conditions: Vec<String>,
+    mut params: Vec<String>,
+) -> Result<UpdateOutcome> {
+    let inserted = upsert_document(filter, update, &mut params)?;
+    // Both the existing row and EXCLUDED are in scope, so the existing
+    // document is named explicitly and the filter runs over a subselect
+    let updated = compile_update_from(update, "t.document", false, &mut params)?;
+    let mut guards: Vec<String> = conditions.into_iter()
+        .map(|condition| format!("EXISTS (SELECT 1 FROM (SELECT t.document AS document) c WHERE {})", condition))
+        .collect();
+    // No-op updates leave the row alone, as MongoDB reports nModified 0 for them
+    guards.push(format!("{} IS DISTINCT FROM t.document", updated));
+
+    let sql = format!(
+        "INSERT INTO {table} AS t (document) VALUES ({inserted}) \
+         ON CONFLICT ((document -> '_id')) DO UPDATE \
+         SET document = {updated}, bson_document = NULL, updated_at = CURRENT_TIMESTAMP WHERE {guards} \
+         RETURNING t.xmax = 0, (t.document -> '_id')::text",
+        table = table, inserted = inserted, updated = updated, guards = guards.join(" AND "),
+    );
+    fauxdb_debug!("Running {}", sql);
+
+    let rows = query(client, &sql, &params, None).await?;
+    if let Some(row) = rows.first() {
+        if row.get::<_, bool>(0) {
+            counter!("fauxdb_upsert_inserts_total").increment(1);
+            return Ok(UpdateOutcome { matched: 0, modified: 0, upserted: returned_id(row, 1)? });
+        }
+        counter!("fauxdb_update_documents_total").increment(1);
+        return Ok(UpdateOutcome { matched: 1, modified: 1, upserted: None });
+    }
+
+    // The _id exists but the update was skipped: either it changed nothing,
+    // or the rest of the filter didn't match and the insert collides
+    let mut select_params = Vec::new();
+    let (select_conditions, _) = pushdown_filter(filter, layout, &mut select_params);
+    let sql = format!("SELECT 1 FROM {} WHERE {}", table, where_clause(&select_conditions));
+    if query(client, &sql, &select_params, None).await?.is_empty() {
+        let id = filter.get("_id").cloned().unwrap_or(Bson::Null);
+        return Err(FauxDBError::DuplicateKey(format!("E11000 duplicate key error collection: {} index: _id_ dup key: {{ _id: {} }}", table, id)));
+    }
+    Ok(UpdateOutcome { matched: 1, modified: 0, upserted: None })
+}
+
+/// The single statement for an update, or None when part of its filter has
+/// to be matched in process first
+pub fn plan_update(table: &str, layout: &StorageLayout, filter: &Document, update: &Document, multi: bool) -> Result<Option<PlannedWrite>> {
+    check_layout(layout)?;
+
+    let mut params = Vec::new();
+    let new_document = compile_update(update, &mut params)?;
+    let (conditions, residual) = pushdown_filter(filter, layout, &mut params);
+    if residual.is_some() {
+        return Ok(None);
+    }
+    Ok(Some(PlannedWrite { sql: update_sql(table, &new_document, &conditions, multi, false), params }))
+}
+
+/// Matched and modified counts from the row an update statement returns
+pub fn update_outcome(row: &tokio_postgres::Row) -> UpdateOutcome {
+    UpdateOutcome {
+        matched: row.get::<_, i64>(0) as u64,
+        modified: row.get::<_, i64>(1) as u64,
+        upserted: None,
+    }
+}
+
+/// Run one update statement as a single UPDATE. Filter clauses SQL can't
+/// evaluate are matched in process first and narrow the UPDATE to the row
+/// versions they matched. A row changed in between is locked at its new
+/// version, which the UPDATE then skips, and is read and matched again.
+pub async fn execute_update(
+    client: &Client,
+    table: &str,
+    layout: &StorageLayout,
+    filter: &Document,
+    update: &Document,
+    multi: bool,
+) -> Result<UpdateOutcome> {
+    check_layout(layout)?;
+
+    let mut params = Vec::new();
+    let new_document = compile_update(update, &mut params)?;
+    let (mut conditions, residual) = pushdown_filter(filter, layout, &mut params);
+
+    let Some(residual) = residual else {
+        let sql = update_sql(table, &new_document, &conditions, multi, false);
+        fauxdb_debug!("Running {}", sql);
+        let rows = query(client, &sql, &params, None).await?;
+        let row = rows.first().ok_or_else(|| FauxDBError::Database("UPDATE returned no counts".to_string()))?;
+        let outcome = update_outcome(row);
+        counter!("fauxdb_update_documents_total").increment(outcome.modified);
+        return Ok(outcome);
+    };
+
+    let predicate = CompiledPredicate::compile(&residual)?;
+    conditions.push(format!("{} = ANY(${})", ROW_VERSION, params.len() + 1));
+    let sql = update_sql(table, &new_document, &conditions, multi, true);
+    let mut outcome = UpdateOutcome::default();
+    let mut changed: Option<Vec<i32>> = None;
+    for _ in 0..RESIDUAL_ATTEMPTS {
+        let versions = matching_versions(client, table, layout, filter, &predicate, multi, changed.as_ref()).await?;
+        if versions.is_empty() {
+            return Ok(outcome);
+        }
+        fauxdb_debug!("Running {}", sql);
+        let rows = query_with(client, &sql, &params, Some(&versions)).await?;
+        let row = rows.first().ok_or_else(|| FauxDBError::Database("UPDATE returned no counts".to_string()))?;
+        let step = update_outcome(row);
+        outcome.matched += step.matched;
+        outcome.modified += step.modified;
+        counter!("fauxdb_update_documents_total").increment(step.modified);
+        if step.matched == versions.len() as u64 {
+            return Ok(outcome);
+        }
+
+        counter!("fauxdb_update_residual_retries_total").increment(1);
+        // A single update looks for its first match again; a multi update
+        // only reads the rows it skipped, as the rest are done
+        if multi {
+            let taken: Vec<i32> = row.get::<_, Option<Vec<i32>>>(2).unwrap_or_default();
+            changed = Some(versions.iter()
+                .map(|version| (version >> 32) as i32)
+                .filter(|id| !taken.contains(id))
+                .collect());
+        }
+    }
+    Err(FauxDBError::WriteConflict(format!("Documents in {} kept changing while the update matched them", table)))
+}
+
+/// Versions of the rows the whole filter matches: the pushable part runs in
+/// SQL and the residual predicate here. `only` limits the read to those ids.
+async fn matching_versions(
+    client: &Client,
+    table: &str,
+    layout: &StorageLayout,
+    filter: &Document,
+    predicate: &CompiledPredicate,
+    multi: bool,
+    only: Option<&Vec<i32>>,
+) -> Result<Vec<i64>> {
+    let mut params = Vec::new();
+    let (mut conditions, _) = pushdown_filter(filter, layout, &mut params);
+    if only.is_some() {
+        conditions.push(format!("id = ANY(${})", params.len() + 1));
+    }
+    let sql = format!(
+        "SELECT {}, {} FROM {} WHERE {} ORDER BY id",
+        document_columns(layout), ROW_VERSION, table, where_clause(&conditions)
+    );
+    let rows = query(client, &sql, &params, only).await?;
+
+    let mut versions = Vec::new();
+    for row in &rows {
+        if predicate.matches(&row_document(row)?) {
+            versions.push(row.get::<_, i64>(2));
+            if !multi {
+                break;
+            }
+        }
+    }
+    Ok(versions)
+}
+
+/// The UPDATE for a compiled update, returning the matched and modified
+/// counts, and with `taken_ids` the ids of the rows it locked
+fn update_sql(table: &str, new_document: &str, conditions: &[String], multi: bool, taken_ids: bool) -> String {
+    // FOR UPDATE re-reads a row changed since the snapshot, so the new
+    // document is always computed from the version being replaced
+    format!(
+        "WITH target AS (\
+            SELECT id, document AS old_document, {new} AS new_document FROM {table} WHERE {conditions} ORDER BY id{limit} FOR UPDATE\
+         ), updated AS (\
+            UPDATE {table} AS t SET document = target.new_document, bson_document = NULL, updated_at = CURRENT_TIMESTAMP \
+            FROM target WHERE t.id = target.id AND target.new_document IS DISTINCT FROM target.old_document RETURNING 1\
+         ) SELECT (SELECT count(*) FROM target), (SELECT count(*) FROM updated){taken}",
+        new = new_document,
+        table = table,
+        conditions = where_clause(conditions),
+        limit = if multi { "" } else { " LIMIT 1" },
+        taken = if taken_ids { ", (SELECT array_agg(id) FROM target)" } else { "" },
+    )
+}
+
+pub(crate) fn where_clause(conditions: &[String]) -> String {
+    if conditions.is_empty() {
+        "TRUE".to_string()
+    } else {
+        conditions.join(" AND ")
+    }
+}
+
+/// Bind JSONB params, plus an optional id list as the last parameter
+pub(crate) async fn query(client: &Client, sql: &str, params: &[String], ids: Option<&Vec<i32>>) -> Result<Vec<tokio_postgres::Row>> {
+    query_with(client, sql, params, ids.map(|ids| ids as &(dyn ToSql + Sync))).await
+}
+
+/// `query` with any value as the last parameter
+async fn query_with(client: &Client, sql: &str, params: &[String], last: Option<&(dyn ToSql + Sync)>) -> Result<Vec<tokio_postgres::Row>> {
+    let jsonb: Vec<JsonbText<&str>> = params.iter().map(|param| JsonbText(param.as_str())).collect();
+    let mut refs: Vec<&(dyn ToSql + Sync)> = jsonb.iter().map(|param| param as &(dyn ToSql + Sync)).collect();
+    refs.extend(last);
+    client.query(sql, &refs).await.map_err(database_error)
+}
+
+/// `query` for a statement prepared once and executed many times
+pub(crate) async fn query_prepared(client: &Client, statement: &Statement, params: &[String]) -> Result<Vec<tokio_postgres::Row>> {
+    let jsonb: Vec<JsonbText<&str>> = params.iter().map(|param| JsonbText(param.as_str())).collect();
+    let refs: Vec<&(dyn ToSql + Sync)> = jsonb.iter().map(|param| param as &(dyn ToSql + Sync)).collect();
+    client.query(statement, &refs).await.map_err(database_error)
+}
+
+/// Unique violations become duplicate key errors, serialization failures
+/// and deadlocks write conflicts, and missing tables UndefinedTable so the
+/// caller can refresh the catalog; otherwise the server's message
+pub(crate) fn database_error(error: impl Borrow<tokio_postgres::Error>) -> FauxDBError {
+    let error = error.borrow();
+    match error.as_db_error() {
+        Some(db_error) if *db_error.code() == SqlState::UNIQUE_VIOLATION => {
+            FauxDBError::DuplicateKey(format!("E11000 duplicate key error: {}", db_error.message()))
+        }
+        Some(db_error) if *db_error.code() == SqlState::T_R_SERIALIZATION_FAILURE
+            || *db_error.code() == SqlState::T_R_DEADLOCK_DETECTED => {
+            FauxDBError::WriteConflict(db_error.message().to_string())
+        }
+        Some(db_error) if *db_error.code() == SqlState::UNDEFINED_TABLE => {
+            FauxDBError::UndefinedTable(db_error.message().to_string())
+        }
+        Some(db_error) => FauxDBError::Database(db_error.message().to_string()),
+        None => FauxDBError::Database(error.to_string()),
+    }
+}
+
+/// Execute a single-collection write command. A table dropped without the
+/// catalog noticing fails every statement before any is applied, so the
+/// batch runs once more against the refreshed catalog; a transaction is
+/// aborted by the failure, so there the error stands.
+pub(crate) async fn execute_bulk_write_retrying(
+    target: ConnectionTarget<'_>,
+    layout: &StorageLayout,
+    models: &[WriteModel],
+    ordered: bool,
+) -> Result<BulkWriteResult> {
+    match execute_bulk_write(target, layout, models, ordered).await {
+        Err(FauxDBError::UndefinedTable(_)) if !target.in_transaction() => {
+            counter!("fauxdb_catalog_retries_total").increment(1);
+            execute_bulk_write(target, layout, models, ordered).await
+        }
+        result => result,
+    }
+}
+
+/// Execute an `update` command
+pub async fn update_command(target: ConnectionTarget<'_>, layout: &StorageLayout, command: &Document) -> Result<Document> {
+    let collection = command.get_str("update")
+        .map_err(|_| invalid("Missing collection in update command".to_string()))?;
+    let database = command.get_str("$db").unwrap_or("fauxdb");
+    let ordered = command.get_bool("ordered").unwrap_or(true);
+    let models = command.get_array("updates")
+        .map_err(|_| invalid("Missing updates in update command".to_string()))?
+        .iter()
+        .map(|statement| {
+            let statement = statement.as_document()
+                .ok_or_else(|| invalid("update statements must be objects".to_string()))?;
+            Ok(WriteModel { database: database.to_string(), collection: collection.to_string(), op: parse_statement(statement)? })
+        })
+        .collect::<Result<Vec<WriteModel>>>()?;
+
+    let result = execute_bulk_write_retrying(target, layout, &models, ordered).await?;
+
+    let mut n = 0;
+    let mut modified = 0;
+    let mut upserted = Vec::new();
+    for (index, outcome) in &result.outcomes {
+        // n counts upserted documents along with matched ones
+        n += outcome.n;
+        modified += outcome.modified;
+        if let Some(id) = &outcome.upserted {
+            n += 1;
+            upserted.push(Bson::Document(doc! { "index": *index as i32, "_id": id.clone() }));
+        }
+    }
+    let mut response = doc! { "n": n as i64, "nModified": modified as i64, "ok": 1.0 };
+    if !upserted.is_empty() {
+        response.insert("upserted", upserted);
+    }
+    result.append_write_errors(&mut response);
+    Ok(response)
+}
+
+fn parse_statement(statement: &Document) -> Result<WriteOp> {
+    let filter = statement.get_document("q")
+        .map_err(|_| invalid("Missing query in update".to_string()))?;
+    let update = match statement.get("u") {
+        Some(Bson::Document(update)) => update,
+        Some(Bson::Array(_)) => return Err(invalid("Pipeline-style updates are not supported".to_string())),
+        _ => return Err(invalid("Missing update document".to_string())),
+    };
+    Ok(WriteOp::Update {
+        filter: filter.clone(),
+        update: update.clone(),
+        multi: statement.get_bool("multi").unwrap_or(false),
+        upsert: statement.get_bool("upsert").unwrap_or(false),
+    })
+}
@@ -9,6 +9,7 @@
 
 use anyhow::{Result, anyhow};
 use bson::Document;
+use crate::error::FauxDBError;
 use crate::fauxdb_debug;
 
 #[derive(Debug, Clone, Copy, PartialEq)]
@@ -178,7 +179,7 @@ impl OpQueryMessage {
         }
         
         // Additional sanity check - document length shouldn't be unreasonably large
-        if doc_length > 16 * 1024 * 1024 { // 16MB limit
+        if doc_length > MAX_BSON_OBJECT_SIZE {
             return Err(anyhow!("BSON document too large: {} bytes (max 16MB)", doc_length));
         }
 
@@ -263,9 +264,22 @@ pub struct OpMsgMessage {
 
 #[derive(Debug)]
 pub enum OpMsgSection {
+    /// Kind 0: the command document
     Body { document: Document },
+    /// Kind 1: documents for one array field of the command, sent outside
+    /// the body so it can exceed the BSON size limit
+    DocumentSequence { identifier: String, documents: Vec<Document> },
 }
 
+/// OP_MSG flag bit: the message ends with a CRC-32C checksum
+const CHECKSUM_PRESENT: u32 = 1;
+
+/// Largest document a client may send, as reported by hello
+pub const MAX_BSON_OBJECT_SIZE: usize = 16 * 1024 * 1024;
+
+/// Largest message a client may send, as reported by hello
+pub const MAX_MESSAGE_SIZE_BYTES: usize = 48_000_000;
+
 impl OpMsgMessage {
     pub fn parse(data: &[u8]) -> Result<Self> {
         let header = MessageHeader::parse(data)?;
@@ -286,11 +300,17 @@ impl OpMsgMessage {
         ]);
         offset += 4;
 
-        // Parse sections (simplified - just handle body section)
+        // Sections run to the end of the message, less the checksum if any
+        let end = if flags & CHECKSUM_PRESENT != 0 {
+            data.len().saturating_sub(4)
+        } else {
+            data.len()
+        };
         let mut sections = Vec::new();
-        if offset < data.len() {
-            let (section, _section_len) = Self::parse_body_section(&data[offset..])?;
+        while offset < end {
+            let (section, section_len) = Self::parse_section(&data[offset..end])?;
             sections.push(section);
+            offset += section_len;
         }
 
         Ok(OpMsgMessage {
@@ -300,19 +320,45 @@ impl OpMsgMessage {
         })
     }
 
-    fn parse_body_section(data: &[u8]) -> Result<(OpMsgSection, usize)> {
+    fn parse_section(data: &[u8]) -> Result<(OpMsgSection, usize)> {
         if data.is_empty() {
             return Err(anyhow!("Empty section"));
         }
 
-        let kind = data[0];
-        if kind != 0 {
-            return Err(anyhow!("Expected body section (kind 0), got {}", kind));
+        match data[0] {
+            0 => {
+                let (document, doc_len) = OpQueryMessage::parse_bson_document(&data[1..])?;
+                fauxdb_debug!("OP_MSG body section: parsed document with {} bytes", doc_len);
+                Ok((OpMsgSection::Body { document }, 1 + doc_len))
+            }
+            1 => {
+                // The size covers itself, the identifier and the documents
+                if data.len() < 5 {
+                    return Err(anyhow!("Document sequence section too short"));
+                }
+                let size = u32::from_le_bytes([data[1], data[2], data[3], data[4]]) as usize;
+                if size < 5 || size + 1 > data.len() {
+                    return Err(anyhow!("Document sequence size {} exceeds available data {} bytes", size, data.len() - 1));
+                }
+                let payload = &data[5..1 + size];
+                let terminator = payload.iter().position(|&b| b == 0)
+                    .ok_or_else(|| anyhow!("Document sequence identifier is not null-terminated"))?;
+                let identifier = std::str::from_utf8(&payload[..terminator])
+                    .map_err(|e| anyhow!("Invalid document sequence identifier: {}", e))?
+                    .to_string();
+
+                let mut documents = Vec::new();
+                let mut offset = terminator + 1;
+                while offset < payload.len() {
+                    let (document, doc_len) = OpQueryMessage::parse_bson_document(&payload[offset..])?;
+                    documents.push(document);
+                    offset += doc_len;
+                }
+                fauxdb_debug!("OP_MSG document sequence {}: {} documents", identifier, documents.len());
+                Ok((OpMsgSection::DocumentSequence { identifier, documents }, 1 + size))
+            }
+            kind => Err(anyhow!("Unknown OP_MSG section kind {}", kind)),
         }
-
-        let (document, doc_len) = OpQueryMessage::parse_bson_document(&data[1..])?;
-        fauxdb_debug!("OP_MSG body section: parsed document with {} bytes", doc_len);
-        Ok((OpMsgSection::Body { document }, 1 + doc_len))
     }
 }
 
@@ -337,6 +383,11 @@ impl WireProtocolHandler {
 
     pub fn build_reply_message(request_id: u32, document: Document) -> Result<Vec<u8>> {
         let bson_data = bson::to_vec(&document)?;
+        Ok(Self::build_reply_message_raw(request_id, &bson_data))
+    }
+
+    /// OP_REPLY around an already-encoded BSON body
+    pub fn build_reply_message_raw(request_id: u32, bson_data: &[u8]) -> Vec<u8> {
         let message_length = 36 + bson_data.len() as u32; // Header (16) + OP_REPLY fields (20) + BSON
         
         let mut response = Vec::with_capacity(message_length as usize);
@@ -354,13 +405,18 @@ impl WireProtocolHandler {
         response.extend_from_slice(&1u32.to_le_bytes());               // numberReturned
         
         // BSON document
-        response.extend_from_slice(&bson_data);
+        response.extend_from_slice(bson_data);
         
-        Ok(response)
+        response
     }
 
     pub fn build_msg_response(request_id: u32, document: Document) -> Result<Vec<u8>> {
         let bson_data = bson::to_vec(&document)?;
+        Ok(Self::build_msg_response_raw(request_id, &bson_data))
+    }
+
+    /// OP_MSG around an already-encoded BSON body
+    pub fn build_msg_response_raw(request_id: u32, bson_data: &[u8]) -> Vec<u8> {
         let message_length = 21 + bson_data.len() as u32; // Header (16) + flags (4) + section (1) + BSON
         
         let mut response = Vec::with_capacity(message_length as usize);
@@ -378,9 +434,70 @@ impl WireProtocolHandler {
         response.push(0); // Section kind
         
         // BSON document
-        response.extend_from_slice(&bson_data);
+        response.extend_from_slice(bson_data);
         
-        Ok(response)
+        response
+    }
+
+    /// Encode `{cursor: {firstBatch: [...], id: 0, ns}, ok: 1}` with each
+    /// batch entry copied in verbatim from its stored BSON bytes. Cursors
+    /// are never left open, so the whole result must fit in one reply
+    /// document; a larger one is an error rather than a reply the client
+    /// would reject.
+    pub fn build_cursor_reply<B: AsRef<[u8]>>(ns: &str, first_batch: &[B]) -> std::result::Result<Vec<u8>, FauxDBError> {
+        let batch_bytes: usize = first_batch.iter().map(|doc| doc.as_ref().len() + 8).sum();
+        if batch_bytes + ns.len() + 64 > MAX_BSON_OBJECT_SIZE {
+            return Err(FauxDBError::WireProtocol(format!(
+                "Result of {} documents ({} bytes) exceeds the {} byte reply limit; narrow the query or add a limit",
+                first_batch.len(), batch_bytes, MAX_BSON_OBJECT_SIZE
+            )));
+        }
+        let mut body = Vec::with_capacity(batch_bytes + ns.len() + 64);
+
+        let body_start = Self::begin_document(&mut body);
+        body.push(0x03);
+        body.extend_from_slice(b"cursor\0");
+        let cursor_start = Self::begin_document(&mut body);
+
+        body.push(0x04);
+        body.extend_from_slice(b"firstBatch\0");
+        let batch_start = Self::begin_document(&mut body);
+        for (index, doc) in first_batch.iter().enumerate() {
+            body.push(0x03);
+            body.extend_from_slice(index.to_string().as_bytes());
+            body.push(0);
+            body.extend_from_slice(doc.as_ref());
+        }
+        Self::end_document(&mut body, batch_start);
+
+        body.push(0x12);
+        body.extend_from_slice(b"id\0");
+        body.extend_from_slice(&0i64.to_le_bytes());
+        body.push(0x02);
+        body.extend_from_slice(b"ns\0");
+        body.extend_from_slice(&(ns.len() as i32 + 1).to_le_bytes());
+        body.extend_from_slice(ns.as_bytes());
+        body.push(0);
+        Self::end_document(&mut body, cursor_start);
+
+        body.push(0x01);
+        body.extend_from_slice(b"ok\0");
+        body.extend_from_slice(&1.0f64.to_le_bytes());
+        Self::end_document(&mut body, body_start);
+
+        Ok(body)
+    }
+
+    fn begin_document(buffer: &mut Vec<u8>) -> usize {
+        let start = buffer.len();
+        buffer.extend_from_slice(&0i32.to_le_bytes());
+        start
+    }
+
+    fn end_document(buffer: &mut Vec<u8>, start: usize) {
+        buffer.push(0);
+        let length = (buffer.len() - start) as i32;
+        buffer[start..start + 4].copy_from_slice(&length.to_le_bytes());
     }
 }
 
@@ -402,15 +519,21 @@ impl WireMessage {
                 doc
             }
             WireMessage::Msg(op_msg) => {
-                // For OP_MSG, get the first body section document
-                if let Some(section) = op_msg.sections.first() {
-                    match section {
-                        OpMsgSection::Body { document } => {
-                            return document.clone();
-                        }
+                // The body, with each document sequence as the array field it
+                // stands for (documents, updates, deletes, ops...)
+                let mut command = op_msg.sections.iter()
+                    .find_map(|section| match section {
+                        OpMsgSection::Body { document } => Some(document.clone()),
+                        _ => None,
+                    })
+                    .unwrap_or_default();
+                for section in &op_msg.sections {
+                    if let OpMsgSection::DocumentSequence { identifier, documents } = section {
+                        let documents = documents.iter().cloned().map(bson::Bson::Document).collect::<Vec<_>>();
+                        command.insert(identifier.clone(), documents);
                     }
                 }
-                Document::new()
+                command
             }
         }
     }
@@ -5,7 +5,10 @@
 
 use anyhow::Result;
 use bson::doc;
+use fauxdb::aggregate::AggregateRequest;
 use fauxdb::aggregation::AggregationEngine;
+use fauxdb::aggregation_pipeline::{AggregationPipeline, PipelineOptions, SampleContext};
+use fauxdb::document_codec::{StorageLayout, StorageMode};
 
 #[tokio::test]
 async fn test_match_stage() -> Result<()> {
@@ -185,4 +188,695 @@ async fn test_aggregation_error_handling() -> Result<()> {
     
     println!("✅ Aggregation error handling test passed");
     Ok(())
-}
\ No newline at end of file
+}
+#[tokio::test]
+async fn test_sample_stage() -> Result<()> {
+    let pipeline = AggregationEngine::new();
+    
+    // Test data
+    let _input_docs: Vec<bson::Document> = (0..100).map(|i| doc! { "n": i }).collect();
+    
+    // Test $sample stage
+    let sample_stage = doc! { "$sample": { "size": 10 } };
+    let stages = vec![sample_stage];
+    
+    let result = pipeline.process_pipeline_with_input(&_input_docs, &stages).await?;
+    
+    assert_eq!(result.len(), 10);
+    
+    // Sampling more than the input returns every document
+    let stages = vec![doc! { "$sample": { "size": 500 } }];
+    let result = pipeline.process_pipeline_with_input(&_input_docs, &stages).await?;
+    assert_eq!(result.len(), 100);
+    
+    println!("✅ $sample stage test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_unwind_stage() -> Result<()> {
+    let input_docs = vec![
+        doc! { "_id": 1, "tags": ["a", "b"] },
+        doc! { "_id": 2, "tags": [] },
+        doc! { "_id": 3, "tags": "c" },
+        doc! { "_id": 4 },
+    ];
+    
+    let stages = vec![doc! { "$unwind": "$tags" }];
+    let result = AggregationEngine::new().process_pipeline_owned(input_docs.clone(), stages).await?;
+    assert_eq!(result, vec![
+        doc! { "_id": 1, "tags": "a" },
+        doc! { "_id": 1, "tags": "b" },
+        doc! { "_id": 3, "tags": "c" },
+    ]);
+    
+    let stages = vec![doc! { "$unwind": { "path": "$tags", "includeArrayIndex": "i", "preserveNullAndEmptyArrays": true } }];
+    let result = AggregationEngine::new().process_pipeline_owned(input_docs.clone(), stages).await?;
+    assert_eq!(result.len(), 5);
+    assert_eq!(result[1], doc! { "_id": 1, "tags": "b", "i": 1_i64 });
+    assert_eq!(result[2], doc! { "_id": 2, "i": bson::Bson::Null });
+    
+    // $lookup needs another collection, which the engine can't read
+    let stages = vec![doc! { "$lookup": { "from": "b", "localField": "x", "foreignField": "y", "as": "z" } }];
+    assert!(AggregationEngine::new().process_pipeline_owned(input_docs, stages).await.is_err());
+    
+    println!("✅ $unwind stage test passed");
+    Ok(())
+}
+
+#[test]
+fn test_sample_stage_to_sql() -> Result<()> {
+    let stages = vec![
+        bson::Bson::Document(doc! { "$sample": { "size": 1000 } }),
+        bson::Bson::Document(doc! { "$match": { "status": "active" } }),
+    ];
+    
+    // With tsm_system_rows the sample reads only the blocks it needs
+    let pipeline = AggregationPipeline::from_bson_array(stages.clone())?
+        .with_sample_context(SampleContext { estimated_rows: Some(200_000_000.0), tsm_system_rows: true });
+    let sql = pipeline.to_sql("events")?;
+    assert!(sql.contains("TABLESAMPLE SYSTEM_ROWS(1000)"));
+    assert!(sql.contains("WHERE status = 'active'"));
+    
+    // Without it, BERNOULLI is sized from reltuples
+    let pipeline = AggregationPipeline::from_bson_array(stages)?
+        .with_sample_context(SampleContext { estimated_rows: Some(200_000_000.0), tsm_system_rows: false });
+    let sql = pipeline.to_sql("events")?;
+    assert!(sql.contains("TABLESAMPLE BERNOULLI"));
+    assert!(sql.contains("LIMIT 1000"));
+    
+    // A non-leading $sample is left to the in-process engine
+    let stages = vec![
+        bson::Bson::Document(doc! { "$match": { "status": "active" } }),
+        bson::Bson::Document(doc! { "$sample": { "size": 10 } }),
+    ];
+    assert!(AggregationPipeline::from_bson_array(stages)?.to_sql("events").is_err());
+    
+    println!("✅ $sample to_sql test passed");
+    Ok(())
+}
+
+#[test]
+fn test_window_stages_to_sql() -> Result<()> {
+    // Moving average over the last three readings per sensor
+    let stages = vec![
+        bson::Bson::Document(doc! { "$setWindowFields": {
+            "partitionBy": "$sensor",
+            "sortBy": { "ts": 1 },
+            "output": { "avgTemp": { "$avg": "$temp", "window": { "documents": [-2, 0] } } }
+        } }),
+    ];
+    let columns = || vec!["sensor".to_string(), "ts".to_string(), "temp".to_string()];
+    
+    // Window stages overwrite columns in place, so they need the column names
+    assert!(AggregationPipeline::from_bson_array(stages.clone())?.to_sql("readings").is_err());
+    let sql = AggregationPipeline::from_bson_array(stages)?.with_columns(columns()).to_sql("readings")?;
+    assert!(sql.starts_with("SELECT sensor, ts, temp, avg(temp) OVER (PARTITION BY sensor ORDER BY ts ASC ROWS BETWEEN 2 PRECEDING AND CURRENT ROW) AS avgTemp FROM ("));
+    
+    // An output named like an input column replaces it rather than repeating it
+    let stages = vec![
+        bson::Bson::Document(doc! { "$setWindowFields": {
+            "sortBy": { "ts": 1 },
+            "output": { "temp": { "$max": "$temp" } }
+        } }),
+    ];
+    let sql = AggregationPipeline::from_bson_array(stages)?.with_columns(columns()).to_sql("readings")?;
+    assert!(sql.starts_with("SELECT sensor, ts, max(temp) OVER (ORDER BY ts ASC) AS temp FROM ("));
+    
+    // Hourly gap filling with the last observed value carried forward
+    let stages = vec![
+        bson::Bson::Document(doc! { "$densify": {
+            "field": "ts",
+            "partitionByFields": ["sensor"],
+            "range": { "step": 1, "unit": "hour", "bounds": "partition" }
+        } }),
+        bson::Bson::Document(doc! { "$fill": {
+            "partitionByFields": ["sensor"],
+            "sortBy": { "ts": 1 },
+            "output": { "temp": { "method": "locf" } }
+        } }),
+    ];
+    let sql = AggregationPipeline::from_bson_array(stages)?.with_columns(columns()).to_sql("readings")?;
+    assert!(sql.contains("generate_series(min(ts), max(ts), INTERVAL '1 hour')"));
+    assert!(sql.contains("count(temp) OVER (PARTITION BY sensor ORDER BY ts ASC) AS _fill_prev_temp"));
+    // The filled column appears once and the group helper not at all
+    assert!(sql.starts_with("SELECT sensor, ts, first_value(temp) OVER (PARTITION BY sensor, _fill_prev_temp ORDER BY ts ASC) AS temp FROM ("));
+    
+    // Linear interpolation divides as numeric, not integer
+    let stages = vec![
+        bson::Bson::Document(doc! { "$fill": {
+            "sortBy": { "ts": 1 },
+            "output": { "temp": { "method": "linear" } }
+        } }),
+    ];
+    let sql = AggregationPipeline::from_bson_array(stages)?.with_columns(columns()).to_sql("readings")?;
+    assert!(sql.starts_with("SELECT sensor, ts, COALESCE(temp::numeric, (first_value(temp) OVER (PARTITION BY _fill_prev_temp ORDER BY ts ASC))::numeric + "));
+    assert!(sql.contains("(ts::numeric - (first_value(ts) OVER (PARTITION BY _fill_prev_temp ORDER BY ts ASC))::numeric)"));
+    assert!(!sql.starts_with("SELECT fill_groups.*"));
+    
+    println!("✅ Window stages to_sql test passed");
+    Ok(())
+}
+
+#[test]
+fn test_union_with_to_sql() -> Result<()> {
+    let stages = vec![
+        bson::Bson::Document(doc! { "$match": { "type": "view" } }),
+        bson::Bson::Document(doc! { "$unionWith": { "coll": "events_2025_02" } }),
+        bson::Bson::Document(doc! { "$limit": 100 }),
+    ];
+    let plan = AggregationPipeline::from_bson_array(stages)?.plan("events_2025_01")?;
+    
+    // The bare-table planner has no collection tables to union; the aggregate
+    // command plans $unionWith against them instead
+    assert_eq!(plan.sql, "SELECT * FROM events_2025_01 WHERE type = 'view'");
+    assert_eq!(plan.remainder_documents(), vec![
+        doc! { "$unionWith": { "coll": "events_2025_02" } },
+        doc! { "$limit": 100 },
+    ]);
+    
+    println!("✅ $unionWith to_sql test passed");
+    Ok(())
+}
+
+#[test]
+fn test_pipeline_optimizer_pushdown() -> Result<()> {
+    let stages = vec![
+        bson::Bson::Document(doc! { "$project": { "name": 1, "age": 1 } }),
+        bson::Bson::Document(doc! { "$match": { "age": { "$gte": 21, "$lt": 65 } } }),
+        bson::Bson::Document(doc! { "$match": { "name": { "$ne": "admin" } } }),
+        bson::Bson::Document(doc! { "$sort": { "age": -1 } }),
+        bson::Bson::Document(doc! { "$limit": 10 }),
+        bson::Bson::Document(doc! { "$bucketAuto": { "groupBy": "$age", "buckets": 4 } }),
+    ];
+    let plan = AggregationPipeline::from_bson_array(stages)?.plan("users")?;
+    
+    // Both $match stages merge and run below the projection; $sort + $limit become one top-K
+    assert_eq!(
+        plan.sql,
+        "SELECT * FROM (SELECT name, age FROM users WHERE age >= 21 AND age < 65 AND name != 'admin') AS sorted ORDER BY age DESC LIMIT 10"
+    );
+    
+    // Stages without a SQL translation are left for the in-process engine
+    assert_eq!(plan.remainder.len(), 1);
+    assert!(plan.remainder_documents()[0].contains_key("$bucketAuto"));
+    
+    // A $match reading a field the projection drops must stay put
+    let stages = vec![
+        bson::Bson::Document(doc! { "$project": { "name": 1 } }),
+        bson::Bson::Document(doc! { "$match": { "age": 30 } }),
+    ];
+    let sql = AggregationPipeline::from_bson_array(stages)?.to_sql("users")?;
+    assert_eq!(sql, "SELECT * FROM (SELECT name FROM users) AS matched WHERE age = 30");
+    
+    // A computed field makes the projection an inclusion too, so age is gone
+    let request = AggregateRequest::parse(&doc! {
+        "aggregate": "users",
+        "pipeline": [ { "$project": { "label": "$name" } }, { "$match": { "age": 30 } } ],
+        "$db": "app"
+    })?;
+    let plan = request.plan(&StorageLayout::new(StorageMode::Jsonb, Vec::new()))?;
+    assert!(!plan.sql.contains("WHERE"));
+    assert_eq!(plan.remainder_documents(), vec![
+        doc! { "$project": { "label": "$name" } },
+        doc! { "$match": { "age": 30 } },
+    ]);
+    
+    // $group accumulators and exclusion projections have no SQL form yet
+    for stage in [
+        doc! { "$group": { "_id": "$city", "total": { "$sum": "$age" } } },
+        doc! { "$project": { "password": 0 } },
+        doc! { "$project": { "_id": 0 } },
+    ] {
+        let stages = vec![
+            bson::Bson::Document(doc! { "$match": { "age": 30 } }),
+            bson::Bson::Document(stage.clone()),
+        ];
+        let plan = AggregationPipeline::from_bson_array(stages)?.plan("users")?;
+        assert_eq!(plan.sql, "SELECT * FROM users WHERE age = 30");
+        assert_eq!(plan.remainder_documents(), vec![stage]);
+    }
+    
+    println!("✅ Pipeline optimizer pushdown test passed");
+    Ok(())
+}
+
+#[test]
+fn test_compiled_predicate() -> Result<()> {
+    use fauxdb::predicate::CompiledPredicate;
+    
+    let predicate = CompiledPredicate::compile(&doc! {
+        "address.city": "Boston",
+        "age": { "$gte": 25, "$lt": 40 },
+        "$or": [ { "tags": "vip" }, { "status": { "$in": ["gold", "platinum"] } } ],
+        "deleted": { "$ne": true }
+    })?;
+    
+    // Int64 and Double ages compare with the Int32 bounds; tags matches inside the array
+    assert!(predicate.matches(&doc! { "address": { "city": "Boston" }, "age": 30i64, "tags": ["new", "vip"] }));
+    assert!(predicate.matches(&doc! { "address": { "city": "Boston" }, "age": 25.0, "status": "gold" }));
+    assert!(!predicate.matches(&doc! { "address": { "city": "Boston" }, "age": 30, "status": "silver" }));
+    assert!(!predicate.matches(&doc! { "address": { "city": "Boston" }, "age": 30, "tags": ["vip"], "deleted": true }));
+    assert!(!predicate.matches(&doc! { "address": { "city": "Austin" }, "age": 30, "tags": ["vip"] }));
+    
+    // Range operators never match across types
+    let predicate = CompiledPredicate::compile(&doc! { "age": { "$gt": 20 } })?;
+    assert!(!predicate.matches(&doc! { "age": "30" }));
+    
+    // Unknown operators are rejected at compile time instead of being ignored
+    assert!(CompiledPredicate::compile(&doc! { "age": { "$bogus": 1 } }).is_err());
+    
+    println!("✅ Compiled predicate test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_group_stage_parallel() -> Result<()> {
+    // Large enough to take the rayon path
+    let input_docs: Vec<bson::Document> = (0..10_000)
+        .map(|i| doc! { "region": if i % 2 == 0 { "east" } else { "west" }, "amount": i, "seq": i })
+        .collect();
+    let stages = vec![
+        doc! { "$group": {
+            "_id": "$region",
+            "total": { "$sum": "$amount" },
+            "orders": { "$count": {} },
+            "firstSeq": { "$first": "$seq" },
+            "maxAmount": { "$max": "$amount" }
+        } },
+    ];
+    
+    let result = AggregationEngine::new().process_pipeline_owned(input_docs, stages).await?;
+    
+    assert_eq!(result.len(), 2);
+    let east = result.iter().find(|d| d.get_str("_id").ok() == Some("east")).unwrap();
+    assert_eq!(east.get_i32("total")?, (0..10_000).step_by(2).sum::<i32>());
+    assert_eq!(east.get_i32("orders")?, 5_000);
+    assert_eq!(east.get_i32("firstSeq")?, 0);
+    assert_eq!(east.get_i32("maxAmount")?, 9_998);
+    
+    println!("✅ Parallel $group stage test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_group_operand_expressions() -> Result<()> {
+    let input_docs = vec![
+        doc! { "item": "a", "price": 2, "qty": 3, "day": 1 },
+        doc! { "item": "b", "price": 5, "qty": 1, "day": 1 },
+        doc! { "item": "a", "price": 2, "qty": 4, "day": 2 },
+    ];
+    let stages = vec![
+        doc! { "$group": {
+            "_id": { "big": { "$gt": ["$qty", 2] } },
+            "revenue": { "$sum": { "$multiply": ["$price", "$qty"] } },
+            "labels": { "$push": { "$concat": ["$item", "-x"] } }
+        } },
+    ];
+    
+    let result = AggregationEngine::new().process_pipeline_owned(input_docs.clone(), stages).await?;
+    
+    assert_eq!(result.len(), 2);
+    let big = result.iter().find(|d| d.get_document("_id").ok().and_then(|id| id.get_bool("big").ok()) == Some(true)).unwrap();
+    assert_eq!(big.get_i32("revenue")?, 14);
+    assert_eq!(big.get_array("labels")?.len(), 2);
+    
+    // Operators the expression engine doesn't know are rejected up front
+    let unsupported = vec![doc! { "$group": { "_id": null, "x": { "$sum": { "$noSuchOperator": "$qty" } } } }];
+    assert!(AggregationEngine::new().process_pipeline_owned(input_docs, unsupported).await.is_err());
+    
+    println!("✅ $group operand expressions test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_group_large_int64_keys() -> Result<()> {
+    // Adjacent ids past 2^53 would share a double, so they keep Int64 width
+    let base: i64 = 1 << 53;
+    let input_docs = vec![
+        doc! { "_id": base + 1, "amount": 1 },
+        doc! { "_id": base + 2, "amount": 2 },
+        doc! { "_id": 7_i64, "amount": 3 },
+        doc! { "_id": 7.0, "amount": 4 },
+    ];
+    let stages = vec![doc! { "$group": { "_id": "$_id", "total": { "$sum": "$amount" } } }];
+    
+    let result = AggregationEngine::new().process_pipeline_owned(input_docs, stages).await?;
+    
+    assert_eq!(result.len(), 3);
+    assert!(result.iter().any(|d| d.get_i64("_id").ok() == Some(base + 1) && d.get_i32("total").ok() == Some(1)));
+    assert!(result.iter().any(|d| d.get_i64("_id").ok() == Some(base + 2) && d.get_i32("total").ok() == Some(2)));
+    // Small numbers still meet across types
+    assert!(result.iter().any(|d| d.get_i32("total").ok() == Some(7)));
+    
+    println!("✅ $group large Int64 key test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_sort_top_k_and_spill() -> Result<()> {
+    let input_docs: Vec<bson::Document> = (0..1_000)
+        .map(|i| doc! { "score": (i * 37) % 1_000, "seq": i })
+        .collect();
+    
+    // $sort + $limit runs as a bounded top-K
+    let top = AggregationEngine::new()
+        .process_pipeline_owned(input_docs.clone(), vec![
+            doc! { "$sort": { "score": -1 } },
+            doc! { "$limit": 3 },
+        ])
+        .await?;
+    let scores: Vec<i32> = top.iter().map(|d| d.get_i32("score").unwrap()).collect();
+    assert_eq!(scores, vec![999, 998, 997]);
+    
+    // A tiny memory limit fails without allowDiskUse...
+    let sort = vec![doc! { "$sort": { "score": 1 } }];
+    let constrained = AggregationEngine::new().with_memory_limit(4 * 1024);
+    assert!(constrained.process_pipeline_owned(input_docs.clone(), sort.clone()).await.is_err());
+    
+    // ...and spills sorted runs to disk with it
+    let sorted = constrained
+        .with_allow_disk_use(true)
+        .process_pipeline_owned(input_docs, sort)
+        .await?;
+    assert_eq!(sorted.len(), 1_000);
+    assert!(sorted.windows(2).all(|w| w[0].get_i32("score").unwrap() <= w[1].get_i32("score").unwrap()));
+    
+    println!("✅ Top-K and external sort test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_group_spill_to_disk() -> Result<()> {
+    let input_docs: Vec<bson::Document> = (0..20_000)
+        .map(|i| doc! { "customer": i / 2, "amount": 1 })
+        .collect();
+    let stages = vec![doc! { "$group": { "_id": "$customer", "total": { "$sum": "$amount" } } }];
+    
+    // allowDiskUse comes from the aggregate command
+    let command = doc! { "aggregate": "orders", "pipeline": [], "allowDiskUse": true, "cursor": {} };
+    let options = PipelineOptions::from_command(&command);
+    assert!(options.allow_disk_use);
+    
+    let constrained = AggregationEngine::new().with_memory_limit(256 * 1024);
+    assert!(constrained.process_pipeline_owned(input_docs.clone(), stages.clone()).await.is_err());
+    
+    let result = constrained
+        .with_budget(options.memory_budget(256 * 1024))
+        .process_pipeline_owned(input_docs, stages)
+        .await?;
+    assert_eq!(result.len(), 10_000);
+    assert!(result.iter().all(|d| d.get_i32("total").unwrap() == 2));
+    
+    println!("✅ $group spill test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_expression_backends() -> Result<()> {
+    use fauxdb::expression::Expr;
+    
+    // SQL backend: computed projections and $expr push down
+    let stages = vec![
+        bson::Bson::Document(doc! { "$match": { "$expr": { "$gt": ["$spent", "$budget"] } } }),
+        bson::Bson::Document(doc! { "$project": {
+            "name": 1,
+            "overrun": { "$subtract": ["$spent", "$budget"] },
+            "tier": { "$cond": { "if": { "$gte": ["$spent", 1000] }, "then": "gold", "else": "basic" } }
+        } }),
+    ];
+    let plan = AggregationPipeline::from_bson_array(stages)?.plan("accounts")?;
+    assert!(plan.remainder.is_empty());
+    assert_eq!(
+        plan.sql,
+        "SELECT name, (spent - budget) AS overrun, (CASE WHEN (spent >= 1000) THEN 'gold' ELSE 'basic' END) AS tier FROM accounts WHERE (spent > budget)"
+    );
+    let week = Expr::parse(&bson::Bson::Document(doc! { "$dateTrunc": { "date": "$at", "unit": "week", "startOfWeek": "monday" } }))?;
+    assert_eq!(week.to_sql()?, "date_bin(INTERVAL '1 week', at, TIMESTAMPTZ '2000-01-03 00:00:00+00')");
+    
+    // Native backend: the same operators evaluated in-process
+    let at = bson::DateTime::parse_rfc3339_str("2024-05-15T13:45:00Z")?;
+    let input_docs = vec![
+        doc! { "_id": 1, "name": "a", "spent": 1500, "budget": 1000, "at": at },
+        doc! { "_id": 2, "name": "b", "spent": 10, "budget": 100, "at": at },
+    ];
+    let stages = vec![
+        doc! { "$match": { "$expr": { "$gt": ["$spent", "$budget"] } } },
+        doc! { "$addFields": {
+            "ratio": { "$divide": ["$spent", "$budget"] },
+            "month": { "$dateTrunc": { "date": "$at", "unit": "month" } },
+            "week": { "$dateTrunc": { "date": "$at", "unit": "week" } }
+        } },
+        doc! { "$project": { "name": 1, "ratio": 1, "month": 1, "week": 1, "label": { "$concat": ["$name", "!"] } } },
+    ];
+    let result = AggregationEngine::new().process_pipeline_with_input(&input_docs, &stages).await?;
+    
+    assert_eq!(result.len(), 1);
+    assert_eq!(result[0].get_i32("_id")?, 1);
+    assert_eq!(result[0].get_f64("ratio")?, 1.5);
+    assert_eq!(result[0].get_str("label")?, "a!");
+    assert_eq!(result[0].get_datetime("month")?.try_to_rfc3339_string()?, "2024-05-01T00:00:00Z");
+    // Weeks start on Sunday by default
+    assert_eq!(result[0].get_datetime("week")?.try_to_rfc3339_string()?, "2024-05-12T00:00:00Z");
+    
+    let replaced = AggregationEngine::new()
+        .process_pipeline_with_input(&input_docs, &[doc! { "$replaceWith": { "who": "$name" } }])
+        .await?;
+    assert_eq!(replaced[1], doc! { "who": "b" });
+    
+    println!("✅ Expression backends test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_aggregate_command_over_collection() -> Result<()> {
+    let layout = StorageLayout::new(StorageMode::Jsonb, Vec::new());
+    let command = doc! {
+        "aggregate": "orders",
+        "pipeline": [
+            { "$match": { "status": "paid" } },
+            { "$sort": { "total": -1 } },
+            { "$skip": 1 },
+            { "$limit": 3 },
+            { "$group": { "_id": "$customer", "spent": { "$sum": "$total" } } },
+            { "$sort": { "_id": 1 } }
+        ],
+        "cursor": {},
+        "$db": "app"
+    };
+    assert!(AggregateRequest::reads_collection(&command));
+    let request = AggregateRequest::parse(&command)?;
+    assert_eq!(request.namespace(), "app.orders");
+    
+    // $match, $sort, $skip and $limit compile against the collection table;
+    // the checked sort reads the skipped row and drops it afterwards
+    let plan = request.plan(&layout)?;
+    assert!(plan.sql.starts_with("SELECT NULL::bytea, document::text, COALESCE(jsonb_typeof(document -> 'total') IN ('array', 'object'), false) AS unordered"));
+    assert!(plan.sql.contains(" FROM \"fauxdb_app\".\"orders_collections\" WHERE (document @> $1 OR document @> $2) ORDER BY unordered DESC, "));
+    assert!(plan.sql.ends_with(", document -> 'total' DESC, id LIMIT 4"));
+    assert_eq!(plan.params.len(), 2);
+    assert!(plan.checks_order);
+    assert_eq!(plan.skip_rows, 1);
+    let remainder = plan.remainder_documents();
+    assert_eq!(remainder.len(), 2);
+    assert!(remainder[0].contains_key("$group"));
+    
+    // Rows as the query returns them: paid orders, highest total first
+    let rows = vec![
+        doc! { "_id": 4, "customer": "c", "status": "paid", "total": 90 },
+        doc! { "_id": 1, "customer": "a", "status": "paid", "total": 50 },
+        doc! { "_id": 3, "customer": "b", "status": "paid", "total": 30 },
+        doc! { "_id": 2, "customer": "a", "status": "paid", "total": 20 },
+    ];
+    let result = request.finish(&plan, rows).await?;
+    assert_eq!(result, vec![
+        doc! { "_id": "a", "spent": 70 },
+        doc! { "_id": "b", "spent": 30 },
+    ]);
+    
+    // Without the sort in SQL it runs in process with everything after it
+    let unordered = request.plan_unordered(&layout)?;
+    assert!(unordered.sql.ends_with("WHERE (document @> $1 OR document @> $2) ORDER BY id"));
+    assert_eq!(unordered.remainder_documents()[0], doc! { "$sort": { "total": -1 } });
+    
+    // Filters SQL can't evaluate exactly stop the pushdown and run first in
+    // process; a numeric $expr still drops the rows that compare false
+    let residual = AggregateRequest::parse(&doc! {
+        "aggregate": "orders",
+        "pipeline": [ { "$match": { "$expr": { "$gt": ["$total", "$budget"] } } }, { "$limit": 5 } ],
+        "$db": "app"
+    })?.plan(&layout)?;
+    assert_eq!(
+        residual.sql,
+        "SELECT NULL::bytea, document::text FROM \"fauxdb_app\".\"orders_collections\" \
+         WHERE (jsonb_typeof(document -> 'budget') IS DISTINCT FROM 'number' OR jsonb_typeof(document -> 'total') IS DISTINCT FROM 'number' \
+         OR ((CASE WHEN jsonb_typeof(document -> 'total') = 'number' THEN (document ->> 'total')::numeric END) > \
+         (CASE WHEN jsonb_typeof(document -> 'budget') = 'number' THEN (document ->> 'budget')::numeric END))) ORDER BY id"
+    );
+    assert_eq!(residual.remainder_documents(), vec![
+        doc! { "$match": { "$expr": { "$gt": ["$total", "$budget"] } } },
+        doc! { "$limit": 5 },
+    ]);
+    
+    let strings = AggregateRequest::parse(&doc! {
+        "aggregate": "orders",
+        "pipeline": [ { "$match": { "$expr": { "$gt": ["$status", "paid"] } } } ],
+        "$db": "app"
+    })?.plan(&layout)?;
+    assert!(!strings.sql.contains("WHERE"));
+    
+    assert!(!AggregateRequest::reads_collection(&doc! { "aggregate": "orders", "pipeline": [ { "$collStats": {} } ] }));
+    
+    // A leading $sample reads the collection table through TABLESAMPLE
+    let sample = AggregateRequest::parse(&doc! {
+        "aggregate": "orders",
+        "pipeline": [ { "$sample": { "size": 10 } }, { "$match": { "status": "paid" } } ],
+        "$db": "app"
+    })?;
+    assert!(sample.samples_collection());
+    let plan = sample
+        .with_sample_context(SampleContext { estimated_rows: Some(1_000_000.0), tsm_system_rows: true })
+        .plan(&layout)?;
+    assert_eq!(
+        plan.sql,
+        "SELECT NULL::bytea, document::text FROM (SELECT sample_source.* FROM \"fauxdb_app\".\"orders_collections\" AS sample_source TABLESAMPLE SYSTEM_ROWS(10)) AS sampled \
+         WHERE (document @> $1 OR document @> $2) ORDER BY id"
+    );
+    assert!(plan.remainder.is_empty());
+    
+    // Filtered branches read their own collection tables in one flat UNION ALL
+    let union = AggregateRequest::parse(&doc! {
+        "aggregate": "events_2025_01",
+        "pipeline": [
+            { "$unionWith": { "coll": "events_2025_02" } },
+            { "$unionWith": { "coll": "events_2025_03", "pipeline": [ { "$match": { "type": "click" } } ] } },
+            { "$limit": 100 }
+        ],
+        "$db": "app"
+    })?;
+    let plan = union.plan(&layout)?;
+    assert_eq!(
+        plan.sql,
+        "(SELECT NULL::bytea, document::text FROM \"fauxdb_app\".\"events_2025_01_collections\" ORDER BY id) UNION ALL \
+         (SELECT NULL::bytea, document::text FROM \"fauxdb_app\".\"events_2025_02_collections\" ORDER BY id) UNION ALL \
+         (SELECT NULL::bytea, document::text FROM \"fauxdb_app\".\"events_2025_03_collections\" WHERE (document @> $1 OR document @> $2) ORDER BY id)"
+    );
+    assert_eq!(plan.union_tables, vec!["\"fauxdb_app\".\"events_2025_02_collections\"", "\"fauxdb_app\".\"events_2025_03_collections\""]);
+    assert_eq!(plan.remainder_documents(), vec![doc! { "$limit": 100 }]);
+    
+    // ...and otherwise run as aggregates of their own
+    let separate = union.plan_separate_unions(&layout)?;
+    assert_eq!(separate.sql, "SELECT NULL::bytea, document::text FROM \"fauxdb_app\".\"events_2025_01_collections\" ORDER BY id");
+    assert_eq!(separate.remainder.len(), 3);
+    let branch = match &separate.remainder[1] {
+        fauxdb::aggregation_pipeline::PipelineStage::UnionWith(options) => union.union_branch(options),
+        other => panic!("expected $unionWith, got {:?}", other),
+    };
+    assert_eq!(branch.namespace(), "app.events_2025_03");
+    assert!(branch.plan(&layout)?.sql.starts_with("SELECT NULL::bytea, document::text FROM \"fauxdb_app\".\"events_2025_03_collections\" WHERE "));
+    
+    println!("✅ aggregate command test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_aggregate_command_memory_limit() -> Result<()> {
+    let layout = StorageLayout::new(StorageMode::Jsonb, Vec::new());
+    let rows: Vec<bson::Document> = (0..20_000)
+        .map(|i| doc! { "customer": i / 2, "amount": 1 })
+        .collect();
+    let command = doc! {
+        "aggregate": "orders",
+        "pipeline": [ { "$group": { "_id": "$customer", "total": { "$sum": "$amount" } } } ],
+        "cursor": {},
+        "$db": "app"
+    };
+    
+    // The configured aggregation_memory_limit bounds the in-process stages...
+    let request = AggregateRequest::parse(&command)?.with_memory_limit(256 * 1024);
+    let plan = request.plan(&layout)?;
+    assert!(request.finish(&plan, rows.clone()).await.is_err());
+    
+    // ...and allowDiskUse lets them spill past it
+    let mut spilling = command.clone();
+    spilling.insert("allowDiskUse", true);
+    let request = AggregateRequest::parse(&spilling)?.with_memory_limit(256 * 1024);
+    let result = request.finish(&plan, rows).await?;
+    assert_eq!(result.len(), 10_000);
+    
+    println!("✅ aggregate command memory limit test passed");
+    Ok(())
+}
+
+#[tokio::test]
+async fn test_aggregate_command_window_stages() -> Result<()> {
+    let layout = StorageLayout::new(StorageMode::Jsonb, Vec::new());
+    
+    // A two-reading moving average per sensor runs in process after the scan
+    let request = AggregateRequest::parse(&doc! {
+        "aggregate": "readings",
+        "pipeline": [ { "$setWindowFields": {
+            "partitionBy": "$sensor",
+            "sortBy": { "ts": 1 },
+            "output": {
+                "avgTemp": { "$avg": "$temp", "window": { "documents": [-1, 0] } },
+                "n": { "$documentNumber": {} }
+            }
+        } } ],
+        "cursor": {},
+        "$db": "app"
+    })?;
+    let plan = request.plan(&layout)?;
+    assert!(plan.remainder_documents()[0].contains_key("$setWindowFields"));
+    let rows = vec![
+        doc! { "_id": 1, "sensor": "a", "ts": 1, "temp": 10 },
+        doc! { "_id": 2, "sensor": "a", "ts": 3, "temp": 40 },
+        doc! { "_id": 3, "sensor": "b", "ts": 1, "temp": 5 },
+        doc! { "_id": 4, "sensor": "a", "ts": 2, "temp": 20 },
+    ];
+    let result = request.finish(&plan, rows).await?;
+    let windows: Vec<(i32, f64, i32)> = result.iter()
+        .map(|doc| (doc.get_i32("_id").unwrap(), doc.get_f64("avgTemp").unwrap(), doc.get_i32("n").unwrap()))
+        .collect();
+    assert_eq!(windows, vec![(1, 10.0, 1), (4, 15.0, 2), (2, 30.0, 3), (3, 5.0, 1)]);
+    
+    // Hourly-style gap filling: densify the missing steps, then interpolate
+    let request = AggregateRequest::parse(&doc! {
+        "aggregate": "readings",
+        "pipeline": [
+            { "$densify": { "field": "ts", "partitionByFields": ["sensor"], "range": { "step": 1, "bounds": "partition" } } },
+            { "$fill": { "partitionByFields": ["sensor"], "sortBy": { "ts": 1 }, "output": { "temp": { "method": "linear" } } } }
+        ],
+        "cursor": {},
+        "$db": "app"
+    })?;
+    let plan = request.plan(&layout)?;
+    let rows = vec![
+        doc! { "_id": 1, "sensor": "a", "ts": 1, "temp": 10 },
+        doc! { "_id": 2, "sensor": "a", "ts": 4, "temp": 40 },
+        doc! { "_id": 3, "sensor": "b", "ts": 2, "temp": 7 },
+    ];
+    let result = request.finish(&plan, rows).await?;
+    assert_eq!(result, vec![
+        doc! { "_id": 1, "sensor": "a", "ts": 1, "temp": 10 },
+        doc! { "sensor": "a", "ts": 2, "temp": 20.0 },
+        doc! { "sensor": "a", "ts": 3, "temp": 30.0 },
+        doc! { "_id": 2, "sensor": "a", "ts": 4, "temp": 40 },
+        doc! { "_id": 3, "sensor": "b", "ts": 2, "temp": 7 },
+    ]);
+    
+    // Calendar units have no fixed length to step or frame by
+    let request = AggregateRequest::parse(&doc! {
+        "aggregate": "readings",
+        "pipeline": [ { "$setWindowFields": {
+            "sortBy": { "ts": 1 },
+            "output": { "total": { "$sum": "$temp", "window": { "range": [-1, 0], "unit": "month" } } }
+        } } ],
+        "$db": "app"
+    })?;
+    let plan = request.plan(&layout)?;
+    assert!(request.finish(&plan, vec![doc! { "ts": bson::DateTime::now(), "temp": 1 }]).await.is_err());
+    
+    println!("✅ aggregate command window stages test passed");
+    Ok(())
+}
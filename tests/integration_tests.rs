@@ -36,6 +36,7 @@ async fn test_connection_pool_creation() -> Result<()> {
         idle_timeout: std::time::Duration::from_secs(600),
         connection_timeout: std::time::Duration::from_secs(30),
         statement_cache_size: 100,
+        max_pinned: 8,
     };
     
     assert_eq!(pool_config.max_size, 10);
@@ -248,5 +249,10 @@ async fn test_configuration_validation() -> Result<()> {
     let deserialized: ProductionConfig = serde_json::from_str(&serialized)?;
     assert!(deserialized.validate().is_ok());
     
+    // More idle connections than the pool holds is rejected
+    let mut oversized = ProductionConfig::default();
+    oversized.database.min_idle = oversized.database.pool_size + 1;
+    assert!(oversized.validate().is_err());
+    
     Ok(())
 }
@@ -23,12 +23,16 @@ fn test_config_loading() -> Result<()> {
         database: DatabaseConfig {
             connection_string: "postgresql://localhost:5432/fauxdb".to_string(),
             pool_size: 10,
+            min_idle: 2,
             max_lifetime: std::time::Duration::from_secs(3600),
             idle_timeout: std::time::Duration::from_secs(600),
             connection_timeout: std::time::Duration::from_secs(30),
             statement_cache_size: 100,
+            max_pinned_connections: None,
             enable_ssl: false,
             ssl_mode: "prefer".to_string(),
+            storage_mode: fauxdb::document_codec::StorageMode::Both,
+            indexed_paths: Vec::new(),
         },
         security: SecurityConfig {
             enable_auth: false,
@@ -46,10 +50,17 @@ fn test_config_loading() -> Result<()> {
         },
         performance: PerformanceConfig {
             query_cache_size: 1024 * 1024, // 1MB
+            query_cache_bytes: 64 * 1024 * 1024,
             query_cache_ttl: std::time::Duration::from_secs(3600),
             batch_size: 1000,
             parallel_workers: 4,
             memory_limit: "1GB".to_string(),
+            aggregation_memory_limit: 100 * 1024 * 1024,
+            point_lookup_batching: true,
+            point_lookup_window_us: 0,
+            single_flight_namespaces: vec!["app.settings".to_string()],
+            query_cache_namespaces: vec!["app.countries".to_string()],
+            transaction_idle_timeout: std::time::Duration::from_secs(60),
             enable_compression: true,
             compression_level: 6,
         },
@@ -122,6 +133,44 @@ fn test_wire_protocol_opcodes() {
     assert_eq!(OpCode::from_u32(9999), None);
 }
 
+#[test]
+fn test_op_msg_document_sequence() -> Result<()> {
+    use fauxdb::wire_protocol::WireProtocolHandler;
+    
+    // Body plus a kind 1 section carrying the documents to insert, each
+    // large enough that the message spans many network reads
+    let body = bson::to_vec(&bson::doc! { "insert": "orders", "$db": "app" })?;
+    let documents: Vec<bson::Document> = (0..3)
+        .map(|i| bson::doc! { "_id": i, "note": "x".repeat(2000) })
+        .collect();
+    let mut sequence = b"documents\0".to_vec();
+    for document in &documents {
+        sequence.extend(bson::to_vec(document)?);
+    }
+    
+    let mut message = Vec::new();
+    message.extend(&[0u8; 4]);
+    message.extend(&7u32.to_le_bytes());
+    message.extend(&0u32.to_le_bytes());
+    message.extend(&2013u32.to_le_bytes());
+    message.extend(&0u32.to_le_bytes());
+    message.push(0);
+    message.extend(&body);
+    message.push(1);
+    message.extend(&((sequence.len() + 4) as u32).to_le_bytes());
+    message.extend(&sequence);
+    let length = message.len() as u32;
+    message[..4].copy_from_slice(&length.to_le_bytes());
+    
+    let command = WireProtocolHandler::parse_message(&message)?.get_command_document();
+    assert_eq!(command.get_str("insert")?, "orders");
+    let parsed = command.get_array("documents")?;
+    assert_eq!(parsed.len(), 3);
+    assert_eq!(parsed[2].as_document(), Some(&documents[2]));
+    
+    Ok(())
+}
+
 #[test]
 fn test_bson_serialization() -> Result<()> {
     use bson::doc;
@@ -167,6 +216,7 @@ fn test_connection_pool_config() {
         idle_timeout: std::time::Duration::from_secs(600),
         connection_timeout: std::time::Duration::from_secs(30),
         statement_cache_size: 100,
+        max_pinned: 75,
     };
     
     assert_eq!(pool_config.max_size, 100);
@@ -193,6 +243,46 @@ fn test_transaction_manager() {
     assert!(_tx_manager_type != std::any::TypeId::of::<()>());
 }
 
+#[test]
+fn test_transaction_request_parsing() -> Result<()> {
+    use fauxdb::transactions::TransactionRequest;
+    
+    let lsid = bson::doc! { "id": bson::Binary { subtype: bson::spec::BinarySubtype::Uuid, bytes: vec![7; 16] } };
+    let start = TransactionRequest::parse(&bson::doc! {
+        "insert": "orders", "lsid": lsid.clone(), "txnNumber": 3i64, "startTransaction": true, "autocommit": false,
+    }).expect("transaction statement");
+    assert_eq!(start.txn_number, 3);
+    assert!(start.start);
+    
+    let next = TransactionRequest::parse(&bson::doc! { "find": "orders", "lsid": lsid.clone(), "txnNumber": 3i64, "autocommit": false })
+        .expect("transaction statement");
+    assert_eq!(next.session, start.session);
+    assert!(!next.start);
+    
+    // Retryable writes carry a txnNumber without autocommit: false
+    assert!(TransactionRequest::parse(&bson::doc! { "insert": "orders", "lsid": lsid, "txnNumber": 4i64 }).is_none());
+    assert!(TransactionRequest::parse(&bson::doc! { "find": "orders" }).is_none());
+    
+    Ok(())
+}
+
+#[test]
+fn test_write_conflict_is_transient() -> Result<()> {
+    use fauxdb::error::FauxDBError;
+    use fauxdb::transactions::TransactionError;
+    
+    let reply = TransactionError::from(FauxDBError::WriteConflict("could not serialize access".to_string())).to_response();
+    assert_eq!(reply.get_i32("code")?, 112);
+    assert_eq!(reply.get_str("codeName")?, "WriteConflict");
+    assert_eq!(reply.get_array("errorLabels")?, &vec![bson::Bson::String("TransientTransactionError".to_string())]);
+    
+    let reply = TransactionError::from(FauxDBError::Database("boom".to_string())).to_response();
+    assert_eq!(reply.get_i32("code")?, 1);
+    assert!(reply.get("errorLabels").is_none());
+    
+    Ok(())
+}
+
 #[test]
 fn test_security_manager() {
     use fauxdb::security::SecurityManager;
@@ -246,3 +336,520 @@ fn test_replication_manager() {
     // Just verify it was created successfully
     assert!(std::ptr::addr_of!(replication_manager) != std::ptr::null());
 }
+
+#[test]
+fn test_explain_plan_mapping() -> Result<()> {
+    use fauxdb::document_codec::{StorageLayout, StorageMode};
+    use fauxdb::explain::ExplainRequest;
+    
+    let explain_doc = bson::doc! {
+        "explain": {
+            "find": "users",
+            "filter": { "age": { "$gt": 30 } },
+            "sort": { "age": 1 },
+            "limit": 5
+        },
+        "verbosity": "executionStats",
+        "$db": "app"
+    };
+    let layout = StorageLayout::new(StorageMode::Jsonb, Vec::new());
+    let request = ExplainRequest::parse(&explain_doc, &layout)?;
+    assert_eq!(request.namespace, "app.users");
+    
+    // The find runs against the collection table, sorted there; the range
+    // filter and the limit after it are finished in process
+    let sql = request.explain_sql();
+    assert!(sql.starts_with("EXPLAIN (ANALYZE, BUFFERS, FORMAT JSON) SELECT NULL::bytea, document::text, "));
+    assert!(sql.contains(" FROM \"fauxdb_app\".\"users_collections\" ORDER BY unordered DESC, "));
+    assert!(request.params.is_empty());
+    assert_eq!(request.in_process_stages, vec![
+        bson::doc! { "$match": { "age": { "$gt": 30 } } },
+        bson::doc! { "$limit": 5_i64 },
+    ]);
+    
+    // Equality pushes down with its containment documents bound as parameters
+    let count = ExplainRequest::parse(&bson::doc! {
+        "explain": { "count": "users", "query": { "status": "active" } },
+        "verbosity": "queryPlanner",
+        "$db": "app"
+    }, &layout)?;
+    assert_eq!(
+        count.explain_sql(),
+        "EXPLAIN (FORMAT JSON, SUMMARY) SELECT NULL::bytea, document::text FROM \"fauxdb_app\".\"users_collections\" WHERE (document @> $1 OR document @> $2) ORDER BY id"
+    );
+    assert_eq!(count.params.len(), 2);
+    assert_eq!(count.in_process_stages, vec![bson::doc! { "$count": "n" }]);
+    
+    // Aggregates explain the SQL the aggregate path runs
+    let aggregate = ExplainRequest::parse(&bson::doc! {
+        "explain": { "aggregate": "users", "pipeline": [ { "$match": { "status": "active" } }, { "$count": "n" } ] },
+        "$db": "app"
+    }, &layout)?;
+    assert!(aggregate.sql.starts_with("SELECT NULL::bytea, document::text FROM \"fauxdb_app\".\"users_collections\" WHERE "));
+    assert_eq!(aggregate.in_process_stages, vec![bson::doc! { "$count": "n" }]);
+    
+    let output = r#"[{"Plan": {"Node Type": "Limit", "Actual Rows": 5, "Actual Loops": 1, "Actual Total Time": 0.05,
+        "Plans": [{"Node Type": "Index Scan", "Index Name": "users_age_idx", "Relation Name": "users",
+            "Scan Direction": "Forward", "Index Cond": "(age > 30)", "Actual Rows": 5, "Actual Loops": 1,
+            "Shared Hit Blocks": 3}]},
+        "Planning Time": 0.2, "Execution Time": 0.08}]"#;
+    let response = request.build_response(output)?;
+    
+    let winning_plan = response.get_document("queryPlanner")?.get_document("winningPlan")?;
+    assert_eq!(winning_plan.get_str("stage")?, "LIMIT");
+    let fetch = winning_plan.get_document("inputStage")?;
+    assert_eq!(fetch.get_str("stage")?, "FETCH");
+    assert_eq!(fetch.get_document("inputStage")?.get_str("stage")?, "IXSCAN");
+    assert_eq!(fetch.get_document("inputStage")?.get_str("indexName")?, "users_age_idx");
+    
+    let stats = response.get_document("executionStats")?;
+    assert_eq!(stats.get_i64("nReturned")?, 5);
+    assert_eq!(stats.get_i64("totalKeysExamined")?, 5);
+    assert!(response.get_document("queryPlanner")?.get_str("sql")?.contains("FROM \"fauxdb_app\".\"users_collections\""));
+    
+    Ok(())
+}
+
+#[test]
+fn test_bulk_insert_prepare() -> Result<()> {
+    use fauxdb::bulk_insert::{prepare_documents, BulkInsertResult};
+    use fauxdb::document_codec::StorageLayout;
+    
+    let documents = vec![
+        bson::doc! { "_id": 1, "name": "a" },
+        bson::doc! { "name": "b" },
+        bson::doc! { "_id": 1, "name": "c" },
+        bson::doc! { "_id": 2, "name": "d" },
+    ];
+    
+    // Unordered keeps going past the duplicate
+    let (prepared, errors) = prepare_documents(&documents, &StorageLayout::default(), false);
+    assert_eq!(prepared.iter().map(|p| p.index).collect::<Vec<_>>(), vec![0, 1, 3]);
+    assert_eq!(errors.len(), 1);
+    assert_eq!(errors[0].index, 2);
+    assert_eq!(errors[0].code, 11000);
+    
+    // Generated _id is stored first
+    let stored = bson::Document::from_reader(&mut prepared[1].encoded.bson.as_deref().unwrap())?;
+    assert_eq!(stored.keys().next().map(String::as_str), Some("_id"));
+    assert!(prepared[1].encoded.jsonb.as_deref().unwrap().contains("\"name\":\"b\""));
+    
+    // Ordered stops at the duplicate
+    let (prepared, errors) = prepare_documents(&documents, &StorageLayout::default(), true);
+    assert_eq!(prepared.len(), 2);
+    assert_eq!(errors.len(), 1);
+    
+    let response = BulkInsertResult { inserted: 2, write_errors: errors }.to_response();
+    assert_eq!(response.get_i64("n")?, 2);
+    let write_errors = response.get_array("writeErrors")?;
+    assert_eq!(write_errors[0].as_document().unwrap().get_i32("index")?, 2);
+    assert_eq!(write_errors[0].as_document().unwrap().get_i32("code")?, 11000);
+    
+    Ok(())
+}
+
+#[test]
+fn test_collection_table_quoting() -> Result<()> {
+    use fauxdb::postgresql_manager::{collection_ddl, collection_table};
+    
+    assert_eq!(collection_table("app", "orders"), "\"fauxdb_app\".\"orders_collections\"");
+    // Case is kept and quotes are doubled, so no name can break out
+    assert_eq!(collection_table("App", "my\"; DROP"), "\"fauxdb_App\".\"my\"\"; DROP_collections\"");
+    
+    let ddl = collection_ddl("app", "Orders");
+    assert_eq!(ddl[0], "CREATE SCHEMA IF NOT EXISTS \"fauxdb_app\"");
+    assert!(ddl[1].starts_with("CREATE TABLE IF NOT EXISTS \"fauxdb_app\".\"Orders_collections\" ("));
+    assert!(ddl[2].contains("CREATE UNIQUE INDEX IF NOT EXISTS \"idx_Orders_id\" ON \"fauxdb_app\".\"Orders_collections\""));
+    
+    Ok(())
+}
+
+#[test]
+fn test_document_codec_round_trip() -> Result<()> {
+    use fauxdb::document_codec::{decode_json, StorageLayout, StorageMode};
+    
+    let document = bson::doc! {
+        "_id": bson::oid::ObjectId::new(),
+        "name": "quote \" and \\ and \n",
+        "count": 7,
+        "big": 5_000_000_000i64,
+        "ratio": 2.0,
+        "pi": 3.25,
+        "nan": f64::NAN,
+        "when": bson::DateTime::from_millis(1_700_000_000_000),
+        "blob": bson::Binary { subtype: bson::spec::BinarySubtype::Generic, bytes: vec![0, 1, 2, 255] },
+        "pattern": bson::Regex { pattern: "^a.*".to_string(), options: "i".to_string() },
+        "ts": bson::Timestamp { time: 10, increment: 2 },
+        "nested": { "tags": ["a", 1, null], "inner": { "x": 1, "y": 2 } },
+    };
+    
+    // JSONB-only stores tagged JSON and reads back the same types
+    let encoded = StorageLayout::new(StorageMode::Jsonb, Vec::new()).encode(&document)?;
+    assert!(encoded.bson.is_none());
+    let json = encoded.jsonb.unwrap();
+    assert!(json.contains("\"ratio\":2.0"));
+    let decoded = decode_json(&json)?;
+    assert_eq!(decoded.get_object_id("_id")?, document.get_object_id("_id")?);
+    assert_eq!(decoded.get_str("name")?, document.get_str("name")?);
+    assert_eq!(decoded.get_i32("count")?, 7);
+    assert_eq!(decoded.get_i64("big")?, 5_000_000_000);
+    assert_eq!(decoded.get_f64("ratio")?, 2.0);
+    assert!(decoded.get_f64("nan")?.is_nan());
+    assert_eq!(decoded.get_datetime("when")?, document.get_datetime("when")?);
+    assert_eq!(decoded.get("blob"), document.get("blob"));
+    assert_eq!(decoded.get("pattern"), document.get("pattern"));
+    assert_eq!(decoded.get("ts"), document.get("ts"));
+    assert_eq!(decoded.get("nested"), document.get("nested"));
+    
+    // BSON-only keeps the raw bytes and just _id and the indexed paths in JSONB
+    let id = format!("\"_id\":{{\"$oid\":\"{}\"}}", document.get_object_id("_id")?.to_hex());
+    let layout = StorageLayout::new(StorageMode::Bson, vec!["count".to_string(), "nested.inner.x".to_string()]);
+    let encoded = layout.encode(&document)?;
+    assert_eq!(encoded.bson.as_ref().map(Vec::len), Some(encoded.bson_size));
+    assert_eq!(encoded.jsonb, Some(format!("{{{},\"count\":7,\"nested\":{{\"inner\":{{\"x\":1}}}}}}", id)));
+    
+    // _id is there even without indexed paths, for the unique _id index
+    let encoded = StorageLayout::new(StorageMode::Bson, Vec::new()).encode(&document)?;
+    assert_eq!(encoded.jsonb, Some(format!("{{{}}}", id)));
+    
+    Ok(())
+}
+
+#[test]
+fn test_find_raw_passthrough() -> Result<()> {
+    use fauxdb::document_codec::{StorageLayout, StorageMode};
+    use fauxdb::find::FindRequest;
+    use fauxdb::wire_protocol::WireProtocolHandler;
+    
+    let stored = vec![
+        bson::to_vec(&bson::doc! { "_id": 1, "name": "a" })?,
+        bson::to_vec(&bson::doc! { "_id": 2, "when": bson::DateTime::from_millis(0) })?,
+    ];
+    let body = WireProtocolHandler::build_cursor_reply("app.users", &stored)?;
+    let reply = bson::Document::from_reader(&mut body.as_slice())?;
+    assert_eq!(reply.get_f64("ok")?, 1.0);
+    let cursor = reply.get_document("cursor")?;
+    assert_eq!(cursor.get_str("ns")?, "app.users");
+    assert_eq!(cursor.get_i64("id")?, 0);
+    let batch = cursor.get_array("firstBatch")?;
+    assert_eq!(batch.len(), 2);
+    assert_eq!(batch[1].as_document().unwrap().get_datetime("when")?.timestamp_millis(), 0);
+    
+    // Cursors aren't kept open, so a result too big for one reply is refused
+    let oversized = vec![vec![0u8; fauxdb::wire_protocol::MAX_BSON_OBJECT_SIZE]];
+    assert!(WireProtocolHandler::build_cursor_reply("app.users", &oversized).is_err());
+    
+    // Scalar equality and sort push down, so rows pass through undecoded
+    let both = StorageLayout::default();
+    let request = FindRequest::parse(&bson::doc! {
+        "find": "users", "$db": "app", "filter": { "name": "a" }, "sort": { "age": -1 }, "limit": 5
+    })?;
+    let plan = request.plan(&both)?;
+    assert!(plan.is_passthrough(&request));
+    assert_eq!(plan.params, vec![r#"{"name":"a"}"#.to_string(), r#"{"name":["a"]}"#.to_string()]);
+    assert!(plan.sql.contains("FROM \"fauxdb_app\".\"users_collections\" WHERE (document @> $1 OR document @> $2)"));
+    assert!(plan.checks_order);
+    assert!(plan.sql.contains("ORDER BY unordered DESC, CASE jsonb_typeof(document -> 'age') WHEN 'number' THEN 1"));
+    assert!(plan.sql.contains(r#"document ->> 'age' END) COLLATE "C" DESC"#));
+    assert!(plan.sql.ends_with("document -> 'age' DESC, id LIMIT 5"));
+    
+    // A checked sort reads the skipped rows and drops them itself
+    let skipped = FindRequest::parse(&bson::doc! { "find": "users", "sort": { "age": 1 }, "skip": 2, "limit": 5 })?;
+    let plan = skipped.plan(&both)?;
+    assert!(plan.sql.ends_with("LIMIT 7") && plan.skip_rows == 2);
+    let plan = skipped.plan_unordered(&both)?;
+    assert!(plan.sort_in_process && !plan.checks_order && !plan.sql.contains("LIMIT"));
+    
+    // Operators and unindexed paths in bson mode need the documents decoded
+    let bson_only = StorageLayout::new(StorageMode::Bson, vec!["name".to_string()]);
+    let request = FindRequest::parse(&bson::doc! {
+        "find": "users", "filter": { "name": "a", "age": { "$gt": 30 } }, "sort": { "age": 1 }, "skip": 2
+    })?;
+    let plan = request.plan(&bson_only)?;
+    assert!(!plan.is_passthrough(&request));
+    assert!(plan.sort_in_process);
+    assert_eq!(plan.residual, Some(bson::doc! { "age": { "$gt": 30 } }));
+    assert!(!plan.sql.contains("OFFSET"));
+    
+    Ok(())
+}
+
+#[test]
+fn test_point_lookup_detection() -> Result<()> {
+    use fauxdb::document_codec::{StorageLayout, StorageMode};
+    use fauxdb::find::FindRequest;
+    
+    let layout = StorageLayout::default();
+    let find = |command: bson::Document| FindRequest::parse(&command);
+    
+    let id = bson::oid::ObjectId::new();
+    let lookup = find(bson::doc! { "find": "users", "filter": { "_id": id }, "limit": 1 })?;
+    assert_eq!(lookup.point_lookup_id(&layout), Some(format!("{{\"$oid\":\"{}\"}}", id.to_hex())));
+    
+    // Anything but a bare _id equality goes through the planner
+    for command in [
+        bson::doc! { "find": "users", "filter": { "_id": { "$gt": 1 } } },
+        bson::doc! { "find": "users", "filter": { "_id": 1, "name": "a" } },
+        bson::doc! { "find": "users", "filter": { "_id": 1 }, "skip": 1 },
+        bson::doc! { "find": "users", "filter": { "name": "a" } },
+    ] {
+        assert!(find(command.clone())?.point_lookup_id(&layout).is_none(), "{:?}", command);
+    }
+    
+    // Raw BSON storage always keeps _id in JSONB
+    let bson_only = StorageLayout::new(StorageMode::Bson, Vec::new());
+    assert_eq!(find(bson::doc! { "find": "users", "filter": { "_id": 1 } })?.point_lookup_id(&bson_only), Some("1".to_string()));
+    
+    Ok(())
+}
+
+#[test]
+fn test_single_flight_keys() -> Result<()> {
+    use fauxdb::single_flight::{aggregate_key, find_key, NamespaceSet};
+    
+    let namespaces = NamespaceSet::new(&["app.settings".to_string(), "catalog.*".to_string()]);
+    assert!(namespaces.contains("app", "settings"));
+    assert!(namespaces.contains("catalog", "products"));
+    assert!(!namespaces.contains("app", "orders"));
+    assert!(NamespaceSet::new(&[]).is_empty());
+    assert!(NamespaceSet::new(&["*".to_string()]).contains("any", "thing"));
+    
+    let command = bson::doc! { "find": "settings", "filter": { "k": 1 }, "limit": 1, "$db": "app", "lsid": { "id": 1 } };
+    let same = bson::doc! { "find": "settings", "filter": { "k": 1 }, "limit": 1, "$db": "app", "lsid": { "id": 2 } };
+    assert_eq!(find_key(&command), find_key(&same));
+    
+    // Anything that changes the reply changes the key
+    let mut other = command.clone();
+    other.insert("skip", 1);
+    assert_ne!(find_key(&command), find_key(&other));
+    
+    // Transactional reads never share
+    let mut in_transaction = command.clone();
+    in_transaction.insert("txnNumber", 1i64);
+    assert!(find_key(&in_transaction).is_none());
+    
+    // Aggregates key on their pipeline and options, and never collide with a find
+    let aggregate = bson::doc! { "aggregate": "settings", "pipeline": [ { "$match": { "k": 1 } } ], "cursor": {}, "$db": "app" };
+    let mut same = aggregate.clone();
+    same.insert("lsid", bson::doc! { "id": 2 });
+    assert_eq!(aggregate_key(&aggregate), aggregate_key(&same));
+    assert_ne!(aggregate_key(&aggregate), find_key(&command));
+    let mut spilling = aggregate.clone();
+    spilling.insert("allowDiskUse", true);
+    assert_ne!(aggregate_key(&aggregate), aggregate_key(&spilling));
+    
+    // Pipelines that write run every time
+    let writes = bson::doc! { "aggregate": "settings", "pipeline": [ { "$out": "copy" } ], "$db": "app" };
+    assert!(aggregate_key(&writes).is_none());
+    
+    Ok(())
+}
+
+#[test]
+fn test_result_cache_invalidation() -> Result<()> {
+    use fauxdb::result_cache::{ResultCache, Written};
+    use fauxdb::single_flight::NamespaceSet;
+    
+    let cache = ResultCache::new(NamespaceSet::new(&["app.*".to_string()]), 3, 64, std::time::Duration::from_secs(60));
+    assert!(cache.applies_to("app", "countries"));
+    
+    let stamp = cache.stamp();
+    cache.insert(b"a".to_vec(), "app.countries".to_string(), stamp, b"reply");
+    assert_eq!(cache.get(b"a"), Some(b"reply".to_vec()));
+    
+    // A find that started before a write finished is never served after it
+    let raced = cache.stamp();
+    cache.record_write(&Written::by_command("insert", &bson::doc! { "insert": "countries", "$db": "app" }).unwrap());
+    assert!(cache.get(b"a").is_none());
+    cache.insert(b"a".to_vec(), "app.countries".to_string(), raced, b"stale");
+    assert!(cache.get(b"a").is_none());
+    
+    // Other collections keep their replies
+    cache.insert(b"b".to_vec(), "app.flags".to_string(), cache.stamp(), b"flags");
+    cache.record_write(&Written::Namespaces(vec!["app.countries".to_string()]));
+    assert_eq!(cache.get(b"b"), Some(b"flags".to_vec()));
+    
+    // The byte bound evicts the least recently used reply
+    cache.insert(b"c".to_vec(), "app.flags".to_string(), cache.stamp(), &[0u8; 60]);
+    assert!(cache.get(b"b").is_none());
+    assert!(cache.get(b"c").is_some());
+    
+    // So does the entry bound, once the bytes fit
+    for key in [b"d", b"e", b"f", b"g"] {
+        cache.insert(key.to_vec(), "app.flags".to_string(), cache.stamp(), b"x");
+    }
+    assert!(cache.get(b"d").is_none());
+    assert!(cache.get(b"e").is_some() && cache.get(b"g").is_some());
+    
+    assert_eq!(
+        Written::by_command("bulkWrite", &bson::doc! { "bulkWrite": 1, "nsInfo": [{ "ns": "app.a" }, { "ns": "app.b" }] }),
+        Some(Written::Namespaces(vec!["app.a".to_string(), "app.b".to_string()]))
+    );
+    assert_eq!(Written::by_command("commitTransaction", &bson::doc! {}), Some(Written::All));
+    assert!(Written::by_command("find", &bson::doc! { "find": "countries" }).is_none());
+    
+    Ok(())
+}
+
+#[test]
+fn test_latency_histogram_percentiles() -> Result<()> {
+    use fauxdb::latency_histogram::LatencyHistogram;
+    use std::time::Duration;
+    
+    let histogram = LatencyHistogram::new();
+    assert_eq!(histogram.percentile(0.99), Duration::ZERO);
+    
+    for micros in 1..=1000u64 {
+        histogram.record(Duration::from_micros(micros));
+    }
+    histogram.record(Duration::from_secs(2));
+    assert_eq!(histogram.count(), 1001);
+    assert_eq!(histogram.max(), Duration::from_secs(2));
+    
+    // Within a sub-bucket, 12.5%, of the exact value
+    let p50 = histogram.percentile(0.5).as_micros() as f64;
+    assert!((p50 - 501.0).abs() <= 501.0 * 0.125, "p50 was {}", p50);
+    let p99 = histogram.percentile(0.99).as_micros() as f64;
+    assert!((p99 - 991.0).abs() <= 991.0 * 0.125, "p99 was {}", p99);
+    // The outlier is only reported at the top, and never above the max
+    assert_eq!(histogram.percentile(1.0), Duration::from_secs(2));
+    assert!(histogram.percentile(0.999) < Duration::from_millis(2));
+    
+    Ok(())
+}
+
+#[test]
+fn test_update_compiler() -> Result<()> {
+    use fauxdb::update::compile_update;
+    
+    let mut params = Vec::new();
+    let sql = compile_update(&bson::doc! {
+        "$set": { "profile.name": "Ann", "when": bson::DateTime::from_millis(5) },
+        "$inc": { "visits": 1 },
+        "$unset": { "legacy": "" },
+        "$push": { "tags": { "$each": ["a", "b"] } },
+        "$currentDate": { "seen": true },
+    }, &mut params)?;
+    assert_eq!(params, vec![
+        r#""Ann""#.to_string(),
+        r#"{"$date":5}"#.to_string(),
+        r#"["a","b"]"#.to_string(),
+    ]);
+    // Parent objects are created before the nested set
+    assert!(sql.contains("jsonb_set(d, ARRAY['profile']::text[], COALESCE(d #> ARRAY['profile']::text[], '{}'::jsonb), true)"));
+    assert!(sql.contains("jsonb_set(d, ARRAY['profile','name']::text[], $1::jsonb, true)"));
+    assert!(sql.contains("COALESCE((d #>> ARRAY['visits']::text[])::numeric, 0) + 1"));
+    assert!(sql.contains("d #- ARRAY['legacy']::text[]"));
+    assert!(sql.contains("COALESCE(d #> ARRAY['tags']::text[], '[]'::jsonb) || $3::jsonb"));
+    assert!(sql.starts_with("(SELECT ") && sql.contains("FROM (SELECT document AS d) s"));
+    
+    // Replacement keeps the stored _id
+    let mut params = Vec::new();
+    let sql = compile_update(&bson::doc! { "name": "Bob" }, &mut params)?;
+    assert!(sql.contains("jsonb_build_object('_id', d -> '_id') || ($1::jsonb - '_id')"));
+    
+    // Invalid updates are rejected before reaching PostgreSQL
+    for bad in [
+        bson::doc! { "$set": { "a": 1 }, "b": 2 },
+        bson::doc! { "$set": { "_id": 1 } },
+        bson::doc! { "$set": { "a.b": 1 }, "$unset": { "a": "" } },
+        bson::doc! { "$inc": { "a": "x" } },
+        bson::doc! { "$push": { "a": { "$each": [1], "$slice": 2 } } },
+    ] {
+        assert!(compile_update(&bad, &mut Vec::new()).is_err(), "{:?} should be rejected", bad);
+    }
+    
+    Ok(())
+}
+
+#[test]
+fn test_upsert_seed_and_find_and_modify() -> Result<()> {
+    use fauxdb::find::{pushdown_filter, FindRequest};
+    use fauxdb::find_and_modify::FindAndModifyRequest;
+    use fauxdb::update::{compile_update_from, upsert_seed};
+    
+    // The seed takes equality fields from the filter, _id first
+    let filter = bson::doc! { "status": "new", "a.b": 1, "n": { "$gt": 5 }, "$and": [{ "_id": 7 }] };
+    let seed = upsert_seed(&filter, &bson::doc! { "$set": { "x": 1 } });
+    assert_eq!(seed, bson::doc! { "_id": 7, "status": "new", "a": { "b": 1 } });
+    let seed = upsert_seed(&bson::doc! { "k": { "$eq": "v" } }, &bson::doc! { "_id": "r", "y": 2 });
+    assert_eq!(seed, bson::doc! { "_id": "r", "k": "v" });
+    
+    // $setOnInsert only applies when inserting
+    let update = bson::doc! { "$setOnInsert": { "created": 1 } };
+    assert!(!compile_update_from(&update, "document", false, &mut Vec::new())?.contains("created"));
+    let sql = compile_update_from(&update, "$1::jsonb", true, &mut vec!["{}".to_string()])?;
+    assert!(sql.contains("SELECT $1::jsonb AS d"));
+    assert!(sql.contains("jsonb_set(d, ARRAY['created']::text[], $2::jsonb, true)"));
+    
+    // _id equality uses the unique _id index
+    let layout = fauxdb::document_codec::StorageLayout::default();
+    let mut params = Vec::new();
+    let (conditions, residual) = pushdown_filter(&bson::doc! { "_id": bson::oid::ObjectId::new() }, &layout, &mut params);
+    assert_eq!(conditions, vec!["document -> '_id' = $1".to_string()]);
+    assert!(residual.is_none() && params[0].starts_with("{\"$oid\":"));
+    let plan = FindRequest::parse(&bson::doc! { "find": "jobs", "filter": { "_id": 1 }, "$db": "app" })?.plan(&layout)?;
+    assert!(plan.sql.contains("WHERE document -> '_id' = $1"));
+    
+    let request = FindAndModifyRequest::parse(&bson::doc! {
+        "findAndModify": "jobs",
+        "query": { "state": "ready" },
+        "sort": { "priority": -1 },
+        "update": { "$set": { "state": "running" } },
+        "new": true,
+        "fields": { "state": 1 },
+    })?;
+    assert!(request.new && !request.remove && request.update.is_some());
+    assert!(FindAndModifyRequest::parse(&bson::doc! { "findAndModify": "jobs", "remove": true, "update": { "$set": { "a": 1 } } }).is_err());
+    assert!(FindAndModifyRequest::parse(&bson::doc! { "findAndModify": "jobs" }).is_err());
+    
+    Ok(())
+}
+
+#[test]
+fn test_bulk_write_planning() -> Result<()> {
+    use fauxdb::bulk_insert::WriteError;
+    use fauxdb::bulk_write::{bulk_write_response, BulkWriteResult, WriteModel, WriteOp, WriteOutcome};
+    use fauxdb::delete::plan_delete;
+    use fauxdb::update::plan_update;
+    
+    let layout = fauxdb::document_codec::StorageLayout::default();
+    
+    // Statements that differ only in values share one SQL text, so a batch
+    // of them is prepared once
+    let first = plan_update("t", &layout, &bson::doc! { "k": 1 }, &bson::doc! { "$set": { "v": 1 } }, false)?.expect("pushdown");
+    let second = plan_update("t", &layout, &bson::doc! { "k": 2 }, &bson::doc! { "$set": { "v": 2 } }, false)?.expect("pushdown");
+    assert_eq!(first.sql, second.sql);
+    assert_ne!(first.params, second.params);
+    assert!(plan_update("t", &layout, &bson::doc! { "k": { "$gt": 1 } }, &bson::doc! { "$set": { "v": 1 } }, true)?.is_none());
+    
+    let delete = plan_delete("t", &layout, &bson::doc! { "_id": 5 }, false).expect("pushdown");
+    assert!(delete.sql.contains("id = (SELECT id FROM t WHERE document -> '_id' = $1 ORDER BY id LIMIT 1 FOR UPDATE)"));
+    assert!(plan_delete("t", &layout, &bson::doc! { "k": { "$gt": 1 } }, true).is_none());
+    
+    let model = |op| WriteModel { database: "app".to_string(), collection: "jobs".to_string(), op };
+    let models = vec![
+        model(WriteOp::Insert(bson::doc! { "_id": 1 })),
+        model(WriteOp::Update { filter: bson::doc! { "_id": 2 }, update: bson::doc! { "$set": { "a": 1 } }, multi: false, upsert: true }),
+        model(WriteOp::Delete { filter: bson::doc! {}, multi: true }),
+    ];
+    let result = BulkWriteResult {
+        outcomes: vec![
+            (0, WriteOutcome { n: 1, ..WriteOutcome::default() }),
+            (1, WriteOutcome { n: 0, modified: 0, upserted: Some(bson::Bson::Int32(2)) }),
+        ],
+        write_errors: vec![WriteError { index: 2, code: 2, errmsg: "bad".to_string() }],
+    };
+    let response = bulk_write_response(&models, &result);
+    assert_eq!(response.get_i32("nInserted")?, 1);
+    assert_eq!(response.get_i32("nUpserted")?, 1);
+    assert_eq!(response.get_i32("nErrors")?, 1);
+    let batch = response.get_document("cursor")?.get_array("firstBatch")?;
+    assert_eq!(batch.len(), 3);
+    let upsert = batch[1].as_document().expect("reply");
+    assert_eq!(upsert.get_i32("n")?, 1);
+    assert_eq!(upsert.get_document("upserted")?.get_i32("_id")?, 2);
+    assert_eq!(batch[2].as_document().expect("reply").get_f64("ok")?, 0.0);
+    
+    Ok(())
+}